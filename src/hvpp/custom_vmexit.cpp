@@ -8,6 +8,18 @@ void custom_vmexit_handler::setup(vcpu_t& vp) noexcept
 {
   vmexit_base_handler::setup(vp);
 
+  //
+  // Create EPT views for the read/execute split of the hooked page:
+  //   - "exec" view maps the hooked page as execute-only,
+  //   - "read" view maps the hooked page to page_read as read-write.
+  // View 0 (the default one) is left untouched. When the hook is active,
+  // EPT violations just switch between these two views - no tables are
+  // rebuilt and no invalidation is needed.
+  //
+  auto& data = data_[mp::cpu_index()];
+  data.view_exec = vp.ept_views().create();
+  data.view_read = vp.ept_views().create();
+
 #if 0
   //
   // Turn on VM-exit on everything we support.
@@ -102,6 +114,13 @@ void custom_vmexit_handler::handle_execute_vmcall(vcpu_t& vp) noexcept
 {
   auto& data = data_[mp::cpu_index()];
 
+  //
+  // Necessary INVEPT/INVVPID are performed when the transactions go out
+  // of scope.
+  //
+  ept_transaction_t exec_view(vp.ept(data.view_exec));
+  ept_transaction_t read_view(vp.ept(data.view_read));
+
   switch (vp.exit_context().rcx)
   {
     case 0xc1:
@@ -115,27 +134,30 @@ void custom_vmexit_handler::handle_execute_vmcall(vcpu_t& vp) noexcept
       hvpp_trace("vmcall (hook) EXEC: 0x%p READ: 0x%p", data.page_exec.value(), data.page_read.value());
 
       //
-      // Set execute-only access.
+      // Set execute-only access in the "exec" view and read-write access
+      // to the "page_read" in the "read" view. Start with the "exec" view.
       //
-      vp.ept().map_4kb(data.page_exec, data.page_exec, epte_t::access_type::execute);
+      exec_view.map_4kb(data.page_exec, data.page_exec, epte_t::access_type::execute);
+      read_view.map_4kb(data.page_exec, data.page_read, epte_t::access_type::read_write);
+      vp.ept_index(data.view_exec);
       break;
 
     case 0xc2:
       hvpp_trace("vmcall (unhook)");
 
       //
-      // Set back read-write-execute access.
+      // Set back read-write-execute access in both views and switch back
+      // to the default view.
       //
-      vp.ept().map_4kb(data.page_exec, data.page_exec, epte_t::access_type::read_write_execute);
+      exec_view.map_4kb(data.page_exec, data.page_exec, epte_t::access_type::read_write_execute);
+      read_view.map_4kb(data.page_exec, data.page_exec, epte_t::access_type::read_write_execute);
+      vp.ept_index(0);
       break;
 
     default:
       vmexit_base_handler::handle_execute_vmcall(vp);
-      return;
+      break;
   }
-
-  vmx::invept(vmx::invept_t::all_context);
-  vmx::invvpid(vmx::invvpid_t::all_context);
 }
 
 void custom_vmexit_handler::handle_ept_violation(vcpu_t& vp) noexcept
@@ -146,34 +168,64 @@ void custom_vmexit_handler::handle_ept_violation(vcpu_t& vp) noexcept
 
   auto& data = data_[mp::cpu_index()];
 
+  if (!exit_qualification.entry_read &&
+      !exit_qualification.entry_write &&
+      !exit_qualification.entry_execute)
+  {
+    //
+    // The page isn't mapped at all - this is not our hook.
+    //
+    vmexit_handler::handle_ept_violation(vp);
+    return;
+  }
+
+  //
+  // Check (without modifying anything) that the view we're going to switch
+  // to actually permits the requested access - otherwise we'd just keep
+  // switching between the views.
+  //
+  auto permits = [&exit_qualification](const epte_t* entry) {
+    return entry &&
+      (!exit_qualification.data_read    || entry->read_access) &&
+      (!exit_qualification.data_write   || entry->write_access) &&
+      (!exit_qualification.data_execute || entry->execute_access);
+  };
+
+  const int view = exit_qualification.data_read || exit_qualification.data_write
+    ? data.view_read
+    : data.view_exec;
+
+  if (!permits(vp.ept(view).lookup(guest_pa)))
+  {
+    vmexit_handler::handle_ept_violation(vp);
+    return;
+  }
+
   if (exit_qualification.data_read || exit_qualification.data_write)
   {
     //
     // Someone requested read or write access to the guest_pa, but the page
     // has execute-only access.
-    // Map the page with "data.page_read" we've saved before in VMCALL handler
-    // and set the access to RW.
+    // Switch to the "read" view, which maps the page with "data.page_read"
+    // we've saved before in VMCALL handler with RW access.
     //
     hvpp_trace("data_read LA: 0x%p PA: 0x%p", guest_la, guest_pa.value());
 
-    vp.ept().map_4kb(data.page_exec, data.page_read, epte_t::access_type::read_write);
+    vp.ept_index(data.view_read);
   }
   else if (exit_qualification.data_execute)
   {
     //
     // Someone requested execute access to the guest_pa, but the page has only
     // read-write access.
-    // Map the page with "data.page_execute" we've saved before in VMCALL handler
-    // and set the access to execute-only.
+    // Switch to the "exec" view, which maps the page with "data.page_execute"
+    // we've saved before in VMCALL handler with execute-only access.
     //
     hvpp_trace("data_execute LA: 0x%p PA: 0x%p", guest_la, guest_pa.value());
 
-    vp.ept().map_4kb(data.page_exec, data.page_exec, epte_t::access_type::execute);
+    vp.ept_index(data.view_exec);
   }
 
-  vmx::invept(vmx::invept_t::all_context);
-  vmx::invvpid(vmx::invvpid_t::all_context);
-
   //
   // Make the instruction which fetched the memory to be executed again (this
   // time without EPT violation).
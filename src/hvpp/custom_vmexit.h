@@ -28,6 +28,9 @@ class custom_vmexit_handler
     {
       pa_t page_read;
       pa_t page_exec;
+
+      int  view_read;
+      int  view_exec;
     };
 
     per_vcpu_data data_[32];
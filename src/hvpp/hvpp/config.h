@@ -3,3 +3,10 @@
 // #define HVPP_SINGLE_VCPU
 #define HVPP_ENABLE_VMWARE_WORKAROUND
 // #define HVPP_WITH_STATS
+// #define HVPP_ENABLE_VE
+// #define HVPP_ENABLE_EPT_AD
+// #define HVPP_ENABLE_PML
+// #define HVPP_ENABLE_LAZY_EPT
+// #define HVPP_ENABLE_BUDDY_ALLOCATOR
+// #define HVPP_ENABLE_MM_POISONING
+// #define HVPP_ENABLE_MM_PROFILER
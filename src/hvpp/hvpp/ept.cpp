@@ -1,48 +1,217 @@
 #include "ept.h"
+#include "config.h"
 
+#include "ia32/vmx.h"
 #include "lib/assert.h"
-#include "lib/bitmap.h"
 #include "lib/mm.h"
+#include "lib/mp.h"
+
+#include <algorithm>
+#include <mutex>
 
 namespace hvpp {
 
+//
+// Bit 11 is ignored by the CPU in all EPT entries. We use it to mark
+// subtables which are owned by this EPT instance. Entries without this
+// bit point to subtables borrowed from the shared EPT (see initialize(ept_t&)).
+//
+static constexpr uint64_t epte_private_flag = 1ull << 11;
+
+//
+// Value of an unused (not present) entry. With #VE support enabled, all
+// entries have "suppress #VE" bit set by default - only pages explicitly
+// marked as convertible (see ept_t::suppress_ve()) cause #VE on EPT
+// violation, all others cause VM-exit as usual. Note that the bit is
+// significant even in not-present entries.
+//
+#ifdef HVPP_ENABLE_VE
+static constexpr uint64_t epte_empty_flags = 1ull << 63;
+#else
+static constexpr uint64_t epte_empty_flags = 0;
+#endif
+
+static bool is_private(const epte_t* entry) noexcept
+{
+  return !!(entry->flags & epte_private_flag);
+}
+
+template <typename TFunction>
+static void for_each_identity_range(TFunction function) noexcept
+{
+  //
+  // Enumerates physical memory covered by ept_t::map_identity() - the whole
+  // <4GB space and all physical memory ranges above it.
+  //
+  static constexpr uint64_t _4gb = 0x1'0000'0000;
+
+  function(memory_range(0, _4gb));
+
+  for (auto range : memory_manager::physical_memory_descriptor())
+  {
+    //
+    // Skip (parts of) ranges which were already covered by the <4GB range.
+    //
+    if (*range.end() <= _4gb)
+    {
+      continue;
+    }
+
+    if (*range.begin() < _4gb)
+    {
+      range.set(_4gb, *range.end());
+    }
+
+    function(range);
+  }
+}
+
+static pa_t identity_map_end() noexcept
+{
+  uint64_t max_pa = 0;
+
+  for_each_identity_range([&max_pa](const memory_range& range) {
+    max_pa = std::max(max_pa, (*range.end()).value());
+  });
+
+  return pa_t(max_pa);
+}
+
 void ept_t::initialize() noexcept
 {
   //
-  // Initialize EPT's PML4. Each PML4 maps 512GB of memory. We would be fine
-  // with just one PML4 in most scenarios, but we have to waste single page
-  // on it anyway. Single page can handle 512 PML4s (their size is 8 bytes)
-  // so just fill the whole page with 512 PML4s.
+  // 4-level EPT covers 256TB of guest-physical address space. Additional
+  // level costs one more memory access on each TLB miss, therefore use it
+  // only when it's really needed.
   //
-  epml4_ = new epte_t[512];
-  hvpp_assert(epml4_ != nullptr);
-  memset(epml4_, 0, sizeof(epte_t) * 512);
-  static_assert(sizeof(epte_t) * 512 == page_size);
+  static constexpr uint64_t _256tb = 1ull << 48;
+
+  auto vmx_ept_vpid_cap = msr::read<msr::vmx_ept_vpid_cap_t>();
+
+  initialize(vmx_ept_vpid_cap.page_walk_length_5 && identity_map_end().value() > _256tb
+    ? page_table_level::pml5
+    : page_table_level::pml4);
+}
+
+void ept_t::initialize(page_table_level root_level) noexcept
+{
+  setup(root_level);
+
+#ifdef HVPP_ENABLE_PML
+  if (eptptr_.enable_access_and_dirty_flags)
+  {
+    allocate_dirty();
+  }
+#endif
+}
+
+void ept_t::initialize(ept_t& shared) noexcept
+{
+  setup(shared.root_level_);
+
+  //
+  // Copy root table of the shared EPT. Note that all tables below it are
+  // still owned by the shared EPT - therefore we have to remove "private"
+  // flag from the copied entries. When any page is remapped through this
+  // EPT, the path to it is copied first (see map_subtable()).
+  //
+  memcpy(root_, shared.root_, sizeof(epte_t) * 512);
+
+  for (int i = 0; i < 512; ++i)
+  {
+    root_[i].flags &= ~epte_private_flag;
+  }
+
+  shared.acquire();
+  shared_ = &shared;
+}
+
+void ept_t::setup(page_table_level root_level) noexcept
+{
+  hvpp_assert(root_level == page_table_level::pml4 ||
+              root_level == page_table_level::pml5);
+
+  //
+  // Initialize EPT's root table (PML4 or PML5). Each PML4 entry maps 512GB
+  // of memory (each PML5 entry 256TB). We would be fine with just one entry
+  // in most scenarios, but we have to waste single page on the table anyway.
+  // Single page can handle 512 entries (their size is 8 bytes) so just fill
+  // the whole page with 512 entries.
+  //
+  table_pool_.initialize();
+  for (auto& table_count : table_count_)
+  {
+    table_count = 0;
+  }
+
+  root_ = allocate_table(root_level);
+  root_level_ = root_level;
 
   //
-  // Get physical address of EPT's PML4.
+  // Get physical address of EPT's root table.
   //
-  pa_t empl4_pa = pa_t::from_va(epml4_);
+  pa_t root_pa = pa_t::from_va(root_);
 
   //
   // Initialize EPT pointer. It's not really JUST pointer, but Intel Manual calls
-  // this structure as such.
+  // this structure as such. Page-walk length is number of levels minus 1,
+  // which is exactly the level of the root table.
   //
+  static_assert(static_cast<int>(page_table_level::pml4) == ept_ptr_t::page_walk_length_4);
+  static_assert(static_cast<int>(page_table_level::pml5) == ept_ptr_t::page_walk_length_5);
+
   eptptr_.flags = 0;
-  eptptr_.memory_type = static_cast<uint64_t>(memory_manager::mtrr().type(empl4_pa));
-  eptptr_.page_walk_length = ept_ptr_t::page_walk_length_4;
-  eptptr_.page_frame_number = empl4_pa.pfn();
+  eptptr_.memory_type = static_cast<uint64_t>(memory_manager::mtrr().type(root_pa));
+  eptptr_.page_walk_length = static_cast<uint64_t>(root_level);
+  eptptr_.page_frame_number = root_pa.pfn();
+
+  //
+  // Standalone EPT holds reference to itself.
+  //
+  shared_ = nullptr;
+  ref_count_ = 1;
+
+  auto vmx_ept_vpid_cap = msr::read<msr::vmx_ept_vpid_cap_t>();
+  pdpte_1gb_pages_       = !!vmx_ept_vpid_cap.pdpte_1gb_pages;
+  invept_single_context_ = !!vmx_ept_vpid_cap.invept_single_context;
+
+#if defined(HVPP_ENABLE_EPT_AD) || defined(HVPP_ENABLE_PML)
+  //
+  // Enable accessed and dirty flags for EPT (required by the page-modification
+  // logging and by the ept_heat_map_t). Overlays (and therefore all EPT views)
+  // inherit this setting from their shared EPT.
+  //
+  eptptr_.enable_access_and_dirty_flags = !!vmx_ept_vpid_cap.ept_accessed_and_dirty_flags;
+#endif
+
+  dirty_buffer_ = nullptr;
+  dirty_ = bitmap();
+
+  demand_fault_count_ = 0;
+  demand_map_count_ = 0;
+
+  memset(walk_cache_, 0, sizeof(walk_cache_));
+  walk_cache_generation_ = 1;
+  lookup_hit_count_ = 0;
+  lookup_miss_count_ = 0;
+
+  memory_type_pending_ = memory_range(0, 0);
+  invalidation_generation_ = 0;
 }
 
 void ept_t::destroy() noexcept
 {
-  eptptr_.flags = 0;
-
   //
-  // Note: this call also frees memory of epml4_ itself.
+  // Release reference of the shared EPT (if this is an overlay) and then
+  // reference of ourselves.
   //
-  destroy(epml4_, page_table_level::pml4);
-  epml4_ = nullptr;
+  if (shared_)
+  {
+    shared_->release();
+    shared_ = nullptr;
+  }
+
+  release();
 }
 
 ept_ptr_t ept_t::ept_pointer() const noexcept
@@ -50,6 +219,16 @@ ept_ptr_t ept_t::ept_pointer() const noexcept
   return eptptr_;
 }
 
+page_table_level ept_t::root_level() const noexcept
+{
+  return root_level_;
+}
+
+uint32_t ept_t::table_count(page_table_level level) const noexcept
+{
+  return table_count_[static_cast<int>(level)];
+}
+
 void ept_t::map_identity() noexcept
 {
   //
@@ -57,94 +236,237 @@ void ept_t::map_identity() noexcept
   // physical memory to the guest. This means that physical memory 0x4000
   // in the guest will be physical memory 0x4000 in the host.
   //
-  // We're going to try to achive that in an optimal way: we're not going
-  // to map whole physical memory in 4kb granularity - instead we'll map
-  // with 4kb granularity just those physical memory ranges, which actually
-  // POINT to physical memory.
-  //
   // Because things like DMA (Direct Memory Access) and IOMMU (I/O memory
   // management unit) are in this game too, some ranges of the physical memory
-  // actually point to other devices. Because we don't care that much about
-  // device's memory, we'll map it with 2MB granularity (to waste less space).
+  // actually point to other devices. Note that new memory ranges for devices
+  // can be created when PC is running; for example if you plug-in USB device
+  // or any PnP device to the computer. But because most of the time (not
+  // always!) these memory ranges reside in lower 4GB of physical address
+  // space, we'll just cover the whole <4GB space - regardless if it's backed
+  // up by actual physical memory or not.
+  //
+  // Above 4GB we'll map just those physical memory ranges, which actually
+  // POINT to physical memory.
+  //
+  // We're going to try to achive that in an optimal way: we're not going
+  // to map whole physical memory in 4kb granularity - instead we'll use the
+  // largest page possible (1GB, 2MB or 4kb). Large page can be used if:
+  //   - the address is aligned to the size of the large page,
+  //   - the large page doesn't cross the end of the mapped range and
+  //   - the memory type (as defined by MTRRs) is uniform across the whole
+  //     large page (otherwise the processor behavior is undefined).
+  //
+  // This way we'll end up using 4kb pages only in places where the memory
+  // type actually changes (typically the first 1MB, covered by fixed MTRRs).
   //
-  // Note that new memory ranges for devices can be created when PC is running;
-  // for example if you plug-in USB device or any PnP device to the computer.
-  // But because most of the time (not always!) these memory ranges reside in
-  // lower 4GB of physical address space, we'll just cover the whole <4GB space
-  // (which is not backed up by actual physical memory) with 2MB EPT pages.
+  // The work is split into 1GB slots (see map_identity_work()), which are
+  // processed here by the current processor only.
+  //
+  map_identity_prepare();
+  map_identity_work();
+}
+
+void ept_t::map_identity_parallel() noexcept
+{
+  map_identity_begin();
+  mp::ipi_call(this, &ept_t::map_identity_work);
+}
+
+void ept_t::map_identity_begin() noexcept
+{
   //
-  // So, to sum it up:
-  //   - Get physical memory descriptor (it will say us which ranges are actually
-  //     backed up by physical memory).
-  //   - Map these ranges with 4kb granularity.
-  //   - Map rest of <4GB address space with 2MB EPT pages.
-  //   - Because 2MB pages MUST be aligned to 2MB address boundary, there is
-  //     a chance we still didn't cover the whole <4GB address space - so we
-  //     will map these "holes" again with 4kb granularity.
+  // Workers allocate tables from their own per-CPU caches - with the pool
+  // lock taken for each table, the workers spend most of their time
+  // waiting for each other.
   //
+  table_pool_.enable_cpu_caches();
+  map_identity_prepare();
+}
+
+void ept_t::map_identity_prepare() noexcept
+{
+  static constexpr uint64_t _1gb   = 1024 * 1024 * 1024;
+  static constexpr uint64_t _512gb = 512 * _1gb;
 
   //
-  // Page frame number map for 0000'0000 - FFFF'FFFF range (first 4GB).
-  // 1 bit == 1 page.
+  // Create PDPTs of all 512GB regions which are going to be mapped (and
+  // all tables above them). The workers then modify only entries of their
+  // own 1GB slot (PDPT entry) and tables below it - therefore they don't
+  // need any synchronization (except of the table allocation).
   //
-  static constexpr uint64_t _4gb = 0x1'0000'0000;
-  static constexpr uint64_t _2mb_pfn_count = 512;
-  static constexpr uint64_t _4kb_pfn_count = 1;
+  for_each_identity_range([this](const memory_range& range) {
+    for (uint64_t pa = (*range.begin()).value() & ~(_512gb - 1); pa < (*range.end()).value(); pa += _512gb)
+    {
+      auto table = root_;
+
+      for (auto level = root_level_; level != page_table_level::pdpt; level = level - 1)
+      {
+        table = map_subtable(&table[pa_t(pa).index(level)], level - 1);
+      }
+    }
+  });
 
-  bitmap pfn_map(_4gb / page_size);
-  int pfn;
+  slot_count_ = static_cast<uint32_t>((identity_map_end().value() + _1gb - 1) / _1gb);
+  next_slot_ = 0;
+}
 
-  pfn = 0;
-  for (auto range : memory_manager::physical_memory_descriptor())
+void ept_t::map_identity_work() noexcept
+{
+  static constexpr uint64_t _1gb = 1024 * 1024 * 1024;
+
+  for (;;)
   {
-    for (auto pa : range)
+    uint64_t slot = next_slot_++;
+
+    if (slot >= slot_count_)
     {
-      map_4kb(pa, pa);
+      break;
+    }
 
-      if (pa < _4gb)
+    const memory_range slot_range(slot * _1gb, (slot + 1) * _1gb);
+
+    for_each_identity_range([this, &slot_range](const memory_range& range) {
+      if (range.intersects(slot_range))
       {
-        pfn_map.set(static_cast<uint32_t>(pa.pfn()));
+        pa_t begin = std::max(*range.begin(), *slot_range.begin());
+        pa_t end   = std::min(*range.end(),   *slot_range.end());
+
+        map_range(begin, begin, (end - begin).value());
       }
-    }
+    });
   }
+}
+
+bool ept_t::map_identity_on_demand(pa_t guest_pa) noexcept
+{
+  static constexpr uint64_t _1gb = 1024 * 1024 * 1024;
+  static constexpr uint64_t _2mb = 2 * 1024 * 1024;
+
+  auto& root = shared_ ? *shared_ : *this;
 
   //
-  // Use 2MB pages whenever possible.
+  // Serialize with other processors - all of them fill the same shared EPT.
   //
-  pfn = 0;
-  while ((pfn = pfn_map.find_first_clear(pfn, _2mb_pfn_count)) != -1)
+  std::lock_guard _(root.lock_);
+
+  page_table_level level;
+
+  if (!root.walk(guest_pa, level))
   {
     //
-    // Check if the page is aligned to 2MB boundary.
+    // "level" now holds level of the first not-present entry - pages larger
+    // than this level would replace existing mappings.
     //
-    if (!(pfn % _2mb_pfn_count))
-    {
-      auto pa = pa_t::from_pfn(pfn);
-      map_2mb(pa, pa);
+    auto uniform = [&guest_pa](uint64_t size) {
+      pa_t begin = guest_pa.value() & ~(size - 1);
+      return memory_manager::mtrr().type(memory_range(begin, begin + size)) != memory_type::invalid;
+    };
 
-      pfn_map.set(pfn, _2mb_pfn_count);
+    pa_t pa = guest_pa.value() & ~(page_size - 1);
+
+    if (level >= page_table_level::pdpt && root.pdpte_1gb_pages_ && uniform(_1gb))
+    {
+      pa = pa.value() & ~(_1gb - 1);
+      root.map_1gb(pa, pa);
     }
+    else if (level >= page_table_level::pd && uniform(_2mb))
+    {
+      pa = pa.value() & ~(_2mb - 1);
+      root.map_2mb(pa, pa);
+    }
+    else
+    {
+      root.map_4kb(pa, pa);
+    }
+
+    root.demand_map_count_ += 1;
+  }
+  else if (!shared_ || walk(guest_pa, level))
+  {
+    //
+    // The page is already mapped in this EPT - another processor mapped it
+    // after this one faulted. Executing the instruction again succeeds.
+    //
+    return true;
+  }
+
+  if (shared_ && !link_shared(guest_pa))
+  {
+    return false;
   }
 
+  root.demand_fault_count_ += 1;
+  return true;
+}
+
+uint32_t ept_t::demand_fault_count() const noexcept
+{
+  auto& root = shared_ ? *shared_ : *this;
+
+  return root.demand_fault_count_;
+}
+
+uint32_t ept_t::demand_map_count() const noexcept
+{
+  auto& root = shared_ ? *shared_ : *this;
+
+  return root.demand_map_count_;
+}
+
+epte_t* ept_t::map(pa_t guest_pa, pa_t host_pa, epte_t::access_type access /* = epte_t::access_type::read_write_execute */, large_page large /* = large_page::none */) noexcept
+{
+  const auto leaf_level = large == large_page::pdpte_1gb ? page_table_level::pdpt
+                        : large == large_page::pde_2mb   ? page_table_level::pd
+                        :                                  page_table_level::pt;
 
   //
-  // Use 4KB pages for the rest.
+  // Descend from the root to the leaf level, creating (or splitting, or
+  // copying) tables on the way. Entries on the path are remembered, so that
+  // the subtables can be merged afterwards.
   //
-  pfn = 0;
-  while ((pfn = pfn_map.find_first_clear(pfn, _4kb_pfn_count)) != -1)
+  epte_t* path[max_level_count];
+  auto table = root_;
+  auto level = root_level_;
+
+  for (; level != leaf_level; level = level - 1)
   {
-    auto pa = pa_t::from_pfn(pfn);
-    map_4kb(pa, pa);
+    path[static_cast<int>(level)] = &table[guest_pa.index(level)];
+    table = map_subtable(path[static_cast<int>(level)], level - 1);
+  }
 
-    pfn_map.set(pfn);
+  auto result = &table[guest_pa.index(leaf_level)];
+  const auto type = memory_manager::mtrr().type(guest_pa);
+
+  if (leaf_level != page_table_level::pt)
+  {
+    unmap_subtable(result, leaf_level - 1);
+    result->update(host_pa, type, true, access);
+  }
+  else
+  {
+    result->update(host_pa, type, access);
   }
 
-  hvpp_assert(pfn_map.all_set());
-}
+  //
+  // Merge subtables bottom-up (PT into 2MB page, PD into 1GB page), stop
+  // at the first one which can't be merged. If the new entry has been
+  // merged, return the large page which now maps it.
+  //
+  for (level = leaf_level + 1; level <= page_table_level::pdpt; level = level + 1)
+  {
+    const auto subtable_level = level - 1;
+    auto entry = path[static_cast<int>(level)];
 
-epte_t* ept_t::map(pa_t guest_pa, pa_t host_pa, epte_t::access_type access /* = epte_t::access_type::read_write_execute */, large_page large /* = large_page::none */) noexcept
-{
-  return map_pml4(guest_pa, host_pa, epml4_, access, large);
+    if ((subtable_level == page_table_level::pd && !pdpte_1gb_pages_) ||
+        !merge_subtable(entry, subtable_level))
+    {
+      break;
+    }
+
+    result = entry;
+  }
+
+  return result;
 }
 
 epte_t* ept_t::map_4kb(pa_t guest_pa, pa_t host_pa, epte_t::access_type access /* = epte_t::access_type::read_write_execute */) noexcept
@@ -162,117 +484,1538 @@ epte_t* ept_t::map_1gb(pa_t guest_pa, pa_t host_pa, epte_t::access_type access /
   return map(guest_pa, host_pa, access, large_page::pdpte_1gb);
 }
 
-//
-// Private
-//
-
-epte_t* ept_t::map_subtable(epte_t* table) noexcept
+void ept_t::map_range(pa_t guest_pa, pa_t host_pa, uint64_t size, epte_t::access_type access /* = epte_t::access_type::read_write_execute */) noexcept
 {
-  //
-  // Get or create next level of EPT table hierarchy.
-  //
-  // PML4 (top level)
-  // -> PDPT
-  //   -> PD
-  //     -> PT
-  //
-  if (table->is_present())
+  static constexpr uint64_t _1gb = 1024 * 1024 * 1024;
+  static constexpr uint64_t _2mb = 2 * 1024 * 1024;
+  static constexpr uint64_t _4kb = page_size;
+
+  cursor_t cursor{};
+
+  const pa_t end = guest_pa + size;
+  pa_t uniform_end = guest_pa;
+  memory_type type = memory_type::invalid;
+
+  while (guest_pa < end)
   {
-    return table->subtable();
-  }
+    //
+    // Memory type is queried only once per region with uniform memory type.
+    //
+    if (guest_pa >= uniform_end)
+    {
+      const auto& mtrr = memory_manager::mtrr();
 
-  auto subtable = new epte_t[512];
-  hvpp_assert(subtable != nullptr);
-  memset(subtable, 0, sizeof(epte_t) * 512);
-  static_assert(sizeof(epte_t) * 512 == page_size);
+      type = mtrr.type(guest_pa);
+      uniform_end = std::min(mtrr.next_boundary(guest_pa), end);
+    }
 
-  table->update(pa_t::from_va(subtable));
-  return subtable;
-}
+    auto can_map = [&guest_pa, &host_pa, &uniform_end](uint64_t large_size) {
+      return !((guest_pa.value() | host_pa.value()) & (large_size - 1)) && guest_pa + large_size <= uniform_end;
+    };
 
-epte_t* ept_t::map_pml4(pa_t guest_pa, pa_t host_pa, epte_t* pml4, epte_t::access_type access, large_page large) noexcept
-{
-  auto pml4e = &pml4[guest_pa.index(page_table_level::pml4)];
-  auto pdpt = map_subtable(pml4e);
+    if (pdpte_1gb_pages_ && can_map(_1gb))
+    {
+      auto pdpte = &cursor_table(cursor, guest_pa, page_table_level::pdpt)[guest_pa.index(page_table_level::pdpt)];
+
+      //
+      // PD (and PT) below this entry is going to be freed.
+      //
+      if (cursor.table[static_cast<int>(page_table_level::pd)] && cursor.entry[static_cast<int>(page_table_level::pd)] == pdpte)
+      {
+        cursor_leave(cursor, page_table_level::pd);
+      }
+
+      unmap_subtable(pdpte, page_table_level::pd);
+      pdpte->update(host_pa, type, true, access);
+
+      guest_pa += _1gb;
+      host_pa  += _1gb;
+    }
+    else if (can_map(_2mb))
+    {
+      auto pde = &cursor_table(cursor, guest_pa, page_table_level::pd)[guest_pa.index(page_table_level::pd)];
+
+      if (cursor.table[static_cast<int>(page_table_level::pt)] && cursor.entry[static_cast<int>(page_table_level::pt)] == pde)
+      {
+        cursor_leave(cursor, page_table_level::pt);
+      }
+
+      unmap_subtable(pde, page_table_level::pt);
+      pde->update(host_pa, type, true, access);
+
+      guest_pa += _2mb;
+      host_pa  += _2mb;
+    }
+    else
+    {
+      auto pte = &cursor_table(cursor, guest_pa, page_table_level::pt)[guest_pa.index(page_table_level::pt)];
+      pte->update(host_pa, type, access);
+
+      guest_pa += _4kb;
+      host_pa  += _4kb;
+    }
+  }
 
-  return map_pdpt(guest_pa, host_pa, pdpt, access, large);
+  cursor_leave(cursor, page_table_level::pdpt);
 }
 
-epte_t* ept_t::map_pdpt(pa_t guest_pa, pa_t host_pa, epte_t* pdpt, epte_t::access_type access, large_page large) noexcept
+void ept_t::protect_range(pa_t guest_pa, uint64_t size, epte_t::access_type access) noexcept
 {
-  auto pdpte = &pdpt[guest_pa.index(page_table_level::pdpt)];
+  cursor_t cursor{};
 
-  if (large == large_page::pdpte_1gb)
+  const pa_t end = guest_pa + size;
+
+  while (guest_pa < end)
   {
-    pdpte->update(host_pa, memory_manager::mtrr().type(guest_pa), true);
-    return pdpte;
+    auto level = root_level_;
+
+    for (;;)
+    {
+      auto entry = &cursor_table(cursor, guest_pa, level)[guest_pa.index(level)];
+
+      //
+      // Size of the memory mapped by this entry.
+      //
+      const uint64_t entry_size = uint64_t(page_size) << (9 * static_cast<int>(level));
+      const pa_t     entry_end  = (guest_pa.value() & ~(entry_size - 1)) + entry_size;
+
+      if (!entry->is_present())
+      {
+        guest_pa = entry_end;
+        break;
+      }
+
+      if (level == page_table_level::pt ||
+          (entry->large_page && !(guest_pa.value() & (entry_size - 1)) && entry_end <= end))
+      {
+        entry->update(access);
+        guest_pa = entry_end;
+        break;
+      }
+
+      //
+      // Descend - if this is a large page, cursor_table() splits it.
+      //
+      level = level - 1;
+    }
   }
 
-  auto pd = map_subtable(pdpte);
-  return map_pd(guest_pa, host_pa, pd, access, large);
+  cursor_leave(cursor, page_table_level::pdpt);
 }
 
-epte_t* ept_t::map_pd(pa_t guest_pa, pa_t host_pa, epte_t* pd, epte_t::access_type access, large_page large) noexcept
+epte_t* ept_t::lookup(pa_t guest_pa) noexcept
 {
-  auto pde = &pd[guest_pa.index(page_table_level::pd)];
+  page_table_level level;
+  return lookup(guest_pa, level);
+}
+
+epte_t* ept_t::lookup(pa_t guest_pa, page_table_level& level) noexcept
+{
+  static constexpr int region_shift = page_shift + 9; // 2MB
+
+  const uint64_t region = guest_pa.value() >> region_shift;
+  auto& slot = walk_cache_[region % walk_cache_size];
 
-  if (large == large_page::pde_2mb)
+  const uint32_t generation        = walk_cache_generation_;
+  const uint32_t shared_generation = shared_ ? shared_->walk_cache_generation_.load() : 0;
+
+  if (slot.pt &&
+      slot.region == region &&
+      slot.generation == generation &&
+      slot.shared_generation == shared_generation)
+  {
+    lookup_hit_count_ += 1;
+
+    auto pte = &slot.pt[guest_pa.index(page_table_level::pt)];
+    level = page_table_level::pt;
+
+    return pte->is_present()
+      ? pte
+      : nullptr;
+  }
+
+  lookup_miss_count_ += 1;
+
+  auto entry = walk(guest_pa, level);
+
+  if (entry && level == page_table_level::pt)
   {
-    pde->update(host_pa, memory_manager::mtrr().type(guest_pa), true);
-    return pde;
+    //
+    // The leaf is in a PT - remember it (PT is page-aligned).
+    //
+    slot.region = region;
+    slot.pt = reinterpret_cast<epte_t*>(page_align(entry));
+    slot.generation = generation;
+    slot.shared_generation = shared_generation;
   }
 
-  auto pt = map_subtable(pde);
-  return map_pt(guest_pa, host_pa, pt, access, large);
+  return entry;
 }
 
-epte_t* ept_t::map_pt(pa_t guest_pa, pa_t host_pa, epte_t* pt, epte_t::access_type access, large_page large) noexcept
+bool ept_t::translate(pa_t guest_pa, pa_t& host_pa) noexcept
 {
-  auto page = &pt[guest_pa.index(page_table_level::pt)];
+  page_table_level level;
+  auto entry = lookup(guest_pa, level);
 
-  (void)(large);
-  hvpp_assert(large == large_page::none);
+  if (!entry)
   {
-    page->update(host_pa, memory_manager::mtrr().type(guest_pa), access);
-    return page;
+    return false;
   }
+
+  //
+  // Offset within the (possibly large) page.
+  //
+  const uint64_t offset_mask = (uint64_t(page_size) << (9 * static_cast<int>(level))) - 1;
+
+  host_pa = pa_t::from_pfn(entry->page_frame_number).value() | (guest_pa.value() & offset_mask);
+  return true;
 }
 
-void ept_t::destroy(epte_t* table, page_table_level ptl_type /* = page_table_level::pml4 */) noexcept
+uint64_t ept_t::lookup_hit_count() const noexcept
 {
-  for (int i = 0; i < 512; ++i)
-  {
-    auto entry = &table[i];
+  return lookup_hit_count_;
+}
 
-    if (entry->is_present())
-    {
-      hvpp_assert(entry->page_frame_number != 0);
+uint64_t ept_t::lookup_miss_count() const noexcept
+{
+  return lookup_miss_count_;
+}
 
-      auto subtable = entry->subtable();
+void ept_t::invalidate_memory_type(const memory_range& range) noexcept
+{
+  auto& root = shared_ ? *shared_ : *this;
 
-      if (!entry->large_page)
-      {
-        switch (ptl_type)
-        {
-          case page_table_level::pml4:
-          case page_table_level::pdpt:
-            destroy(subtable, ptl_type - 1);
-            break;
-
-          case page_table_level::pd:
-            delete subtable;
-            break;
-
-          case page_table_level::pt:
-          default:
-            hvpp_assert(0);
-            break;
-        }
-      }
-    }
+  std::lock_guard _(root.lock_);
+
+  if (!range.size())
+  {
+    return;
   }
 
-  delete[] table;
+  //
+  // Keep just single range covering all recorded ranges - MTRRs are
+  // usually changed in bulk and the recomputation skips unmapped memory
+  // quickly anyway.
+  //
+  memory_type_pending_ = memory_type_pending_.size()
+    ? memory_range(std::min(*memory_type_pending_.begin(), *range.begin()),
+                   std::max(*memory_type_pending_.end(),   *range.end()))
+    : range;
+}
+
+bool ept_t::update_memory_type() noexcept
+{
+  auto& root = shared_ ? *shared_ : *this;
+
+  std::lock_guard _(root.lock_);
+
+  if (!memory_type_pending_.size())
+  {
+    return false;
+  }
+
+  if (!shared_)
+  {
+    memory_manager::update_mtrr();
+  }
+
+  //
+  // Addresses above the range covered by the root table would wrap around.
+  //
+  const uint64_t root_size = uint64_t(page_size) << (9 * (static_cast<int>(root_level_) + 1));
+
+  pa_t       guest_pa = *memory_type_pending_.begin();
+  const pa_t end      = std::min(*memory_type_pending_.end(), pa_t(root_size));
+
+  memory_type_pending_ = memory_range(0, 0);
+
+  cursor_t cursor{};
+
+  while (guest_pa < end)
+  {
+    auto level = root_level_;
+
+    for (;;)
+    {
+      auto entry = &cursor_table(cursor, guest_pa, level)[guest_pa.index(level)];
+
+      const uint64_t entry_size  = uint64_t(page_size) << (9 * static_cast<int>(level));
+      const pa_t     entry_begin = guest_pa.value() & ~(entry_size - 1);
+      const pa_t     entry_end   = entry_begin.value() + entry_size;
+
+      //
+      // Skip unmapped memory and subtables borrowed from the shared EPT.
+      //
+      if (!entry->is_present() ||
+          (level != page_table_level::pt && !entry->large_page && !is_private(entry)))
+      {
+        guest_pa = entry_end;
+        break;
+      }
+
+      if (level == page_table_level::pt || entry->large_page)
+      {
+        const auto type = memory_manager::mtrr().type(memory_range(entry_begin, entry_end));
+
+        if (type != memory_type::invalid)
+        {
+          entry->memory_type = static_cast<uint64_t>(type);
+          guest_pa = entry_end;
+          break;
+        }
+
+        //
+        // Memory type of the large page isn't uniform anymore - descend,
+        // cursor_table() splits it.
+        //
+      }
+
+      level = level - 1;
+    }
+  }
+
+  cursor_leave(cursor, page_table_level::pdpt);
+
+  return true;
+}
+
+void ept_t::request_invalidation() noexcept
+{
+  auto& root = shared_ ? *shared_ : *this;
+
+  root.invalidation_generation_ += 1;
+}
+
+uint32_t ept_t::invalidation_generation() const noexcept
+{
+  auto& root = shared_ ? *shared_ : *this;
+
+  return root.invalidation_generation_;
+}
+
+epte_t* ept_t::suppress_ve(pa_t guest_pa, bool suppress) noexcept
+{
+  auto pte = split_4kb(guest_pa);
+
+  if (!pte || !pte->is_present())
+  {
+    return nullptr;
+  }
+
+  pte->suppress_ve = suppress;
+  return pte;
+}
+
+int ept_t::dirty_page_count() const noexcept
+{
+  auto& root = shared_ ? *shared_ : *this;
+
+  return root.dirty_.size_in_bits();
+}
+
+void ept_t::mark_dirty(const pa_t* guest_pa, int count) noexcept
+{
+  auto& root = shared_ ? *shared_ : *this;
+
+  if (!root.dirty_buffer_)
+  {
+    return;
+  }
+
+  std::lock_guard _(root.dirty_lock_);
+
+  for (int i = 0; i < count; ++i)
+  {
+    //
+    // Find the leaf in this EPT (it might be an overlay which maps the page
+    // differently than the shared EPT) and record all 4kb pages it maps.
+    //
+    page_table_level level;
+    auto entry = walk(guest_pa[i], level);
+
+    if (!entry)
+    {
+      continue;
+    }
+
+    const uint64_t page_count = level == page_table_level::pt ? 1
+                              : level == page_table_level::pd ? 512
+                              :                                 512 * 512;
+
+    const uint64_t first_page = guest_pa[i].pfn() & ~(page_count - 1);
+    const uint64_t max_page   = root.dirty_.size_in_bits();
+
+    if (first_page >= max_page)
+    {
+      continue;
+    }
+
+    root.dirty_.set(static_cast<int>(first_page),
+                    static_cast<int>(std::min(page_count, max_page - first_page)));
+  }
+}
+
+int ept_t::harvest_dirty(bitmap& dirty) noexcept
+{
+  auto& root = shared_ ? *shared_ : *this;
+
+  if (!root.dirty_buffer_)
+  {
+    return 0;
+  }
+
+  std::lock_guard _(root.dirty_lock_);
+
+  //
+  // Move recorded pages into the caller's bitmap. The last word might be
+  // covered only partially - bits above "bit_count" are left in place.
+  //
+  const int bit_count  = std::min(dirty.size_in_bits(), root.dirty_.size_in_bits());
+  const int word_count = (bit_count + 63) / 64;
+
+  auto dirty_buffer = reinterpret_cast<uint64_t*>(dirty.buffer());
+
+  for (int i = 0; i < word_count; ++i)
+  {
+    uint64_t word = root.dirty_buffer_[i];
+
+    if (i == word_count - 1 && bit_count % 64)
+    {
+      word &= (uint64_t(1) << (bit_count % 64)) - 1;
+    }
+
+    dirty_buffer[i] = word;
+    root.dirty_buffer_[i] &= ~word;
+  }
+
+  bitmap harvested(dirty_buffer, bit_count);
+  int result = harvested.count_set();
+
+  //
+  // Clear dirty flags, so that the processor logs next write into these
+  // pages. All 4kb pages of a large page share one leaf entry - skip to
+  // the end of it.
+  //
+  for (int page = harvested.find_next_set(0);
+           page < bit_count;
+           page = harvested.find_next_set(page))
+  {
+    page_table_level level;
+    auto entry = root.walk(pa_t::from_pfn(page), level);
+
+    if (entry && entry->dirty)
+    {
+      entry->dirty = false;
+    }
+
+    const int page_count = !entry || level == page_table_level::pt ? 1
+                         : level == page_table_level::pd           ? 512
+                         :                                           512 * 512;
+
+    page = (page | (page_count - 1)) + 1;
+  }
+
+  return result;
+}
+
+//
+// Private
+//
+
+void ept_t::acquire() noexcept
+{
+  ++ref_count_;
+}
+
+void ept_t::release() noexcept
+{
+  if (--ref_count_ > 0)
+  {
+    return;
+  }
+
+  eptptr_.flags = 0;
+
+  //
+  // All tables (including root_ itself) are allocated from the pool,
+  // therefore there is no need to walk the hierarchy.
+  //
+  table_pool_.destroy();
+  root_ = nullptr;
+  walk_cache_generation_ += 1;
+
+  for (auto& table_count : table_count_)
+  {
+    table_count = 0;
+  }
+
+  delete[] dirty_buffer_;
+  dirty_buffer_ = nullptr;
+  dirty_ = bitmap();
+
+  demand_fault_count_ = 0;
+  demand_map_count_ = 0;
+}
+
+void ept_t::allocate_dirty() noexcept
+{
+  //
+  // Dirty bitmap covers the same physical memory as map_identity(), rounded
+  // up to the whole 64-bit words.
+  //
+  const int word_count = static_cast<int>((identity_map_end().pfn() + 63) / 64);
+
+  dirty_buffer_ = new uint64_t[word_count];
+  hvpp_assert(dirty_buffer_ != nullptr);
+
+  memset(dirty_buffer_, 0, word_count * sizeof(uint64_t));
+  dirty_ = bitmap(dirty_buffer_, word_count * 64);
+}
+
+epte_t* ept_t::allocate_table(page_table_level level) noexcept
+{
+  auto table = table_pool_.allocate();
+  hvpp_assert(table != nullptr);
+  static_assert(sizeof(epte_t) * 512 == page_size);
+
+  if constexpr (epte_empty_flags != 0)
+  {
+    for (int i = 0; i < 512; ++i)
+    {
+      table[i].flags = epte_empty_flags;
+    }
+  }
+
+  table_count_[static_cast<int>(level)] += 1;
+
+  //
+  // New PT might replace a PT which was borrowed from the shared EPT (see
+  // map_subtable()) - invalidate the lookup cache.
+  //
+  if (level == page_table_level::pt)
+  {
+    walk_cache_generation_ += 1;
+  }
+
+  return table;
+}
+
+void ept_t::free_table(epte_t* table, page_table_level level) noexcept
+{
+  table_pool_.free(table);
+  table_count_[static_cast<int>(level)] -= 1;
+
+  if (level == page_table_level::pt)
+  {
+    walk_cache_generation_ += 1;
+  }
+}
+
+epte_t* ept_t::map_subtable(epte_t* table, page_table_level level) noexcept
+{
+  //
+  // Get or create next level of EPT table hierarchy.
+  //
+  // PML5 (top level of 5-level EPT)
+  // -> PML4 (top level of 4-level EPT)
+  //   -> PDPT
+  //     -> PD
+  //       -> PT
+  //
+  if (table->is_present() && is_private(table))
+  {
+    return table->subtable();
+  }
+
+  auto subtable = allocate_table(level);
+
+  //
+  // The entry may be live - other processors can walk it while it's being
+  // changed (e.g. when update_memory_type() splits a large page of the
+  // shared EPT). Therefore the new entry is built aside and published with
+  // a single 64-bit store, after the subtable is filled in.
+  //
+  epte_t new_entry = *table;
+
+  if (table->is_present() && table->large_page)
+  {
+    //
+    // The entry maps large page. Split it into subtable of 512 smaller pages
+    // (2MB pages for 1GB page, 4kb pages for 2MB page), which inherit access
+    // rights and memory type of the large page. Memory type of the large page
+    // was uniform, therefore it's valid for each of the smaller pages too.
+    //
+    const uint64_t pfn_step = 1ull << (9 * static_cast<int>(level));
+
+    for (int i = 0; i < 512; ++i)
+    {
+      subtable[i].flags = table->flags & ~epte_private_flag;
+      subtable[i].page_frame_number = table->page_frame_number + i * pfn_step;
+      subtable[i].large_page = level != page_table_level::pt;
+    }
+
+    new_entry.flags = 0;
+  }
+  else if (table->is_present())
+  {
+    //
+    // The subtable is borrowed from the shared EPT. Make private copy of it
+    // (copy-on-write), so that the shared EPT stays untouched. Subtables
+    // referenced by the copy are still borrowed.
+    //
+    memcpy(subtable, table->subtable(), sizeof(epte_t) * 512);
+
+    for (int i = 0; i < 512; ++i)
+    {
+      subtable[i].flags &= ~epte_private_flag;
+    }
+  }
+
+  new_entry.update(pa_t::from_va(subtable));
+  new_entry.flags |= epte_private_flag;
+
+  std::atomic_thread_fence(std::memory_order_release);
+  table->flags = new_entry.flags;
+
+  return subtable;
+}
+
+void ept_t::unmap_subtable(epte_t* table, page_table_level level) noexcept
+{
+  //
+  // Free the subtable (if it's owned by us) and reset the entry, so it can
+  // be turned into a large page.
+  //
+  if (table->is_present() && !table->large_page)
+  {
+    if (is_private(table))
+    {
+      destroy(table->subtable(), level);
+    }
+
+    //
+    // The lookup cache might hold a PT of the dropped subtree. Private PTs
+    // invalidate it when they're freed, but PTs borrowed from the shared
+    // EPT aren't freed here at all.
+    //
+    walk_cache_generation_ += 1;
+  }
+
+  table->flags = epte_empty_flags;
+}
+
+bool ept_t::merge_subtable(epte_t* table, page_table_level level) noexcept
+{
+  //
+  // Replace the subtable with single large page (2MB page for PT, 1GB page
+  // for PD) if all its 512 entries are uniform - i.e. they map consecutive
+  // pages (starting at aligned address) with the same access rights and
+  // memory type. Because memory type of each page is derived from MTRRs,
+  // uniform memory type of entries means uniform memory type of the whole
+  // large page.
+  //
+  // Only subtables owned by us can be merged. Also, while any overlay holds
+  // reference to this EPT, the subtable might be borrowed by it and must
+  // not be freed. Keeping it alive instead wouldn't help either - overlays
+  // which copied the entry pointing to it would keep using it, but it
+  // wouldn't be reachable by later updates of the shared EPT anymore.
+  // Therefore the shared EPT isn't merged at all while overlays exist.
+  //
+  if (!is_private(table) || table->large_page || ref_count_ > 1)
+  {
+    return false;
+  }
+
+  static constexpr uint64_t epte_attribute_mask =
+    0b0000'0111'1111 | // read, write, execute, memory type, ignore PAT
+    (1ull << 10)     | // user-mode execute
+    (1ull << 63);      // suppress #VE
+
+  const uint64_t pfn_step = 1ull << (9 * static_cast<int>(level));
+  const bool     large    = level != page_table_level::pt;
+
+  auto subtable = table->subtable();
+  auto& first = subtable[0];
+
+  auto is_uniform = [&](int i) {
+    return subtable[i].is_present() &&
+           !!subtable[i].large_page == large &&
+           subtable[i].page_frame_number == first.page_frame_number + i * pfn_step &&
+           !((subtable[i].flags ^ first.flags) & epte_attribute_mask);
+  };
+
+  //
+  // Check the last entry first - this quickly rejects subtables which are
+  // being filled in ascending order (e.g. by map_identity()).
+  //
+  if ((first.page_frame_number & (pfn_step * 512 - 1)) || !is_uniform(0) || !is_uniform(511))
+  {
+    return false;
+  }
+
+  for (int i = 1; i < 511; ++i)
+  {
+    if (!is_uniform(i))
+    {
+      return false;
+    }
+  }
+
+  epte_t merged;
+  merged.flags = first.flags & epte_attribute_mask;
+  merged.page_frame_number = first.page_frame_number;
+  merged.large_page = true;
+
+  destroy(subtable, level);
+  *table = merged;
+
+  return true;
+}
+
+bool ept_t::link_shared(pa_t guest_pa) noexcept
+{
+  //
+  // Find first not-present entry on the path to "guest_pa" in this overlay
+  // and fill it from the shared EPT:
+  //   - if the shared EPT has an entry on the same level, copy it (without
+  //     the "private" flag - the subtable, if any, is borrowed),
+  //   - if the shared EPT maps larger page (this overlay owns a private
+  //     table inside of it), create the entry as a part of that large page.
+  // Returns true if "guest_pa" is mapped through this overlay afterwards.
+  //
+  epte_t* table = root_;
+  epte_t* shared_table = shared_->root_;
+  epte_t* shared_leaf = nullptr;
+  auto shared_leaf_level = root_level_;
+  auto level = root_level_;
+
+  for (;;)
+  {
+    auto entry = &table[guest_pa.index(level)];
+
+    if (!shared_leaf)
+    {
+      auto shared_entry = &shared_table[guest_pa.index(level)];
+
+      if (!shared_entry->is_present())
+      {
+        return false;
+      }
+
+      if (!entry->is_present())
+      {
+        entry->flags = shared_entry->flags & ~epte_private_flag;
+        return true;
+      }
+
+      if (level != page_table_level::pt && shared_entry->large_page)
+      {
+        shared_leaf = shared_entry;
+        shared_leaf_level = level;
+      }
+      else
+      {
+        shared_table = shared_entry->subtable();
+      }
+    }
+    else if (!entry->is_present())
+    {
+      //
+      // Number of 4kb pages mapped by an entry on given level.
+      //
+      auto page_count = [](page_table_level l) {
+        return 1ull << (9 * static_cast<int>(l));
+      };
+
+      epte_t new_entry;
+      new_entry.flags = shared_leaf->flags & ~epte_private_flag;
+      new_entry.large_page = level != page_table_level::pt;
+      new_entry.page_frame_number = shared_leaf->page_frame_number +
+        (guest_pa.pfn() & (page_count(shared_leaf_level) - 1) & ~(page_count(level) - 1));
+
+      entry->flags = new_entry.flags;
+      return true;
+    }
+
+    if (!is_private(entry) || level == page_table_level::pt || entry->large_page)
+    {
+      //
+      // The rest of the path is borrowed from the shared EPT (or the page
+      // is already mapped) - there is nothing to link, but the mapping may
+      // already be visible through the borrowed subtable.
+      //
+      page_table_level walk_level;
+      return walk(guest_pa, walk_level) != nullptr;
+    }
+
+    table = entry->subtable();
+    level = level - 1;
+  }
+}
+
+epte_t* ept_t::cursor_table(cursor_t& cursor, pa_t guest_pa, page_table_level level) noexcept
+{
+  if (level == root_level_)
+  {
+    return root_;
+  }
+
+  //
+  // Size of the memory mapped by the whole table of this level.
+  //
+  const int      index      = static_cast<int>(level);
+  const uint64_t table_size = uint64_t(page_size) << (9 * (index + 1));
+  const pa_t     base       = guest_pa.value() & ~(table_size - 1);
+
+  if (cursor.table[index] && cursor.base[index] == base)
+  {
+    return cursor.table[index];
+  }
+
+  cursor_leave(cursor, level);
+
+  auto parent = cursor_table(cursor, guest_pa, level + 1);
+  auto entry  = &parent[guest_pa.index(level + 1)];
+
+  cursor.table[index] = map_subtable(entry, level);
+  cursor.entry[index] = entry;
+  cursor.base[index]  = base;
+
+  return cursor.table[index];
+}
+
+void ept_t::cursor_leave(cursor_t& cursor, page_table_level level) noexcept
+{
+  //
+  // Leave the table of this level and all tables below it. Tables are
+  // merged bottom-up, so that a PD can be merged into 1GB page after all
+  // of its PTs have been merged into 2MB pages.
+  //
+  for (auto l = page_table_level::pt; l <= level; l = l + 1)
+  {
+    const int index = static_cast<int>(l);
+
+    if (!cursor.table[index])
+    {
+      continue;
+    }
+
+    if (l == page_table_level::pt || (l == page_table_level::pd && pdpte_1gb_pages_))
+    {
+      merge_subtable(cursor.entry[index], l);
+    }
+
+    cursor.table[index] = nullptr;
+  }
+}
+
+epte_t* ept_t::split_4kb(pa_t guest_pa) noexcept
+{
+  //
+  // Make the whole path to the 4kb page private and split large pages on
+  // the way. Note that map_subtable() does both.
+  //
+  auto table = root_;
+
+  for (auto level = root_level_; level != page_table_level::pt; level = level - 1)
+  {
+    auto entry = &table[guest_pa.index(level)];
+
+    if (!entry->is_present())
+    {
+      return nullptr;
+    }
+
+    table = map_subtable(entry, level - 1);
+  }
+
+  return &table[guest_pa.index(page_table_level::pt)];
+}
+
+void ept_t::destroy(epte_t* table, page_table_level level) noexcept
+{
+  //
+  // Free the table and all subtables below it. PTs have no subtables and
+  // large pages don't point to any table.
+  //
+  if (level != page_table_level::pt)
+  {
+    for (int i = 0; i < 512; ++i)
+    {
+      auto entry = &table[i];
+
+      //
+      // Skip subtables which are borrowed from the shared EPT.
+      //
+      if (entry->is_present() && is_private(entry) && !entry->large_page)
+      {
+        hvpp_assert(entry->page_frame_number != 0);
+
+        destroy(entry->subtable(), level - 1);
+      }
+    }
+  }
+
+  free_table(table, level);
+}
+
+epte_t* ept_t::walk(pa_t guest_pa, page_table_level& level) const noexcept
+{
+  epte_t* table = root_;
+  level = root_level_;
+
+  for (;;)
+  {
+    auto entry = &table[guest_pa.index(level)];
+
+    if (!entry->is_present())
+    {
+      return nullptr;
+    }
+
+    if (level == page_table_level::pt || entry->large_page)
+    {
+      return entry;
+    }
+
+    table = entry->subtable();
+    level = level - 1;
+  }
+}
+
+//
+// Table pool
+//
+
+void ept_table_pool_t::initialize() noexcept
+{
+  free_list_ = nullptr;
+  chunk_count_ = 0;
+  next_page_ = 0;
+  last_chunk_page_count_ = 0;
+  cpu_cache_ = nullptr;
+}
+
+void ept_table_pool_t::destroy() noexcept
+{
+  for (int i = 0; i < chunk_count_; ++i)
+  {
+    memory_manager::free(chunk_[i]);
+  }
+
+  if (cpu_cache_)
+  {
+    memory_manager::free(cpu_cache_);
+  }
+
+  initialize();
+}
+
+void ept_table_pool_t::enable_cpu_caches() noexcept
+{
+  static_assert(sizeof(cpu_cache_t) * max_cpu_cache_count == page_size);
+
+  //
+  // If the allocation fails, all CPUs just keep using the pool lock.
+  //
+  if (!cpu_cache_)
+  {
+    cpu_cache_ = reinterpret_cast<cpu_cache_t*>(memory_manager::allocate_zeroed(page_size));
+  }
+}
+
+epte_t* ept_table_pool_t::allocate() noexcept
+{
+  if (cpu_cache_)
+  {
+    return allocate_cached();
+  }
+
+  std::lock_guard _(lock_);
+  return allocate_unlocked();
+}
+
+epte_t* ept_table_pool_t::allocate_cached() noexcept
+{
+  auto& cache = cpu_cache_[mp::cpu_index() % max_cpu_cache_count];
+  std::lock_guard _(cache.lock);
+
+  if (cache.page_count == 0)
+  {
+    //
+    // Take the next batch of unused pages of the current chunk (or a page
+    // of the free list). The batch never spans more than one chunk, which
+    // also keeps the small first chunks of the pool small.
+    //
+    std::lock_guard _(lock_);
+
+    if (free_list_)
+    {
+      return allocate_unlocked();
+    }
+
+    if (next_page_ == last_chunk_page_count_ && !grow())
+    {
+      return nullptr;
+    }
+
+    cache.next_page = chunk_[chunk_count_ - 1] + next_page_ * page_size;
+    cache.page_count = std::min(cpu_cache_page_count, last_chunk_page_count_ - next_page_);
+    next_page_ += cache.page_count;
+  }
+
+  auto page = cache.next_page;
+  cache.next_page += page_size;
+  cache.page_count -= 1;
+
+  return reinterpret_cast<epte_t*>(page);
+}
+
+epte_t* ept_table_pool_t::allocate_unlocked() noexcept
+{
+  if (free_list_)
+  {
+    auto page = free_list_;
+    free_list_ = page->next;
+    page->next = nullptr;
+
+    return reinterpret_cast<epte_t*>(page);
+  }
+
+  if (next_page_ == last_chunk_page_count_ && !grow())
+  {
+    return nullptr;
+  }
+
+  auto page = chunk_[chunk_count_ - 1] + next_page_ * page_size;
+  next_page_ += 1;
+
+  return reinterpret_cast<epte_t*>(page);
+}
+
+void ept_table_pool_t::free(epte_t* table) noexcept
+{
+  memset(table, 0, page_size);
+
+  std::lock_guard _(lock_);
+
+  auto page = reinterpret_cast<free_page_t*>(table);
+  page->next = free_list_;
+  free_list_ = page;
+}
+
+uint32_t ept_table_pool_t::page_count() const noexcept
+{
+  uint32_t result = 0;
+
+  for (int i = 0; i < chunk_count_; ++i)
+  {
+    result += chunk_page_count(i);
+  }
+
+  return result;
+}
+
+int ept_table_pool_t::chunk_page_count(int chunk_index) noexcept
+{
+  //
+  // 1, 2, 4, ... 256, 512, 512, ...
+  //
+  return chunk_index < 9
+    ? min_chunk_page_count << chunk_index
+    : max_chunk_page_count;
+}
+
+bool ept_table_pool_t::grow() noexcept
+{
+  if (chunk_count_ == max_chunk_count)
+  {
+    return false;
+  }
+
+  int page_count = chunk_page_count(chunk_count_);
+
+  //
+  // Tables must be zeroed - take pages zeroed in advance, if possible
+  // (this may run in VM-exit handler).
+  //
+  auto chunk = reinterpret_cast<uint8_t*>(memory_manager::allocate_zeroed(page_count * page_size));
+
+  if (!chunk)
+  {
+    return false;
+  }
+
+  chunk_[chunk_count_] = chunk;
+  chunk_count_ += 1;
+
+  next_page_ = 0;
+  last_chunk_page_count_ = page_count;
+
+  return true;
+}
+
+//
+// Views
+//
+
+void ept_views_t::initialize(ept_t& shared) noexcept
+{
+  shared_ = &shared;
+
+  eptp_list_ = new ept_ptr_t[max_view_count];
+  hvpp_assert(eptp_list_ != nullptr);
+  memset(eptp_list_, 0, sizeof(ept_ptr_t) * max_view_count);
+  static_assert(sizeof(ept_ptr_t) * max_view_count == page_size);
+
+  memset(view_, 0, sizeof(view_));
+  count_ = 0;
+
+  //
+  // Create default view.
+  //
+  create();
+}
+
+void ept_views_t::destroy() noexcept
+{
+  for (int i = 0; i < max_view_count; ++i)
+  {
+    if (view_[i])
+    {
+      destroy(i);
+    }
+  }
+
+  delete[] eptp_list_;
+  eptp_list_ = nullptr;
+  shared_ = nullptr;
+}
+
+int ept_views_t::create() noexcept
+{
+  for (int i = 0; i < max_view_count; ++i)
+  {
+    if (!view_[i])
+    {
+      auto view = new ept_t;
+      hvpp_assert(view != nullptr);
+
+      view->initialize(*shared_);
+
+      view_[i] = view;
+      eptp_list_[i] = view->ept_pointer();
+      count_ += 1;
+
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+void ept_views_t::destroy(int index) noexcept
+{
+  hvpp_assert(contains(index));
+
+  eptp_list_[index].flags = 0;
+
+  view_[index]->destroy();
+  delete view_[index];
+  view_[index] = nullptr;
+
+  count_ -= 1;
+}
+
+bool ept_views_t::contains(int index) const noexcept
+{
+  return index >= 0 && index < max_view_count && view_[index] != nullptr;
+}
+
+int ept_views_t::count() const noexcept
+{
+  return count_;
+}
+
+ept_t& ept_views_t::operator[](int index) noexcept
+{
+  hvpp_assert(contains(index));
+
+  return *view_[index];
+}
+
+ept_t& ept_views_t::shared() noexcept
+{
+  return *shared_;
+}
+
+pa_t ept_views_t::eptp_list_address() const noexcept
+{
+  return pa_t::from_va(eptp_list_);
+}
+
+//
+// Transaction
+//
+
+ept_transaction_t::ept_transaction_t(ept_t& ept) noexcept
+  : ept_(ept)
+  , map_count_(0)
+  , flushes_avoided_(0)
+  , invept_pending_(false)
+  , invvpid_pending_(false)
+{
+
+}
+
+ept_transaction_t::~ept_transaction_t() noexcept
+{
+  commit();
+}
+
+epte_t* ept_transaction_t::map(pa_t guest_pa, pa_t host_pa, epte_t::access_type access /* = epte_t::access_type::read_write_execute */, ept_t::large_page large /* = ept_t::large_page::none */) noexcept
+{
+  //
+  // Remember the entry which currently translates "guest_pa" (if any), so
+  // that we can find out what exactly has changed.
+  //
+  page_table_level old_level;
+  auto old_entry_ptr = ept_.walk(guest_pa, old_level);
+  auto old_entry = old_entry_ptr ? *old_entry_ptr : epte_t{ 0 };
+
+  auto new_entry = ept_.map(guest_pa, host_pa, access, large);
+
+  map_count_ += 1;
+
+  //
+  // Processor doesn't cache translations derived from not-present entries.
+  //
+  if (!old_entry.is_present())
+  {
+    return new_entry;
+  }
+
+  //
+  // Large page maps 512 (2MB) or 512*512 (1GB) consecutive 4kb pages.
+  //
+  uint64_t level_page_count = 1ull << (9 * static_cast<int>(old_level));
+  uint64_t old_host_pfn = old_entry.page_frame_number + (guest_pa.pfn() & (level_page_count - 1));
+
+  if (old_host_pfn != host_pa.pfn())
+  {
+    invept_pending_ = true;
+    invvpid_pending_ = true;
+  }
+  else if (old_entry.access != new_entry->access ||
+           old_entry.memory_type != new_entry->memory_type)
+  {
+    invept_pending_ = true;
+  }
+
+  return new_entry;
+}
+
+epte_t* ept_transaction_t::map_4kb(pa_t guest_pa, pa_t host_pa, epte_t::access_type access /* = epte_t::access_type::read_write_execute */) noexcept
+{
+  return map(guest_pa, host_pa, access, ept_t::large_page::none);
+}
+
+epte_t* ept_transaction_t::map_2mb(pa_t guest_pa, pa_t host_pa, epte_t::access_type access /* = epte_t::access_type::read_write_execute */) noexcept
+{
+  return map(guest_pa, host_pa, access, ept_t::large_page::pde_2mb);
+}
+
+epte_t* ept_transaction_t::map_1gb(pa_t guest_pa, pa_t host_pa, epte_t::access_type access /* = epte_t::access_type::read_write_execute */) noexcept
+{
+  return map(guest_pa, host_pa, access, ept_t::large_page::pdpte_1gb);
+}
+
+epte_t* ept_transaction_t::suppress_ve(pa_t guest_pa, bool suppress) noexcept
+{
+  page_table_level old_level;
+  auto old_entry_ptr = ept_.walk(guest_pa, old_level);
+  auto old_entry = old_entry_ptr ? *old_entry_ptr : epte_t{ 0 };
+
+  auto new_entry = ept_.suppress_ve(guest_pa, suppress);
+
+  map_count_ += 1;
+
+  if (new_entry && old_entry.suppress_ve != new_entry->suppress_ve)
+  {
+    invept_pending_ = true;
+  }
+
+  return new_entry;
+}
+
+void ept_transaction_t::commit() noexcept
+{
+  //
+  // Without transaction, each remap would be followed by INVEPT and INVVPID
+  // (both all-context).
+  //
+  uint32_t flush_count = 0;
+
+  if (invept_pending_)
+  {
+    if (ept_.invept_single_context_)
+    {
+      vmx::invept_desc_t descriptor{ ept_.ept_pointer(), 0 };
+      vmx::invept(vmx::invept_t::single_context, &descriptor);
+    }
+    else
+    {
+      vmx::invept(vmx::invept_t::all_context);
+    }
+
+    flush_count += 1;
+  }
+
+  if (invvpid_pending_)
+  {
+    vmx::invvpid(vmx::invvpid_t::all_context);
+    flush_count += 1;
+  }
+
+  flushes_avoided_ += map_count_ * 2 - flush_count;
+
+  map_count_ = 0;
+  invept_pending_ = false;
+  invvpid_pending_ = false;
+}
+
+uint32_t ept_transaction_t::flushes_avoided() const noexcept
+{
+  return flushes_avoided_;
+}
+
+//
+// Heat map
+//
+
+void ept_heat_map_t::initialize(ept_t& ept) noexcept
+{
+  ept_ = &ept;
+
+  //
+  // Cover the same physical memory as map_identity(), rounded up to the
+  // whole 64-bit words of the "touched" bitmap.
+  //
+  const uint64_t region_size = 1ull << region_shift;
+  const uint64_t region_count = (identity_map_end().value() + region_size - 1) >> region_shift;
+  const int word_count = static_cast<int>((region_count + 63) / 64);
+
+  region_count_ = word_count * 64;
+
+  heat_ = new uint8_t[region_count_];
+  hvpp_assert(heat_ != nullptr);
+  memset(heat_, 0, region_count_);
+
+  touched_buffer_ = new uint64_t[word_count];
+  hvpp_assert(touched_buffer_ != nullptr);
+  touched_ = bitmap(touched_buffer_, region_count_);
+
+  scan_count_ = 0;
+  accessed_page_count_ = 0;
+  dirty_page_count_ = 0;
+  memset(histogram_, 0, sizeof(histogram_));
+}
+
+void ept_heat_map_t::destroy() noexcept
+{
+  delete[] heat_;
+  delete[] touched_buffer_;
+
+  heat_ = nullptr;
+  touched_buffer_ = nullptr;
+  touched_ = bitmap();
+  region_count_ = 0;
+}
+
+void ept_heat_map_t::scan() noexcept
+{
+  touched_.clear();
+  accessed_page_count_ = 0;
+  dirty_page_count_ = 0;
+
+  scan_table(ept_->root_, ept_->root_level_, 0);
+
+  //
+  // Age all regions: the highest bit of the heat represents this scan,
+  // lower bits represent previous scans. Regions are aged by words of 64
+  // - words of regions with the same heat which were either all touched
+  // or all untouched (cold memory, or hot memory in the steady state) are
+  // aged at once, so that the aging doesn't dominate the scan.
+  //
+  memset(histogram_, 0, sizeof(histogram_));
+
+  uint32_t warm_count = 0;
+
+  for (int word = 0; word < region_count_ / 64; ++word)
+  {
+    const auto heat    = heat_ + word * 64;
+    const auto touched = touched_buffer_[word];
+
+    uint64_t first_value;
+    memcpy(&first_value, heat, sizeof(first_value));
+
+    bool uniform = first_value == (first_value & 0xff) * 0x0101010101010101 &&
+                   (touched == 0 || touched == ~0ull);
+
+    for (int i = sizeof(uint64_t); i < 64 && uniform; i += sizeof(uint64_t))
+    {
+      uint64_t value;
+      memcpy(&value, heat + i, sizeof(value));
+      uniform = value == first_value;
+    }
+
+    if (uniform)
+    {
+      const auto new_heat = static_cast<uint8_t>((heat[0] >> 1) | (touched ? 0x80 : 0));
+
+      if (new_heat != heat[0])
+      {
+        memset(heat, new_heat, 64);
+      }
+
+      if (new_heat)
+      {
+        histogram_[ia32_asm_popcnt(new_heat)] += 64;
+        warm_count += 64;
+      }
+
+      continue;
+    }
+
+    for (int i = 0; i < 64; ++i)
+    {
+      heat[i] = static_cast<uint8_t>((heat[i] >> 1) | ((touched >> i) & 1 ? 0x80 : 0));
+
+      if (heat[i])
+      {
+        histogram_[ia32_asm_popcnt(heat[i])] += 1;
+        warm_count += 1;
+      }
+    }
+  }
+
+  histogram_[0] = region_count_ - warm_count;
+
+  scan_count_ += 1;
+}
+
+void ept_heat_map_t::scan_table(epte_t* table, page_table_level level, uint64_t first_pfn) noexcept
+{
+  static constexpr uint64_t pages_per_region = 1ull << (region_shift - page_shift);
+
+  static constexpr uint64_t epte_accessed_flag = 1ull << 8;
+  static constexpr uint64_t epte_dirty_flag    = 1ull << 9;
+
+  //
+  // Number of 4kb pages mapped by an entry on this level.
+  //
+  const uint64_t page_count = 1ull << (9 * static_cast<int>(level));
+
+  uint64_t accessed_count = 0;
+  uint64_t dirty_count = 0;
+
+  for (uint64_t i = 0; i < 512; ++i)
+  {
+    auto& entry = table[i];
+
+    //
+    // The processor sets accessed flag in every EPT paging-structure entry
+    // it uses during the translation - if the flag is clear, nothing below
+    // this entry has been accessed since the last scan and the whole subtree
+    // can be skipped.
+    //
+    if (!entry.is_present() || !entry.accessed)
+    {
+      continue;
+    }
+
+    const uint64_t pfn  = first_pfn + i * page_count;
+    const bool     leaf = level == page_table_level::pt || entry.large_page;
+
+    //
+    // Regions are 2MB, i.e. PD entries. Entries above them (1GB pages)
+    // touch several regions, entries below them (4kb pages) were already
+    // covered by their PD entry.
+    //
+    if (level == page_table_level::pd)
+    {
+      const uint64_t region = pfn / pages_per_region;
+
+      if (region < static_cast<uint64_t>(region_count_))
+      {
+        touched_.set(static_cast<int>(region));
+      }
+    }
+    else if (leaf && level > page_table_level::pd)
+    {
+      const uint64_t first_region = pfn / pages_per_region;
+
+      if (first_region < static_cast<uint64_t>(region_count_))
+      {
+        touched_.set(static_cast<int>(first_region),
+                     static_cast<int>(std::min(page_count / pages_per_region, region_count_ - first_region)));
+      }
+    }
+
+    //
+    // Both flags are cleared with a single write. Accumulate the counters
+    // locally, the compiler can't keep members in registers across the
+    // writes into the tables.
+    //
+    if (leaf)
+    {
+      accessed_count += page_count;
+      dirty_count += entry.dirty ? page_count : 0;
+      entry.flags &= ~(epte_accessed_flag | epte_dirty_flag);
+    }
+    else
+    {
+      entry.flags &= ~epte_accessed_flag;
+      scan_table(entry.subtable(), level - 1, pfn);
+    }
+  }
+
+  accessed_page_count_ += accessed_count;
+  dirty_page_count_ += dirty_count;
+}
+
+int ept_heat_map_t::region_count() const noexcept
+{
+  return region_count_;
+}
+
+uint8_t ept_heat_map_t::heat(int region) const noexcept
+{
+  return region < region_count_
+    ? heat_[region]
+    : 0;
+}
+
+uint32_t ept_heat_map_t::histogram(int scan_count) const noexcept
+{
+  return scan_count < histogram_size
+    ? histogram_[scan_count]
+    : 0;
+}
+
+uint64_t ept_heat_map_t::accessed_page_count() const noexcept
+{
+  return accessed_page_count_;
+}
+
+uint64_t ept_heat_map_t::dirty_page_count() const noexcept
+{
+  return dirty_page_count_;
+}
+
+uint32_t ept_heat_map_t::scan_count() const noexcept
+{
+  return scan_count_;
 }
 
 }
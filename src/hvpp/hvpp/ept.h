@@ -1,11 +1,90 @@
 #pragma once
 #include "ia32/ept.h"
 #include "ia32/memory.h"
+#include "lib/bitmap.h"
+#include "lib/spinlock.h"
+
+#include <atomic>
 
 namespace hvpp {
 
 using namespace ia32;
 
+//
+// Pool of pages for EPT tables.
+//
+// Pages are carved from chunks of physically-unrelated but virtually
+// contiguous pages, allocated from the memory manager. Chunks grow
+// geometrically (1, 2, 4, ... 512 pages), which keeps tables of one EPT
+// close together. The first chunk holds just the root table - most EPTs
+// (overlays, EPT views) never need more than a few tables. Each chunk is zeroed once when it's allocated; freed
+// pages are zeroed and put on a free list, so that allocate() always
+// returns zeroed page in O(1) time.
+//
+// destroy() releases all chunks at once - tables don't have to be freed
+// individually.
+//
+// allocate() and free() can be called concurrently (see
+// ept_t::map_identity_parallel()). For heavy concurrent use, per-CPU caches
+// can be enabled by enable_cpu_caches() - each CPU then takes batches of
+// cpu_cache_page_count pages from the current chunk and hands them out
+// without taking the pool lock. Pages left in the caches stay there until
+// destroy().
+//
+class ept_table_pool_t
+{
+  public:
+    static constexpr int min_chunk_page_count = 1;
+    static constexpr int max_chunk_page_count = 512;
+    static constexpr int max_chunk_count      = 68;
+    static constexpr int max_cpu_cache_count  = 64;
+    static constexpr int cpu_cache_page_count = 32;
+
+    void initialize() noexcept;
+    void destroy() noexcept;
+
+    void enable_cpu_caches() noexcept;
+
+    epte_t* allocate() noexcept;
+    void free(epte_t* table) noexcept;
+
+    //
+    // Number of pages reserved by the pool (allocated or free).
+    //
+    uint32_t page_count() const noexcept;
+
+  private:
+    static int chunk_page_count(int chunk_index) noexcept;
+
+    bool grow() noexcept;
+    epte_t* allocate_unlocked() noexcept;
+    epte_t* allocate_cached() noexcept;
+
+    struct free_page_t
+    {
+      free_page_t* next;
+    };
+
+    struct alignas(64) cpu_cache_t
+    {
+      spinlock   lock;                  // Uncontended (see memory_manager magazines)
+      uint8_t*   next_page;
+      int        page_count;
+    };
+
+    cpu_cache_t* cpu_cache_;            // max_cpu_cache_count caches or nullptr
+
+    free_page_t* free_list_;
+
+    uint8_t*     chunk_[max_chunk_count];
+    int          chunk_count_;
+
+    int          next_page_;            // Next unused page in the last chunk
+    int          last_chunk_page_count_;
+
+    spinlock     lock_;
+};
+
 class ept_t
 {
   public:
@@ -16,29 +95,445 @@ class ept_t
       pdpte_1gb,
     };
 
+    //
+    // Initialize standalone EPT, which owns all of its tables.
+    //
+    // The first overload picks the number of paging-structure levels on its
+    // own: 5-level EPT (PML5 root) is used only when the processor supports
+    // it and some physical memory lies above 256TB (which isn't reachable
+    // with 4 levels); otherwise 4-level EPT (PML4 root) is used. The second
+    // overload forces the root level (page_table_level::pml4 or pml5).
+    //
     void initialize() noexcept;
+    void initialize(page_table_level root_level) noexcept;
+
+    //
+    // Initialize EPT as a private overlay of the "shared" EPT. The overlay
+    // borrows all tables of the shared EPT and copies them (on write) only
+    // when some page is remapped through the overlay. Shared EPT is reference
+    // counted and its tables are freed when the last overlay is destroyed.
+    // The overlay has the same number of levels as the shared EPT.
+    //
+    void initialize(ept_t& shared) noexcept;
     void destroy() noexcept;
 
     ept_ptr_t ept_pointer() const noexcept;
 
+    //
+    // Returns level of the root table (page_table_level::pml4 or pml5).
+    //
+    page_table_level root_level() const noexcept;
+
+    //
+    // Returns number of tables (pages) allocated by this EPT for specified
+    // level. Tables borrowed from the shared EPT are not counted.
+    //
+    uint32_t table_count(page_table_level level) const noexcept;
+
     void map_identity() noexcept;
+
+    //
+    // Parallel identity mapping. The work is split into 1GB slots, which are
+    // claimed by the workers one by one. map_identity_begin() prepares the
+    // slots (and enables per-CPU caches of the table pool) and
+    // map_identity_work() processes them until there is none left - it's
+    // meant to be called by any number of threads at the same time.
+    // map_identity_parallel() runs it on all logical processors (via IPI).
+    //
+    void map_identity_parallel() noexcept;
+    void map_identity_begin() noexcept;
+    void map_identity_work() noexcept;
+
+    //
+    // On-demand identity mapping (see HVPP_ENABLE_LAZY_EPT).
+    //
+    // Maps the page containing "guest_pa" in the shared EPT with the largest
+    // page possible (1GB, 2MB or 4kb) - it must be free in the shared EPT
+    // and its memory type must be uniform. If this is an overlay, the new
+    // mapping is then linked into it as well (overlay copied the shared
+    // tables before they contained this mapping). Returns true if the page
+    // is mapped in this EPT afterwards - including the case when another
+    // processor mapped it first - so that the faulting instruction can be
+    // executed again. Callers are expected to call this only for EPT
+    // violations caused by a not-present entry.
+    //
+    // Demand fault counters are kept in the shared EPT: demand_fault_count()
+    // counts all successful calls (including overlays), demand_map_count()
+    // counts pages mapped in the shared EPT.
+    //
+    bool map_identity_on_demand(pa_t guest_pa) noexcept;
+    uint32_t demand_fault_count() const noexcept;
+    uint32_t demand_map_count() const noexcept;
     epte_t* map(pa_t guest_pa, pa_t host_pa, epte_t::access_type access = epte_t::access_type::read_write_execute, large_page large = large_page::none) noexcept;
 
     epte_t* map_4kb(pa_t guest_pa, pa_t host_pa, epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
     epte_t* map_2mb(pa_t guest_pa, pa_t host_pa, epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
     epte_t* map_1gb(pa_t guest_pa, pa_t host_pa, epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
 
+    //
+    // Range operations.
+    //
+    // map_range() maps "size" bytes at "guest_pa" to "host_pa" with the
+    // largest pages possible - page size is limited by alignment of both
+    // addresses, by the end of the range and by the memory type (it must be
+    // uniform across the page).
+    //
+    // protect_range() changes access rights of all mapped pages in the range.
+    // Large pages which are only partially covered are split first.
+    // Unmapped parts of the range are skipped.
+    //
+    // Both operations keep a cursor at the current PDPT/PD/PT, therefore each
+    // table is visited just once. Subtables are merged back into large pages
+    // (if possible) when the cursor leaves them. Caller is responsible for
+    // the invalidation.
+    //
+    void map_range(pa_t guest_pa, pa_t host_pa, uint64_t size, epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
+    void protect_range(pa_t guest_pa, uint64_t size, epte_t::access_type access) noexcept;
+
+    //
+    // Read-only queries.
+    //
+    // lookup() returns leaf entry (4kb, 2MB or 1GB page) which maps
+    // "guest_pa" (and optionally its level), or nullptr if the address isn't
+    // mapped. translate() returns host physical address to which "guest_pa"
+    // is mapped. Neither of them allocates, splits or copies any table - in
+    // overlays, the returned entry might belong to a table borrowed from the
+    // shared EPT and must not be modified.
+    //
+    // PTs found by the lookups are remembered in a small direct-mapped cache
+    // (indexed by 2MB region), therefore repeated lookups in the same 2MB
+    // region (e.g. on hooked pages) skip the walk from the root. The cache
+    // is invalidated whenever any PT of this EPT is allocated or freed, or
+    // a PT borrowed from the shared EPT is replaced by a large page.
+    // Lookups are not synchronized with concurrent modifications of the EPT.
+    //
+    epte_t* lookup(pa_t guest_pa) noexcept;
+    epte_t* lookup(pa_t guest_pa, page_table_level& level) noexcept;
+    bool    translate(pa_t guest_pa, pa_t& host_pa) noexcept;
+
+    uint64_t lookup_hit_count() const noexcept;
+    uint64_t lookup_miss_count() const noexcept;
+
+    //
+    // Memory type recomputation (after the guest changed MTRRs).
+    //
+    // invalidate_memory_type() records range of guest-physical memory whose
+    // memory type might have changed. update_memory_type() recomputes memory
+    // type of all entries which map the recorded memory: large pages whose
+    // memory type isn't uniform anymore are split and subtables which became
+    // uniform are merged (when the cursor leaves them). Standalone EPT first
+    // re-reads MTRRs of the current processor (see memory_manager::update_mtrr()).
+    // Returns false if nothing was recorded. Caller is responsible for the
+    // invalidation on all processors (see request_invalidation()).
+    //
+    // Overlays update only entries in their private tables - borrowed tables
+    // are updated through the shared EPT, which should therefore be updated
+    // first. Updates are serialized by the lock of the shared EPT.
+    //
+    // Note that subtables of the shared EPT are never merged while any
+    // overlay exists (see merge_subtable()) - and each VCPU holds at least
+    // one overlay (its view 0) from hypervisor::start() to stop(). Large
+    // pages of the shared EPT split by the recomputation therefore stay
+    // split until the hypervisor is stopped. Memory types are correct, only
+    // the TLB reach is smaller. Private tables of overlays are merged.
+    //
+    void invalidate_memory_type(const memory_range& range) noexcept;
+    bool update_memory_type() noexcept;
+
+    //
+    // Deferred invalidation on all processors. request_invalidation() asks
+    // every VCPU which uses this EPT (or any overlay of the same shared
+    // EPT) to invalidate cached EPT translations (all-context INVEPT). Each
+    // VCPU compares invalidation_generation() with the last one it has seen
+    // before it enters the guest again (see vcpu_t::entry_host()) - i.e.
+    // other processors are invalidated on their next VM-exit, not
+    // immediately. IPIs can't be sent from VMX-root mode.
+    //
+    void     request_invalidation() noexcept;
+    uint32_t invalidation_generation() const noexcept;
+
+    //
+    // Sets or clears "suppress #VE" bit of the 4kb page (large page is split
+    // first). When the bit is cleared and "EPT-violation #VE" is enabled
+    // (see HVPP_ENABLE_VE), EPT violations on this page are converted into
+    // #VE in the guest instead of VM-exit. Returns nullptr if the page isn't
+    // mapped. Caller is responsible for the invalidation (or can use the
+    // ept_transaction_t).
+    //
+    epte_t* suppress_ve(pa_t guest_pa, bool suppress) noexcept;
+
+    //
+    // Dirty page tracking (see HVPP_ENABLE_PML).
+    //
+    // Standalone EPT keeps bitmap of dirty 4kb pages (bit N represents page
+    // with PFN N) covering the identity-mapped memory - the bitmap is
+    // allocated by initialize(). Overlays forward both methods to the
+    // shared EPT, because they share the leaf entries with it.
+    //
+    // mark_dirty() records guest-physical addresses reported by the
+    // page-modification log. The processor logs only the first write into
+    // a page with clear dirty flag, therefore all 4kb pages of a large page
+    // are recorded.
+    //
+    // harvest_dirty() moves recorded pages into "dirty" (which should be at
+    // least dirty_page_count() bits long) and returns their count. Dirty
+    // flags of harvested pages are cleared in the leaf entries of the shared
+    // EPT, so that next write to them is logged again (leaf entries in the
+    // tables privately owned by overlays are left intact). Caller is
+    // responsible for the invalidation on all processors.
+    //
+    int  dirty_page_count() const noexcept;
+    void mark_dirty(const pa_t* guest_pa, int count) noexcept;
+    int  harvest_dirty(bitmap& dirty) noexcept;
+
+  private:
+    friend class ept_transaction_t;
+    friend class ept_heat_map_t;
+
+    static constexpr int max_level_count = static_cast<int>(page_table_level::pml5) + 1;
+
+    //
+    // Cursor of the range operations. For each level, it holds the table
+    // of that level which was used last (table[pt] is PT, ...), guest
+    // address of the first page mapped through it and the entry pointing
+    // to it (in the table one level above).
+    //
+    struct cursor_t
+    {
+      epte_t* table[max_level_count];
+      epte_t* entry[max_level_count];
+      pa_t    base[max_level_count];
+    };
+
+    //
+    // Slot of the lookup cache - PT which maps the 2MB "region". The slot
+    // is valid only if its "generation" matches walk_cache_generation_.
+    // Overlays can cache PTs borrowed from the shared EPT, which frees them
+    // on its own - such slots also have to match "shared_generation" (the
+    // walk_cache_generation_ of the shared EPT).
+    //
+    static constexpr int walk_cache_size = 64;
+
+    struct walk_cache_entry_t
+    {
+      uint64_t region;
+      epte_t*  pt;
+      uint32_t generation;
+      uint32_t shared_generation;
+    };
+
+    void setup(page_table_level root_level) noexcept;
+    void acquire() noexcept;
+    void release() noexcept;
+
+    void allocate_dirty() noexcept;
+
+    void map_identity_prepare() noexcept;
+
+    epte_t* allocate_table(page_table_level level) noexcept;
+    void    free_table(epte_t* table, page_table_level level) noexcept;
+
+    epte_t* map_subtable(epte_t* table, page_table_level level) noexcept;
+    epte_t* split_4kb(pa_t guest_pa) noexcept;
+    void    unmap_subtable(epte_t* table, page_table_level level) noexcept;
+    bool    merge_subtable(epte_t* table, page_table_level level) noexcept;
+    bool    link_shared(pa_t guest_pa) noexcept;
+    epte_t* cursor_table(cursor_t& cursor, pa_t guest_pa, page_table_level level) noexcept;
+    void    cursor_leave(cursor_t& cursor, page_table_level level) noexcept;
+
+    void destroy(epte_t* table, page_table_level level) noexcept;
+
+    //
+    // Returns leaf entry (4kb, 2MB or 1GB page) which maps "guest_pa" and its
+    // level, or nullptr if the address isn't mapped.
+    //
+    epte_t* walk(pa_t guest_pa, page_table_level& level) const noexcept;
+
+    alignas(page_size) ept_ptr_t        eptptr_;
+                       epte_t*          root_;
+                       page_table_level root_level_;
+
+                       ept_table_pool_t table_pool_;
+
+                       ept_t*           shared_;
+                       std::atomic<int> ref_count_;
+
+                       std::atomic<uint32_t> table_count_[max_level_count];
+                       bool                  pdpte_1gb_pages_;
+                       bool                  invept_single_context_;
+
+                       uint64_t*        dirty_buffer_;
+                       bitmap           dirty_;
+                       spinlock         dirty_lock_;
+
+                       spinlock         lock_;
+                       uint32_t         demand_fault_count_;
+                       uint32_t         demand_map_count_;
+
+                       std::atomic<uint32_t> next_slot_;
+                       uint32_t              slot_count_;
+
+                       walk_cache_entry_t    walk_cache_[walk_cache_size];
+                       std::atomic<uint32_t> walk_cache_generation_;
+                       uint64_t              lookup_hit_count_;
+                       uint64_t              lookup_miss_count_;
+
+                       memory_range          memory_type_pending_;
+                       std::atomic<uint32_t> invalidation_generation_;
+};
+
+//
+// Set of EPT views.
+//
+// Each view is a private overlay of the shared EPT (see
+// ept_t::initialize(ept_t&)), therefore all views share subtrees which
+// they didn't modify. Switching between views requires just change of
+// the EPT pointer - no tables are rebuilt.
+//
+// The set also maintains EPTP list - page holding EPT pointers of all
+// views, which is used by VMFUNC leaf 0 (EPTP switching). Entries of
+// destroyed (or never created) views are zero, which is invalid EPT
+// pointer - VMFUNC with such index causes VM-exit.
+//
+// View 0 always exists.
+//
+class ept_views_t
+{
+  public:
+    static constexpr int max_view_count = 512;
+
+    void initialize(ept_t& shared) noexcept;
+    void destroy() noexcept;
+
+    //
+    // Creates new view and returns its index, or -1 if no free index is
+    // available.
+    //
+    int  create() noexcept;
+    void destroy(int index) noexcept;
+
+    bool contains(int index) const noexcept;
+    int  count() const noexcept;
+
+    ept_t& operator[](int index) noexcept;
+    ept_t& shared() noexcept;
+
+    pa_t eptp_list_address() const noexcept;
+
+  private:
+    ept_t*     shared_;
+    ept_ptr_t* eptp_list_;
+    ept_t*     view_[max_view_count];
+    int        count_;
+};
+
+//
+// Batch of EPT remaps with single invalidation at the end.
+//
+// Each remap is compared with the entry it replaces and only the minimal
+// invalidation is recorded:
+//   - nothing, if the page wasn't mapped before or the mapping didn't change,
+//   - INVEPT (single-context for this EPT if supported), if only access
+//     rights or memory type changed,
+//   - INVEPT and INVVPID, if the page now points to another host page.
+//
+// Recorded invalidations are performed in commit(), which is also called
+// from the destructor.
+//
+// Note that INVEPT/INVVPID affect only the current logical processor.
+//
+class ept_transaction_t
+{
+  public:
+    ept_transaction_t(ept_t& ept) noexcept;
+    ~ept_transaction_t() noexcept;
+    ept_transaction_t(const ept_transaction_t& other) noexcept = delete;
+    ept_transaction_t(ept_transaction_t&& other) noexcept = delete;
+    ept_transaction_t& operator=(const ept_transaction_t& other) noexcept = delete;
+    ept_transaction_t& operator=(ept_transaction_t&& other) noexcept = delete;
+
+    epte_t* map(pa_t guest_pa, pa_t host_pa, epte_t::access_type access = epte_t::access_type::read_write_execute, ept_t::large_page large = ept_t::large_page::none) noexcept;
+
+    epte_t* map_4kb(pa_t guest_pa, pa_t host_pa, epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
+    epte_t* map_2mb(pa_t guest_pa, pa_t host_pa, epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
+    epte_t* map_1gb(pa_t guest_pa, pa_t host_pa, epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
+
+    epte_t* suppress_ve(pa_t guest_pa, bool suppress) noexcept;
+
+    void commit() noexcept;
+
+    //
+    // Number of INVEPT/INVVPID instructions saved compared to invalidating
+    // all contexts after each remap.
+    //
+    uint32_t flushes_avoided() const noexcept;
+
   private:
-    epte_t* map_subtable(epte_t* table) noexcept;
-    epte_t* map_pml4(pa_t guest_pa, pa_t host_pa, epte_t* pml4, epte_t::access_type access, large_page large) noexcept;
-    epte_t* map_pdpt(pa_t guest_pa, pa_t host_pa, epte_t* pdpt, epte_t::access_type access, large_page large) noexcept;
-    epte_t* map_pd  (pa_t guest_pa, pa_t host_pa, epte_t* pd,   epte_t::access_type access, large_page large) noexcept;
-    epte_t* map_pt  (pa_t guest_pa, pa_t host_pa, epte_t* pt,   epte_t::access_type access, large_page large) noexcept;
+    ept_t&   ept_;
+    uint32_t map_count_;
+    uint32_t flushes_avoided_;
+    bool     invept_pending_;
+    bool     invvpid_pending_;
+};
+
+//
+// Working-set estimation from EPT accessed and dirty flags.
+//
+// Requires accessed and dirty flags to be enabled in the EPT pointer (see
+// HVPP_ENABLE_EPT_AD), otherwise scan() never finds anything.
+//
+// Each scan() walks the EPT, counts and clears accessed and dirty flags of
+// the leaf entries and updates the heat of each 2MB region of the physical
+// memory. Heat is an 8-bit history of the last 8 scans - the highest bit
+// is set if the region was accessed during the last scan, the lowest bit
+// represents the 8th scan back. Subtrees with clear accessed flag in the
+// PML4E/PDPTE/PDE are skipped.
+//
+// Note that cached translations can prevent the processor from setting the
+// flags again - caller is responsible for the invalidation (INVEPT) on all
+// processors after each scan.
+//
+class ept_heat_map_t
+{
+  public:
+    static constexpr int region_shift   = 21;   // 2MB
+    static constexpr int histogram_size = 9;    // 0..8 scans
+
+    void initialize(ept_t& ept) noexcept;
+    void destroy() noexcept;
+
+    void scan() noexcept;
+
+    int      region_count() const noexcept;
+    uint8_t  heat(int region) const noexcept;
+
+    //
+    // Number of regions accessed in exactly "scan_count" of the last 8 scans.
+    //
+    uint32_t histogram(int scan_count) const noexcept;
+
+    //
+    // Number of accessed and dirty 4kb pages during the last scan (pages of
+    // large pages are counted individually).
+    //
+    uint64_t accessed_page_count() const noexcept;
+    uint64_t dirty_page_count() const noexcept;
+    uint32_t scan_count() const noexcept;
+
+  private:
+    void scan_table(epte_t* table, page_table_level level, uint64_t first_pfn) noexcept;
+
+    ept_t*    ept_;
 
-    void destroy(epte_t* table, page_table_level ptl_type = page_table_level::pml4) noexcept;
+    uint8_t*  heat_;
+    uint64_t* touched_buffer_;
+    bitmap    touched_;
+    int       region_count_;
 
-    alignas(page_size) ept_ptr_t eptptr_;
-                       epte_t*   epml4_;
+    uint32_t  scan_count_;
+    uint64_t  accessed_page_count_;
+    uint64_t  dirty_page_count_;
+    uint32_t  histogram_[histogram_size];
 };
 
 }
@@ -4,6 +4,7 @@
 #include "ia32/cpuid/cpuid_eax_01.h"
 #include "lib/assert.h"
 #include "lib/log.h"
+#include "lib/mm.h"
 #include "lib/mp.h"
 
 #define single_cpu_call(callback)                       \
@@ -44,6 +45,33 @@ void hypervisor::start(vmexit_handler* handler) noexcept
 
   handler_ = handler;
 
+  //
+  // Build identity EPT. This is done just once (instead of once per each
+  // VCPU, although the work is split between all processors) - every VCPU
+  // then creates just a lightweight overlay of this EPT, which shares all
+  // the tables with it.
+  //
+  ept_.initialize();
+
+#ifdef HVPP_ENABLE_LAZY_EPT
+  //
+  // Start with empty EPT - pages are mapped when the guest touches them for
+  // the first time (see vmexit_handler::handle_ept_violation()).
+  //
+#else
+  ept_.map_identity_parallel();
+#endif
+
+  hvpp_info("EPT tables: PML5: %u, PML4: %u, PDPT: %u, PD: %u, PT: %u",
+            ept_.table_count(page_table_level::pml5),
+            ept_.table_count(page_table_level::pml4),
+            ept_.table_count(page_table_level::pdpt),
+            ept_.table_count(page_table_level::pd),
+            ept_.table_count(page_table_level::pt));
+
+  hvpp_info("Memory manager initialized in %llu cycles",
+            memory_manager::statistics().initialize_cycles);
+
 #ifdef HVPP_SINGLE_VCPU
   single_cpu_call(start_ipi_callback);
 #else
@@ -61,6 +89,47 @@ void hypervisor::stop() noexcept
   mp::ipi_call(this, &hypervisor::stop_ipi_callback);
 #endif
 
+#ifdef HVPP_ENABLE_LAZY_EPT
+  hvpp_info("EPT demand faults: %u, pages mapped: %u",
+            ept_.demand_fault_count(),
+            ept_.demand_map_count());
+#endif
+
+  //
+  // Release our reference of the shared EPT. Because all VCPUs (which held
+  // reference to it as well) are destroyed by now, this frees the EPT.
+  //
+  ept_.destroy();
+
+  const auto mm_stats = memory_manager::statistics();
+  hvpp_info("Memory manager: allocations: %llu (fast: %llu), frees: %llu (fast: %llu), "
+            "lock acquisitions: %llu (contended: %llu, wait cycles: %llu)",
+            mm_stats.allocation_count, mm_stats.fast_allocation_count,
+            mm_stats.free_count, mm_stats.fast_free_count,
+            mm_stats.lock_count, mm_stats.lock_contention_count,
+            mm_stats.lock_wait_cycles);
+  hvpp_info("Memory manager: slab pages: %llu, slab objects: %llu, largest free block: %llu pages",
+            mm_stats.slab_page_count, mm_stats.slab_object_count,
+            mm_stats.largest_free_page_count);
+  hvpp_info("Memory manager: zeroed in advance: %llu pages, allocate_zeroed hits: %llu, misses: %llu",
+            mm_stats.zeroer_page_count, mm_stats.zeroed_hit_count, mm_stats.zeroed_miss_count);
+  hvpp_info("Memory manager: arenas: %llu, failed allocations: %llu, root mode allocations below watermark: %llu",
+            mm_stats.arena_count, mm_stats.failed_allocation_count,
+            mm_stats.low_memory_root_allocation_count);
+#ifdef HVPP_ENABLE_MM_PROFILER
+  hvpp_info("Memory manager: peak allocated: %llu bytes, allocations in VM-exit handlers: %llu "
+            "(see memory_manager::profile_dump())",
+            mm_stats.peak_allocated_bytes, mm_stats.root_allocation_count);
+#endif
+
+  for (int i = 0; i < static_cast<int>(mm_stats.arena_count); ++i)
+  {
+    const auto arena_stats = memory_manager::arena_statistics(i);
+    hvpp_info("Memory manager: arena %u: %p, size: %llu, allocated: %llu, allocations: %llu, largest free block: %llu pages",
+              i, arena_stats.base_address, arena_stats.size, arena_stats.allocated_bytes,
+              arena_stats.allocation_count, arena_stats.largest_free_page_count);
+  }
+
   hvpp_info("hvpp stopped");
 }
 
@@ -112,7 +181,7 @@ void hypervisor::check_ipi_callback() noexcept
 void hypervisor::start_ipi_callback() noexcept
 {
   auto idx = mp::cpu_index();
-  vcpu_[idx].initialize(handler_);
+  vcpu_[idx].initialize(handler_, ept_);
   vcpu_[idx].launch();
 }
 
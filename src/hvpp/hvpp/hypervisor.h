@@ -24,6 +24,7 @@ class hypervisor
     void stop_ipi_callback() noexcept;
 
     vcpu_t vcpu_[32];
+    ept_t ept_;
     vmexit_handler* handler_;
     bool check_;
 };
@@ -1,9 +1,11 @@
 #include "vcpu.h"
 #include "vmexit.h"
+#include "config.h"
 
 #include "lib/assert.h"
 #include "lib/bitmap.h"
 #include "lib/log.h"
+#include "lib/mm.h"
 #include "lib/noopt.h"
 
 #include <iterator> // std::end()
@@ -16,12 +18,14 @@ namespace hvpp {
 // Public
 //
 
-void vcpu_t::initialize(vmexit_handler* handler) noexcept
+void vcpu_t::initialize(vmexit_handler* handler, ept_t& shared_ept) noexcept
 {
+#ifdef HVPP_ENABLE_MM_POISONING
   //
   // Fill out initial stack with garbage.
   //
   memset(stack_, 0xcc, sizeof(stack_));
+#endif
 
   //
   // Reset guest and exit context. This is not really needed, as it is overwritten
@@ -37,9 +41,17 @@ void vcpu_t::initialize(vmexit_handler* handler) noexcept
   state_ = vcpu_state::off;
 
   //
-  // Initialize EPT.
+  // Initialize EPT views. Each view is just a private overlay of the shared
+  // identity EPT (owned by the hypervisor). Tables are copied into the view
+  // only when the VM-exit handler remaps some page through it. By default
+  // only view 0 exists and it's active.
   //
-  ept_.initialize();
+  ept_views_.initialize(shared_ept);
+  ept_index_ = 0;
+  ept_invalidation_generation_ = shared_ept.invalidation_generation();
+  ept_switching_ = false;
+  ept_violation_ve_ = false;
+  pml_enabled_ = false;
 
   //
   // Initialize VM-exit handler.
@@ -100,9 +112,9 @@ void vcpu_t::destroy() noexcept
   handler_->invoke_termination();
 
   //
-  // Deallocate EPT.
+  // Deallocate EPT views.
   //
-  ept_.destroy();
+  ept_views_.destroy();
 }
 
 void vcpu_t::launch() noexcept
@@ -195,6 +207,68 @@ void vcpu_t::terminate() noexcept
   }
 }
 
+auto vcpu_t::ept() noexcept -> ept_t&
+{
+  return ept_views_[ept_index()];
+}
+
+auto vcpu_t::ept(int index) noexcept -> ept_t&
+{
+  return ept_views_[index];
+}
+
+auto vcpu_t::ept_views() noexcept -> ept_views_t&
+{
+  return ept_views_;
+}
+
+auto vcpu_t::ept_index() const noexcept -> int
+{
+  //
+  // If EPTP switching is enabled, the guest might have switched the view
+  // on its own - the processor keeps the current index in the VMCS.
+  //
+  return ept_switching_
+    ? eptp_index()
+    : ept_index_;
+}
+
+void vcpu_t::ept_index(int index) noexcept
+{
+  //
+  // Switching view doesn't require any invalidation - cached translations
+  // are tagged by the EPT pointer.
+  //
+  ept_index_ = index;
+  ept_pointer(ept_views_[index].ept_pointer());
+
+  //
+  // EPTP index is also reported in the #VE information area.
+  //
+  if (ept_switching_ || ept_violation_ve_)
+  {
+    eptp_index(static_cast<uint16_t>(index));
+  }
+}
+
+void vcpu_t::pml_flush() noexcept
+{
+  if (!pml_enabled_)
+  {
+    return;
+  }
+
+  //
+  // The processor fills the log from the last entry downwards, therefore
+  // valid entries are those above the current PML index.
+  //
+  int first = vmx::pml_t::first_entry(pml_index());
+
+  ept().mark_dirty(&pml_.entry[first], vmx::pml_t::max_entry_count - first);
+
+  pml_index(static_cast<uint16_t>(vmx::pml_t::max_entry_count - 1));
+}
+
 void vcpu_t::exit_handler(vmexit_handler* handler) noexcept
 {
   handler_ = handler;
@@ -220,12 +294,14 @@ void vcpu_t::error() noexcept
 void vcpu_t::setup() noexcept
 {
   //
-  // Setup EPT, enter VMX operation, load VMCS, set VMCS fields, call handler's
-  // setup() method, invalidate EPT and VPID and launch the VM.
+  // Enter VMX operation, load VMCS, set VMCS fields, call handler's setup()
+  // method, invalidate EPT and VPID and launch the VM.
   // This function should NOT return - the next instruction after vmlaunch should
   // be at vcpu_t::entry_guest_ (vcpu.asm).
   //
-  ept_.map_identity();
+  // Note that EPT is already mapped - the identity mapping is built just once
+  // by the hypervisor and shared by all VCPUs.
+  //
 
   load_vmxon();
   load_vmcs();
@@ -371,9 +447,9 @@ void vcpu_t::setup_guest() noexcept
   vcpu_id(1);
 
   //
-  // Set EPT pointer.
+  // Set EPT pointer of the active view.
   //
-  ept_pointer(ept_.ept_pointer());
+  ept_pointer(ept_views_[ept_index_].ept_pointer());
 
   //
   // VMCS link pointer points to the shadow VMCS if VMCS shadowing is enabled.
@@ -409,8 +485,70 @@ void vcpu_t::setup_guest() noexcept
   procbased_ctls2.enable_rdtscp = true;
   procbased_ctls2.enable_xsaves = true;
   procbased_ctls2.enable_invpcid = true;
+  procbased_ctls2.enable_vm_functions = true;
+#ifdef HVPP_ENABLE_VE
+  procbased_ctls2.ept_violation_ve = true;
+#endif
+#ifdef HVPP_ENABLE_PML
+  procbased_ctls2.enable_pml = !!ept().ept_pointer().enable_access_and_dirty_flags;
+#endif
   processor_based_controls2(procbased_ctls2);
 
+  //
+  // If the processor supports VM functions, enable EPTP switching (VMFUNC
+  // leaf 0), so that the guest can switch EPT views without VM-exit.
+  // VMFUNC with index of non-existent view causes VM-exit.
+  //
+  if (processor_based_controls2().enable_vm_functions)
+  {
+    msr::vmx_vmfunc_t vmfunc_ctls{ 0 };
+    vmfunc_ctls.eptp_switching = true;
+    vmfunc_controls(vmfunc_ctls);
+
+    ept_switching_ = !!vmfunc_controls().eptp_switching;
+
+    if (ept_switching_)
+    {
+      eptp_list_address(ept_views_.eptp_list_address());
+      eptp_index(static_cast<uint16_t>(ept_index_));
+    }
+  }
+
+#ifdef HVPP_ENABLE_VE
+  //
+  // If the processor supports it, let EPT violations on pages which don't
+  // have "suppress #VE" bit set (see ept_t::suppress_ve()) be delivered
+  // into the guest as #VE (virtualization exception) instead of VM-exit.
+  // Details of the violation are stored in the #VE information area.
+  //
+  ept_violation_ve_ = !!processor_based_controls2().ept_violation_ve;
+
+  if (ept_violation_ve_)
+  {
+    memset(&ve_info_, 0, sizeof(ve_info_));
+    ve_info_address(pa_t::from_va(&ve_info_));
+    eptp_index(static_cast<uint16_t>(ept_index_));
+  }
+#endif
+
+#ifdef HVPP_ENABLE_PML
+  //
+  // If the processor supports it, log guest-physical addresses of pages
+  // written by the guest (page-modification logging). The processor logs
+  // an address whenever it sets dirty flag of an EPT leaf entry, which
+  // requires accessed and dirty flags to be enabled in the EPT pointer
+  // (see ept_t::initialize()).
+  //
+  pml_enabled_ = !!processor_based_controls2().enable_pml;
+
+  if (pml_enabled_)
+  {
+    memset(&pml_, 0, sizeof(pml_));
+    pml_address(pa_t::from_va(&pml_));
+    pml_index(static_cast<uint16_t>(vmx::pml_t::max_entry_count - 1));
+  }
+#endif
+
   //
   // By default we want each VM-entry and VM-exit in 64bit mode.
   //
@@ -480,7 +618,9 @@ void vcpu_t::entry_host() noexcept
     exit_context_.rflags = guest_rflags();
 
     {
+      memory_manager::set_root_mode(true);
       handler_->handle(*this);
+      memory_manager::set_root_mode(false);
 
       if (state_ == vcpu_state::terminated)
       {
@@ -499,6 +639,18 @@ void vcpu_t::entry_host() noexcept
       {
         exit_context_.rip += exit_instruction_length();
       }
+
+      //
+      // Perform invalidation requested by any processor (see
+      // ept_t::request_invalidation()).
+      //
+      const auto ept_invalidation_generation = ept_views_.shared().invalidation_generation();
+
+      if (ept_invalidation_generation_ != ept_invalidation_generation)
+      {
+        ept_invalidation_generation_ = ept_invalidation_generation;
+        vmx::invept(vmx::invept_t::all_context);
+      }
     }
 
     guest_rsp(exit_context_.rsp);
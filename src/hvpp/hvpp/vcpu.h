@@ -104,7 +104,7 @@ enum class vcpu_state
 class vcpu_t
 {
   public:
-    void initialize(vmexit_handler* handler = nullptr) noexcept;
+    void initialize(vmexit_handler* handler, ept_t& shared_ept) noexcept;
     void destroy() noexcept;
 
     void launch() noexcept;
@@ -113,7 +113,33 @@ class vcpu_t
     auto exit_handler() const noexcept -> vmexit_handler*;
     void exit_handler(vmexit_handler* handler) noexcept;
 
-    ept_t& ept() noexcept { return ept_; }
+    //
+    // EPT views. ept() returns currently active view. Active view can be
+    // also switched by the guest itself via VMFUNC (EPTP switching), if the
+    // processor supports it.
+    //
+    auto ept() noexcept -> ept_t&;
+    auto ept(int index) noexcept -> ept_t&;
+    auto ept_views() noexcept -> ept_views_t&;
+    auto ept_index() const noexcept -> int;
+    void ept_index(int index) noexcept;
+
+    //
+    // Virtualization-exception information area of this VCPU. Used only when
+    // "EPT-violation #VE" is enabled (see HVPP_ENABLE_VE).
+    //
+    auto ve_info() noexcept -> vmx::ve_info_t& { return ve_info_; }
+
+    //
+    // Page-modification log of this VCPU. Used only when page-modification
+    // logging is enabled (see HVPP_ENABLE_PML). pml_flush() moves logged
+    // guest-physical addresses into the dirty bitmap of the EPT (see
+    // ept_t::mark_dirty()) and resets the log. It's called when the log is
+    // full - call it also before ept_t::harvest_dirty(), otherwise up to
+    // 511 pages logged by this VCPU aren't reported yet.
+    //
+    auto pml() noexcept -> vmx::pml_t& { return pml_; }
+    void pml_flush() noexcept;
 
     context_t& exit_context() { return exit_context_; }
     void suppress_rip_adjust() noexcept { suppress_rip_adjust_ = true; }
@@ -137,6 +163,18 @@ class vcpu_t
     void vcpu_id(uint16_t virtual_processor_identifier) noexcept;
     auto ept_pointer() const noexcept -> ept_ptr_t;
     void ept_pointer(ept_ptr_t ept_pointer) noexcept;
+    auto eptp_list_address() const noexcept -> pa_t;
+    void eptp_list_address(pa_t eptp_list_address) noexcept;
+    auto eptp_index() const noexcept -> uint16_t;
+    void eptp_index(uint16_t index) noexcept;
+    auto vmfunc_controls() const noexcept -> msr::vmx_vmfunc_t;
+    void vmfunc_controls(msr::vmx_vmfunc_t controls) noexcept;
+    auto ve_info_address() const noexcept -> pa_t;
+    void ve_info_address(pa_t ve_info_address) noexcept;
+    auto pml_address() const noexcept -> pa_t;
+    void pml_address(pa_t pml_address) noexcept;
+    auto pml_index() const noexcept -> uint16_t;         // technically, this is guest state
+    void pml_index(uint16_t index) noexcept;
     auto vmcs_link_pointer() const noexcept -> pa_t;     // technically, this is guest state
     void vmcs_link_pointer(pa_t link_pointer) noexcept;
 
@@ -339,6 +377,8 @@ class vcpu_t
     vmx::vmcs_t        vmcs_;
     vmx::msr_bitmap_t  msr_bitmap_;
     vmx::io_bitmap_t   io_bitmap_;
+    vmx::ve_info_t     ve_info_;
+    vmx::pml_t         pml_;
 
     //
     // FXSAVE area - to keep SSE registers sane between VM-exits.
@@ -347,7 +387,12 @@ class vcpu_t
 
     vmexit_handler*    handler_;
     vcpu_state         state_;
-    ept_t              ept_;
+    ept_views_t        ept_views_;
+    int                ept_index_;
+    uint32_t           ept_invalidation_generation_;
+    bool               ept_switching_;
+    bool               ept_violation_ve_;
+    bool               pml_enabled_;
     bool               suppress_rip_adjust_;
 };
 
@@ -158,6 +158,78 @@ void vcpu_t::ept_pointer(ept_ptr_t ept_pointer) noexcept
   vmx::vmwrite(vmx::vmcs_t::field::ctrl_ept_pointer, ept_pointer);
 }
 
+auto vcpu_t::eptp_list_address() const noexcept -> pa_t
+{
+  pa_t result;
+  vmx::vmread(vmx::vmcs_t::field::ctrl_ept_pointer_list_address, result);
+  return result;
+}
+
+void vcpu_t::eptp_list_address(pa_t eptp_list_address) noexcept
+{
+  vmx::vmwrite(vmx::vmcs_t::field::ctrl_ept_pointer_list_address, eptp_list_address);
+}
+
+auto vcpu_t::eptp_index() const noexcept -> uint16_t
+{
+  uint16_t result;
+  vmx::vmread(vmx::vmcs_t::field::ctrl_eptp_index, result);
+  return result;
+}
+
+void vcpu_t::eptp_index(uint16_t index) noexcept
+{
+  vmx::vmwrite(vmx::vmcs_t::field::ctrl_eptp_index, index);
+}
+
+auto vcpu_t::vmfunc_controls() const noexcept -> msr::vmx_vmfunc_t
+{
+  msr::vmx_vmfunc_t result;
+  vmx::vmread(vmx::vmcs_t::field::ctrl_vmfunc_controls, result);
+  return result;
+}
+
+void vcpu_t::vmfunc_controls(msr::vmx_vmfunc_t controls) noexcept
+{
+  vmx::vmwrite(vmx::vmcs_t::field::ctrl_vmfunc_controls, vmx::adjust(controls));
+}
+
+auto vcpu_t::ve_info_address() const noexcept -> pa_t
+{
+  pa_t result;
+  vmx::vmread(vmx::vmcs_t::field::ctrl_virtualization_exception_info_address, result);
+  return result;
+}
+
+void vcpu_t::ve_info_address(pa_t ve_info_address) noexcept
+{
+  vmx::vmwrite(vmx::vmcs_t::field::ctrl_virtualization_exception_info_address, ve_info_address);
+}
+
+auto vcpu_t::pml_address() const noexcept -> pa_t
+{
+  pa_t result;
+  vmx::vmread(vmx::vmcs_t::field::ctrl_pml_address, result);
+  return result;
+}
+
+void vcpu_t::pml_address(pa_t pml_address) noexcept
+{
+  vmx::vmwrite(vmx::vmcs_t::field::ctrl_pml_address, pml_address);
+}
+
+auto vcpu_t::pml_index() const noexcept -> uint16_t
+{
+  uint16_t result;
+  vmx::vmread(vmx::vmcs_t::field::guest_pml_index, result);
+  return result;
+}
+
+void vcpu_t::pml_index(uint16_t index) noexcept
+{
+  vmx::vmwrite(vmx::vmcs_t::field::guest_pml_index, index);
+}
+
 auto vcpu_t::vmcs_link_pointer() const noexcept -> pa_t
 {
   pa_t result;
@@ -2,10 +2,12 @@
 #include "vcpu.h"
 #include "config.h"
 
+#include "ia32/mtrr.h"
 #include "ia32/vmx.h"
 
 #include "lib/assert.h"
 #include "lib/cr3_guard.h"
+#include "lib/mm.h"
 
 #ifdef HVPP_ENABLE_VMWARE_WORKAROUND
 # include "lib/vmware/vmware.h"
@@ -110,6 +112,23 @@ void vmexit_handler::setup(vcpu_t& vp) noexcept
   vp.guest_ss(seg_t{ gdtr, read<ss_t>() });
   vp.guest_tr(seg_t{ gdtr, read<tr_t>() });
   vp.guest_ldtr(seg_t{ gdtr, read<ldtr_t>() });
+
+  //
+  // Trap writes to MTRRs - memory types in the EPT are derived from them
+  // (see handle_execute_wrmsr()). Bit N in the "wrmsr_low" bitmap
+  // represents MSR N.
+  //
+  vmx::msr_bitmap_t msr_bitmap{ 0 };
+
+  for (uint32_t msr_id = msr::mtrr_physbase_t::msr_id; msr_id <= msr::mtrr_def_type_t::msr_id; ++msr_id)
+  {
+    if (memory_manager::mtrr().is_mtrr_msr(msr_id))
+    {
+      msr_bitmap.wrmsr_low[msr_id / 8] |= 1 << (msr_id % 8);
+    }
+  }
+
+  vp.msr_bitmap(msr_bitmap);
 }
 
 void vmexit_handler::handle(vcpu_t& vp) noexcept
@@ -182,7 +201,6 @@ void vmexit_handler::handle_execute_invpcid(vcpu_t& vp)
 void vmexit_handler::handle_execute_vmfunc(vcpu_t& vp)                          noexcept { handle_execute_vm_fallback(vp); }
 void vmexit_handler::handle_execute_encls(vcpu_t& vp)                           noexcept { handle_fallback(vp); }
 void vmexit_handler::handle_execute_rdseed(vcpu_t& vp)                          noexcept { handle_fallback(vp); }
-void vmexit_handler::handle_page_modification_log_full(vcpu_t& vp)              noexcept { handle_fallback(vp); }
 void vmexit_handler::handle_execute_xsaves(vcpu_t& vp)                          noexcept { handle_fallback(vp); }
 void vmexit_handler::handle_execute_xrstors(vcpu_t& vp)                         noexcept { handle_fallback(vp); }
 
@@ -756,11 +774,75 @@ void vmexit_handler::handle_execute_wrmsr(vcpu_t& vp) noexcept
       break;
 
     default:
+      if (memory_manager::mtrr().is_mtrr_msr(msr_id))
+      {
+        handle_mtrr_write(vp, msr_id, msr_value);
+        break;
+      }
+
       msr::write(msr_id, msr_value);
       break;
   }
 }
 
+void vmexit_handler::handle_mtrr_write(vcpu_t& vp, uint32_t msr_id, uint64_t msr_value) noexcept
+{
+  //
+  // Memory types in the EPT are derived from MTRRs, therefore they have to
+  // follow changes made by the guest. Range affected by the write is
+  // recorded in the shared EPT and in all EPT views of this VCPU.
+  //
+  auto range = mtrr::write_range(msr_id, msr_value);
+  msr::write(msr_id, msr_value);
+
+  auto& views = vp.ept_views();
+
+  if (range.size())
+  {
+    views.shared().invalidate_memory_type(range);
+
+    for (int i = 0; i < ept_views_t::max_view_count; ++i)
+    {
+      if (views.contains(i))
+      {
+        views[i].invalidate_memory_type(range);
+      }
+    }
+  }
+
+  //
+  // The guest changes MTRRs with MTRRs disabled (Vol3A[11.11.8(MTRR
+  // Considerations in MP Systems)]) - it typically writes several of them
+  // in a row and then enables MTRRs again. Recompute memory types (and
+  // invalidate the EPT) just once, when MTRRs are enabled. The shared EPT
+  // goes first, as it re-reads MTRRs.
+  //
+  if (!msr::read<msr::mtrr_def_type_t>().mtrr_enable)
+  {
+    return;
+  }
+
+  bool updated = views.shared().update_memory_type();
+
+  for (int i = 0; i < ept_views_t::max_view_count; ++i)
+  {
+    if (views.contains(i))
+    {
+      updated |= views[i].update_memory_type();
+    }
+  }
+
+  //
+  // Other processors use the same shared EPT - let all of them (including
+  // this one) invalidate cached translations before they enter the guest
+  // again.
+  //
+  if (updated)
+  {
+    views.shared().request_invalidation();
+  }
+}
+
 void vmexit_handler::handle_gdtr_idtr_access(vcpu_t& vp) noexcept
 {
   auto instruction_info = vp.exit_instruction_info().gdtr_idtr_access;
@@ -848,6 +930,23 @@ void vmexit_handler::handle_ldtr_tr_access(vcpu_t& vp) noexcept
 
 void vmexit_handler::handle_ept_violation(vcpu_t& vp) noexcept
 {
+#ifdef HVPP_ENABLE_LAZY_EPT
+  //
+  // EPT is populated on demand - if the guest touched memory which isn't
+  // mapped yet, map it and execute the instruction again.
+  //
+  auto exit_qualification = vp.exit_qualification().ept_violation;
+
+  if (!exit_qualification.entry_read &&
+      !exit_qualification.entry_write &&
+      !exit_qualification.entry_execute &&
+      vp.ept().map_identity_on_demand(vp.exit_guest_physical_address()))
+  {
+    vp.suppress_rip_adjust();
+    return;
+  }
+#endif
+
   //
   // TODO
   //
@@ -878,6 +977,17 @@ void vmexit_handler::handle_execute_xsetbv(vcpu_t& vp) noexcept
                      vp.exit_context().rax);
 }
 
+void vmexit_handler::handle_page_modification_log_full(vcpu_t& vp) noexcept
+{
+  //
+  // Move logged addresses into the dirty bitmap and reset the log. This
+  // VM-exit occurs before the write which would be logged, therefore the
+  // instruction must be executed again.
+  //
+  vp.pml_flush();
+  vp.suppress_rip_adjust();
+}
+
 void vmexit_handler::handle_execute_vm_fallback(vcpu_t& vp) noexcept
 {
   vp.inject(
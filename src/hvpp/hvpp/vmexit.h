@@ -90,6 +90,11 @@ class vmexit_handler
     virtual void handle_fallback(vcpu_t& /* vp */) noexcept { }
     virtual void handle_execute_vm_fallback(vcpu_t& vp) noexcept;
 
+    //
+    // Called by handle_execute_wrmsr() for writes into MTRRs.
+    //
+    virtual void handle_mtrr_write(vcpu_t& vp, uint32_t msr_id, uint64_t msr_value) noexcept;
+
   private:
     using handler_fn_t = void (vmexit_handler::*)(vcpu_t&);
     handler_fn_t handlers_[65];
@@ -276,8 +276,8 @@ struct context_t
 
 static_assert(sizeof(context_t) == 144);
 
-template <typename T> T    read()         noexcept { static_assert(0, "invalid specialization"); }
-template <typename T> void write(T value) noexcept { static_assert(0, "invalid specialization"); }
+template <typename T> T    read()         noexcept { static_assert(sizeof(T) == 0, "invalid specialization"); }
+template <typename T> void write(T value) noexcept { static_assert(sizeof(T) == 0, "invalid specialization"); }
 
 //
 // ====================
@@ -1,4 +1,7 @@
 #pragma once
+#include "../asm.h"
+#include "../msr/arch.h"
+
 #include <cstdint>
 #include <type_traits>
 
@@ -236,12 +239,12 @@ struct seg_t
       if constexpr (std::is_same_v<T, fs_t>)
       {
         (void)(descriptor_table);
-        base_address = reinterpret_cast<void*>(msr::read<msr::fs_base_t>());
+        base_address = reinterpret_cast<void*>(ia32_asm_read_msr(msr::fs_base_t::msr_id));
       }
       else if constexpr (std::is_same_v<T, gs_t>)
       {
         (void)(descriptor_table);
-        base_address = reinterpret_cast<void*>(msr::read<msr::gs_base_t>());
+        base_address = reinterpret_cast<void*>(ia32_asm_read_msr(msr::gs_base_t::msr_id));
       }
       else
       {
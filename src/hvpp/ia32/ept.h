@@ -8,6 +8,7 @@ namespace ia32 {
 struct ept_ptr_t
 {
   static constexpr int page_walk_length_4 = 3;
+  static constexpr int page_walk_length_5 = 4;
 
   union
   {
@@ -19,7 +20,7 @@ struct ept_ptr_t
       uint64_t page_walk_length : 3;
       uint64_t enable_access_and_dirty_flags : 1;
       uint64_t reserved_1 : 5;
-      uint64_t page_frame_number : 36;
+      uint64_t page_frame_number : 40;
     };
   };
 };
@@ -201,8 +202,8 @@ struct epte_t
       uint64_t dirty : 1;
       uint64_t user_mode_execute : 1;
       uint64_t reserved_1 : 1;
-      uint64_t page_frame_number : 36;
-      uint64_t reserved_2 : 15;
+      uint64_t page_frame_number : 40;
+      uint64_t reserved_2 : 11;
       uint64_t suppress_ve : 1;
     };
 
@@ -20,6 +20,7 @@ enum class memory_type : uint8_t
 
 enum class page_table_level : uint8_t
 {
+  pml5 = 4,
   pml4 = 3,
   pdpt = 2,
   pd   = 1,
@@ -183,6 +184,16 @@ class memory_range
       return pa >= begin_ && pa < end_;
     }
 
+    bool contains(const memory_range& other) const noexcept
+    {
+      return other.begin_ >= begin_ && other.end_ <= end_;
+    }
+
+    bool intersects(const memory_range& other) const noexcept
+    {
+      return other.begin_ < end_ && other.end_ > begin_;
+    }
+
     page_iterator begin() const noexcept { return page_iterator(begin_); }
     page_iterator end()   const noexcept { return page_iterator(end_); }
     size_t        size()  const noexcept { return end_.value() - begin_.value(); }
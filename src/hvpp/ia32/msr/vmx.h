@@ -271,7 +271,7 @@ struct vmx_ept_vpid_cap_t
       uint64_t execute_only_pages : 1;
       uint64_t reserved_1 : 5;
       uint64_t page_walk_length_4 : 1;
-      uint64_t reserved_2 : 1;
+      uint64_t page_walk_length_5 : 1;
       uint64_t memory_type_uncacheable : 1;
       uint64_t reserved_3 : 5;
       uint64_t memory_type_write_back : 1;
@@ -296,4 +296,21 @@ struct vmx_ept_vpid_cap_t
   };
 };
 
+struct vmx_vmfunc_t
+{
+  static constexpr uint32_t msr_id = 0x00000491;
+  using result_type = vmx_vmfunc_t;
+
+  union
+  {
+    uint64_t flags;
+
+    struct
+    {
+      uint64_t eptp_switching : 1;
+      uint64_t reserved_1 : 63;
+    };
+  };
+};
+
 }
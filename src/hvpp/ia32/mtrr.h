@@ -2,6 +2,7 @@
 #include "memory.h"
 #include "msr.h"
 
+#include <algorithm>
 #include <cstdint>
 
 namespace ia32 {
@@ -18,7 +19,7 @@ class mtrr
     static constexpr int fixed_count = (1 + 2 + 8) * 8;
     static constexpr int max_variable_count = 255;
 
-    mtrr() noexcept { check_fixed(); check_variable(); }
+    mtrr() noexcept { check_fixed(); check_variable(); build_index(); }
     mtrr(const mtrr& other) noexcept = delete;
     mtrr(mtrr&& other) noexcept = delete;
     mtrr& operator=(const mtrr& other) noexcept = delete;
@@ -29,6 +30,217 @@ class mtrr
     size_t            size()  const noexcept { return fixed_count + variable_count_; }
 
     memory_type type(pa_t pa) const noexcept
+    {
+      return find(pa)->type;
+    }
+
+    memory_type type(const memory_range& range) const noexcept
+    {
+      //
+      // Returns memory type of the whole range or memory_type::invalid if the
+      // memory type is not uniform across the range.
+      //
+      auto item = find(*range.begin());
+
+      return item->range.contains(range)
+        ? item->type
+        : memory_type::invalid;
+    }
+
+    pa_t next_boundary(pa_t pa) const noexcept
+    {
+      //
+      // Returns first address above "pa" where the memory type changes
+      // (or end of the physical address space).
+      //
+      return *find(pa)->range.end();
+    }
+
+    bool same_types(const mtrr& other) const noexcept
+    {
+      //
+      // Returns true if both objects resolve every physical address to the
+      // same memory type.
+      //
+      if (index_count_ != other.index_count_)
+      {
+        return false;
+      }
+
+      for (int i = 0; i < index_count_; ++i)
+      {
+        if (*index_[i].range.begin() != *other.index_[i].range.begin() ||
+            *index_[i].range.end()   != *other.index_[i].range.end()   ||
+            index_[i].type           != other.index_[i].type)
+        {
+          return false;
+        }
+      }
+
+      return true;
+    }
+
+    bool is_mtrr_msr(uint32_t msr_id) const noexcept
+    {
+      //
+      // Returns true if "msr_id" is IA32_MTRR_DEF_TYPE, one of the fixed-range
+      // MTRRs or one of the supported variable-range MTRRs. Number of the
+      // supported variable-range MTRRs is cached when the MTRRs are read, so
+      // this doesn't read any MSR (it's called on each WRMSR VM-exit).
+      //
+      if (msr_id == msr::mtrr_def_type_t::msr_id ||
+          (msr_id >= msr::mtrr_physbase_t::msr_id &&
+           msr_id <  msr::mtrr_physbase_t::msr_id + variable_range_count_ * 2))
+      {
+        return true;
+      }
+
+      bool result = false;
+
+      for_each_type(msr::mtrr_fix_list_t{}, [msr_id, &result](auto mtrr_fixed, int) {
+        result |= decltype(mtrr_fixed)::msr_id == msr_id;
+      });
+
+      return result;
+    }
+
+    static memory_range write_range(uint32_t msr_id, uint64_t new_value) noexcept
+    {
+      //
+      // Returns range of physical memory whose memory type might be changed
+      // by writing "new_value" into the MTRR "msr_id" - i.e. range covered by
+      // the MTRR either before or after the write. Current value is read from
+      // the MSR, therefore this method must be called before the write.
+      // Returns empty range if the write can't change any memory type (e.g.
+      // it just disables or enables MTRRs).
+      //
+      const uint64_t old_value = msr::read(msr_id);
+
+      if (msr_id == msr::mtrr_def_type_t::msr_id)
+      {
+        msr::mtrr_def_type_t old_def_type{ old_value };
+        msr::mtrr_def_type_t new_def_type{ new_value };
+
+        if (old_def_type.default_memory_type != new_def_type.default_memory_type)
+        {
+          return memory_range(0, max_physical_address);
+        }
+
+        if (old_def_type.fixed_range_mtrr_enable != new_def_type.fixed_range_mtrr_enable)
+        {
+          return memory_range(0, fixed_range_end);
+        }
+
+        return memory_range(0, 0);
+      }
+
+      if (msr_id >= msr::mtrr_physbase_t::msr_id && msr_id < fixed_range_first_msr_id)
+      {
+        //
+        // Variable-range MTRRs come in base/mask pairs - read the other half
+        // of the pair.
+        //
+        const uint32_t base_msr_id = msr_id & ~1u;
+
+        const uint64_t old_base = msr::read(base_msr_id);
+        const uint64_t old_mask = msr::read(base_msr_id + 1);
+        const uint64_t new_base = msr_id == base_msr_id ? new_value : old_base;
+        const uint64_t new_mask = msr_id == base_msr_id ? old_mask  : new_value;
+
+        if (old_base == new_base && old_mask == new_mask)
+        {
+          return memory_range(0, 0);
+        }
+
+        auto variable_range = [](uint64_t base, uint64_t mask) {
+          msr::mtrr_physbase_t mtrr_base{ base };
+          msr::mtrr_physmask_t mtrr_mask{ mask };
+
+          if (!mtrr_mask.valid || !mtrr_mask.page_frame_number)
+          {
+            return memory_range(0, 0);
+          }
+
+          uint64_t size = 1ull << ia32_asm_bsf(mtrr_mask.page_frame_number);
+
+          return memory_range(
+            pa_t::from_pfn(mtrr_base.page_frame_number),
+            pa_t::from_pfn(mtrr_base.page_frame_number + size));
+        };
+
+        auto old_range = variable_range(old_base, old_mask);
+        auto new_range = variable_range(new_base, new_mask);
+
+        if (!old_range.size()) { return new_range; }
+        if (!new_range.size()) { return old_range; }
+
+        return memory_range(std::min(*old_range.begin(), *new_range.begin()),
+                            std::max(*old_range.end(),   *new_range.end()));
+      }
+
+      memory_range result(0, 0);
+
+      for_each_type(msr::mtrr_fix_list_t{}, [msr_id, old_value, new_value, &result](auto mtrr_fixed, int) {
+        using ia32_mtrr_t = decltype(mtrr_fixed);
+
+        if (ia32_mtrr_t::msr_id == msr_id && old_value != new_value)
+        {
+          result = memory_range(ia32_mtrr_t::mtrr_base, ia32_mtrr_t::mtrr_base + 8 * ia32_mtrr_t::mtrr_size);
+        }
+      });
+
+      return result;
+    }
+
+  private:
+    //
+    // Highest physical address covered by the index (MAXPHYADDR is at most
+    // 52 bits).
+    //
+    static constexpr uint64_t max_physical_address = 1ull << 52;
+
+    //
+    // Fixed-range MTRRs cover the first 1MB of physical memory. Pairs of
+    // variable-range MTRRs (starting at 0x200) are below the first fixed-range
+    // MTRR MSR.
+    //
+    static constexpr uint64_t fixed_range_end = 0x100000;
+    static constexpr uint32_t fixed_range_first_msr_id = 0x250;
+
+    //
+    // Each variable MTRR adds at most 2 boundaries, each fixed MTRR adds at
+    // most 1 interval.
+    //
+    static constexpr int max_index_count = fixed_count + 2 * max_variable_count + 1;
+
+    const mtrr_range* find(pa_t pa) const noexcept
+    {
+      //
+      // Binary search for the last interval which begins at or below "pa".
+      // The index covers whole physical address space without holes, so
+      // such interval always exists.
+      //
+      int lo = 0;
+      int hi = index_count_ - 1;
+
+      while (lo < hi)
+      {
+        int mid = (lo + hi + 1) / 2;
+
+        if (*index_[mid].range.begin() <= pa)
+        {
+          lo = mid;
+        }
+        else
+        {
+          hi = mid - 1;
+        }
+      }
+
+      return &index_[lo];
+    }
+
+    memory_type variable_type(pa_t pa) const noexcept
     {
       //
       // If the MTRRs are not enabled (by setting the E flag in the IA32_MTRR_DEF_TYPE MSR), then all memory accesses
@@ -51,23 +263,32 @@ class mtrr
       //
       // (ref: Vol3A[11.11.4.1(MTRR Precedences)]
       //
+      // Note that fixed MTRRs are handled in build_index(). Undefined overlaps
+      // are resolved as UC.
+      //
       memory_type result = memory_type::invalid;
 
-      for (auto mtrr_item : *this)
+      for (int i = 0; i < variable_count_; ++i)
       {
-        if (mtrr_item.range.contains(pa))
+        auto& mtrr_item = variable_[i];
+
+        if (!mtrr_item.range.contains(pa))
         {
-          if (is_fixed(mtrr_item) || mtrr_item.type == memory_type::uncacheable)
-          {
-            result = mtrr_item.type;
-            break;
-          }
+          continue;
+        }
 
-          if ((result == memory_type::write_through || mtrr_item.type == memory_type::write_through) &&
-               result == memory_type::write_back)
-          {
-            result = memory_type::write_through;
-          }
+        if (result == memory_type::invalid || result == mtrr_item.type)
+        {
+          result = mtrr_item.type;
+        }
+        else if ((result == memory_type::write_through && mtrr_item.type == memory_type::write_back) ||
+                 (result == memory_type::write_back    && mtrr_item.type == memory_type::write_through))
+        {
+          result = memory_type::write_through;
+        }
+        else
+        {
+          result = memory_type::uncacheable;
         }
       }
 
@@ -79,7 +300,92 @@ class mtrr
       return result;
     }
 
-  private:
+    void add_index(pa_t begin_pa, pa_t end_pa, memory_type type) noexcept
+    {
+      //
+      // Merge with previous interval if it has the same memory type.
+      //
+      if (index_count_ > 0 && index_[index_count_ - 1].type == type)
+      {
+        index_[index_count_ - 1].range.set(*index_[index_count_ - 1].range.begin(), end_pa);
+        return;
+      }
+
+      index_[index_count_].range = memory_range(begin_pa, end_pa);
+      index_[index_count_].type  = type;
+      index_count_ += 1;
+    }
+
+    void build_index() noexcept
+    {
+      //
+      // Build sorted table of non-overlapping intervals covering the whole
+      // physical address space, where each interval has single (already
+      // resolved) memory type. Adjacent intervals always have different
+      // memory types.
+      //
+      index_count_ = 0;
+
+      pa_t variable_begin = 0;
+
+      if (fixed_enabled_)
+      {
+        for (auto& mtrr_item : fixed_)
+        {
+          add_index(*mtrr_item.range.begin(), *mtrr_item.range.end(), mtrr_item.type);
+        }
+
+        variable_begin = *fixed_[fixed_count - 1].range.end();
+      }
+
+      //
+      // Collect (sorted, unique) boundaries of the variable MTRRs. The memory
+      // type is constant between two neighbouring boundaries.
+      //
+      pa_t boundary[2 * max_variable_count + 2];
+      int boundary_count = 0;
+
+      auto add_boundary = [&](pa_t pa) {
+        if (pa < variable_begin || pa > max_physical_address)
+        {
+          return;
+        }
+
+        for (int i = 0; i < boundary_count; ++i)
+        {
+          if (boundary[i] == pa)
+          {
+            return;
+          }
+        }
+
+        int i = boundary_count;
+
+        while (i > 0 && boundary[i - 1] > pa)
+        {
+          boundary[i] = boundary[i - 1];
+          i -= 1;
+        }
+
+        boundary[i] = pa;
+        boundary_count += 1;
+      };
+
+      add_boundary(variable_begin);
+      add_boundary(max_physical_address);
+
+      for (int i = 0; i < variable_count_; ++i)
+      {
+        add_boundary(*variable_[i].range.begin());
+        add_boundary(*variable_[i].range.end());
+      }
+
+      for (int i = 0; i < boundary_count - 1; ++i)
+      {
+        add_index(boundary[i], boundary[i + 1], variable_type(boundary[i]));
+      }
+    }
+
     void check_fixed() noexcept
     {
       auto mtrr_default      = msr::read<msr::mtrr_def_type_t>();
@@ -87,7 +393,9 @@ class mtrr
 
       default_memory_type_ = static_cast<memory_type>(mtrr_default.default_memory_type);
 
-      if (mtrr_capabilities.fixed_range_supported && mtrr_default.fixed_range_mtrr_enable)
+      fixed_enabled_ = mtrr_capabilities.fixed_range_supported && mtrr_default.fixed_range_mtrr_enable;
+
+      if (fixed_enabled_)
       {
         for_each_type(msr::mtrr_fix_list_t{}, [this](auto mtrr_fixed, int i) {
           using ia32_mtrr_t = decltype(mtrr_fixed);
@@ -111,9 +419,13 @@ class mtrr
     void check_variable() noexcept
     {
       auto mtrr_capabilities = msr::read<msr::mtrr_capabilities_t>();
-      variable_count_ = mtrr_capabilities.variable_range_count;
+      variable_range_count_ = static_cast<uint32_t>(mtrr_capabilities.variable_range_count);
+      variable_count_ = 0;
 
-      for (int i = 0; i < variable_count_; ++i)
+      //
+      // Keep only valid variable MTRRs.
+      //
+      for (int i = 0; i < static_cast<int>(mtrr_capabilities.variable_range_count); ++i)
       {
         auto mtrr_base = msr::read<msr::mtrr_physbase_t>(msr::mtrr_physbase_t::msr_id + i * 2);
         auto mtrr_mask = msr::read<msr::mtrr_physmask_t>(msr::mtrr_physmask_t::msr_id + i * 2);
@@ -122,24 +434,15 @@ class mtrr
         {
           uint64_t size = 1ull << ia32_asm_bsf(mtrr_mask.page_frame_number);
 
-          variable_[i].range = memory_range(
+          variable_[variable_count_].range = memory_range(
             pa_t::from_pfn(mtrr_base.page_frame_number),
             pa_t::from_pfn(mtrr_base.page_frame_number + size));
-          variable_[i].type  = static_cast<memory_type>(mtrr_base.type);
+          variable_[variable_count_].type  = static_cast<memory_type>(mtrr_base.type);
+          variable_count_ += 1;
         }
       }
     }
 
-    bool is_fixed(const mtrr_range& range) const noexcept
-    {
-      return (const mtrr_range*)&range < (const mtrr_range*)variable_;
-    }
-
-    bool is_variable(const mtrr_range& range) const noexcept
-    {
-      return (const mtrr_range*)&range >= (const mtrr_range*)variable_;
-    }
-
     union
     {
       struct
@@ -151,8 +454,13 @@ class mtrr
       mtrr_range mtrr_[fixed_count + max_variable_count];
     };
 
+    mtrr_range index_[max_index_count];
+    int index_count_ = 0;
+
     memory_type default_memory_type_ = memory_type::uncacheable;
     int variable_count_ = 0;
+    uint32_t variable_range_count_ = 0;
+    bool fixed_enabled_ = false;
 };
 
 }
@@ -13,6 +13,8 @@
 #include "vmx/exception_bitmap.h"
 #include "vmx/io_bitmap.h"
 #include "vmx/msr_bitmap.h"
+#include "vmx/pml.h"
+#include "vmx/ve_info.h"
 
 #include <cstdint>
 
@@ -54,7 +56,10 @@ auto adjust(T desired) noexcept
   constexpr bool is_vmx_procbased_ctls2_msr =
     std::is_same_v<T, msr::vmx_procbased_ctls2_t>;
 
-  static_assert(is_control_register || is_vmx_ctl_msr || is_vmx_procbased_ctls2_msr,
+  constexpr bool is_vmx_vmfunc_msr =
+    std::is_same_v<T, msr::vmx_vmfunc_t>;
+
+  static_assert(is_control_register || is_vmx_ctl_msr || is_vmx_procbased_ctls2_msr || is_vmx_vmfunc_msr,
                 "type is not adjustable");
 
   if constexpr (is_control_register)
@@ -87,6 +92,17 @@ auto adjust(T desired) noexcept
     desired.flags |= true_ctls.allowed_0_settings;
     desired.flags &= true_ctls.allowed_1_settings;
 
+    return desired;
+  }
+  else if constexpr(is_vmx_vmfunc_msr)
+  {
+    //
+    // IA32_VMX_VMFUNC reports only allowed 1-settings.
+    //
+    auto vmfunc = msr::read<msr::vmx_vmfunc_t>();
+
+    desired.flags &= vmfunc.flags;
+
     return desired;
   }
 }
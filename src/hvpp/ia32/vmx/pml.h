@@ -0,0 +1,39 @@
+#pragma once
+#include "../memory.h"
+
+#include <cstdint>
+
+namespace ia32::vmx {
+
+//
+// Page-modification log.
+// (ref: Vol3C[28.2.6(Page-Modification Logging)])
+//
+// When the processor sets dirty flag of an EPT leaf entry, it writes
+// guest-physical address of the accessed 4kb page into entry[PML index]
+// and decrements the PML index (guest-state field). Entries are therefore
+// filled from the last one downwards. When the log is full (the index is
+// outside of 0..511), next logging causes "page-modification log full"
+// VM-exit instead.
+//
+struct alignas(page_size) pml_t
+{
+  static constexpr int max_entry_count = page_size / sizeof(uint64_t);
+
+  //
+  // Returns index of the first valid entry for given PML index. If the
+  // log is full, the index has wrapped around (to 0xFFFF).
+  //
+  static constexpr int first_entry(uint16_t pml_index) noexcept
+  {
+    return pml_index >= max_entry_count
+      ? 0
+      : pml_index + 1;
+  }
+
+  pa_t entry[max_entry_count];
+};
+
+static_assert(sizeof(pml_t) == page_size);
+
+}
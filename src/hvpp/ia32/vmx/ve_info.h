@@ -0,0 +1,39 @@
+#pragma once
+#include "../memory.h"
+
+#include <cstdint>
+
+namespace ia32::vmx {
+
+//
+// Virtualization-exception information area.
+// (ref: Vol3C[25.5.6.2(Virtualization-Exception Information)])
+//
+struct alignas(page_size) ve_info_t
+{
+  union
+  {
+    struct
+    {
+      uint32_t exit_reason;             // Always 48 (EPT violation)
+
+      //
+      // The processor writes 0xFFFFFFFF here when it delivers #VE. Until
+      // the guest resets this field back to 0, subsequent EPT violations
+      // cause VM-exit instead of #VE.
+      //
+      uint32_t busy;
+
+      uint64_t exit_qualification;
+      uint64_t guest_linear_address;
+      uint64_t guest_physical_address;
+      uint16_t eptp_index;
+    };
+
+    uint8_t data[page_size];
+  };
+};
+
+static_assert(sizeof(ve_info_t) == page_size);
+
+}
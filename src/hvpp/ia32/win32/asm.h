@@ -132,6 +132,15 @@ unsigned long      ia32_asm_bsr(_In_ unsigned long long word) noexcept
   return result;
 }
 
+inline
+unsigned long long ia32_asm_popcnt(_In_ unsigned long long word) noexcept
+{
+  //
+  // POPCNT is available on every CPU with EPT support.
+  //
+  return __popcnt64(word);
+}
+
 inline
 unsigned char      ia32_asm_bt(_In_ const void* base, _In_ unsigned long offset) noexcept
 {
@@ -7,13 +7,31 @@ namespace ia32 {
 
   namespace detail
   {
+    static const address_translator_t* address_translator = nullptr;
+
+    void set_address_translator(const address_translator_t* translator) noexcept
+    {
+      address_translator = translator;
+    }
+
     uint64_t pa_from_va(void* va) noexcept
     {
+      uint64_t pa;
+      if (address_translator && address_translator->pa_from_va(va, pa))
+      {
+        return pa;
+      }
+
       return MmGetPhysicalAddress(va).QuadPart;
     }
 
     void* va_from_pa(uint64_t pa) noexcept
     {
+      if (auto va = address_translator ? address_translator->va_from_pa(pa) : nullptr)
+      {
+        return va;
+      }
+
       PHYSICAL_ADDRESS win_pa;
       win_pa.QuadPart = pa;
 
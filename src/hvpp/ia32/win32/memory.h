@@ -6,4 +6,18 @@ namespace ia32::detail {
 uint64_t pa_from_va(void* va) noexcept;
 void*    va_from_pa(uint64_t pa) noexcept;
 
+//
+// Translator of addresses, which can be resolved without calling the OS
+// (e.g.: memory of the memory manager). It's tried first - its functions
+// return false/nullptr for addresses they don't know about. Installed by
+// the owner of that memory, nullptr removes it.
+//
+struct address_translator_t
+{
+  bool  (*pa_from_va)(const void* va, uint64_t& pa) noexcept;
+  void* (*va_from_pa)(uint64_t pa) noexcept;
+};
+
+void set_address_translator(const address_translator_t* translator) noexcept;
+
 }
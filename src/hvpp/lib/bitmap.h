@@ -4,6 +4,8 @@
 #include <cstdint>
 #include <cstring>
 
+#include <emmintrin.h>
+
 #include <algorithm>
 #include <limits>
 
@@ -25,11 +27,11 @@ class bitmap
     bitmap& operator=(bitmap&& other) = default;
 
     bitmap(int size_in_bits) noexcept
-      : buffer_(new word_t[word(size_in_bits)])
+      : buffer_(new word_t[word(size_in_bits + bit_count - 1)])
       , size_in_bits_(size_in_bits)
       , owning_(true)
     {
-      memset(buffer_, 0, size_in_bits / 8);
+      memset(buffer_, 0, word(size_in_bits + bit_count - 1) * sizeof(word_t));
     }
 
     bitmap(void* buffer, int size_in_bits) noexcept
@@ -43,7 +45,7 @@ class bitmap
     template <typename T, int SIZE>
     bitmap(T (&buffer)[SIZE]) noexcept
       : buffer_(reinterpret_cast<word_t*>(buffer))
-      , size_in_bits_(SIZE * sizeof(T))
+      , size_in_bits_(SIZE * sizeof(T) * 8)
       , owning_(false)
     {
 
@@ -141,19 +143,23 @@ class bitmap
       }
     }
 
-    int find_first_set() const noexcept
+    //
+    // Return index of the first set/clear bit at or after the index,
+    // or size_in_bits() if there is no such bit.
+    //
+    int find_next_set(int index) const noexcept
     {
-      for (int i = 0; i * 8 < size_in_bits_; ++i)
-      {
-        if (buffer_[i])
-        {
-          return std::min(
-            static_cast<int>(i * 8 + ia32_asm_bsf(static_cast<uint64_t>(buffer_[i]))),
-            size_in_bits_);
-        }
-      }
+      return find_next(index, size_in_bits_, 0);
+    }
 
-      return size_in_bits_;
+    int find_next_clear(int index) const noexcept
+    {
+      return find_next(index, size_in_bits_, ~word_t(0));
+    }
+
+    int find_first_set() const noexcept
+    {
+      return find_next_set(0);
     }
 
     int find_first_set(int index, int count) const noexcept
@@ -177,9 +183,7 @@ class bitmap
 
       while (current_bit + count <= size_in_bits_)
       {
-        static constexpr int max_count = std::numeric_limits<decltype(count)>::max();
-
-        current_bit += get_length_of_clear(current_bit, max_count);
+        current_bit = find_next_set(current_bit);
         int current_length = get_length_of_set(current_bit, count);
 
         if (current_length >= count)
@@ -200,17 +204,7 @@ class bitmap
 
     int find_first_clear() const noexcept
     {
-      for (int i = 0; i * 8 < size_in_bits_; ++i)
-      {
-        if (buffer_[i] != ~0)
-        {
-          return std::min(
-            static_cast<int>(i * 8 + ia32_asm_bsf(~static_cast<uint64_t>(buffer_[i]))),
-            size_in_bits_);
-        }
-      }
-
-      return size_in_bits_;
+      return find_next_clear(0);
     }
 
     int find_first_clear(int count) const noexcept
@@ -237,11 +231,9 @@ class bitmap
 
       int current_bit = index;
 
-      while (current_bit + count < size_in_bits_)
+      while (current_bit + count <= size_in_bits_)
       {
-        static constexpr int max_count = std::numeric_limits<decltype(count)>::max();
-
-        current_bit += get_length_of_set(current_bit, max_count);
+        current_bit = find_next_clear(current_bit);
         int current_length = get_length_of_clear(current_bit, count);
 
         if (current_length >= count)
@@ -287,97 +279,155 @@ class bitmap
       return are_bits_clear(0, size_in_bits_);
     }
 
-  private:
-    int get_length_of_set(int index, int count) const noexcept
+    int count_set() const noexcept
     {
-      //
-      // Stolen from ReactOS - RtlpGetLengthOfRunSet.
-      //
+      return count_set(0, size_in_bits_);
+    }
 
-      if (index >= size_in_bits_)
+    int count_set(int index, int count) const noexcept
+    {
+      if (index >= size_in_bits_ || count <= 0)
       {
         return 0;
       }
 
-      const word_t* buffer = &buffer_[word(index)];
-      int bit_position = offset(index);
-
-      count = std::min(count, size_in_bits_ - index);
-      const word_t* buffer_max = &buffer[word(bit_position + count + bit_count - 1)];
+      const int end = end_of_run(index, count);
+      const int first_word = static_cast<int>(word(index));
+      const int last_word  = static_cast<int>(word(end - 1));
 
-      word_t inv_value = ~(*buffer++) >> bit_position << bit_position;
+      int result = 0;
 
-      while (inv_value == 0 && buffer < buffer_max)
+      for (int i = first_word; i <= last_word; ++i)
       {
-        inv_value = ~(*buffer++);
-      }
+        word_t value = buffer_[i];
 
-      if (inv_value == 0)
-      {
-        return count;
-      }
+        if (i == first_word)
+        {
+          value &= ~word_t(0) << offset(index);
+        }
+
+        if (i == last_word && offset(end))
+        {
+          value &= mask(end) - 1;
+        }
 
-      bit_position = ia32_asm_bsf(inv_value);
+        result += static_cast<int>(ia32_asm_popcnt(value));
+      }
 
-      int length = static_cast<int>(buffer - buffer_) * bit_count - index;
-      length += bit_position - bit_count;
+      return result;
+    }
 
-      if (length > size_in_bits_ - index)
+  private:
+    int get_length_of_set(int index, int count) const noexcept
+    {
+      if (index >= size_in_bits_ || count <= 0)
       {
-        length = size_in_bits_ - index;
+        return 0;
       }
 
-      return length;
+      return find_next(index, end_of_run(index, count), ~word_t(0)) - index;
     }
 
     int get_length_of_clear(int index, int count) const noexcept
     {
-      //
-      // Stolen from ReactOS - RtlpGetLengthOfRunClear.
-      //
-
-      if (index >= size_in_bits_)
+      if (index >= size_in_bits_ || count <= 0)
       {
         return 0;
       }
 
-      const word_t* buffer = &buffer_[word(index)];
-      int bit_position = offset(index);
+      return find_next(index, end_of_run(index, count), 0) - index;
+    }
+
+    int end_of_run(int index, int count) const noexcept
+    {
+      //
+      // Written this way so that "index + count" can't overflow when
+      // callers pass INT_MAX as the count.
+      //
+      return count < size_in_bits_ - index
+        ? index + count
+        : size_in_bits_;
+    }
 
-      count = std::min(count, size_in_bits_ - index);
-      const word_t* buffer_max = &buffer[word(bit_position + count + bit_count - 1)];
+    using word_t = uint64_t;
+    static constexpr word_t bit_count = sizeof(word_t) * 8;
 
-      word_t value = *buffer++ >> bit_position << bit_position;
+    inline constexpr int    offset(int bit) const noexcept { return bit % bit_count; }
+    inline constexpr word_t word  (int bit) const noexcept { return bit / bit_count; }
+    inline constexpr word_t mask  (int bit) const noexcept { return word_t(1) << offset(bit); }
 
-      while (value == 0 && buffer < buffer_max)
+    //
+    // Return index of the first bit in [index, end) which differs from
+    // the bits of skip_value (0 - find set bit, ~0 - find clear bit),
+    // or end if there is no such bit.
+    //
+    int find_next(int index, int end, word_t skip_value) const noexcept
+    {
+      if (index >= end)
       {
-        value = *buffer++;
+        return end;
       }
 
+      const word_t* buffer     = &buffer_[word(index)];
+      const word_t* buffer_end = &buffer_[word(end + bit_count - 1)];
+
+      word_t value = (*buffer ^ skip_value) & (~word_t(0) << offset(index));
+
       if (value == 0)
       {
-        return count;
+        buffer = skip_words(buffer + 1, buffer_end, skip_value);
+
+        if (buffer == buffer_end)
+        {
+          return end;
+        }
+
+        value = *buffer ^ skip_value;
       }
 
-      bit_position = ia32_asm_bsf(value);
+      return std::min(
+        static_cast<int>((buffer - buffer_) * bit_count + ia32_asm_bsf(value)),
+        end);
+    }
 
-      int length = static_cast<int>(buffer - buffer_) * bit_count - index;
-      length += bit_position - bit_count;
+    //
+    // Return pointer to the first word in [buffer, buffer_end) which is
+    // not equal to the value.
+    //
+    // Long runs of empty/full words are skipped 4 words (256 bits) per
+    // iteration with SSE2, which is part of the x64 baseline and can be
+    // used freely in the kernel.  AVX2 is intentionally not used - the
+    // driver isn't built for it and the VM-exit handler saves only the
+    // legacy SSE state (fxsave).
+    //
+    static const word_t* skip_words(const word_t* buffer, const word_t* buffer_end, word_t value) noexcept
+    {
+      const __m128i pattern = _mm_set1_epi64x(static_cast<long long>(value));
 
-      if (length > size_in_bits_ - index)
+      while (buffer_end - buffer >= 4)
       {
-        length = size_in_bits_ - index;
-      }
+        const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buffer));
+        const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buffer + 2));
 
-      return length;
-    }
+        const __m128i equal = _mm_and_si128(
+          _mm_cmpeq_epi32(lo, pattern),
+          _mm_cmpeq_epi32(hi, pattern));
 
-    using word_t = uint64_t;
-    static constexpr word_t bit_count = sizeof(word_t) * 8;
+        if (_mm_movemask_epi8(equal) != 0xffff)
+        {
+          break;
+        }
 
-    inline constexpr int    offset(int bit) const noexcept { return bit % bit_count; }
-    inline constexpr word_t word  (int bit) const noexcept { return bit / bit_count; }
-    inline constexpr word_t mask  (int bit) const noexcept { return word_t(1) << offset(bit); }
+        buffer += 4;
+      }
+
+      while (buffer < buffer_end && *buffer == value)
+      {
+        buffer += 1;
+      }
+
+      return buffer;
+    }
 
     word_t* buffer_;
     int size_in_bits_;
@@ -3,11 +3,15 @@
 
 #include "ia32/memory.h"
 
+#include "hvpp/config.h"
+
 #include "lib/assert.h"
 #include "lib/bitmap.h"
+#include "lib/mp.h"
 #include "lib/object.h"
 #include "lib/spinlock.h"
 
+#include <atomic>
 #include <cstring>
 #include <limits>
 #include <mutex>
@@ -22,6 +26,9 @@
 //
 // Memory manager is provided memory space on which it can operate. Small part
 // from this space is reserved for the page bitmap and page allocation map.
+// More memory spaces (arenas) can be added later by add_arena(). Each arena
+// has its own metadata described below, offsets are relative to the pool
+// of the arena. All arenas are protected by single global lock.
 //
 // Page bitmap sets bit 1 at page offset, if the page is allocated (e.g.:
 // if 4th page (at base_address + 4*PAGE_SIZE) is allocated, 4th bit in this
@@ -33,303 +40,2432 @@
 // corresponding number in the map is reset to 0.
 //
 // Note: allocations are always page-aligned - therefore allocation for
-//       even 1 byte results in waste of 4096 bytes.
+//       even 1 byte results in waste of 4096 bytes. Small objects should
+//       be allocated by allocate_small() (global operator new does this),
+//       which carves them out of size-class slabs (see below).
+//
+// Single-page allocations (the vast majority - EPT tables, hook pages,
+// ...) are served from per-CPU magazines. Magazine is a small stack of
+// free pages (of any arena) owned by one CPU. Pages in the magazine are marked as used
+// in the page bitmap, but their page allocation map entry is 0. Magazine
+// is refilled from (and drained to) the page bitmap in batches, therefore
+// the global lock is taken only once per magazine_batch_size allocations.
+//
+// Each magazine has its own lock. The lock is uncontended in practice
+// (it is shared only when the thread is preempted and moved to another
+// CPU between picking up the magazine and using it, or when there are
+// more CPUs than magazines).
+//
+// With HVPP_ENABLE_BUDDY_ALLOCATOR, runs of pages are not searched in the
+// page bitmap, but taken from a binary buddy system (the page bitmap is
+// still maintained, so that leak checks work the same way). Free blocks
+// of 2^order pages are linked in per-order free lists - buddy link map
+// holds the links and buddy order map holds (order + 1) for the first page
+// of each free block (free pages themselves are never touched, so that
+// they don't have to be brought into the cache and zeroed pages stay
+// zeroed). Allocation takes the smallest sufficient block and splits
+// it, pages past the requested page count are returned right away. Both
+// allocation and free take O(log n) steps, regardless of fragmentation.
+// Arenas usually aren't a power of two pages long - blocks which would
+// reach past the end of the arena are clamped to it, so that the whole
+// arena can still be coalesced into a single block (block at the end of
+// the arena whose buddy lies completely past the end is promoted to the
+// next order right away).
+//
+// Zeroed page map holds 1 for each page, which is known to contain only
+// zeros. Pages are zeroed by zero_free_pages(), which is meant to be
+// called periodically from a low-priority thread. That thread runs at
+// passive level and can be interrupted by VM-exit handlers and IPI
+// callbacks, which allocate too - therefore it never takes any allocator
+// lock. Instead, allocation paths (which hold the global lock anyway)
+// reserve small batches of free pages which are not zeroed yet and push
+// them onto a lock-free per-arena list. zero_free_pages() takes the whole
+// list, zeroes the pages and pushes them onto another list, from which
+// allocation paths return them back to the page bitmap. Pages on both
+// lists stay marked in the page bitmap. allocate_zeroed() then has to
+// memset only pages which haven't been zeroed in advance. Any allocation
+// clears the map for the allocated pages, as the caller may write to them.
+//
+// With HVPP_ENABLE_MM_POISONING, freed memory is filled with 0xCC. This
+// helps with debugging use-after-free bugs and uninitialized variables
+// and class members (in reused memory).
+//
+// Physical layout of each arena is recorded once when it's added,
+// so that VA->PA and PA->VA translations of hypervisor-owned memory don't
+// have to call the OS (MmGetPhysicalAddress/MmGetVirtualForPhysical aren't
+// safe to call in VMX-root mode). The memory is split into 2MB chunks (of
+// virtual address space). PA chunk table holds PA of each chunk, if the
+// chunk is physically contiguous (the usual case). Otherwise it holds
+// index into PA page table, which holds PA of each page of such chunk.
+// Reverse translation uses open-addressing hash table, which maps PFNs to
+// page indices.
+//
+// With HVPP_ENABLE_MM_PROFILER, each allocation is recorded in a table of
+// live allocations (open addressing keyed by address, with backward shift
+// deletion) and accounted to its call site (open addressing keyed by the
+// return address). Both tables have fixed size and are protected by their
+// own lock, which is always taken last. Internal allocations (slab pages)
+// are not recorded - only the objects allocated from them are.
+//
+// Slab is a single page, which starts with a cache-line sized slab_t
+// header, followed by objects of one size class. Free objects of a slab
+// are linked in a singly-linked list, and slabs with at least one free
+// object are linked in a per-class list. Because of the header, slab
+// objects are never page-aligned - free() uses this to tell them apart
+// from page allocations. Size classes of 64 bytes and more are multiples
+// of the cache line, therefore such objects are cache-line aligned.
 //
 
 namespace memory_manager
 {
-  uint8_t*  base_address = nullptr;         // Pool base address
-  size_t    available_size = 0;             // Available memory in the pool
-
   using pgbmp_t = object_t<bitmap>;
-  pgbmp_t   page_bitmap;                    // Bitmap holding used pages
-  int       page_bitmap_buffer_size = 0;    //
-
   using pgmap_t = uint16_t;
-  pgmap_t*  page_allocation_map = nullptr;  // Map holding number of allocated pages
-  int       page_allocation_map_size = 0;   //
 
-  int       last_page_offset = 0;           // Last returned page offset - used as hint
+  //
+  // Physical layout of the arena.
+  //
+  static constexpr size_t pa_chunk_size = 2 * 1024 * 1024;
+  static constexpr int    pa_chunk_page_count = pa_chunk_size / ia32::page_size;
 
-  size_t    number_of_allocated_bytes = 0;
-  size_t    number_of_free_bytes = 0;
+#ifdef HVPP_ENABLE_BUDDY_ALLOCATOR
+  //
+  // Buddy allocator. Blocks of the highest order span 64GB, so that any
+  // arena fits into a single (clamped) block.
+  //
+  static constexpr int buddy_max_order = 24;
+  static constexpr int buddy_candidate_count = 4;
 
-  object_t<ia32::physical_memory_descriptor> memory_descriptor;
-  object_t<ia32::mtrr> memory_type_range_registers;
-  object_t<spinlock> lock;
+  struct buddy_link_t
+  {
+    int next;                               // Page offset of the next free block or -1
+    int previous;                           // Page offset of the previous free block or -1
+  };
+#endif
 
-  void initialize(void* address, size_t size) noexcept
+  //
+  // Entry of the zeroer lists - pages are linked through their first bytes.
+  //
+  struct zero_page_t
   {
-    if (size < ia32::page_size * 3)
-    {
-      //
-      // We need at least 3 pages (see explanation below).
-      //
-      hvpp_assert(0);
-      return;
-    }
+    zero_page_t* next;
+  };
 
-    //
-    // If the provided address is not page aligned, align it to the next page.
-    //
-    if (ia32::byte_offset(address) != 0)
-    {
-      uint32_t lost_bytes = ia32::byte_offset(address);
+  struct arena_t
+  {
+    uint8_t*  base_address = nullptr;         // Pool base address
+    size_t    available_size = 0;             // Available memory in the pool
 
-      address = reinterpret_cast<uint8_t*>(ia32::page_align(address)) + ia32::page_size;
+    pgbmp_t   page_bitmap;                    // Bitmap holding used pages
+    int       page_bitmap_buffer_size = 0;    //
 
-      //
-      // Subtract amount of "lost" bytes due to alignment.
-      //
-      size -= lost_bytes;
-    }
+    pgmap_t*  page_allocation_map = nullptr;  // Map holding number of allocated pages
+    int       page_allocation_map_size = 0;   //
 
-    //
-    // Align size to the page boundary.
-    //
-    size = reinterpret_cast<size_t>(ia32::page_align(size));
+    int       last_page_offset = 0;           // Last returned page offset - used as hint
 
-    //
-    // Check again.
-    //
-    if (size < ia32::page_size * 3)
-    {
-      hvpp_assert(0);
-      return;
-    }
+    uint8_t*  pa_region_base = nullptr;       // Start of the provided memory rounded down to 2MB
+    uint8_t*  pa_region_begin = nullptr;      // Start of the provided memory
+    uint8_t*  pa_region_end = nullptr;        // End of the provided memory
+    uint64_t* pa_chunk_table = nullptr;       // PA of each chunk, or (page table index << 1) | 1
+    int       pa_chunk_count = 0;             //
+    uint64_t* pa_page_table = nullptr;        // PA of each page of not contiguous chunks
+    uint32_t* pa_hash_table = nullptr;        // PFN -> page index + 1
+    int       pa_hash_table_size = 0;         // Power of 2
 
-    //
-    // Address is page-aligned, size is page-aligned, and all requirements are met.
-    // Proceed with initialization.
-    //
+    uint8_t*  zeroed_page_map = nullptr;      // Map of pages known to be zeroed
+    int       zeroed_page_map_size = 0;       //
+    int       zeroer_page_offset = 0;         // Next page offset checked by zeroer_exchange_unlocked()
 
-    //
-    // The provided memory is split up to 3 parts:
-    //   1. page bitmap - stores information if page is allocated or not
-    //   2. page count  - stores information how many consecutive pages has been allocated
-    //   3. memory pool - this is the memory which will be provided
-    //
-    // For (1), there is taken (size / PAGE_SIZE / 8) bytes from the provided memory space.
-    // For (2), there is taken (size / PAGE_SIZE * sizeof(pgmap_t)) bytes from the provided
-    // memory space. The rest memory is used for (3). This should account for ~93% of the
-    // provided memory space (if it is big enough, e.g.: 32MB).
-    //
+    std::atomic<zero_page_t*> zero_pending = nullptr; // Pages reserved for zero_free_pages()
+    std::atomic<zero_page_t*> zero_done = nullptr;    // Pages zeroed by zero_free_pages()
+    int       zero_reserved_count = 0;        // Pages on both lists above
 
-    //
-    // Construct the page bitmap.
-    //
-    uint8_t* page_bitmap_buffer = reinterpret_cast<uint8_t*>(address);
-    page_bitmap_buffer_size = static_cast<int>(ia32::round_to_pages(size / ia32::page_size / 8));
-    memset(page_bitmap_buffer, 0, page_bitmap_buffer_size);
+#ifdef HVPP_ENABLE_BUDDY_ALLOCATOR
+    uint8_t*  buddy_order_map = nullptr;      // Order + 1 of free blocks (at their first page)
+    int       buddy_order_map_size = 0;       //
+    buddy_link_t* buddy_link_map = nullptr;   // Free list links of free blocks (at their first page)
+    int       buddy_link_map_size = 0;        //
+    int       buddy_page_count = 0;           // Number of pages managed by the buddy allocator
 
-    page_bitmap.initialize(page_bitmap_buffer, page_bitmap_buffer_size * 8);
+    int       buddy_free_list[buddy_max_order + 1]; // First free block of each order or -1
+#endif
 
-    //
-    // Construct the page allocation map.
-    //
-    page_allocation_map = reinterpret_cast<pgmap_t*>(page_bitmap_buffer + page_bitmap_buffer_size);
-    page_allocation_map_size = static_cast<int>(ia32::round_to_pages(size / ia32::page_size) * sizeof(pgmap_t));
-    memset(page_allocation_map, 0, page_allocation_map_size);
+    std::atomic<size_t>   allocated_bytes = 0;  // Bytes allocated from this arena
+    std::atomic<uint64_t> allocation_count = 0; // Allocations served by this arena
+  };
 
-    //
-    // Compute available memory.
-    //
-    base_address = reinterpret_cast<uint8_t*>(page_allocation_map) + page_allocation_map_size;
-    available_size = size
-      - page_bitmap_buffer_size
-      - page_allocation_map_size;
+  //
+  // Arenas are published by incrementing arena_count (with release
+  // semantics) after they're fully initialized, and they're never removed
+  // (until destroy()), therefore they can be looked up without any lock.
+  //
+  arena_t   arenas[max_arena_count];
+  std::atomic<int> arena_count = 0;
 
+  size_t    arena_watermark = 0;            // Free bytes below which arena_needed() returns true
 
-    //
-    // Initialize memory pool with garbage. This should help with debugging
-    // uninitialized variables and class members.
-    //
-    memset(base_address, 0xcc, available_size);
+  const ia32::detail::address_translator_t address_translator = { &pa_from_va, &va_from_pa };
 
-    //
-    // Set initial values of allocated/free bytes.
-    //
-    number_of_allocated_bytes = 0;
-    number_of_free_bytes = size;
+  static constexpr int zeroer_batch_size  = 32;   // Pages reserved per zeroer_exchange_unlocked()
+  static constexpr int zeroer_scan_size   = 512;  // Pages checked per zeroer_exchange_unlocked()
+  static constexpr int zeroer_reserve_max = 256;  // Pages reserved per arena at most
+  static constexpr int zeroer_lead_max    = 4096; // Pages scanned ahead of the allocation hint at most
 
-    //
-    // Initialize physical memory descriptor and MTRRs.
-    //
-    lock.initialize();
-    memory_descriptor.initialize();
-    memory_type_range_registers.initialize();
-  }
+  int       zeroer_arena_index = 0;         // Next arena handled by zeroer_exchange_unlocked()
 
-  void destroy() noexcept
+  std::atomic<size_t> number_of_allocated_bytes = 0;
+  std::atomic<size_t> number_of_free_bytes = 0;
+
+  //
+  // Per-CPU cache of single free pages.
+  //
+  static constexpr int max_magazine_count  = 64;
+  static constexpr int magazine_size       = 64;
+  static constexpr int magazine_batch_size = magazine_size / 2;
+
+  struct alignas(64) magazine_t
   {
-    //
-    // Destroy all objects. Note that this method doesn't lock and assumes
-    // all allocations has been already freed.
-    //
-    memory_type_range_registers.destroy();
-    memory_descriptor.destroy();
-    lock.destroy();
+    spinlock  lock;
+    int       count = 0;
+    uint8_t*  page[magazine_size] = {};
 
-    //
-    // Checks for memory leaks.
-    //
-    hvpp_assert(page_bitmap->all_clear());
+    uint64_t  allocation_count = 0;         // Allocations served by the magazine
+    uint64_t  free_count = 0;               // Frees served by the magazine
 
     //
-    // Checks for allocator corruption.
+    // Set by set_root_mode(). Magazines are shared if there are more
+    // CPUs than magazines, but this is used only for statistics.
     //
-    hvpp_assert(std::all_of(
-      page_allocation_map,
-      page_allocation_map + page_allocation_map_size / sizeof(pgmap_t),
-      [](auto page_count) { return page_count == 0; }));
+    bool      root_mode = false;
+  };
 
-    base_address = nullptr;
-    available_size = 0;
+  magazine_t magazines[max_magazine_count];
 
-    page_bitmap.destroy();
-    page_bitmap_buffer_size = 0;
+  //
+  // Global lock statistics. Updated only while the global lock is held.
+  //
+  uint64_t  global_allocation_count = 0;    // Allocations served by the page bitmap
+  uint64_t  global_free_count = 0;          // Frees served by the page bitmap
+  uint64_t  global_lock_count = 0;          // Number of global lock acquisitions
+  uint64_t  global_lock_contention_count = 0; // ... out of which had to wait
+  uint64_t  global_lock_wait_cycles = 0;    // TSC cycles spent waiting
+  uint64_t  zeroer_page_count = 0;          // Pages zeroed by zero_free_pages()
 
-    page_allocation_map = nullptr;
-    page_allocation_map_size = 0;
+  std::atomic<uint64_t> zeroed_hit_count  = 0; // Pages of allocate_zeroed() zeroed in advance
+  std::atomic<uint64_t> zeroed_miss_count = 0; // Pages of allocate_zeroed() zeroed on the spot
 
-    last_page_offset = 0;
-    number_of_allocated_bytes = 0;
-    number_of_free_bytes = 0;
-  }
+  std::atomic<uint64_t> failed_allocation_count = 0;   // Allocations which returned nullptr
+  std::atomic<uint64_t> low_memory_root_allocation_count = 0; // Root mode allocations below the watermark
 
-  void* allocate(size_t size) noexcept
+  uint64_t  initialize_cycles = 0;          // TSC cycles spent in initialize()
+
+  //
+  // Size-class slabs.
+  //
+  struct alignas(64) slab_t
   {
-    hvpp_assert(base_address != nullptr && available_size > 0);
+    slab_t*   next;                         // Next slab with free objects
+    slab_t*   previous;                     // Previous slab with free objects
+    void*     free_list;                    // First free object
+    uint16_t  used_count;                   // Number of allocated objects
+    uint16_t  capacity;                     // Number of objects in this slab
+    uint8_t   size_class;                   // Index into slab_classes
+  };
 
-    //
-    // Return at least 1 page, even if someone required 0.
-    //
-    if (size == 0)
+  static_assert(sizeof(slab_t) == 64);
+
+  struct alignas(64) slab_class_t
+  {
+    spinlock  lock;
+    uint32_t  size;                         // Object size
+    slab_t*   partial = nullptr;            // Slabs with free objects
+
+    uint64_t  page_count = 0;               // Number of slabs
+    uint64_t  object_count = 0;             // Number of allocated objects
+  };
+
+  slab_class_t slab_classes[] = {
+    { {},   16 }, { {},   32 }, { {},   64 }, { {},  128 }, { {},  192 },
+    { {},  256 }, { {},  448 }, { {},  576 }, { {}, 1344 }, { {}, 1984 },
+  };
+
+  static constexpr int slab_class_count = sizeof(slab_classes) / sizeof(slab_classes[0]);
+  static constexpr int slab_data_size = ia32::page_size - sizeof(slab_t);
+
+#ifdef HVPP_ENABLE_MM_PROFILER
+  //
+  // Allocation profiler.
+  //
+  static constexpr int profiler_site_table_size       = 1024;   // Power of 2
+  static constexpr int profiler_allocation_table_size = 16384;  // Power of 2
+
+  spinlock  profiler_lock;
+  profile_site_t       profiler_sites[profiler_site_table_size];
+  profile_allocation_t profiler_allocations[profiler_allocation_table_size];
+  int       profiler_site_count = 0;
+  int       profiler_allocation_count = 0;
+  uint32_t  profiler_dropped_count = 0;
+  uint64_t  profiler_peak_allocated_bytes = 0;
+  uint64_t  profiler_root_allocation_count = 0;
+#endif
+
+  object_t<ia32::physical_memory_descriptor> memory_descriptor;
+  object_t<ia32::mtrr> memory_type_range_registers;
+  object_t<spinlock> lock;
+
+  //
+  // MTRRs re-read by update_mtrr(). Readers of mtrr() don't take any lock,
+  // therefore an index which has been published is never modified - each
+  // update builds a new snapshot aside and publishes it by a single pointer
+  // store. Replaced snapshots are kept (linked by "previous") until
+  // destroy(), because some processor might still be using them. When the
+  // memory types match an already existing snapshot, that one is published
+  // again instead, so there are only as many snapshots as there were
+  // distinct MTRR settings.
+  //
+  struct mtrr_snapshot_t
+  {
+    ia32::mtrr       mtrr;
+    mtrr_snapshot_t* previous;
+  };
+
+  std::atomic<const ia32::mtrr*> current_mtrr;
+  mtrr_snapshot_t* mtrr_snapshots = nullptr;
+
+  //
+  // Lockable wrapper around the global lock (usable with std::lock_guard),
+  // which collects the statistics above.
+  //
+  struct global_lock_t
+  {
+    void lock() noexcept
     {
-      hvpp_assert(0);
-      size = 1;
+      if (!memory_manager::lock->try_lock())
+      {
+        const auto wait_begin = ia32_asm_read_tsc();
+        memory_manager::lock->lock();
+
+        global_lock_contention_count += 1;
+        global_lock_wait_cycles += ia32_asm_read_tsc() - wait_begin;
+      }
+
+      global_lock_count += 1;
     }
 
-    int page_count = static_cast<int>(ia32::bytes_to_pages(size));
+    void unlock() noexcept
+    {
+      memory_manager::lock->unlock();
+    }
+  } global_lock;
 
-    //
-    // Check if the desired number of pages can fit into the allocation map.
-    //
-    if (page_count > std::numeric_limits<pgmap_t>::max() - 1)
+  magazine_t& current_magazine() noexcept
+  {
+    return magazines[mp::cpu_index() % max_magazine_count];
+  }
+
+  arena_t* arena_from_address(const void* address) noexcept
+  {
+    const int count = arena_count.load(std::memory_order_acquire);
+
+    for (int i = 0; i < count; ++i)
     {
-      hvpp_assert(0);
-      return nullptr;
+      if (address >= arenas[i].base_address &&
+          address <  arenas[i].base_address + arenas[i].available_size)
+      {
+        return &arenas[i];
+      }
     }
 
-    int previous_page_offset;
+    return nullptr;
+  }
+
+#ifdef HVPP_ENABLE_MM_PROFILER
+  uint64_t profiler_hash(uint64_t value) noexcept
+  {
+    return (value * 0x9e3779b97f4a7c15) >> 32;
+  }
+
+  allocation_context current_allocation_context() noexcept
+  {
+    if (current_magazine().root_mode)
+    {
+      return allocation_context::root;
+    }
 
+    switch (mp::context())
     {
-      std::lock_guard _(*lock);
+      case mp::context_t::dispatch: return allocation_context::dispatch;
+      case mp::context_t::ipi:      return allocation_context::ipi;
+      default:                      return allocation_context::passive;
+    }
+  }
 
-      last_page_offset = page_bitmap->find_first_clear(last_page_offset, page_count);
+  profile_site_t* profiler_site(uint64_t caller, bool insert) noexcept
+  {
+    //
+    // Finds (or inserts) the call site. Returns nullptr if it's not found
+    // (or if the table is full). Profiler lock must be held.
+    //
+    for (auto slot = profiler_hash(caller); ; ++slot)
+    {
+      auto& site = profiler_sites[slot & (profiler_site_table_size - 1)];
 
-      if (last_page_offset == -1)
+      if (site.caller == caller)
       {
-        last_page_offset = 0;
-        last_page_offset = page_bitmap->find_first_clear(last_page_offset, page_count);
+        return &site;
+      }
 
-        if (last_page_offset == -1)
+      if (site.caller == 0)
+      {
+        //
+        // Keep at least one empty slot, so that the search terminates.
+        //
+        if (!insert || profiler_site_count == profiler_site_table_size - 1)
         {
-          //
-          // Not enough memory...
-          //
-          hvpp_assert(0);
           return nullptr;
         }
-      }
-
-      page_bitmap->set(last_page_offset, page_count);
-      page_allocation_map[last_page_offset] = static_cast<pgmap_t>(page_count);
-
-      previous_page_offset = last_page_offset;
-      last_page_offset += page_count;
 
-      number_of_allocated_bytes += page_count * ia32::page_size;
-      number_of_free_bytes      -= page_count * ia32::page_size;
+        site.caller = caller;
+        profiler_site_count += 1;
+        return &site;
+      }
     }
-
-    //
-    // Return the final address. Note that we're not under lock here - we don't
-    // need it, because everything neccessary has been done (bitmap + page
-    // allocation map manipulation).
-    //
-    return base_address + previous_page_offset * ia32::page_size;
   }
 
-  void free(void* address) noexcept
+  int profiler_allocation_slot(uint64_t address) noexcept
   {
     //
-    // Our allocator always provides page-aligned memory.
+    // Returns slot of the allocation or of the first empty slot, where it
+    // can be inserted. Profiler lock must be held.
     //
-    hvpp_assert(ia32::byte_offset(address) == 0);
+    for (auto slot = profiler_hash(address >> 4); ; ++slot)
+    {
+      const int index = static_cast<int>(slot & (profiler_allocation_table_size - 1));
 
-    int offset = static_cast<int>(ia32::bytes_to_pages(reinterpret_cast<uint8_t*>(address) - base_address));
+      if (profiler_allocations[index].address == address ||
+          profiler_allocations[index].address == 0)
+      {
+        return index;
+      }
+    }
+  }
 
-    if (offset * ia32::page_size > available_size)
+  void profile_allocate(void* address, size_t size, void* caller, uint64_t cycles) noexcept
+  {
+    if (!caller)
     {
       //
-      // We don't own this memory.
+      // Internal allocation.
       //
-      hvpp_assert(0);
       return;
     }
 
-    std::lock_guard _(*lock);
+    const auto context = current_allocation_context();
+    const auto cpu = mp::cpu_index();
+
+    std::lock_guard _(profiler_lock);
+
+    profiler_peak_allocated_bytes = std::max<uint64_t>(profiler_peak_allocated_bytes, number_of_allocated_bytes);
+
+    if (context == allocation_context::root)
+    {
+      profiler_root_allocation_count += 1;
+    }
+
+    auto site = profiler_site(reinterpret_cast<uint64_t>(caller), true);
+
+    //
+    // Keep the table of live allocations at most 3/4 full, so that the
+    // probe sequences stay short.
+    //
+    if (!site || profiler_allocation_count >= profiler_allocation_table_size / 4 * 3)
+    {
+      profiler_dropped_count += 1;
+      return;
+    }
+
+    site->allocation_count += 1;
+    site->live_count += 1;
+    site->live_bytes += size;
+    site->peak_live_bytes = std::max(site->peak_live_bytes, site->live_bytes);
+    site->max_cycles = std::max(site->max_cycles, cycles);
+    site->context_count[static_cast<int>(context)] += 1;
+
+    auto& allocation = profiler_allocations[profiler_allocation_slot(reinterpret_cast<uint64_t>(address))];
+    allocation.address = reinterpret_cast<uint64_t>(address);
+    allocation.caller  = reinterpret_cast<uint64_t>(caller);
+    allocation.size    = static_cast<uint32_t>(size);
+    allocation.cpu     = static_cast<uint16_t>(cpu);
+    allocation.context = context;
+
+    profiler_allocation_count += 1;
+  }
+
+  void profile_free(void* address) noexcept
+  {
+    std::lock_guard _(profiler_lock);
 
-    if (page_allocation_map[offset] == 0)
+    int index = profiler_allocation_slot(reinterpret_cast<uint64_t>(address));
+
+    if (profiler_allocations[index].address == 0)
     {
       //
-      // This memory wasn't allocated.
+      // Internal or dropped allocation.
       //
-      hvpp_assert(0);
       return;
     }
 
-    //
-    // Clear number of allocated pages.
-    //
-    int page_count = page_allocation_map[offset];
-    page_allocation_map[offset] = 0;
+    if (auto site = profiler_site(profiler_allocations[index].caller, false))
+    {
+      site->live_count -= 1;
+      site->live_bytes -= profiler_allocations[index].size;
+    }
 
     //
-    // Clear pages in the bitmap.
+    // Move following entries of the probe sequence into the hole, unless
+    // they'd end up before their home slot.
     //
-    page_bitmap->clear(offset, page_count);
+    constexpr int mask = profiler_allocation_table_size - 1;
 
-    number_of_allocated_bytes -= page_count * ia32::page_size;
-    number_of_free_bytes      += page_count * ia32::page_size;
+    for (int next = (index + 1) & mask; profiler_allocations[next].address; next = (next + 1) & mask)
+    {
+      const int home = static_cast<int>(profiler_hash(profiler_allocations[next].address >> 4) & mask);
+
+      if (((next - home) & mask) >= ((next - index) & mask))
+      {
+        profiler_allocations[index] = profiler_allocations[next];
+        index = next;
+      }
+    }
+
+    profiler_allocations[index] = {};
+    profiler_allocation_count -= 1;
   }
+#endif
 
-  size_t allocated_bytes() noexcept
+#ifdef HVPP_ENABLE_BUDDY_ALLOCATOR
+  void buddy_push(arena_t& arena, int page_offset, int order) noexcept
   {
-    return number_of_allocated_bytes;
+    auto& link = arena.buddy_link_map[page_offset];
+    link.next = arena.buddy_free_list[order];
+    link.previous = -1;
+
+    if (link.next != -1) { arena.buddy_link_map[link.next].previous = page_offset; }
+
+    arena.buddy_free_list[order] = page_offset;
+    arena.buddy_order_map[page_offset] = static_cast<uint8_t>(order + 1);
   }
 
-  size_t free_bytes() noexcept
+  void buddy_remove(arena_t& arena, int page_offset, int order) noexcept
   {
-    return number_of_free_bytes;
+    const auto& link = arena.buddy_link_map[page_offset];
+
+    if (link.previous != -1) { arena.buddy_link_map[link.previous].next = link.next; }
+    else                     { arena.buddy_free_list[order] = link.next;             }
+
+    if (link.next != -1)     { arena.buddy_link_map[link.next].previous = link.previous; }
+
+    arena.buddy_order_map[page_offset] = 0;
   }
 
-  const ia32::physical_memory_descriptor& physical_memory_descriptor() noexcept
+  int buddy_block_page_count(const arena_t& arena, int page_offset, int order) noexcept
   {
-    return *memory_descriptor;
+    //
+    // Blocks are clamped to the end of the arena.
+    //
+    return std::min(1 << order, arena.buddy_page_count - page_offset);
   }
 
-  const ia32::mtrr& mtrr() noexcept
+  void buddy_free_block(arena_t& arena, int page_offset, int order) noexcept
+  {
+    //
+    // Merge the block with its buddy for as long as the buddy is free
+    // and of the same order. Buddy which lies past the end of the arena
+    // doesn't exist - the block covers everything up to the end already.
+    //
+    while (order < buddy_max_order)
+    {
+      const int buddy_offset = page_offset ^ (1 << order);
+
+      if (buddy_offset >= arena.buddy_page_count)
+      {
+        order += 1;
+        continue;
+      }
+
+      if (arena.buddy_order_map[buddy_offset] != order + 1)
+      {
+        break;
+      }
+
+      buddy_remove(arena, buddy_offset, order);
+      page_offset = std::min(page_offset, buddy_offset);
+      order += 1;
+    }
+
+    buddy_push(arena, page_offset, order);
+  }
+
+  void buddy_free_range(arena_t& arena, int page_offset, int page_count) noexcept
   {
-    return *memory_type_range_registers;
+    //
+    // Split the range into the largest naturally aligned blocks (clamped to
+    // the end of the arena). There is at most 2 * buddy_max_order of them.
+    //
+    const int end = page_offset + page_count;
+
+    while (page_offset < end)
+    {
+      int order = 0;
+      while (order < buddy_max_order &&
+             (page_offset & ((2 << order) - 1)) == 0 &&
+             page_offset + buddy_block_page_count(arena, page_offset, order + 1) <= end)
+      {
+        order += 1;
+      }
+
+      buddy_free_block(arena, page_offset, order);
+      page_offset += 1 << order;
+    }
+  }
+
+  int buddy_allocate(arena_t& arena, int page_count) noexcept
+  {
+    int order = 0;
+    while ((1 << order) < page_count)
+    {
+      order += 1;
+    }
+
+    //
+    // Find the smallest sufficient block. Of the first few sufficient
+    // blocks in the list, the one with the lowest address is taken - this
+    // keeps allocations packed towards the beginning of the arena, instead
+    // of scattering small allocations over blocks which have just been
+    // coalesced (plain LIFO order quickly leaves no large block free).
+    // Only one block of each order can be clamped (the one containing the
+    // end of the arena), therefore at most one block per order is skipped.
+    //
+    int page_offset = -1;
+    int current_order = order;
+
+    for (; current_order <= buddy_max_order; ++current_order)
+    {
+      int candidate_count = 0;
+
+      for (int block_offset = arena.buddy_free_list[current_order];
+           block_offset != -1 && candidate_count < buddy_candidate_count;
+           block_offset = arena.buddy_link_map[block_offset].next)
+      {
+        if (buddy_block_page_count(arena, block_offset, current_order) >= page_count)
+        {
+          if (page_offset == -1 || block_offset < page_offset)
+          {
+            page_offset = block_offset;
+          }
+
+          candidate_count += 1;
+        }
+      }
+
+      if (page_offset != -1)
+      {
+        break;
+      }
+    }
+
+    if (page_offset == -1)
+    {
+      return -1;
+    }
+
+    buddy_remove(arena, page_offset, current_order);
+
+    //
+    // Split the block until it has the desired order, then give back pages
+    // which weren't requested. The lower half of a clamped block is always
+    // still large enough, the upper half might not exist at all.
+    //
+    while (current_order > order)
+    {
+      current_order -= 1;
+
+      if (page_offset + (1 << current_order) < arena.buddy_page_count)
+      {
+        buddy_push(arena, page_offset + (1 << current_order), current_order);
+      }
+    }
+
+    const int block_page_count = buddy_block_page_count(arena, page_offset, order);
+
+    if (page_count < block_page_count)
+    {
+      buddy_free_range(arena, page_offset + page_count, block_page_count - page_count);
+    }
+
+    return page_offset;
+  }
+
+  int buddy_largest_free_page_count(const arena_t& arena) noexcept
+  {
+    int result = 0;
+
+    for (int order = buddy_max_order; order >= 0 && result < (2 << order); --order)
+    {
+      //
+      // Only one block of the order can be clamped.
+      //
+      for (int block_offset = arena.buddy_free_list[order];
+           block_offset != -1 && result < (1 << order);
+           block_offset = arena.buddy_link_map[block_offset].next)
+      {
+        result = std::max(result, buddy_block_page_count(arena, block_offset, order));
+      }
+    }
+
+    return result;
+  }
+
+  void buddy_take_range(arena_t& arena, int page_offset, int page_count) noexcept
+  {
+    //
+    // Removes free pages [page_offset, page_offset + page_count) from the
+    // free lists. Each free block overlapping the range is removed, and its
+    // parts outside of the range are freed again.
+    //
+    const int end = page_offset + page_count;
+    int current = page_offset;
+
+    while (current < end)
+    {
+      //
+      // Find the free block containing the current page - its first page
+      // is the current page rounded down to the order of the block.
+      //
+      int order = 0;
+      int block_offset = current;
+
+      while (arena.buddy_order_map[block_offset] != order + 1)
+      {
+        if (++order > buddy_max_order)
+        {
+          //
+          // The page isn't free.
+          //
+          hvpp_assert(0);
+          return;
+        }
+
+        block_offset = current & ~((1 << order) - 1);
+      }
+
+      buddy_remove(arena, block_offset, order);
+
+      const int block_end = block_offset + buddy_block_page_count(arena, block_offset, order);
+
+      if (block_offset < current)
+      {
+        buddy_free_range(arena, block_offset, current - block_offset);
+      }
+
+      if (block_end > end)
+      {
+        buddy_free_range(arena, end, block_end - end);
+      }
+
+      current = block_end;
+    }
+  }
+
+  void buddy_initialize(arena_t& arena, int page_count) noexcept
+  {
+    for (auto& first_block : arena.buddy_free_list)
+    {
+      first_block = -1;
+    }
+
+    arena.buddy_page_count = page_count;
+    buddy_free_range(arena, 0, page_count);
+  }
+#endif
+
+  bool is_physically_contiguous(const arena_t& arena, int page_offset, int page_count, size_t alignment) noexcept
+  {
+    const auto first_pa = ia32::pa_t::from_va(arena.base_address + page_offset * ia32::page_size);
+
+    if (first_pa.value() & (alignment - 1))
+    {
+      return false;
+    }
+
+    for (int i = 1; i < page_count; ++i)
+    {
+      const auto pa = ia32::pa_t::from_va(arena.base_address + (page_offset + i) * ia32::page_size);
+
+      if (pa.value() != first_pa.value() + i * ia32::page_size)
+      {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  int allocate_pages_aligned_unlocked(arena_t& arena, int page_count, size_t alignment, bool contiguous) noexcept
+  {
+    //
+    // Finds and marks page_count consecutive free pages, whose virtual
+    // address is aligned to "alignment" (and physical address too, if
+    // "contiguous" is set - in which case the pages must be physically
+    // contiguous as well). Candidates are checked at every suitably
+    // aligned offset. Global lock must be held.
+    //
+    const int alignment_page_count = static_cast<int>(std::max<size_t>(alignment / ia32::page_size, 1));
+    const int base_page_count = static_cast<int>(reinterpret_cast<uintptr_t>(arena.base_address) / ia32::page_size);
+    const int page_total = arena.page_bitmap->size_in_bits();
+
+    for (int page_offset = (alignment_page_count - base_page_count % alignment_page_count) % alignment_page_count;
+             page_offset + page_count <= page_total;
+             page_offset += alignment_page_count)
+    {
+      if (!arena.page_bitmap->are_bits_clear(page_offset, page_count))
+      {
+        continue;
+      }
+
+      if (contiguous && !is_physically_contiguous(arena, page_offset, page_count, alignment))
+      {
+        continue;
+      }
+
+      arena.page_bitmap->set(page_offset, page_count);
+
+#ifdef HVPP_ENABLE_BUDDY_ALLOCATOR
+      buddy_take_range(arena, page_offset, page_count);
+#endif
+
+      return page_offset;
+    }
+
+    return -1;
+  }
+
+  int allocate_pages_unlocked(arena_t& arena, int page_count) noexcept
+  {
+    //
+    // Finds and marks page_count consecutive free pages in the page bitmap.
+    // Returns page offset of the first page or -1. Global lock must be held.
+    //
+#ifdef HVPP_ENABLE_BUDDY_ALLOCATOR
+    const int page_offset = buddy_allocate(arena, page_count);
+
+    if (page_offset != -1)
+    {
+      arena.page_bitmap->set(page_offset, page_count);
+    }
+
+    return page_offset;
+#else
+    arena.last_page_offset = arena.page_bitmap->find_first_clear(arena.last_page_offset, page_count);
+
+    if (arena.last_page_offset == -1)
+    {
+      arena.last_page_offset = 0;
+      arena.last_page_offset = arena.page_bitmap->find_first_clear(arena.last_page_offset, page_count);
+
+      if (arena.last_page_offset == -1)
+      {
+        arena.last_page_offset = 0;
+        return -1;
+      }
+    }
+
+    arena.page_bitmap->set(arena.last_page_offset, page_count);
+
+    const int result = arena.last_page_offset;
+    arena.last_page_offset += page_count;
+
+    return result;
+#endif
+  }
+
+  uint64_t pa_hash(uint64_t pfn) noexcept
+  {
+    return (pfn * 0x9e3779b97f4a7c15) >> 32;
+  }
+
+  uint64_t pa_of_page(const arena_t& arena, int page_index) noexcept
+  {
+    //
+    // Returns PA of page_index-th page of the arena (counting from
+    // pa_region_base).
+    //
+    const auto chunk = arena.pa_chunk_table[page_index / pa_chunk_page_count];
+    const auto page_in_chunk = page_index % pa_chunk_page_count;
+
+    return (chunk & 1)
+      ? arena.pa_page_table[(chunk >> 1) + page_in_chunk]
+      : chunk + page_in_chunk * ia32::page_size;
+  }
+
+  size_t pa_layout_size(void* address, size_t size, int& chunk_count, int& not_contiguous_chunk_count, int& hash_table_size) noexcept
+  {
+    //
+    // Checks contiguity of each 2MB chunk of [address, address + size)
+    // and returns number of bytes needed for the tables.
+    //
+    const auto begin = reinterpret_cast<uint8_t*>(reinterpret_cast<uintptr_t>(address) & ~(pa_chunk_size - 1));
+    const auto end   = reinterpret_cast<uint8_t*>(address) + size;
+
+    chunk_count = static_cast<int>((end - begin + pa_chunk_size - 1) / pa_chunk_size);
+    not_contiguous_chunk_count = 0;
+
+    for (int i = 0; i < chunk_count; ++i)
+    {
+      const auto chunk_begin = std::max(begin + i * pa_chunk_size, reinterpret_cast<uint8_t*>(address));
+      const auto chunk_end   = std::min(begin + (i + 1) * pa_chunk_size, end);
+      const auto first_pa    = ia32::detail::pa_from_va(chunk_begin);
+
+      for (auto page = chunk_begin + ia32::page_size; page < chunk_end; page += ia32::page_size)
+      {
+        if (ia32::detail::pa_from_va(page) != first_pa + (page - chunk_begin))
+        {
+          not_contiguous_chunk_count += 1;
+          break;
+        }
+      }
+    }
+
+    hash_table_size = 1;
+    while (hash_table_size < 2 * chunk_count * pa_chunk_page_count)
+    {
+      hash_table_size *= 2;
+    }
+
+    return ia32::round_to_pages(chunk_count * sizeof(uint64_t)) +
+           ia32::round_to_pages(not_contiguous_chunk_count * pa_chunk_page_count * sizeof(uint64_t)) +
+           ia32::round_to_pages(hash_table_size * sizeof(uint32_t));
+  }
+
+  void pa_layout_initialize(arena_t& arena, void* address, size_t size, uint8_t* buffer, int chunk_count, int hash_table_size) noexcept
+  {
+    //
+    // Fills the tables (stored in the buffer) for [address, address + size).
+    //
+    const auto begin = reinterpret_cast<uint8_t*>(reinterpret_cast<uintptr_t>(address) & ~(pa_chunk_size - 1));
+    const auto end   = reinterpret_cast<uint8_t*>(address) + size;
+
+    arena.pa_chunk_table = reinterpret_cast<uint64_t*>(buffer);
+    arena.pa_chunk_count = chunk_count;
+    arena.pa_page_table  = reinterpret_cast<uint64_t*>(buffer + ia32::round_to_pages(chunk_count * sizeof(uint64_t)));
+
+    int page_table_count = 0;
+
+    for (int i = 0; i < chunk_count; ++i)
+    {
+      const auto chunk_begin = std::max(begin + i * pa_chunk_size, reinterpret_cast<uint8_t*>(address));
+      const auto chunk_end   = std::min(begin + (i + 1) * pa_chunk_size, end);
+      const auto first_pa    = ia32::detail::pa_from_va(chunk_begin);
+
+      bool contiguous = true;
+
+      for (auto page = chunk_begin + ia32::page_size; page < chunk_end; page += ia32::page_size)
+      {
+        if (ia32::detail::pa_from_va(page) != first_pa + (page - chunk_begin))
+        {
+          contiguous = false;
+          break;
+        }
+      }
+
+      if (contiguous)
+      {
+        //
+        // PA of the (possibly not provided) beginning of the chunk.
+        //
+        arena.pa_chunk_table[i] = first_pa - (chunk_begin - (begin + i * pa_chunk_size));
+      }
+      else
+      {
+        arena.pa_chunk_table[i] = (static_cast<uint64_t>(page_table_count) << 1) | 1;
+
+        for (int j = 0; j < pa_chunk_page_count; ++j)
+        {
+          const auto page = begin + i * pa_chunk_size + j * ia32::page_size;
+
+          arena.pa_page_table[page_table_count + j] = (page >= chunk_begin && page < chunk_end)
+            ? ia32::detail::pa_from_va(page)
+            : 0;
+        }
+
+        page_table_count += pa_chunk_page_count;
+      }
+    }
+
+    arena.pa_hash_table = reinterpret_cast<uint32_t*>(reinterpret_cast<uint8_t*>(arena.pa_page_table) +
+                          ia32::round_to_pages(page_table_count * sizeof(uint64_t)));
+    arena.pa_hash_table_size = hash_table_size;
+    memset(arena.pa_hash_table, 0, hash_table_size * sizeof(uint32_t));
+
+    const int first_page_index = static_cast<int>((reinterpret_cast<uint8_t*>(address) - begin) / ia32::page_size);
+    const int last_page_index  = static_cast<int>((end - begin) / ia32::page_size);
+
+    for (int page_index = first_page_index; page_index < last_page_index; ++page_index)
+    {
+      auto slot = pa_hash(pa_of_page(arena, page_index) >> ia32::page_shift);
+
+      while (arena.pa_hash_table[slot & (hash_table_size - 1)])
+      {
+        slot += 1;
+      }
+
+      arena.pa_hash_table[slot & (hash_table_size - 1)] = page_index + 1;
+    }
+
+    arena.pa_region_base = begin;
+    arena.pa_region_begin = reinterpret_cast<uint8_t*>(address);
+    arena.pa_region_end = end;
+  }
+
+#ifndef HVPP_ENABLE_BUDDY_ALLOCATOR
+  bool take_free_page_unlocked(arena_t& arena, int page_offset) noexcept
+  {
+    //
+    // Marks particular page as used, if it's free in the page bitmap.
+    // Global lock must be held.
+    //
+    if (arena.page_bitmap->test(page_offset))
+    {
+      return false;
+    }
+
+    arena.page_bitmap->set(page_offset);
+    return true;
+  }
+#endif
+
+  void free_pages_unlocked(arena_t& arena, int page_offset, int page_count) noexcept
+  {
+    //
+    // Releases pages marked by allocate_pages_unlocked(arena).
+    // Global lock must be held.
+    //
+    arena.page_bitmap->clear(page_offset, page_count);
+
+#ifdef HVPP_ENABLE_BUDDY_ALLOCATOR
+    buddy_free_range(arena, page_offset, page_count);
+#endif
+  }
+
+  int largest_free_page_count_unlocked(arena_t& arena) noexcept
+  {
+    //
+    // Returns size of the largest run of free pages (pages cached in the
+    // magazines are not counted). Global lock must be held.
+    //
+#ifdef HVPP_ENABLE_BUDDY_ALLOCATOR
+    return buddy_largest_free_page_count(arena);
+#else
+    const int size = arena.page_bitmap->size_in_bits();
+
+    int result = 0;
+    int index = arena.page_bitmap->find_next_clear(0);
+
+    while (index < size)
+    {
+      const int run_end = arena.page_bitmap->find_next_set(index);
+
+      result = std::max(result, run_end - index);
+      index = arena.page_bitmap->find_next_clear(run_end);
+    }
+
+    return result;
+#endif
+  }
+
+  uint8_t* allocate_from_arenas_unlocked(int page_count, size_t alignment, bool contiguous, bool aligned) noexcept
+  {
+    //
+    // Tries arenas in the order they were added. Returns address of the
+    // first page or nullptr. Global lock must be held.
+    //
+    const int count = arena_count.load(std::memory_order_acquire);
+
+    for (int i = 0; i < count; ++i)
+    {
+      auto& arena = arenas[i];
+
+      const int page_offset = aligned
+        ? allocate_pages_aligned_unlocked(arena, page_count, alignment, contiguous)
+        : allocate_pages_unlocked(arena, page_count);
+
+      if (page_offset != -1)
+      {
+        return arena.base_address + page_offset * ia32::page_size;
+      }
+    }
+
+    return nullptr;
+  }
+
+  void zero_list_push(std::atomic<zero_page_t*>& list, zero_page_t* page) noexcept
+  {
+    //
+    // Pages are removed from the zeroer lists only by exchanging the whole
+    // list, therefore this push doesn't suffer from the ABA problem.
+    //
+    auto head = list.load(std::memory_order_relaxed);
+
+    do
+    {
+      page->next = head;
+    } while (!list.compare_exchange_weak(head, page, std::memory_order_release, std::memory_order_relaxed));
+  }
+
+  void zeroer_return_unlocked(arena_t& arena, zero_page_t* page, bool zeroed) noexcept
+  {
+    //
+    // Returns pages taken from a zeroer list back to the page bitmap.
+    // Global lock must be held.
+    //
+    while (page)
+    {
+      const auto next = page->next;
+      const int page_offset = static_cast<int>((reinterpret_cast<uint8_t*>(page) - arena.base_address) / ia32::page_size);
+
+      if (zeroed)
+      {
+        //
+        // The link is the only non-zero data in the page.
+        //
+        page->next = nullptr;
+        arena.zeroed_page_map[page_offset] = 1;
+        zeroer_page_count += 1;
+      }
+
+      free_pages_unlocked(arena, page_offset, 1);
+      arena.zero_reserved_count -= 1;
+
+      page = next;
+    }
+  }
+
+  void zeroer_exchange_unlocked() noexcept
+  {
+    //
+    // Returns pages zeroed by zero_free_pages() back to the page bitmap
+    // and reserves another batch of free pages which aren't zeroed yet.
+    // Only one arena is handled per call, so that the cost of allocation
+    // paths calling this stays bounded. Global lock must be held.
+    //
+    const int count = arena_count.load(std::memory_order_acquire);
+    const int index = zeroer_arena_index < count ? zeroer_arena_index : 0;
+    zeroer_arena_index = (index + 1) % count;
+
+    auto& arena = arenas[index];
+
+    zeroer_return_unlocked(arena, arena.zero_done.exchange(nullptr, std::memory_order_acquire), true);
+
+#ifdef HVPP_ENABLE_BUDDY_ALLOCATOR
+    //
+    // Reserve the smallest free blocks - taking pages at fixed offsets
+    // would split large blocks page by page. The smallest free block is
+    // often a page which has just come back zeroed, there is nothing
+    // to do then.
+    //
+    for (int reserved = 0;
+         reserved < zeroer_batch_size && arena.zero_reserved_count < zeroer_reserve_max;
+         ++reserved)
+    {
+      const int current = buddy_allocate(arena, 1);
+
+      if (current < 0)
+      {
+        break;
+      }
+
+      if (arena.zeroed_page_map[current])
+      {
+        buddy_free_range(arena, current, 1);
+        break;
+      }
+
+      arena.page_bitmap->set(current);
+      zero_list_push(arena.zero_pending, reinterpret_cast<zero_page_t*>(arena.base_address + current * ia32::page_size));
+      arena.zero_reserved_count += 1;
+    }
+#else
+    const int page_total = arena.page_bitmap->size_in_bits();
+
+    //
+    // Pages are allocated right after the last allocated ones (see
+    // allocate_pages_unlocked()), therefore reserve pages a bit ahead of
+    // them - so that they are zeroed and back by the time allocations
+    // get there, and allocations don't have to skip reserved pages.
+    //
+    const int lead = (arena.zeroer_page_offset - arena.last_page_offset + page_total) % page_total;
+
+    if (lead < zeroer_reserve_max || lead > zeroer_lead_max)
+    {
+      arena.zeroer_page_offset = (arena.last_page_offset + zeroer_reserve_max) % page_total;
+    }
+
+    for (int i = 0, reserved = 0;
+         i < zeroer_scan_size && reserved < zeroer_batch_size && arena.zero_reserved_count < zeroer_reserve_max;
+         ++i)
+    {
+      const int current = arena.zeroer_page_offset;
+      arena.zeroer_page_offset = (arena.zeroer_page_offset + 1) % page_total;
+
+      if (!arena.zeroed_page_map[current] && take_free_page_unlocked(arena, current))
+      {
+        zero_list_push(arena.zero_pending, reinterpret_cast<zero_page_t*>(arena.base_address + current * ia32::page_size));
+        arena.zero_reserved_count += 1;
+        reserved += 1;
+      }
+    }
+#endif
+  }
+
+  void zeroer_reclaim_all_unlocked() noexcept
+  {
+    //
+    // Returns all pages of the zeroer lists back to the page bitmap (used
+    // when the memory runs out and on destroy()). Pages which are being
+    // zeroed right now come back through the zeroed list later.
+    // Global lock must be held.
+    //
+    const int count = arena_count.load(std::memory_order_acquire);
+
+    for (int i = 0; i < count; ++i)
+    {
+      auto& arena = arenas[i];
+
+      zeroer_return_unlocked(arena, arena.zero_pending.exchange(nullptr, std::memory_order_acquire), false);
+      zeroer_return_unlocked(arena, arena.zero_done.exchange(nullptr, std::memory_order_acquire), true);
+    }
+  }
+
+  void magazine_refill(magazine_t& magazine) noexcept
+  {
+    //
+    // Moves up to magazine_batch_size free pages from the page bitmap
+    // into the (empty) magazine. Magazine lock must be held.
+    //
+    std::lock_guard _(global_lock);
+    zeroer_exchange_unlocked();
+
+    while (magazine.count < magazine_batch_size)
+    {
+      const auto page = allocate_from_arenas_unlocked(1, ia32::page_size, false, false);
+
+      if (!page)
+      {
+        break;
+      }
+
+      magazine.page[magazine.count++] = page;
+    }
+  }
+
+  void magazine_drain(magazine_t& magazine, int count) noexcept
+  {
+    //
+    // Returns "count" pages from the top of the magazine back to the page
+    // bitmap of their arena. Magazine lock must be held.
+    //
+    std::lock_guard _(global_lock);
+
+    while (count-- > 0 && magazine.count > 0)
+    {
+      const auto page = magazine.page[--magazine.count];
+      auto& arena = *arena_from_address(page);
+
+      free_pages_unlocked(arena, static_cast<int>((page - arena.base_address) / ia32::page_size), 1);
+    }
+  }
+
+  void magazine_drain_all() noexcept
+  {
+    for (auto& magazine : magazines)
+    {
+      std::lock_guard _(magazine.lock);
+      magazine_drain(magazine, magazine.count);
+    }
+  }
+
+  void slab_unlink(slab_class_t& slab_class, slab_t* slab) noexcept
+  {
+    if (slab->previous) { slab->previous->next = slab->next; }
+    else                { slab_class.partial = slab->next;   }
+
+    if (slab->next)     { slab->next->previous = slab->previous; }
+
+    slab->next = nullptr;
+    slab->previous = nullptr;
+  }
+
+  void slab_link(slab_class_t& slab_class, slab_t* slab) noexcept
+  {
+    slab->previous = nullptr;
+    slab->next = slab_class.partial;
+
+    if (slab_class.partial) { slab_class.partial->previous = slab; }
+
+    slab_class.partial = slab;
+  }
+
+  void* allocate_pages(size_t size, size_t alignment, bool contiguous, bool zeroed) noexcept;
+
+  slab_t* slab_create(int size_class) noexcept
+  {
+    //
+    // Allocates a new slab page and threads all objects into its free
+    // list. Class lock must be held.
+    //
+    auto slab = reinterpret_cast<slab_t*>(allocate_pages(ia32::page_size, ia32::page_size, false, false));
+
+    if (!slab)
+    {
+      return nullptr;
+    }
+
+    const auto object_size = slab_classes[size_class].size;
+    const auto capacity = static_cast<uint16_t>(slab_data_size / object_size);
+
+    auto object = reinterpret_cast<uint8_t*>(slab + 1);
+    for (int i = 0; i < capacity - 1; ++i)
+    {
+      *reinterpret_cast<void**>(object + i * object_size) = object + (i + 1) * object_size;
+    }
+
+    *reinterpret_cast<void**>(object + (capacity - 1) * object_size) = nullptr;
+
+    slab->next = nullptr;
+    slab->previous = nullptr;
+    slab->free_list = object;
+    slab->used_count = 0;
+    slab->capacity = capacity;
+    slab->size_class = static_cast<uint8_t>(size_class);
+
+    return slab;
+  }
+
+  void* slab_allocate(int size_class) noexcept
+  {
+    auto& slab_class = slab_classes[size_class];
+    std::lock_guard _(slab_class.lock);
+
+    auto slab = slab_class.partial;
+
+    if (!slab)
+    {
+      slab = slab_create(size_class);
+
+      if (!slab)
+      {
+        return nullptr;
+      }
+
+      slab_link(slab_class, slab);
+      slab_class.page_count += 1;
+    }
+
+    auto object = slab->free_list;
+    slab->free_list = *reinterpret_cast<void**>(object);
+    slab->used_count += 1;
+
+    if (slab->used_count == slab->capacity)
+    {
+      slab_unlink(slab_class, slab);
+    }
+
+    slab_class.object_count += 1;
+
+    return object;
+  }
+
+  void slab_free(void* address) noexcept
+  {
+    auto slab = reinterpret_cast<slab_t*>(ia32::page_align(address));
+    auto arena = arena_from_address(slab);
+
+    if (!arena)
+    {
+      //
+      // We don't own this memory.
+      //
+      hvpp_assert(0);
+      return;
+    }
+
+    const int slab_offset = static_cast<int>(ia32::bytes_to_pages(reinterpret_cast<uint8_t*>(slab) - arena->base_address));
+    const auto object_offset = reinterpret_cast<uint8_t*>(address) - reinterpret_cast<uint8_t*>(slab + 1);
+
+    if (arena->page_allocation_map[slab_offset] != 1 ||
+        slab->size_class >= slab_class_count ||
+        object_offset < 0 ||
+        object_offset % slab_classes[slab->size_class].size != 0 ||
+        object_offset / slab_classes[slab->size_class].size >= slab->capacity)
+    {
+      //
+      // This is not an object allocated by allocate_small().
+      //
+      hvpp_assert(0);
+      return;
+    }
+
+    auto& slab_class = slab_classes[slab->size_class];
+    std::lock_guard _(slab_class.lock);
+
+    hvpp_assert(slab->used_count > 0);
+
+#ifdef HVPP_ENABLE_MM_POISONING
+    memset(address, 0xcc, slab_class.size);
+#endif
+
+    *reinterpret_cast<void**>(address) = slab->free_list;
+    slab->free_list = address;
+    slab->used_count -= 1;
+    slab_class.object_count -= 1;
+
+    if (slab->used_count + 1 == slab->capacity)
+    {
+      //
+      // The slab was full - make it available again.
+      //
+      slab_link(slab_class, slab);
+    }
+    else if (slab->used_count == 0 && (slab_class.partial != slab || slab->next))
+    {
+      //
+      // The slab is empty and it's not the only slab with free objects.
+      // Release it, but always keep the last one, so that allocating and
+      // freeing single object doesn't keep creating and releasing slabs.
+      // (Checking just for the first slab of the list isn't enough - slab
+      // which was full is linked first, so it would be kept too.)
+      //
+      slab_unlink(slab_class, slab);
+      slab_class.page_count -= 1;
+      free(slab);
+    }
+  }
+
+  void slab_release_all() noexcept
+  {
+    //
+    // Releases empty slabs kept by slab_free().
+    //
+    for (auto& slab_class : slab_classes)
+    {
+      std::lock_guard _(slab_class.lock);
+
+      auto slab = slab_class.partial;
+
+      while (slab)
+      {
+        auto next = slab->next;
+
+        if (slab->used_count == 0)
+        {
+          slab_unlink(slab_class, slab);
+          slab_class.page_count -= 1;
+          free(slab);
+        }
+
+        slab = next;
+      }
+    }
+  }
+
+  bool arena_initialize(arena_t& arena, void* address, size_t size) noexcept
+  {
+    //
+    // Carves metadata of the arena from the provided memory. The arena
+    // isn't visible to the rest of the memory manager yet.
+    //
+    if (size < ia32::page_size * 3)
+    {
+      //
+      // We need at least 3 pages (see explanation below).
+      //
+      hvpp_assert(0);
+      return false;
+    }
+
+    //
+    // If the provided address is not page aligned, align it to the next page.
+    //
+    if (ia32::byte_offset(address) != 0)
+    {
+      uint32_t lost_bytes = ia32::byte_offset(address);
+
+      address = reinterpret_cast<uint8_t*>(ia32::page_align(address)) + ia32::page_size;
+
+      //
+      // Subtract amount of "lost" bytes due to alignment.
+      //
+      size -= lost_bytes;
+    }
+
+    //
+    // Align size to the page boundary.
+    //
+    size = reinterpret_cast<size_t>(ia32::page_align(size));
+
+    //
+    // Check again.
+    //
+    if (size < ia32::page_size * 3)
+    {
+      hvpp_assert(0);
+      return false;
+    }
+
+    //
+    // Address is page-aligned, size is page-aligned, and all requirements are met.
+    // Proceed with initialization.
+    //
+
+    //
+    // Record physical layout of the provided memory first. Tables are stored
+    // at the beginning of the provided memory.
+    //
+    {
+      int chunk_count;
+      int not_contiguous_chunk_count;
+      int hash_table_size;
+
+      const auto pa_table_size = pa_layout_size(address, size, chunk_count, not_contiguous_chunk_count, hash_table_size);
+
+      if (size < pa_table_size + ia32::page_size * 3)
+      {
+        hvpp_assert(0);
+        return false;
+      }
+
+      pa_layout_initialize(arena, address, size, reinterpret_cast<uint8_t*>(address), chunk_count, hash_table_size);
+
+      address = reinterpret_cast<uint8_t*>(address) + pa_table_size;
+      size -= pa_table_size;
+    }
+
+    //
+    // The provided memory is split up to 4 parts:
+    //   1. page bitmap - stores information if page is allocated or not
+    //   2. page count  - stores information how many consecutive pages has been allocated
+    //   3. zeroed map  - stores information if page is known to be zeroed
+    //   4. memory pool - this is the memory which will be provided
+    //
+    // For (1), there is taken (size / PAGE_SIZE / 8) bytes from the provided memory space.
+    // For (2), there is taken (size / PAGE_SIZE * sizeof(pgmap_t)) bytes from the provided
+    // memory space. For (3), there is taken (size / PAGE_SIZE) bytes. The rest memory is
+    // used for (4). This should account for ~91% of the provided memory space (if it is
+    // big enough, e.g.: 32MB). Buddy allocator takes another (size / PAGE_SIZE * 9) bytes.
+    //
+
+    //
+    // Construct the page bitmap.
+    //
+    uint8_t* page_bitmap_buffer = reinterpret_cast<uint8_t*>(address);
+    arena.page_bitmap_buffer_size = static_cast<int>(ia32::round_to_pages(size / ia32::page_size / 8));
+    memset(page_bitmap_buffer, 0, arena.page_bitmap_buffer_size);
+
+    //
+    // Construct the page allocation map.
+    //
+    arena.page_allocation_map = reinterpret_cast<pgmap_t*>(page_bitmap_buffer + arena.page_bitmap_buffer_size);
+    arena.page_allocation_map_size = static_cast<int>(ia32::round_to_pages(size / ia32::page_size) * sizeof(pgmap_t));
+    memset(arena.page_allocation_map, 0, arena.page_allocation_map_size);
+
+    //
+    // Construct the zeroed page map.
+    //
+    arena.zeroed_page_map = reinterpret_cast<uint8_t*>(arena.page_allocation_map) + arena.page_allocation_map_size;
+    arena.zeroed_page_map_size = static_cast<int>(ia32::round_to_pages(size / ia32::page_size));
+    memset(arena.zeroed_page_map, 0, arena.zeroed_page_map_size);
+
+#ifdef HVPP_ENABLE_BUDDY_ALLOCATOR
+    //
+    // Construct the buddy order map.
+    //
+    arena.buddy_order_map = arena.zeroed_page_map + arena.zeroed_page_map_size;
+    arena.buddy_order_map_size = static_cast<int>(ia32::round_to_pages(size / ia32::page_size));
+    memset(arena.buddy_order_map, 0, arena.buddy_order_map_size);
+
+    //
+    // Construct the buddy link map (entries of used pages are never read,
+    // therefore it doesn't need to be initialized).
+    //
+    arena.buddy_link_map = reinterpret_cast<buddy_link_t*>(arena.buddy_order_map + arena.buddy_order_map_size);
+    arena.buddy_link_map_size = static_cast<int>(ia32::round_to_pages(size / ia32::page_size * sizeof(buddy_link_t)));
+
+    //
+    // Compute available memory.
+    //
+    arena.base_address = reinterpret_cast<uint8_t*>(arena.buddy_link_map) + arena.buddy_link_map_size;
+    arena.available_size = size
+      - arena.page_bitmap_buffer_size
+      - arena.page_allocation_map_size
+      - arena.zeroed_page_map_size
+      - arena.buddy_order_map_size
+      - arena.buddy_link_map_size;
+#else
+    //
+    // Compute available memory.
+    //
+    arena.base_address = arena.zeroed_page_map + arena.zeroed_page_map_size;
+    arena.available_size = size
+      - arena.page_bitmap_buffer_size
+      - arena.page_allocation_map_size
+      - arena.zeroed_page_map_size;
+#endif
+
+    //
+    // The bitmap buffer is rounded up to whole pages, but only the bits
+    // covering the memory pool may be used - otherwise allocations could
+    // return addresses past the end of the pool.
+    //
+    arena.page_bitmap.initialize(page_bitmap_buffer, static_cast<int>(arena.available_size / ia32::page_size));
+
+    //
+    // Note that the memory pool itself is not touched here - it is zeroed
+    // in the background by zero_free_pages() and (optionally) poisoned
+    // when it's freed.
+    //
+
+#ifdef HVPP_ENABLE_BUDDY_ALLOCATOR
+    //
+    // Put the whole pool into the buddy free lists.
+    //
+    buddy_initialize(arena, static_cast<int>(arena.available_size / ia32::page_size));
+#endif
+
+    arena.last_page_offset = 0;
+    arena.zeroer_page_offset = 0;
+    arena.zero_pending = nullptr;
+    arena.zero_done = nullptr;
+    arena.zero_reserved_count = 0;
+    arena.allocated_bytes = 0;
+    arena.allocation_count = 0;
+
+    return true;
+  }
+
+  void arena_destroy(arena_t& arena) noexcept
+  {
+    //
+    // Checks for memory leaks.
+    //
+    hvpp_assert(arena.page_bitmap->all_clear());
+
+    //
+    // Checks for allocator corruption.
+    //
+    hvpp_assert(std::all_of(
+      arena.page_allocation_map,
+      arena.page_allocation_map + arena.page_allocation_map_size / sizeof(pgmap_t),
+      [](auto page_count) { return page_count == 0; }));
+
+    arena.base_address = nullptr;
+    arena.available_size = 0;
+
+    arena.page_bitmap.destroy();
+    arena.page_bitmap_buffer_size = 0;
+
+    arena.page_allocation_map = nullptr;
+    arena.page_allocation_map_size = 0;
+
+    arena.zeroed_page_map = nullptr;
+    arena.zeroed_page_map_size = 0;
+
+    arena.pa_region_base = nullptr;
+    arena.pa_region_begin = nullptr;
+    arena.pa_region_end = nullptr;
+    arena.pa_chunk_table = nullptr;
+    arena.pa_chunk_count = 0;
+    arena.pa_page_table = nullptr;
+    arena.pa_hash_table = nullptr;
+    arena.pa_hash_table_size = 0;
+
+    arena.last_page_offset = 0;
+    arena.zero_pending = nullptr;
+    arena.zero_done = nullptr;
+    arena.zero_reserved_count = 0;
+    arena.allocated_bytes = 0;
+  }
+
+  void initialize(void* address, size_t size) noexcept
+  {
+    const auto initialize_begin = ia32_asm_read_tsc();
+
+    if (!arena_initialize(arenas[0], address, size))
+    {
+      return;
+    }
+
+    arena_count = 1;
+    arena_watermark = 0;
+
+    //
+    // Set initial values of allocated/free bytes.
+    //
+    number_of_allocated_bytes = 0;
+    number_of_free_bytes = arenas[0].available_size;
+
+    for (auto& magazine : magazines)
+    {
+      magazine.count = 0;
+      magazine.allocation_count = 0;
+      magazine.free_count = 0;
+      magazine.root_mode = false;
+    }
+
+    for (auto& slab_class : slab_classes)
+    {
+      slab_class.partial = nullptr;
+      slab_class.page_count = 0;
+      slab_class.object_count = 0;
+    }
+
+    global_allocation_count = 0;
+    global_free_count = 0;
+    global_lock_count = 0;
+    global_lock_contention_count = 0;
+    global_lock_wait_cycles = 0;
+
+    zeroer_arena_index = 0;
+    zeroer_page_count = 0;
+    zeroed_hit_count = 0;
+    zeroed_miss_count = 0;
+
+    failed_allocation_count = 0;
+    low_memory_root_allocation_count = 0;
+
+#ifdef HVPP_ENABLE_MM_PROFILER
+    memset(profiler_sites, 0, sizeof(profiler_sites));
+    memset(profiler_allocations, 0, sizeof(profiler_allocations));
+    profiler_site_count = 0;
+    profiler_allocation_count = 0;
+    profiler_dropped_count = 0;
+    profiler_peak_allocated_bytes = 0;
+    profiler_root_allocation_count = 0;
+#endif
+
+    //
+    // Initialize physical memory descriptor and MTRRs.
+    //
+    lock.initialize();
+    memory_descriptor.initialize();
+    memory_type_range_registers.initialize();
+    current_mtrr = &*memory_type_range_registers;
+    mtrr_snapshots = nullptr;
+
+    //
+    // Let pa_t/va() translate memory of the arenas without calling the OS.
+    //
+    ia32::detail::set_address_translator(&address_translator);
+
+    initialize_cycles = ia32_asm_read_tsc() - initialize_begin;
+  }
+
+  bool add_arena(void* address, size_t size) noexcept
+  {
+    const int index = arena_count.load(std::memory_order_relaxed);
+
+    if (index == 0 || index == max_arena_count)
+    {
+      hvpp_assert(index != 0);
+      return false;
+    }
+
+    //
+    // Nobody else can see the arena until it's published below, therefore
+    // it's initialized without holding any lock. Global lock must not be
+    // taken here - add_arena() runs at passive level and VM-exit handlers
+    // or IPI callbacks which interrupt it would deadlock on it.
+    //
+    if (!arena_initialize(arenas[index], address, size))
+    {
+      return false;
+    }
+
+    arena_count.store(index + 1, std::memory_order_release);
+    number_of_free_bytes += arenas[index].available_size;
+
+    return true;
+  }
+
+  void destroy() noexcept
+  {
+    //
+    // Destroy all objects. Note that this method doesn't lock and assumes
+    // all allocations has been already freed.
+    //
+    ia32::detail::set_address_translator(nullptr);
+
+    while (mtrr_snapshots)
+    {
+      auto previous = mtrr_snapshots->previous;
+      delete mtrr_snapshots;
+      mtrr_snapshots = previous;
+    }
+
+    current_mtrr = nullptr;
+    memory_type_range_registers.destroy();
+    memory_descriptor.destroy();
+
+    //
+    // Release empty slabs and return cached pages to the page bitmap before
+    // checking for leaks.
+    //
+    slab_release_all();
+    magazine_drain_all();
+    zeroer_reclaim_all_unlocked();
+    lock.destroy();
+
+    for (int i = 0; i < arena_count; ++i)
+    {
+      arena_destroy(arenas[i]);
+    }
+
+    arena_count = 0;
+    arena_watermark = 0;
+
+    number_of_allocated_bytes = 0;
+    number_of_free_bytes = 0;
+  }
+
+  void* allocate_pages(size_t size, size_t alignment, bool contiguous, bool zeroed) noexcept
+  {
+    hvpp_assert(arena_count > 0);
+
+    //
+    // Return at least 1 page, even if someone required 0.
+    //
+    if (size == 0)
+    {
+      hvpp_assert(0);
+      size = 1;
+    }
+
+    int page_count = static_cast<int>(ia32::bytes_to_pages(size));
+
+    //
+    // Check if the desired number of pages can fit into the allocation map.
+    //
+    if (page_count > std::numeric_limits<pgmap_t>::max() - 1)
+    {
+      hvpp_assert(0);
+      return nullptr;
+    }
+
+    //
+    // Single page is always page-aligned and physically contiguous.
+    //
+    const bool aligned = (alignment > ia32::page_size) || (contiguous && page_count > 1);
+
+    uint8_t* address = nullptr;
+
+    if (page_count == 1 && !aligned)
+    {
+      //
+      // Fast path - take the page from the magazine of the current CPU.
+      //
+      auto& magazine = current_magazine();
+      std::lock_guard _(magazine.lock);
+
+      if (magazine.count == 0)
+      {
+        magazine_refill(magazine);
+      }
+
+      if (magazine.count > 0)
+      {
+        address = magazine.page[--magazine.count];
+        magazine.allocation_count += 1;
+      }
+    }
+
+    if (!address)
+    {
+      std::lock_guard _(global_lock);
+      zeroer_exchange_unlocked();
+      address = allocate_from_arenas_unlocked(page_count, alignment, contiguous, aligned);
+      global_allocation_count += address != nullptr;
+    }
+
+    if (!address)
+    {
+      //
+      // Free pages might be sitting in magazines of other CPUs or in the
+      // zeroer lists. Return them to the page bitmap and try again.
+      //
+      magazine_drain_all();
+
+      std::lock_guard _(global_lock);
+      zeroer_reclaim_all_unlocked();
+      address = allocate_from_arenas_unlocked(page_count, alignment, contiguous, aligned);
+
+      if (!address)
+      {
+        //
+        // Not enough memory...
+        //
+        failed_allocation_count += 1;
+        hvpp_assert(0);
+        return nullptr;
+      }
+
+      global_allocation_count += 1;
+    }
+
+    auto& arena = *arena_from_address(address);
+    const int page_offset = static_cast<int>((address - arena.base_address) / ia32::page_size);
+
+    //
+    // Pages are already marked in the bitmap, therefore nobody else can
+    // touch this entry of the page allocation map - no lock is needed.
+    //
+    arena.page_allocation_map[page_offset] = static_cast<pgmap_t>(page_count);
+    arena.allocated_bytes += page_count * ia32::page_size;
+    arena.allocation_count += 1;
+
+    number_of_allocated_bytes += page_count * ia32::page_size;
+    number_of_free_bytes      -= page_count * ia32::page_size;
+
+    if (number_of_free_bytes < arena_watermark && current_magazine().root_mode)
+    {
+      //
+      // New arena can be added only at passive level - if the memory runs
+      // out before that happens, allocations in VM-exit handlers will fail.
+      //
+      low_memory_root_allocation_count += 1;
+    }
+
+    if (zeroed)
+    {
+      int miss_count = 0;
+
+      for (int i = 0; i < page_count; ++i)
+      {
+        const auto page = address + i * ia32::page_size;
+
+        if (!arena.zeroed_page_map[page_offset + i])
+        {
+          memset(page, 0, ia32::page_size);
+          miss_count += 1;
+        }
+      }
+
+      zeroed_hit_count += page_count - miss_count;
+      zeroed_miss_count += miss_count;
+    }
+
+    //
+    // The caller owns the pages now and may write into them.
+    //
+    memset(arena.zeroed_page_map + page_offset, 0, page_count);
+
+    return address;
+  }
+
+  void* allocate_pages(size_t size, size_t alignment, bool contiguous, bool zeroed, void* caller) noexcept
+  {
+#ifdef HVPP_ENABLE_MM_PROFILER
+    const auto begin = ia32_asm_read_tsc();
+    const auto address = allocate_pages(size, alignment, contiguous, zeroed);
+
+    if (address)
+    {
+      profile_allocate(address, size, caller, ia32_asm_read_tsc() - begin);
+    }
+
+    return address;
+#else
+    (void)(caller);
+    return allocate_pages(size, alignment, contiguous, zeroed);
+#endif
+  }
+
+  void* slab_allocate(int size_class, size_t size, void* caller) noexcept
+  {
+#ifdef HVPP_ENABLE_MM_PROFILER
+    const auto begin = ia32_asm_read_tsc();
+    const auto object = slab_allocate(size_class);
+
+    if (object)
+    {
+      profile_allocate(object, size, caller, ia32_asm_read_tsc() - begin);
+    }
+
+    return object;
+#else
+    (void)(size);
+    (void)(caller);
+    return slab_allocate(size_class);
+#endif
+  }
+
+  void* allocate(size_t size) noexcept
+  {
+    return allocate_pages(size, ia32::page_size, false, false, _ReturnAddress());
+  }
+
+  void* allocate_zeroed(size_t size) noexcept
+  {
+    return allocate_pages(size, ia32::page_size, false, true, _ReturnAddress());
+  }
+
+  void* allocate_aligned(size_t size, size_t alignment, bool contiguous, void* caller) noexcept
+  {
+    if (alignment & (alignment - 1) || alignment > max_alignment)
+    {
+      //
+      // Alignment must be power of 2 and at most 2MB.
+      //
+      hvpp_assert(0);
+      return nullptr;
+    }
+
+    alignment = std::max<size_t>(alignment, min_alignment);
+
+    if (alignment <= 64)
+    {
+      //
+      // Objects of a slab lie within single page, therefore they are
+      // physically contiguous. Object at offset (sizeof(slab_t) + i * size)
+      // is aligned if the class size is multiple of the alignment.
+      //
+      for (int size_class = 0; size_class < slab_class_count; ++size_class)
+      {
+        if (size <= slab_classes[size_class].size &&
+            slab_classes[size_class].size % alignment == 0)
+        {
+          return slab_allocate(size_class, size, caller);
+        }
+      }
+    }
+
+    return allocate_pages(size, std::max<size_t>(alignment, ia32::page_size), contiguous, false, caller);
+  }
+
+  void* allocate_aligned(size_t size, size_t alignment, bool contiguous) noexcept
+  {
+    return allocate_aligned(size, alignment, contiguous, _ReturnAddress());
+  }
+
+  void* allocate_small(size_t size, void* caller) noexcept
+  {
+    for (int size_class = 0; size_class < slab_class_count; ++size_class)
+    {
+      if (size <= slab_classes[size_class].size)
+      {
+        return slab_allocate(size_class, size, caller);
+      }
+    }
+
+    return allocate_pages(size, ia32::page_size, false, false, caller);
+  }
+
+  void* allocate_small(size_t size) noexcept
+  {
+    return allocate_small(size, _ReturnAddress());
+  }
+
+  void free(void* address) noexcept
+  {
+#ifdef HVPP_ENABLE_MM_PROFILER
+    profile_free(address);
+#endif
+
+    //
+    // Page allocations are always page-aligned, slab objects never are.
+    //
+    if (ia32::byte_offset(address) != 0)
+    {
+      slab_free(address);
+      return;
+    }
+
+    auto arena = arena_from_address(address);
+
+    if (!arena)
+    {
+      //
+      // We don't own this memory.
+      //
+      hvpp_assert(0);
+      return;
+    }
+
+    int offset = static_cast<int>(ia32::bytes_to_pages(reinterpret_cast<uint8_t*>(address) - arena->base_address));
+
+    //
+    // The entry of the page allocation map belongs to the caller until
+    // the pages are released below.
+    //
+    int page_count = arena->page_allocation_map[offset];
+
+    if (page_count == 0)
+    {
+      //
+      // This memory wasn't allocated.
+      //
+      hvpp_assert(0);
+      return;
+    }
+
+#ifdef HVPP_ENABLE_MM_POISONING
+    memset(address, 0xcc, page_count * ia32::page_size);
+#endif
+
+    //
+    // Clear number of allocated pages.
+    //
+    arena->page_allocation_map[offset] = 0;
+    arena->allocated_bytes -= page_count * ia32::page_size;
+
+    number_of_allocated_bytes -= page_count * ia32::page_size;
+    number_of_free_bytes      += page_count * ia32::page_size;
+
+    if (page_count == 1)
+    {
+      //
+      // Fast path - put the page into the magazine of the current CPU.
+      // If the magazine is full, return half of it to the page bitmap
+      // first.
+      //
+      auto& magazine = current_magazine();
+      std::lock_guard _(magazine.lock);
+
+      if (magazine.count == magazine_size)
+      {
+        magazine_drain(magazine, magazine_batch_size);
+      }
+
+      magazine.page[magazine.count++] = reinterpret_cast<uint8_t*>(address);
+      magazine.free_count += 1;
+      return;
+    }
+
+    //
+    // Clear pages in the bitmap.
+    //
+    std::lock_guard _(global_lock);
+    free_pages_unlocked(*arena, offset, page_count);
+    global_free_count += 1;
+  }
+
+  int zero_free_pages(arena_t& arena, int max_page_count) noexcept
+  {
+    //
+    // Takes the whole list of reserved pages - nobody else can see them
+    // until they're pushed onto the zeroed list, therefore no lock is
+    // needed (see zeroer_exchange_unlocked()).
+    //
+    auto page = arena.zero_pending.exchange(nullptr, std::memory_order_acquire);
+
+    int result = 0;
+
+    while (page && result < max_page_count)
+    {
+      const auto next = page->next;
+
+      memset(page, 0, ia32::page_size);
+      zero_list_push(arena.zero_done, page);
+
+      page = next;
+      result += 1;
+    }
+
+    //
+    // Put back pages over the limit.
+    //
+    while (page)
+    {
+      const auto next = page->next;
+      zero_list_push(arena.zero_pending, page);
+      page = next;
+    }
+
+    return result;
+  }
+
+  int zero_free_pages(int max_page_count) noexcept
+  {
+    int result = 0;
+
+    for (int i = 0; i < arena_count.load(std::memory_order_acquire) && result < max_page_count; ++i)
+    {
+      result += zero_free_pages(arenas[i], max_page_count - result);
+    }
+
+    return result;
+  }
+
+  bool pa_from_va(const void* va, uint64_t& pa) noexcept
+  {
+    const auto address = reinterpret_cast<const uint8_t*>(va);
+    const int count = arena_count.load(std::memory_order_acquire);
+
+    for (int i = 0; i < count; ++i)
+    {
+      const auto& arena = arenas[i];
+
+      if (address >= arena.pa_region_begin && address < arena.pa_region_end)
+      {
+        const int page_index = static_cast<int>((address - arena.pa_region_base) / ia32::page_size);
+        pa = pa_of_page(arena, page_index) + ia32::byte_offset(va);
+
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  void* va_from_pa(uint64_t pa) noexcept
+  {
+    const auto pfn = pa >> ia32::page_shift;
+    const int count = arena_count.load(std::memory_order_acquire);
+
+    for (int i = 0; i < count; ++i)
+    {
+      const auto& arena = arenas[i];
+
+      for (auto slot = pa_hash(pfn); ; ++slot)
+      {
+        const auto entry = arena.pa_hash_table[slot & (arena.pa_hash_table_size - 1)];
+
+        if (!entry)
+        {
+          break;
+        }
+
+        if ((pa_of_page(arena, entry - 1) >> ia32::page_shift) == pfn)
+        {
+          return arena.pa_region_base + (entry - 1) * ia32::page_size + ia32::byte_offset(pa);
+        }
+      }
+    }
+
+    return nullptr;
+  }
+
+  size_t allocated_bytes() noexcept
+  {
+    return number_of_allocated_bytes;
+  }
+
+  size_t free_bytes() noexcept
+  {
+    return number_of_free_bytes;
+  }
+
+  statistics_t statistics() noexcept
+  {
+    statistics_t result{};
+
+    for (auto& magazine : magazines)
+    {
+      std::lock_guard _(magazine.lock);
+      result.cached_page_count     += magazine.count;
+      result.allocation_count      += magazine.allocation_count;
+      result.free_count            += magazine.free_count;
+      result.fast_allocation_count += magazine.allocation_count;
+      result.fast_free_count       += magazine.free_count;
+    }
+
+    for (auto& slab_class : slab_classes)
+    {
+      std::lock_guard _(slab_class.lock);
+      result.slab_page_count   += slab_class.page_count;
+      result.slab_object_count += slab_class.object_count;
+    }
+
+    //
+    // Read the global counters directly (not through global_lock), so that
+    // querying statistics doesn't show up in them.
+    //
+    std::lock_guard _(*lock);
+
+    for (int i = 0; i < arena_count; ++i)
+    {
+      result.largest_free_page_count = std::max<uint64_t>(
+        result.largest_free_page_count,
+        largest_free_page_count_unlocked(arenas[i]));
+    }
+
+    result.allocation_count     += global_allocation_count;
+    result.free_count           += global_free_count;
+    result.lock_count            = global_lock_count;
+    result.lock_contention_count = global_lock_contention_count;
+    result.lock_wait_cycles      = global_lock_wait_cycles;
+    result.zeroer_page_count     = zeroer_page_count;
+    result.zeroed_hit_count      = zeroed_hit_count;
+    result.zeroed_miss_count     = zeroed_miss_count;
+    result.initialize_cycles     = initialize_cycles;
+    result.arena_count           = arena_count;
+    result.failed_allocation_count = failed_allocation_count;
+    result.low_memory_root_allocation_count = low_memory_root_allocation_count;
+
+#ifdef HVPP_ENABLE_MM_PROFILER
+    {
+      std::lock_guard profiler_guard(profiler_lock);
+      result.peak_allocated_bytes  = profiler_peak_allocated_bytes;
+      result.root_allocation_count = profiler_root_allocation_count;
+    }
+#endif
+
+    return result;
+  }
+
+  size_t profile_dump(void* buffer, size_t buffer_size) noexcept
+  {
+#ifdef HVPP_ENABLE_MM_PROFILER
+    std::lock_guard _(profiler_lock);
+
+    const size_t required_size = sizeof(profile_header_t)
+      + profiler_site_count       * sizeof(profile_site_t)
+      + profiler_allocation_count * sizeof(profile_allocation_t);
+
+    if (!buffer || buffer_size < required_size)
+    {
+      return required_size;
+    }
+
+    auto header = reinterpret_cast<profile_header_t*>(buffer);
+    header->magic                 = profile_magic;
+    header->version               = profile_version;
+    header->site_count            = static_cast<uint16_t>(profiler_site_count);
+    header->allocation_count      = static_cast<uint32_t>(profiler_allocation_count);
+    header->dropped_count         = profiler_dropped_count;
+    header->peak_allocated_bytes  = profiler_peak_allocated_bytes;
+    header->root_allocation_count = profiler_root_allocation_count;
+
+    auto site = reinterpret_cast<profile_site_t*>(header + 1);
+    for (auto& current : profiler_sites)
+    {
+      if (current.caller)
+      {
+        *site++ = current;
+      }
+    }
+
+    auto allocation = reinterpret_cast<profile_allocation_t*>(site);
+    for (auto& current : profiler_allocations)
+    {
+      if (current.address)
+      {
+        *allocation++ = current;
+      }
+    }
+
+    return required_size;
+#else
+    (void)(buffer);
+    (void)(buffer_size);
+    return 0;
+#endif
+  }
+
+  arena_statistics_t arena_statistics(int index) noexcept
+  {
+    arena_statistics_t result{};
+
+    if (index < 0 || index >= arena_count.load(std::memory_order_acquire))
+    {
+      return result;
+    }
+
+    auto& arena = arenas[index];
+
+    std::lock_guard _(*lock);
+    result.base_address            = arena.base_address;
+    result.size                    = arena.available_size;
+    result.allocated_bytes         = arena.allocated_bytes;
+    result.allocation_count        = arena.allocation_count;
+    result.largest_free_page_count = largest_free_page_count_unlocked(arena);
+
+    return result;
+  }
+
+  void set_arena_watermark(size_t free_bytes) noexcept
+  {
+    arena_watermark = free_bytes;
+  }
+
+  bool arena_needed() noexcept
+  {
+    return number_of_free_bytes < arena_watermark &&
+           arena_count < max_arena_count;
+  }
+
+  void set_root_mode(bool root_mode) noexcept
+  {
+    current_magazine().root_mode = root_mode;
+  }
+
+  const ia32::physical_memory_descriptor& physical_memory_descriptor() noexcept
+  {
+    return *memory_descriptor;
+  }
+
+  const ia32::mtrr& mtrr() noexcept
+  {
+    return *current_mtrr.load(std::memory_order_acquire);
+  }
+
+  bool update_mtrr() noexcept
+  {
+    auto snapshot = new mtrr_snapshot_t;
+
+    if (!snapshot)
+    {
+      return false;
+    }
+
+    const ia32::mtrr* existing = nullptr;
+
+    if (memory_type_range_registers->same_types(snapshot->mtrr))
+    {
+      existing = &*memory_type_range_registers;
+    }
+
+    for (auto it = mtrr_snapshots; it && !existing; it = it->previous)
+    {
+      if (it->mtrr.same_types(snapshot->mtrr))
+      {
+        existing = &it->mtrr;
+      }
+    }
+
+    if (existing)
+    {
+      delete snapshot;
+
+      if (existing == &mtrr())
+      {
+        return false;
+      }
+
+      current_mtrr.store(existing, std::memory_order_release);
+      return true;
+    }
+
+    snapshot->previous = mtrr_snapshots;
+    mtrr_snapshots = snapshot;
+
+    current_mtrr.store(&snapshot->mtrr, std::memory_order_release);
+    return true;
   }
 }
 
-void* operator new  (size_t size)                                    { return memory_manager::allocate(size); }
-void* operator new[](size_t size)                                    { return memory_manager::allocate(size); }
-void* operator new  (size_t size, std::align_val_t)                  { return memory_manager::allocate(size); }
-void* operator new[](size_t size, std::align_val_t)                  { return memory_manager::allocate(size); }
+void* operator new  (size_t size)                                    { return memory_manager::allocate_small(size, _ReturnAddress()); }
+void* operator new[](size_t size)                                    { return memory_manager::allocate_small(size, _ReturnAddress()); }
+void* operator new  (size_t size, std::align_val_t alignment)        { return memory_manager::allocate_aligned(size, static_cast<size_t>(alignment), false, _ReturnAddress()); }
+void* operator new[](size_t size, std::align_val_t alignment)        { return memory_manager::allocate_aligned(size, static_cast<size_t>(alignment), false, _ReturnAddress()); }
 
 void operator delete  (void* address)                                { memory_manager::free(address); }
 void operator delete[](void* address)                                { memory_manager::free(address); }
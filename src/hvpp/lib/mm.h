@@ -7,12 +7,201 @@ namespace memory_manager
   void initialize(void* base_address, size_t size) noexcept;
   void destroy() noexcept;
 
+  //
+  // Memory provided to initialize() is the first arena. More arenas can
+  // be added by add_arena() - allocations try arenas in the order they
+  // were added. Arenas are returned only by destroy(), after which the
+  // caller is responsible for releasing their memory.
+  //
+  // Arenas can't be allocated in VM-exit handlers, therefore they should
+  // be added in advance - arena_needed() returns true when free memory
+  // drops below the watermark set by set_arena_watermark(). It's meant to
+  // be polled by a thread at passive level. add_arena() must be called at
+  // passive level and the caller is responsible for its serialization.
+  //
+  static constexpr int max_arena_count = 16;
+
+  bool add_arena(void* base_address, size_t size) noexcept;
+  bool arena_needed() noexcept;
+  void set_arena_watermark(size_t free_bytes) noexcept;
+
   void* allocate(size_t size) noexcept;
+
+  //
+  // Same as allocate(), but the memory is zeroed. Pages zeroed in advance
+  // by zero_free_pages() are not zeroed again.
+  //
+  void* allocate_zeroed(size_t size) noexcept;
+
+  //
+  // Allocates memory aligned to "alignment" (power of 2, from 16 bytes
+  // up to 2MB). If "contiguous" is set, the memory is also physically
+  // contiguous and its physical address has the same alignment (e.g.:
+  // for buffers which should be mapped by large pages). Used by the
+  // aligned variants of the global operator new.
+  //
+  static constexpr size_t min_alignment = 16;
+  static constexpr size_t max_alignment = 2 * 1024 * 1024;
+
+  void* allocate_aligned(size_t size, size_t alignment, bool contiguous = false) noexcept;
+
+  //
+  // Allocates small object (up to 1984 bytes) from size-class slabs.
+  // Objects are at least 16-byte aligned (cache-line aligned for sizes
+  // of 64 bytes and more), but never page-aligned. Bigger sizes are
+  // forwarded to allocate(). Used by the global operator new.
+  //
+  void* allocate_small(size_t size) noexcept;
+
+  //
+  // Frees memory returned by allocate(), allocate_aligned() or
+  // allocate_small().
+  //
   void free(void* address) noexcept;
 
   size_t allocated_bytes() noexcept;
   size_t free_bytes() noexcept;
 
+  //
+  // Allocator statistics. Single-page allocations are served from per-CPU
+  // magazines ("fast" counts) and touch the global lock only on magazine
+  // refill/drain. Divide lock_count by allocation_count + free_count
+  // to get number of global lock acquisitions per operation.
+  //
+  struct statistics_t
+  {
+    uint64_t allocation_count;              // Total number of allocations
+    uint64_t free_count;                    // Total number of frees
+    uint64_t fast_allocation_count;         // ... served by per-CPU magazines
+    uint64_t fast_free_count;               // ... served by per-CPU magazines
+    uint64_t cached_page_count;             // Free pages held by magazines
+    uint64_t lock_count;                    // Global lock acquisitions
+    uint64_t lock_contention_count;         // ... which had to wait
+    uint64_t lock_wait_cycles;              // TSC cycles spent waiting
+    uint64_t slab_page_count;               // Pages used by slabs
+    uint64_t slab_object_count;             // Objects allocated from slabs
+    uint64_t largest_free_page_count;       // Largest allocation which can succeed
+    uint64_t zeroer_page_count;             // Pages zeroed by zero_free_pages()
+    uint64_t zeroed_hit_count;              // Pages of allocate_zeroed() zeroed in advance
+    uint64_t zeroed_miss_count;             // Pages of allocate_zeroed() zeroed on the spot
+    uint64_t initialize_cycles;             // TSC cycles spent in initialize()
+    uint64_t arena_count;                   // Number of arenas
+    uint64_t failed_allocation_count;       // Allocations which returned nullptr
+    uint64_t low_memory_root_allocation_count; // Root mode allocations made below the watermark
+    uint64_t peak_allocated_bytes;          // High-water mark of allocated_bytes() (profiler only)
+    uint64_t root_allocation_count;         // Allocations made in VM-exit handlers (profiler only)
+  };
+
+  statistics_t statistics() noexcept;
+
+  struct arena_statistics_t
+  {
+    void*    base_address;                  // First page of the pool
+    uint64_t size;                          // Size of the pool (without metadata)
+    uint64_t allocated_bytes;               // Allocated bytes (without pages cached by magazines)
+    uint64_t allocation_count;              // Total number of allocations
+    uint64_t largest_free_page_count;       // Largest allocation which can succeed
+  };
+
+  arena_statistics_t arena_statistics(int index) noexcept;
+
+  //
+  // Marks the current CPU as running VM-exit handler (VMX-root mode).
+  // Used only for statistics (see low_memory_root_allocation_count and
+  // the allocation profiler).
+  //
+  void set_root_mode(bool root_mode) noexcept;
+
+  //
+  // Allocation profiler (HVPP_ENABLE_MM_PROFILER). Each allocation is
+  // tagged with the caller address, requested size, CPU and context in
+  // which it was made. Profiler keeps table of live allocations and
+  // per-call-site accounting (including high-water mark of live bytes
+  // and worst allocation time). Allocations made in VM-exit handlers
+  // (root context) are counted separately.
+  //
+  // profile_dump() writes profile_header_t, followed by site_count of
+  // profile_site_t and allocation_count of profile_allocation_t. It
+  // returns number of written bytes - or required size of the buffer
+  // (without writing anything), if the buffer is too small. Returns 0
+  // if the profiler is disabled.
+  //
+  enum class allocation_context : uint8_t
+  {
+    passive,
+    dispatch,
+    ipi,
+    root,                                   // VM-exit handler
+    count,
+  };
+
+  static constexpr uint32_t profile_magic   = 'pmvh';
+  static constexpr uint16_t profile_version = 1;
+
+  struct profile_header_t
+  {
+    uint32_t magic;                         // profile_magic
+    uint16_t version;                       // profile_version
+    uint16_t site_count;                    // Number of profile_site_t records
+    uint32_t allocation_count;              // Number of profile_allocation_t records
+    uint32_t dropped_count;                 // Allocations which didn't fit into the tables
+    uint64_t peak_allocated_bytes;          // High-water mark of allocated_bytes()
+    uint64_t root_allocation_count;         // Allocations made in VM-exit handlers
+  };
+
+  struct profile_site_t
+  {
+    uint64_t caller;                        // Return address of the allocation
+    uint64_t allocation_count;              // Total number of allocations
+    uint64_t live_count;                    // Number of live allocations
+    uint64_t live_bytes;                    // Requested bytes of live allocations
+    uint64_t peak_live_bytes;               // High-water mark of live_bytes
+    uint64_t max_cycles;                    // Slowest allocation (TSC cycles)
+    uint64_t context_count[static_cast<int>(allocation_context::count)];
+  };
+
+  struct profile_allocation_t
+  {
+    uint64_t address;
+    uint64_t caller;
+    uint32_t size;                          // Requested size
+    uint16_t cpu;
+    allocation_context context;
+    uint8_t  reserved;
+  };
+
+  static_assert(sizeof(profile_header_t) == 32);
+  static_assert(sizeof(profile_allocation_t) == 24);
+
+  size_t profile_dump(void* buffer, size_t buffer_size) noexcept;
+
+  //
+  // Zeroes up to max_page_count free pages, so that allocate_zeroed()
+  // doesn't have to. Should be called periodically from a low-priority
+  // thread. Zeroes only pages reserved by preceding allocations and takes
+  // no lock, therefore VM-exit handlers and IPI callbacks which interrupt
+  // it can still allocate. Returns number of zeroed pages (0 if there was
+  // nothing to zero).
+  //
+  int zero_free_pages(int max_page_count) noexcept;
+
+  //
+  // Translate addresses of memory of the arenas using tables built when
+  // the arena was added. Can be called at any IRQL and in VMX-root
+  // mode. pa_from_va() returns false and va_from_pa() returns nullptr
+  // if the address doesn't belong to this memory.
+  //
+  bool pa_from_va(const void* va, uint64_t& pa) noexcept;
+  void* va_from_pa(uint64_t pa) noexcept;
+
   const ia32::physical_memory_descriptor& physical_memory_descriptor() noexcept;
   const ia32::mtrr& mtrr() noexcept;
+
+  //
+  // Re-reads MTRRs of the current processor and publishes them (for mtrr())
+  // if any memory type changed. Returns true if so. Concurrent calls have
+  // to be serialized by the caller, readers of mtrr() don't have to be -
+  // the reference returned by mtrr() stays valid until destroy().
+  //
+  bool update_mtrr() noexcept;
 }
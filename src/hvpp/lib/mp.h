@@ -1,6 +1,21 @@
 #pragma once
 #include <cstdint>
 
+namespace mp {
+
+//
+// Context in which the current CPU is running (IRQL on Windows).
+// Callbacks of ipi_call() run in the "ipi" context.
+//
+enum class context_t : uint8_t
+{
+  passive,
+  dispatch,
+  ipi,
+};
+
+}
+
 #include "win32/mp.h"
 
 //
@@ -14,6 +29,11 @@ inline uint32_t cpu_index() noexcept
   return detail::cpu_index();
 }
 
+inline context_t context() noexcept
+{
+  return detail::context();
+}
+
 inline void sleep(uint32_t milliseconds) noexcept
 {
   detail::sleep(milliseconds);
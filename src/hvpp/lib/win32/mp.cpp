@@ -1,4 +1,5 @@
 #include "mp.h"
+#include "lib/mp.h"
 
 #include <cstdint>
 
@@ -11,6 +12,15 @@ uint32_t cpu_index() noexcept
   return KeGetCurrentProcessorNumberEx(NULL);
 }
 
+context_t context() noexcept
+{
+  const auto irql = KeGetCurrentIrql();
+
+  return irql >= IPI_LEVEL      ? context_t::ipi
+       : irql >= DISPATCH_LEVEL ? context_t::dispatch
+       :                          context_t::passive;
+}
+
 void sleep(uint32_t milliseconds) noexcept
 {
   LARGE_INTEGER interval;
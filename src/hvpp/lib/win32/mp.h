@@ -1,10 +1,18 @@
 #pragma once
 #include <cstdint>
 
+namespace mp {
+
+  enum class context_t : uint8_t;
+
+}
+
 namespace mp::detail {
 
   uint32_t cpu_index() noexcept;
 
+  context_t context() noexcept;
+
   void sleep(uint32_t milliseconds) noexcept;
 
   void ipi_call(void(*callback)(void*), void* context) noexcept;
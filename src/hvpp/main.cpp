@@ -29,6 +29,16 @@ HvppDestroy(
   _In_ hvpp::vmexit_handler* VmExitHandler
   );
 
+NTSTATUS
+HvppStartMemoryThread(
+  VOID
+  );
+
+VOID
+HvppStopMemoryThread(
+  VOID
+  );
+
 //////////////////////////////////////////////////////////////////////////
 // Variables.
 //////////////////////////////////////////////////////////////////////////
@@ -41,6 +51,16 @@ static ULONG                  HvppMemoryTag     = 'ppvh';
 static hvpp::hypervisor*      HvppHypervisor    = nullptr;
 static hvpp::vmexit_handler*  HvppVmExitHandler = nullptr;
 
+static PVOID                  HvppArena[memory_manager::max_arena_count - 1]; // Arenas added by the memory thread
+static ULONG                  HvppArenaCount     = 0;
+static SIZE_T                 HvppArenaSize      = 32 * 1024 * 1024;
+static SIZE_T                 HvppArenaWatermark = 16 * 1024 * 1024;           // Add arena below 16MB of free memory
+
+static PETHREAD               HvppMemoryThread   = nullptr;
+static KEVENT                 HvppMemoryThreadStopEvent;
+static LONGLONG               HvppMemoryThreadInterval      = -10 * 1000 * 10; // 10ms (relative)
+static int                    HvppMemoryThreadZeroBatchSize = 1024;            // 4MB per interval
+
 //////////////////////////////////////////////////////////////////////////
 // Function implementations.
 //////////////////////////////////////////////////////////////////////////
@@ -61,6 +81,13 @@ HvppInitialize(
 
   logger::initialize();
   memory_manager::initialize(Memory, Size);
+  memory_manager::set_arena_watermark(HvppArenaWatermark);
+
+  if (!NT_SUCCESS(HvppStartMemoryThread()))
+  {
+    HvppDestroy(HypervisorInstance, VmExitHandlerInstance);
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
 
   HypervisorInstance = new hvpp::hypervisor();
 
@@ -105,8 +132,151 @@ HvppDestroy(
     delete VmExitHandler;
   }
 
+  HvppStopMemoryThread();
+
   memory_manager::destroy();
   logger::destroy();
+
+  //
+  // Release arenas added by the memory thread.
+  //
+  while (HvppArenaCount > 0)
+  {
+    ExFreePoolWithTag(HvppArena[--HvppArenaCount], HvppMemoryTag);
+  }
+}
+
+VOID
+HvppAddArena(
+  VOID
+  )
+{
+  PVOID Arena;
+
+  if (HvppArenaCount == RTL_NUMBER_OF(HvppArena))
+  {
+    return;
+  }
+
+  Arena = ExAllocatePoolWithTag(NonPagedPool,
+                                HvppArenaSize,
+                                HvppMemoryTag);
+
+  if (!Arena)
+  {
+    //
+    // Try again in the next interval.
+    //
+    return;
+  }
+
+  if (!memory_manager::add_arena(Arena, HvppArenaSize))
+  {
+    ExFreePoolWithTag(Arena, HvppMemoryTag);
+    return;
+  }
+
+  HvppArena[HvppArenaCount++] = Arena;
+}
+
+VOID
+HvppMemoryThreadRoutine(
+  _In_ PVOID Context
+  )
+{
+  UNREFERENCED_PARAMETER(Context);
+
+  //
+  // Add arenas to the memory manager when it's running low on memory and
+  // zero its free pages in the background, so that allocate_zeroed()
+  // (e.g.: allocation of EPT tables in VM-exit handler) doesn't have to.
+  // Neither can be done in VM-exit handlers. Note that this thread can be
+  // interrupted by VM-exit handlers and IPI callbacks, which allocate -
+  // therefore nothing called from here may take allocator locks.
+  //
+  KeSetPriorityThread(KeGetCurrentThread(), LOW_PRIORITY + 1);
+
+  LARGE_INTEGER Interval;
+  Interval.QuadPart = HvppMemoryThreadInterval;
+
+  while (KeWaitForSingleObject(&HvppMemoryThreadStopEvent,
+                               Executive,
+                               KernelMode,
+                               FALSE,
+                               &Interval) == STATUS_TIMEOUT)
+  {
+    if (memory_manager::arena_needed())
+    {
+      HvppAddArena();
+    }
+
+    memory_manager::zero_free_pages(HvppMemoryThreadZeroBatchSize);
+  }
+
+  PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+NTSTATUS
+HvppStartMemoryThread(
+  VOID
+  )
+{
+  NTSTATUS Status;
+  HANDLE ThreadHandle;
+
+  KeInitializeEvent(&HvppMemoryThreadStopEvent, NotificationEvent, FALSE);
+
+  Status = PsCreateSystemThread(&ThreadHandle,
+                                THREAD_ALL_ACCESS,
+                                nullptr,
+                                nullptr,
+                                nullptr,
+                                &HvppMemoryThreadRoutine,
+                                nullptr);
+
+  if (!NT_SUCCESS(Status))
+  {
+    return Status;
+  }
+
+  Status = ObReferenceObjectByHandle(ThreadHandle,
+                                     THREAD_ALL_ACCESS,
+                                     *PsThreadType,
+                                     KernelMode,
+                                     reinterpret_cast<PVOID*>(&HvppMemoryThread),
+                                     nullptr);
+
+  if (!NT_SUCCESS(Status))
+  {
+    //
+    // The thread is already running - stop it and wait until it exits,
+    // otherwise it would keep using the memory manager (and the driver
+    // image) after HvppInitialize() fails.
+    //
+    HvppMemoryThread = nullptr;
+
+    KeSetEvent(&HvppMemoryThreadStopEvent, IO_NO_INCREMENT, FALSE);
+    ZwWaitForSingleObject(ThreadHandle, FALSE, nullptr);
+  }
+
+  ZwClose(ThreadHandle);
+
+  return Status;
+}
+
+VOID
+HvppStopMemoryThread(
+  VOID
+  )
+{
+  if (HvppMemoryThread)
+  {
+    KeSetEvent(&HvppMemoryThreadStopEvent, IO_NO_INCREMENT, FALSE);
+    KeWaitForSingleObject(HvppMemoryThread, Executive, KernelMode, FALSE, nullptr);
+
+    ObDereferenceObject(HvppMemoryThread);
+    HvppMemoryThread = nullptr;
+  }
 }
 
 extern "C"
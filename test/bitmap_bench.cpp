@@ -0,0 +1,150 @@
+//
+// Microbenchmarks of lib/bitmap.h on 1M-bit bitmaps (the page bitmap of
+// a 4GB arena has 1M bits).
+//
+// - Walk of all runs of set bits of a sparse bitmap (runs of 1-8 bits,
+//   4096-8191 bits apart) with find_next_set()/find_next_clear(), with a
+//   scalar word-at-a-time loop (what find_next() did before skipping
+//   uniform words with SSE2) and bit by bit with test().
+// - find_first_clear() of 64 bits in a bitmap that is mostly full, with
+//   a few short holes, and a single fitting hole near its end.
+// - count_set() of the whole bitmap.
+//
+// Usage: bitmap_bench [repeat_count]
+//
+#include "lib/bitmap.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+static constexpr int bit_count = 1 << 20;
+
+static uint64_t sparse_buffer[bit_count / 64];
+static uint64_t full_buffer[bit_count / 64];
+
+template <typename TFunction>
+static double microseconds(int repeat_count, TFunction function)
+{
+  const auto begin = std::chrono::steady_clock::now();
+
+  for (int i = 0; i < repeat_count; ++i)
+  {
+    function();
+  }
+
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count() / repeat_count;
+}
+
+static int scalar_find_next(const uint64_t* buffer, int index, uint64_t skip_value)
+{
+  //
+  // One word per iteration.
+  //
+  int word = index / 64;
+  uint64_t value = (buffer[word] ^ skip_value) & (~0ull << (index % 64));
+
+  while (value == 0)
+  {
+    if (++word == bit_count / 64)
+    {
+      return bit_count;
+    }
+
+    value = buffer[word] ^ skip_value;
+  }
+
+  return word * 64 + __builtin_ctzll(value);
+}
+
+int main(int argc, char** argv)
+{
+  const int repeat_count = argc > 1 ? atoi(argv[1]) : 200;
+
+  srand(1);
+
+  bitmap sparse(sparse_buffer, bit_count);
+  bitmap full(full_buffer, bit_count);
+
+  for (int i = 0; i < bit_count - 8; i += 4096 + rand() % 4096)
+  {
+    sparse.set(i, 1 + rand() % 8);
+  }
+
+  full.set(0, bit_count);
+
+  for (int i = 0; i < 64; ++i)
+  {
+    full.clear(rand() % (bit_count - 64), 1 + rand() % 32);
+  }
+
+  full.clear(bit_count - 1000, 64);
+
+  volatile int sink;
+
+  //
+  // Walks of runs - all three must find the same runs.
+  //
+  long run_sum[3] = {};
+
+  const double walk_us = microseconds(repeat_count, [&] {
+    long sum = 0;
+
+    for (int i = sparse.find_next_set(0); i < bit_count; i = sparse.find_next_set(sparse.find_next_clear(i)))
+    {
+      sum += i;
+    }
+
+    run_sum[0] = sum;
+  });
+
+  const double scalar_walk_us = microseconds(repeat_count, [&] {
+    long sum = 0;
+
+    for (int i = scalar_find_next(sparse_buffer, 0, 0); i < bit_count;
+         i = scalar_find_next(sparse_buffer, scalar_find_next(sparse_buffer, i, ~0ull), 0))
+    {
+      sum += i;
+    }
+
+    run_sum[1] = sum;
+  });
+
+  const double bit_walk_us = microseconds(repeat_count / 10 + 1, [&] {
+    long sum = 0;
+
+    for (int i = 0; i < bit_count; ++i)
+    {
+      if (sparse.test(i) && (i == 0 || !sparse.test(i - 1)))
+      {
+        sum += i;
+      }
+    }
+
+    run_sum[2] = sum;
+  });
+
+  const double find_us = microseconds(repeat_count, [&] {
+    sink = full.find_first_clear(0, 64);
+  });
+
+  const double count_us = microseconds(repeat_count, [&] {
+    sink = sparse.count_set();
+  });
+
+  printf("walk of runs (word + SSE2):   %10.2f us\n", walk_us);
+  printf("walk of runs (scalar words):  %10.2f us\n", scalar_walk_us);
+  printf("walk of runs (bit by bit):    %10.2f us\n", bit_walk_us);
+  printf("find_first_clear(0, 64):      %10.2f us (found at %d)\n", find_us, full.find_first_clear(0, 64));
+  printf("count_set():                  %10.2f us\n", count_us);
+
+  (void)(sink);
+
+  if (run_sum[0] != run_sum[1] || run_sum[0] != run_sum[2])
+  {
+    printf("FAILED: walks found different runs\n");
+    return 1;
+  }
+
+  return 0;
+}
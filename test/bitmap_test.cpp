@@ -0,0 +1,213 @@
+//
+// Randomized comparison of lib/bitmap.h against a naive bit-by-bit
+// reference.
+//
+// Bitmaps of 1-700 bits are filled with random, clustered or sparse
+// patterns (and garbage past their end, which must be ignored), then set
+// and cleared in random ranges. Every search and count is compared with
+// the reference after each step.
+//
+// Usage: bitmap_test [iteration_count]
+//
+#include "lib/bitmap.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+static constexpr int max_bit_count = 700;
+
+struct reference_t
+{
+  bool bit[max_bit_count];
+  int  size;
+
+  int find_next(int index, bool value) const
+  {
+    for (; index < size; ++index)
+    {
+      if (bit[index] == value)
+      {
+        return index;
+      }
+    }
+
+    return size;
+  }
+
+  int find_first(int index, int count, bool value) const
+  {
+    if (count > size)
+    {
+      return -1;
+    }
+
+    if (index >= size)
+    {
+      index = 0;
+    }
+
+    if (count == 0)
+    {
+      return index & ~7;
+    }
+
+    for (int start = index; start + count <= size; ++start)
+    {
+      int length = 0;
+
+      while (length < count && bit[start + length] == value)
+      {
+        length += 1;
+      }
+
+      if (length == count)
+      {
+        return start;
+      }
+    }
+
+    return -1;
+  }
+
+  bool are_bits(int index, int count, bool value) const
+  {
+    if (index + count > size || count <= 0)
+    {
+      return false;
+    }
+
+    for (int i = index; i < index + count; ++i)
+    {
+      if (bit[i] != value)
+      {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  int count_set(int index, int count) const
+  {
+    int result = 0;
+
+    for (int i = index; i < size && i < index + count; ++i)
+    {
+      result += bit[i];
+    }
+
+    return result;
+  }
+};
+
+static int failure_count = 0;
+
+static void check(bool condition, const char* what, int size, int index, int count)
+{
+  if (!condition && ++failure_count <= 10)
+  {
+    printf("mismatch: %s (size %d, index %d, count %d)\n", what, size, index, count);
+  }
+}
+
+static void compare(const bitmap& b, const reference_t& r)
+{
+  const int n = r.size;
+
+  for (int q = 0; q < 20; ++q)
+  {
+    const int i = rand() % (n + 5);
+    const int j = rand() % n;
+    const int c = rand() % 40;
+
+    check(b.find_next_set(i)    == r.find_next(i, true),  "find_next_set", n, i, 0);
+    check(b.find_next_clear(i)  == r.find_next(i, false), "find_next_clear", n, i, 0);
+    check(b.find_first_set(j, c)   == r.find_first(j, c, true),  "find_first_set", n, j, c);
+    check(b.find_first_clear(j, c) == r.find_first(j, c, false), "find_first_clear", n, j, c);
+    check(b.are_bits_set(j, c)   == r.are_bits(j, c, true),  "are_bits_set", n, j, c);
+    check(b.are_bits_clear(j, c) == r.are_bits(j, c, false), "are_bits_clear", n, j, c);
+    check(b.count_set(j, c) == r.count_set(j, c), "count_set", n, j, c);
+    check(b.test(j) == r.bit[j], "test", n, j, 0);
+  }
+
+  check(b.find_first_set()   == r.find_next(0, true),  "find_first_set()", n, 0, 0);
+  check(b.find_first_clear() == r.find_next(0, false), "find_first_clear()", n, 0, 0);
+  check(b.count_set() == r.count_set(0, n), "count_set()", n, 0, n);
+  check(b.all_set()   == r.are_bits(0, n, true),  "all_set", n, 0, n);
+  check(b.all_clear() == r.are_bits(0, n, false), "all_clear", n, 0, n);
+}
+
+int main(int argc, char** argv)
+{
+  const int iteration_count = argc > 1 ? atoi(argv[1]) : 3000;
+
+  srand(1);
+
+  for (int iteration = 0; iteration < iteration_count; ++iteration)
+  {
+    const int n = 1 + rand() % max_bit_count;
+    const int density = rand() % 100;
+    const int pattern = rand() % 3;
+
+    uint64_t buffer[(max_bit_count + 63) / 64 + 4] = {};
+    bitmap b(buffer, n);
+    reference_t r = { {}, n };
+
+    for (int i = 0; i < n; ++i)
+    {
+      const bool value = pattern == 0 ? rand() % 100 < density    // random
+                       : pattern == 1 ? (i / 40) % 2 == 1          // clustered
+                       :                rand() % 100 < 2;          // sparse
+
+      if (value)
+      {
+        b.set(i);
+        r.bit[i] = true;
+      }
+    }
+
+    //
+    // Garbage past the end of the bitmap.
+    //
+    if (n % 64)
+    {
+      buffer[n / 64] |= ~0ull << (n % 64);
+    }
+
+    for (int w = (n + 63) / 64; w < static_cast<int>(sizeof(buffer) / sizeof(buffer[0])); ++w)
+    {
+      buffer[w] = rand() % 2 ? ~0ull : 0;
+    }
+
+    compare(b, r);
+
+    //
+    // Range operations.
+    //
+    for (int step = 0; step < 5; ++step)
+    {
+      const int index = rand() % n;
+      const int count = 1 + rand() % (n - index);
+      const bool value = rand() % 2;
+
+      if (value)
+      {
+        b.set(index, count);
+      }
+      else
+      {
+        b.clear(index, count);
+      }
+
+      for (int i = index; i < index + count; ++i)
+      {
+        r.bit[i] = value;
+      }
+
+      compare(b, r);
+    }
+  }
+
+  printf("%d iterations, %d mismatches\n", iteration_count, failure_count);
+  return failure_count != 0;
+}
@@ -0,0 +1,285 @@
+//
+// Check of 5-level EPT (PML5 root) over synthetic physical memory above
+// 256TB.
+//
+// Physical memory: [1MB, 4GB) and 8GB at 300TB. IA32_VMX_EPT_VPID_CAP
+// reports 5-level walks. mock_translate() walks the EPT from the EPT
+// pointer like the processor does (with the number of levels taken from
+// its page-walk length). Checks that:
+//   - initialize() picks the PML5 root only when the processor supports
+//     it and memory extends above 256TB,
+//   - the identity mapping translates low and high addresses, also
+//     through 1GB pages above 256TB, and nothing past the memory,
+//   - 4kb, 2MB and 1GB remaps above 256TB work, split 1GB page merges
+//     back when the 4kb page is restored,
+//   - overlay of the 5-level EPT inherits its root level and copies only
+//     the 5 tables on the path to a remapped high page,
+//   - forced PML5 root over low memory translates like the PML4 root.
+//
+// Usage: ept_5level_test
+//
+#include "support/harness.h"
+
+#include "hvpp/ept.h"
+#include "lib/mm.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace hvpp;
+
+static int bad_count = 0;
+
+static void check(bool condition, const char* what)
+{
+  if (!condition)
+  {
+    printf("FAIL: %s\n", what);
+    bad_count += 1;
+  }
+}
+
+static constexpr uint64_t _2mb   = 2ull << 20;
+static constexpr uint64_t _1gb   = 1ull << 30;
+static constexpr uint64_t _1tb   = 1ull << 40;
+static constexpr uint64_t _256tb = 1ull << 48;
+
+static constexpr uint64_t high_base = 300 * _1tb;
+static constexpr uint64_t high_size = 8 * _1gb;
+
+static_assert(high_base > _256tb);
+
+static const epte_t* mock_translate(ept_ptr_t eptp, uint64_t guest_pa, uint64_t& host_pa, int& leaf_level)
+{
+  auto table = static_cast<const epte_t*>(pa_t::from_pfn(eptp.page_frame_number).va());
+
+  for (int level = static_cast<int>(eptp.page_walk_length); level >= 0; --level)
+  {
+    const auto& entry = table[(guest_pa >> (12 + 9 * level)) & 511];
+
+    if (!entry.is_present())
+    {
+      return nullptr;
+    }
+
+    if (level == 0 || entry.large_page)
+    {
+      const uint64_t page_mask = (1ull << (12 + 9 * level)) - 1;
+      host_pa = (pa_t::from_pfn(entry.page_frame_number).value() & ~page_mask) | (guest_pa & page_mask);
+      leaf_level = level;
+      return &entry;
+    }
+
+    table = static_cast<const epte_t*>(pa_t::from_pfn(entry.page_frame_number).va());
+  }
+
+  return nullptr;
+}
+
+static bool translates(ept_t& ept, uint64_t guest_pa, uint64_t expected_host_pa, int expected_level = -1)
+{
+  uint64_t host_pa = 0;
+  int level = -1;
+
+  return mock_translate(ept.ept_pointer(), guest_pa, host_pa, level) &&
+         host_pa == expected_host_pa &&
+         (expected_level == -1 || level == expected_level);
+}
+
+static bool unmapped(ept_t& ept, uint64_t guest_pa)
+{
+  uint64_t host_pa;
+  int level;
+
+  return !mock_translate(ept.ept_pointer(), guest_pa, host_pa, level);
+}
+
+static uint32_t total_table_count(ept_t& ept)
+{
+  uint32_t result = 0;
+
+  for (auto level = page_table_level::pt; level <= ept.root_level(); level = level + 1)
+  {
+    result += ept.table_count(level);
+  }
+
+  return result;
+}
+
+static void setup_memory(bool high)
+{
+  harness::setup_physical_memory(1, (4ull << 30) - 0x100000, 0);
+
+  if (high)
+  {
+    harness::physical_memory_ranges[1].BaseAddress.QuadPart = high_base;
+    harness::physical_memory_ranges[1].NumberOfBytes.QuadPart = high_size;
+  }
+}
+
+static const uint64_t low_samples[] = {
+  0x100000, 0x1ff000, 0x200000, 0x40123000, 0xbffff000, 0xc0000000, 0xfffff000,
+};
+
+int main()
+{
+  static constexpr uint64_t page_walk_length_5 = 1 << 7;
+
+  const size_t pool_size = 64 * 1024 * 1024;
+  const auto pool = aligned_alloc(ia32::page_size, pool_size);
+
+  //
+  // Root level selection.
+  //
+  {
+    static const struct
+    {
+      bool             cap;
+      bool             high;
+      page_table_level expected;
+      const char*      what;
+    } cases[] = {
+      { true,  true,  page_table_level::pml5, "PML5 root for memory above 256TB" },
+      { true,  false, page_table_level::pml4, "PML4 root for memory below 256TB" },
+      { false, false, page_table_level::pml4, "PML4 root without 5-level support" },
+    };
+
+    for (const auto& test_case : cases)
+    {
+      harness::setup_msrs(true);
+      harness::msr_table[0x48c] |= test_case.cap ? page_walk_length_5 : 0;
+      setup_memory(test_case.high);
+
+      memory_manager::initialize(pool, pool_size);
+
+      static ept_t ept;
+      ept.initialize();
+
+      check(ept.root_level() == test_case.expected &&
+            ept.ept_pointer().page_walk_length == static_cast<uint64_t>(test_case.expected), test_case.what);
+
+      ept.destroy();
+      memory_manager::destroy();
+    }
+  }
+
+  harness::setup_msrs(true);
+  harness::msr_table[0x48c] |= page_walk_length_5;
+  setup_memory(true);
+
+  memory_manager::initialize(pool, pool_size);
+
+  {
+    static ept_t shared;
+    shared.initialize();
+    shared.map_identity();
+
+    check(shared.root_level() == page_table_level::pml5, "5-level EPT");
+
+    //
+    // Identity mapping.
+    //
+    for (const auto pa : low_samples)
+    {
+      check(translates(shared, pa, pa), "low identity translation");
+    }
+
+    check(translates(shared, high_base, high_base, 2), "high memory start mapped by 1GB page");
+    check(translates(shared, high_base + 0x12345678, high_base + 0x12345678, 2), "high memory mapped by 1GB page");
+    check(translates(shared, high_base + high_size - 0x1000, high_base + high_size - 0x1000), "high memory end");
+    check(unmapped(shared, high_base + high_size), "past the high memory");
+    check(unmapped(shared, high_base - _1gb), "below the high memory");
+    check(unmapped(shared, 100 * _1tb), "between the ranges");
+
+    pa_t host_pa;
+    check(shared.translate(pa_t(high_base + 0x5000), host_pa) && host_pa.value() == high_base + 0x5000, "translate() above 256TB");
+
+    //
+    // Remaps above 256TB.
+    //
+    const uint64_t remap_pa = high_base + 3 * _1gb + 0x123000;
+
+    shared.map_4kb(pa_t(remap_pa), pa_t(0x80000000));
+    check(translates(shared, remap_pa, 0x80000000, 0), "4kb remap above 256TB");
+    check(translates(shared, remap_pa + 0x1000, remap_pa + 0x1000, 0), "neighbour of the 4kb remap");
+    check(translates(shared, remap_pa + _2mb, remap_pa + _2mb, 1), "split 1GB page keeps 2MB pages");
+
+    shared.map_2mb(pa_t(high_base + 4 * _1gb), pa_t(0x40000000));
+    check(translates(shared, high_base + 4 * _1gb + 0x1234, 0x40001234, 1), "2MB remap above 256TB");
+
+    shared.map_1gb(pa_t(high_base + 5 * _1gb), pa_t(0x40000000));
+    check(translates(shared, high_base + 5 * _1gb + 0x123456, 0x40123456, 2), "1GB remap above 256TB");
+
+    shared.map_4kb(pa_t(remap_pa), pa_t(remap_pa));
+    check(translates(shared, remap_pa, remap_pa, 2), "split 1GB page merged back");
+
+    shared.map_2mb(pa_t(high_base + 4 * _1gb), pa_t(high_base + 4 * _1gb));
+    shared.map_1gb(pa_t(high_base + 5 * _1gb), pa_t(high_base + 5 * _1gb));
+
+    //
+    // Overlay.
+    //
+    static ept_t overlay;
+    overlay.initialize(shared);
+
+    check(overlay.root_level() == page_table_level::pml5 &&
+          overlay.ept_pointer().page_walk_length == ept_ptr_t::page_walk_length_5, "overlay inherits the root level");
+
+    overlay.map_4kb(pa_t(high_base + 0x7000), pa_t(0x80000000));
+
+    check(translates(overlay, high_base + 0x7000, 0x80000000, 0), "overlay remap above 256TB");
+    check(translates(shared, high_base + 0x7000, high_base + 0x7000, 2), "shared EPT untouched");
+    check(translates(overlay, 0x40123000, 0x40123000), "overlay sees low memory");
+    check(total_table_count(overlay) == 5, "overlay copied only the path to the page");
+
+    overlay.destroy();
+    shared.destroy();
+  }
+
+  check(memory_manager::allocated_bytes() == 0, "everything freed");
+
+  memory_manager::destroy();
+
+  //
+  // Forced PML5 root over low memory only.
+  //
+  setup_memory(false);
+
+  memory_manager::initialize(pool, pool_size);
+
+  {
+    static ept_t ept4;
+    static ept_t ept5;
+
+    ept4.initialize();
+    ept4.map_identity();
+
+    ept5.initialize(page_table_level::pml5);
+    ept5.map_identity();
+
+    check(ept4.root_level() == page_table_level::pml4 && ept5.root_level() == page_table_level::pml5, "forced root level");
+    check(total_table_count(ept5) == total_table_count(ept4) + 1, "PML5 root adds just the root table");
+
+    for (const auto pa : low_samples)
+    {
+      uint64_t host_pa4, host_pa5;
+      int level4, level5;
+
+      check(mock_translate(ept4.ept_pointer(), pa, host_pa4, level4) &&
+            mock_translate(ept5.ept_pointer(), pa, host_pa5, level5) &&
+            host_pa4 == host_pa5 && level4 == level5, "PML5 root translates like PML4 root");
+    }
+
+    ept5.destroy();
+    ept4.destroy();
+  }
+
+  check(memory_manager::allocated_bytes() == 0, "everything freed");
+
+  memory_manager::destroy();
+  free(pool);
+
+  printf("%s\n", bad_count ? "FAIL" : "PASS");
+
+  return bad_count != 0;
+}
@@ -0,0 +1,317 @@
+//
+// Scan speed of the EPT heat map (ept_heat_map_t, see HVPP_ENABLE_EPT_AD),
+// compared to a full walk which visits every present entry regardless of
+// the accessed flags of the tables above it.
+//
+// Identity EPT of 64GB (2MB pages, 4kb pages at both ends). mock_access()
+// sets accessed flags on the whole path and dirty flag of the leaf, like
+// the processor does. Working sets:
+//   - clustered: all 2MB regions of every 64th (8th) GB,
+//   - scattered: one 2MB region in each GB (no subtree can be skipped),
+//   - all regions.
+// Checks that:
+//   - both scans count the same accessed and dirty pages as were touched,
+//   - all accessed and dirty flags are cleared after the scan,
+//   - the heat map scan is faster for the clustered working sets,
+//   - 8-scan history and histogram of hot and warm regions are correct,
+//     and both cool down when nothing is accessed.
+//
+// Usage: ept_heat_map_bench [repeat_count]
+//
+#include "support/harness.h"
+
+#include "hvpp/ept.h"
+#include "lib/mm.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace hvpp;
+
+static int bad_count = 0;
+
+static void check(bool condition, const char* what)
+{
+  if (!condition)
+  {
+    printf("FAIL: %s\n", what);
+    bad_count += 1;
+  }
+}
+
+static constexpr uint64_t memory_size  = 64ull << 30;
+static constexpr uint64_t region_size  = 1ull << ept_heat_map_t::region_shift;
+static constexpr uint64_t gb_size      = 1ull << 30;
+static constexpr uint64_t regions_per_gb = gb_size / region_size;
+
+static epte_t* root_table(ept_t& ept)
+{
+  return static_cast<epte_t*>(pa_t::from_pfn(ept.ept_pointer().page_frame_number).va());
+}
+
+//
+// Adds number of 4kb pages which became accessed (dirty) to the counters.
+//
+static void mock_access(ept_t& ept, uint64_t guest_pa, bool write, uint64_t& accessed_count, uint64_t& dirty_count)
+{
+  auto table = root_table(ept);
+
+  for (int level = static_cast<int>(ept.root_level()); level >= 0; --level)
+  {
+    auto& entry = table[(guest_pa >> (12 + 9 * level)) & 511];
+
+    if (!entry.is_present())
+    {
+      return;
+    }
+
+    const bool     leaf       = level == 0 || entry.large_page;
+    const uint64_t page_count = 1ull << (9 * level);
+
+    if (leaf)
+    {
+      accessed_count += entry.accessed ? 0 : page_count;
+      dirty_count += !entry.dirty && write ? page_count : 0;
+      entry.dirty |= write;
+    }
+
+    entry.accessed = true;
+
+    if (leaf)
+    {
+      return;
+    }
+
+    table = entry.subtable();
+  }
+}
+
+static void full_scan(epte_t* table, int level, uint64_t& accessed_count, uint64_t& dirty_count)
+{
+  for (int i = 0; i < 512; ++i)
+  {
+    auto& entry = table[i];
+
+    if (!entry.is_present())
+    {
+      continue;
+    }
+
+    const uint64_t page_count = 1ull << (9 * level);
+
+    if (level == 0 || entry.large_page)
+    {
+      accessed_count += entry.accessed ? page_count : 0;
+      dirty_count += entry.dirty ? page_count : 0;
+    }
+    else
+    {
+      full_scan(entry.subtable(), level - 1, accessed_count, dirty_count);
+    }
+
+    entry.accessed = false;
+    entry.dirty = false;
+  }
+}
+
+static bool all_flags_clear(const epte_t* table, int level)
+{
+  for (int i = 0; i < 512; ++i)
+  {
+    const auto& entry = table[i];
+
+    if (!entry.is_present())
+    {
+      continue;
+    }
+
+    if (entry.accessed || ((level == 0 || entry.large_page) && entry.dirty))
+    {
+      return false;
+    }
+
+    if (level > 0 && !entry.large_page && !all_flags_clear(entry.subtable(), level - 1))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+struct working_set_t
+{
+  const char* name;
+  uint64_t    gb_stride;        // every N-th GB ...
+  uint64_t    region_stride;    // ... every N-th region in it
+};
+
+static void touch(ept_t& ept, const working_set_t& working_set, uint64_t& accessed_count, uint64_t& dirty_count)
+{
+  accessed_count = 0;
+  dirty_count = 0;
+
+  for (uint64_t gb = 0; gb < memory_size / gb_size + 1; gb += working_set.gb_stride)
+  {
+    for (uint64_t region = 0; region < regions_per_gb; region += working_set.region_stride)
+    {
+      //
+      // Last page of the region - also the first region (starting at 1MB)
+      // has it mapped. Every other region is written to.
+      //
+      const uint64_t pa = gb * gb_size + region * region_size + region_size - ia32::page_size;
+      mock_access(ept, pa, region % (2 * working_set.region_stride) == 0, accessed_count, dirty_count);
+    }
+  }
+}
+
+static double elapsed_us(std::chrono::steady_clock::time_point begin)
+{
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+}
+
+int main(int argc, char** argv)
+{
+  const int repeat_count = std::max(argc > 1 ? atoi(argv[1]) : 20, 1);
+
+  harness::setup_msrs(false);
+  harness::setup_physical_memory(1, memory_size, 0);
+
+  const size_t pool_size = 64 * 1024 * 1024;
+  const auto pool = aligned_alloc(ia32::page_size, pool_size);
+  memory_manager::initialize(pool, pool_size);
+
+  {
+    static ept_t ept;
+    ept.initialize();
+    ept.map_identity();
+
+    check(ept.ept_pointer().enable_access_and_dirty_flags, "accessed and dirty flags enabled");
+
+    const int root_level = static_cast<int>(ept.root_level());
+
+    //
+    // map_identity() leaves the flags clear, but make sure.
+    //
+    {
+      uint64_t accessed_count = 0, dirty_count = 0;
+      full_scan(root_table(ept), root_level, accessed_count, dirty_count);
+    }
+
+    static ept_heat_map_t heat_map;
+    heat_map.initialize(ept);
+
+    static const working_set_t working_sets[] = {
+      { "clustered 1/64",  64, 1   },
+      { "clustered 1/8",   8,  1   },
+      { "scattered 1/512", 1,  512 },
+      { "all",             1,  1   },
+    };
+
+    printf("%-16s %10s %12s %12s %8s\n", "working set", "pages", "heat map us", "full us", "speedup");
+
+    for (const auto& working_set : working_sets)
+    {
+      double heat_map_us = 1e30;
+      double full_us = 1e30;
+      uint64_t touched_count = 0;
+
+      for (int i = 0; i < repeat_count; ++i)
+      {
+        uint64_t accessed_count, dirty_count;
+
+        touch(ept, working_set, accessed_count, dirty_count);
+
+        auto begin = std::chrono::steady_clock::now();
+        heat_map.scan();
+        heat_map_us = std::min(heat_map_us, elapsed_us(begin));
+
+        check(heat_map.accessed_page_count() == accessed_count, "heat map accessed pages");
+        check(heat_map.dirty_page_count() == dirty_count, "heat map dirty pages");
+
+        if (i == 0)
+        {
+          check(all_flags_clear(root_table(ept), root_level), "heat map cleared the flags");
+        }
+
+        touch(ept, working_set, accessed_count, dirty_count);
+        touched_count = accessed_count;
+
+        uint64_t full_accessed_count = 0, full_dirty_count = 0;
+
+        begin = std::chrono::steady_clock::now();
+        full_scan(root_table(ept), root_level, full_accessed_count, full_dirty_count);
+        full_us = std::min(full_us, elapsed_us(begin));
+
+        check(full_accessed_count == accessed_count && full_dirty_count == dirty_count, "full scan pages");
+      }
+
+      printf("%-16s %10llu %12.1f %12.1f %8.2f\n", working_set.name,
+        (unsigned long long)touched_count, heat_map_us, full_us, full_us / heat_map_us);
+
+      if (working_set.region_stride == 1 && working_set.gb_stride > 1)
+      {
+        check(heat_map_us < full_us, "heat map skips untouched subtrees");
+      }
+    }
+
+    heat_map.destroy();
+
+    //
+    // History - regions of the 5th GB accessed in each of 8 scans, regions
+    // of the 20th GB in every other scan (starting with the first).
+    //
+    heat_map.initialize(ept);
+
+    for (int i = 0; i < 8; ++i)
+    {
+      uint64_t accessed_count = 0, dirty_count = 0;
+
+      for (uint64_t region = 0; region < regions_per_gb; ++region)
+      {
+        mock_access(ept, 5 * gb_size + region * region_size, false, accessed_count, dirty_count);
+
+        if (i % 2 == 0)
+        {
+          mock_access(ept, 20 * gb_size + region * region_size, false, accessed_count, dirty_count);
+        }
+      }
+
+      heat_map.scan();
+    }
+
+    check(heat_map.scan_count() == 8, "scan count");
+    check(heat_map.heat(static_cast<int>(5 * regions_per_gb)) == 0xff, "hot region heat");
+    check(heat_map.heat(static_cast<int>(20 * regions_per_gb)) == 0x55, "warm region heat");
+    check(heat_map.heat(0) == 0, "cold region heat");
+    check(heat_map.histogram(8) == regions_per_gb, "hot regions in histogram");
+    check(heat_map.histogram(4) == regions_per_gb, "warm regions in histogram");
+    check(heat_map.histogram(0) == heat_map.region_count() - 2 * regions_per_gb, "cold regions in histogram");
+
+    //
+    // Nothing accessed in the next 8 scans - everything cools down.
+    //
+    for (int i = 0; i < 8; ++i)
+    {
+      heat_map.scan();
+    }
+
+    check(heat_map.heat(static_cast<int>(5 * regions_per_gb)) == 0, "hot region cooled down");
+    check(heat_map.heat(static_cast<int>(20 * regions_per_gb)) == 0, "warm region cooled down");
+    check(heat_map.histogram(0) == static_cast<uint32_t>(heat_map.region_count()), "all regions cold");
+
+    heat_map.destroy();
+    ept.destroy();
+  }
+
+  check(memory_manager::allocated_bytes() == 0, "everything freed");
+
+  memory_manager::destroy();
+  free(pool);
+
+  printf("%s\n", bad_count ? "FAIL" : "PASS");
+
+  return bad_count != 0;
+}
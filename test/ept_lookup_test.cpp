@@ -0,0 +1,136 @@
+//
+// Check of the lookup cache of ept_t (see ept_t::lookup()).
+//
+// An overlay looks up a page in the 2MB region at 4GB, where the physical
+// memory ends and which the shared EPT therefore maps with 4kb pages - the
+// PT borrowed from the shared EPT is cached.
+// The overlay then replaces the whole PT with a large page (by map_2mb(),
+// map_1gb() and map_range()); the next lookup must see the large page,
+// not the leaf of the cached PT. The same is checked for a PT owned by
+// the overlay and for a PT of the shared EPT freed by a merge.
+//
+// Usage: ept_lookup_test
+//
+#include "support/harness.h"
+
+#include "hvpp/ept.h"
+#include "lib/mm.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace hvpp;
+
+static int bad_count = 0;
+
+static void check(bool condition, const char* what)
+{
+  if (!condition)
+  {
+    printf("FAIL: %s\n", what);
+    bad_count += 1;
+  }
+}
+
+static constexpr uint64_t region   = 0x100000000;
+static constexpr uint64_t guest_pa = region + 0x1000;
+static constexpr uint64_t host_1gb = 0x80000000;
+
+static void check_lookup(ept_t& ept, uint64_t pa, page_table_level expected_level, uint64_t expected_host_pa, const char* what)
+{
+  page_table_level level;
+  auto entry = ept.lookup(pa_t(pa), level);
+
+  pa_t host_pa;
+  ept.translate(pa_t(pa), host_pa);
+
+  if (!entry || level != expected_level || host_pa.value() != expected_host_pa)
+  {
+    printf("FAIL: %s (level %d, host pa 0x%llx)\n", what,
+      entry ? static_cast<int>(level) : -1,
+      static_cast<unsigned long long>(host_pa.value()));
+
+    bad_count += 1;
+  }
+}
+
+template <typename TRemap>
+static void check_overlay(ept_t& shared, uint64_t expected_host_pa, page_table_level expected_level, const char* what, TRemap remap)
+{
+  ept_t overlay;
+  overlay.initialize(shared);
+
+  //
+  // Cache the borrowed PT.
+  //
+  check_lookup(overlay, guest_pa, page_table_level::pt, guest_pa, what);
+  check_lookup(overlay, guest_pa, page_table_level::pt, guest_pa, what);
+  check(overlay.lookup_miss_count() == 1, "borrowed PT cached");
+
+  remap(overlay);
+  check_lookup(overlay, guest_pa, expected_level, expected_host_pa, what);
+
+  //
+  // Shared EPT still maps the page with 4kb page.
+  //
+  check_lookup(shared, guest_pa, page_table_level::pt, guest_pa, "shared EPT untouched");
+
+  overlay.destroy();
+}
+
+int main()
+{
+  harness::setup_msrs(true);
+  harness::setup_physical_memory(1, (4ull << 30) + 0x3000, 0);
+
+  const size_t pool_size = 64 * 1024 * 1024;
+  const auto pool = aligned_alloc(ia32::page_size, pool_size);
+  memory_manager::initialize(pool, pool_size);
+
+  {
+    ept_t shared;
+    shared.initialize();
+    shared.map_identity();
+
+    check_lookup(shared, guest_pa, page_table_level::pt, guest_pa, "identity map");
+
+    check_overlay(shared, host_1gb + 0x1000, page_table_level::pd, "borrowed PT replaced by map_2mb()", [](ept_t& overlay) {
+      overlay.map_2mb(pa_t(region), pa_t(host_1gb));
+    });
+
+    check_overlay(shared, host_1gb + 0x1000, page_table_level::pdpt, "borrowed PT replaced by map_1gb()", [](ept_t& overlay) {
+      overlay.map_1gb(pa_t(region), pa_t(host_1gb));
+    });
+
+    check_overlay(shared, host_1gb + 0x1000, page_table_level::pd, "borrowed PT replaced by map_range()", [](ept_t& overlay) {
+      overlay.map_range(pa_t(region), pa_t(host_1gb), 0x200000);
+    });
+
+    check_overlay(shared, host_1gb + 0x1000, page_table_level::pd, "private PT replaced by map_2mb()", [](ept_t& overlay) {
+      overlay.map_4kb(pa_t(guest_pa), pa_t(guest_pa));
+      check_lookup(overlay, guest_pa, page_table_level::pt, guest_pa, "private PT");
+      overlay.map_2mb(pa_t(region), pa_t(host_1gb));
+    });
+
+    //
+    // PT of the shared EPT (which is not referenced by any overlay now)
+    // merged back into large page.
+    //
+    const uint64_t split_pa = 0x40005000;
+
+    shared.map_4kb(pa_t(split_pa), pa_t(host_1gb));
+    check_lookup(shared, split_pa, page_table_level::pt, host_1gb, "shared 2MB page split");
+
+    shared.map_4kb(pa_t(split_pa), pa_t(split_pa));
+    check_lookup(shared, split_pa, page_table_level::pdpt, split_pa, "shared PT merged");
+
+    shared.destroy();
+  }
+
+  memory_manager::destroy();
+  free(pool);
+
+  printf("%s\n", bad_count ? "FAIL" : "PASS");
+
+  return bad_count != 0;
+}
@@ -0,0 +1,168 @@
+//
+// Scaling of ept_t::map_identity_parallel() with the number of processors.
+//
+// In the driver, map_identity_work() runs on all logical processors via
+// IPI. Here it runs on 1..N threads (N defaults to the number of hardware
+// threads), each pretending to be a different processor. The identity EPT
+// of 512GB of physical memory (32 ranges with 4kb-misaligned boundaries,
+// 1GB pages disabled) is built by each thread count and compared against
+// the one built by the serial map_identity(). The best of repeat_count
+// runs is taken.
+//
+// Fails if the tables differ, or if any thread count up to the number of
+// hardware threads isn't faster than the serial build (on a single-core
+// host the speedup is only reported).
+//
+// Usage: ept_parallel_bench [max_thread_count]
+//
+#include "support/harness.h"
+
+#include "hvpp/ept.h"
+#include "lib/mm.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+using namespace hvpp;
+
+static constexpr int repeat_count = 5;
+
+static uint64_t hash_table(const epte_t* table, int level)
+{
+  //
+  // Hash of the mappings (including memory types), regardless of where
+  // the tables were allocated and which thread allocated them.
+  //
+  uint64_t result = 0;
+
+  for (int i = 0; i < 512; ++i)
+  {
+    const auto& entry = table[i];
+
+    if (!entry.is_present())
+    {
+      continue;
+    }
+
+    if (level == 0 || entry.large_page)
+    {
+      result = result * 31 + (entry.flags & ~(1ull << 11)) + i;
+    }
+    else
+    {
+      const auto subtable = reinterpret_cast<const epte_t*>(ia32::pa_t::from_pfn(entry.page_frame_number).va());
+      result = result * 31 + hash_table(subtable, level - 1) + i;
+    }
+  }
+
+  return result;
+}
+
+int main(int argc, char** argv)
+{
+  const int hardware_thread_count = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  const int max_thread_count = argc > 1 ? atoi(argv[1]) : hardware_thread_count;
+
+  harness::setup_msrs(false);
+  harness::setup_physical_memory(32, (16ull << 30) + 0x3000, 0x5000);
+
+  const size_t pool_size = 256 * 1024 * 1024;
+  const auto pool = aligned_alloc(ia32::page_size, pool_size);
+  memory_manager::initialize(pool, pool_size);
+
+  uint64_t reference_hash = 0;
+  double serial_ms = 0;
+  int result = 0;
+
+  printf("%8s %10s %8s %6s %6s %5s\n", "threads", "ms", "speedup", "pd", "pt", "same");
+
+  for (int thread_count = 1; thread_count <= max_thread_count; thread_count *= 2)
+  {
+    double ms = 0;
+    uint64_t hash = 0;
+    uint32_t pd_count = 0;
+    uint32_t pt_count = 0;
+
+    for (int repeat = 0; repeat < repeat_count; ++repeat)
+    {
+      ept_t ept;
+      ept.initialize();
+
+      const auto begin = std::chrono::steady_clock::now();
+
+      if (thread_count == 1)
+      {
+        ept.map_identity();
+      }
+      else
+      {
+        ept.map_identity_begin();
+
+        std::vector<std::thread> threads;
+
+        for (int i = 0; i < thread_count; ++i)
+        {
+          threads.emplace_back([&ept, i] {
+            harness::set_cpu_index(i);
+            ept.map_identity_work();
+          });
+        }
+
+        for (auto& thread : threads)
+        {
+          thread.join();
+        }
+      }
+
+      const double repeat_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+      ms = repeat ? std::min(ms, repeat_ms) : repeat_ms;
+
+      const auto root = reinterpret_cast<const epte_t*>(ia32::pa_t::from_pfn(ept.ept_pointer().page_frame_number).va());
+      hash = hash_table(root, 3);
+      pd_count = ept.table_count(page_table_level::pd);
+      pt_count = ept.table_count(page_table_level::pt);
+
+      ept.destroy();
+
+      if (thread_count == 1 && repeat == 0)
+      {
+        reference_hash = hash;
+      }
+
+      result |= hash != reference_hash;
+    }
+
+    if (thread_count == 1)
+    {
+      serial_ms = ms;
+    }
+
+    const double speedup = serial_ms / ms;
+    const bool slow = thread_count > 1 && thread_count <= hardware_thread_count && speedup <= 1.0;
+
+    printf("%8d %10.2f %8.2f %6u %6u %5s%s\n",
+      thread_count, ms, speedup, pd_count, pt_count,
+      hash == reference_hash ? "yes" : "NO",
+      slow ? "  FAIL: no speedup" : "");
+
+    result |= slow;
+
+    if (thread_count < max_thread_count && thread_count * 2 > max_thread_count)
+    {
+      thread_count = max_thread_count / 2;
+    }
+  }
+
+  if (hardware_thread_count == 1)
+  {
+    printf("single hardware thread - speedup not checked\n");
+  }
+
+  memory_manager::destroy();
+  free(pool);
+
+  return result;
+}
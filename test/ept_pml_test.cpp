@@ -0,0 +1,164 @@
+//
+// Check of the page-modification log drain and of the dirty bitmap of
+// ept_t (see HVPP_ENABLE_PML).
+//
+// A synthetic log holds (from the PML index upwards, like the processor
+// fills it) writes into a 4kb page, 2MB page, 1GB page, unmapped address
+// and the same 2MB page again; entries below the PML index hold garbage
+// which must be ignored. The log is drained the same way as
+// vcpu_t::pml_flush() does and harvested into the caller's bitmap:
+//   - all 4kb pages of a large page must be reported,
+//   - dirty flags of the leaf entries must be cleared,
+//   - harvested pages must be removed from the EPT,
+//   - bitmaps which don't end on a 64-bit word boundary must receive
+//     the pages of their last partial word (and only those).
+//
+// Usage: ept_pml_test
+//
+#include "support/harness.h"
+
+#include "hvpp/ept.h"
+#include "ia32/vmx/pml.h"
+#include "lib/mm.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace hvpp;
+
+static int bad_count = 0;
+
+static void check(bool condition, const char* what)
+{
+  if (!condition)
+  {
+    printf("FAIL: %s\n", what);
+    bad_count += 1;
+  }
+}
+
+static uint64_t pfn(uint64_t pa)
+{
+  return pa >> 12;
+}
+
+int main()
+{
+  //
+  // [1MB, 4GB + 1MB + 12kb) - 4kb pages below 2MB, 2MB pages up to 1GB,
+  // 1GB pages above.
+  //
+  harness::setup_msrs(true);
+  harness::setup_physical_memory(1, (4ull << 30) + 0x3000, 0);
+
+  const size_t pool_size = 64 * 1024 * 1024;
+  const auto pool = aligned_alloc(ia32::page_size, pool_size);
+  memory_manager::initialize(pool, pool_size);
+
+  {
+    ept_t ept;
+    ept.initialize();
+    ept.map_identity();
+
+    check(ept.dirty_page_count() > 0, "dirty bitmap allocated");
+
+    const uint64_t pa_4kb     = 0x100000 + 5 * 0x1000;
+    const uint64_t pa_2mb     = 3 * 0x200000 + 0x7000;
+    const uint64_t pa_2mb_2nd = 3 * 0x200000 + 0x1ff000;
+    const uint64_t pa_1gb     = 0x40000000 + 0x1234000;
+    const uint64_t pa_garbage = 0x80000000 + 0x5000;
+    const uint64_t pa_unmapped = 0x10000000000;
+
+    page_table_level level_4kb, level_2mb, level_1gb;
+    const auto pte   = ept.lookup(pa_t(pa_4kb), level_4kb);
+    const auto pde   = ept.lookup(pa_t(pa_2mb), level_2mb);
+    const auto pdpte = ept.lookup(pa_t(pa_1gb), level_1gb);
+
+    check(pte   && level_4kb == page_table_level::pt,   "4kb page mapped");
+    check(pde   && level_2mb == page_table_level::pd,   "2MB page mapped");
+    check(pdpte && level_1gb == page_table_level::pdpt, "1GB page mapped");
+
+    if (bad_count)
+    {
+      return 1;
+    }
+
+    //
+    // The processor sets the dirty flags and logs the writes.
+    //
+    pte->dirty   = true;
+    pde->dirty   = true;
+    pdpte->dirty = true;
+
+    static vmx::pml_t pml;
+    const uint16_t pml_index = vmx::pml_t::max_entry_count - 6;
+
+    for (int i = 0; i <= pml_index; ++i)
+    {
+      pml.entry[i] = pa_t(pa_garbage);
+    }
+
+    pml.entry[pml_index + 1] = pa_t(pa_2mb_2nd);
+    pml.entry[pml_index + 2] = pa_t(pa_unmapped);
+    pml.entry[pml_index + 3] = pa_t(pa_1gb);
+    pml.entry[pml_index + 4] = pa_t(pa_2mb);
+    pml.entry[pml_index + 5] = pa_t(pa_4kb);
+
+    check(vmx::pml_t::first_entry(0xffff) == 0,   "full log drained from entry 0");
+    check(vmx::pml_t::first_entry(511)    == 512, "empty log drains nothing");
+
+    const int first = vmx::pml_t::first_entry(pml_index);
+    ept.mark_dirty(&pml.entry[first], vmx::pml_t::max_entry_count - first);
+
+    //
+    // Harvest everything.
+    //
+    bitmap dirty(ept.dirty_page_count());
+
+    const auto begin = std::chrono::steady_clock::now();
+    const int count = ept.harvest_dirty(dirty);
+    const double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+
+    printf("harvested %d pages in %.1f us\n", count, us);
+
+    check(count == 1 + 512 + 512 * 512, "harvested page count");
+    check(dirty.count_set() == count, "bitmap matches the count");
+    check(dirty.test(static_cast<int>(pfn(pa_4kb))), "4kb page reported");
+    check(dirty.are_bits_set(static_cast<int>(pfn(pa_2mb) & ~511), 512), "whole 2MB page reported");
+    check(dirty.are_bits_set(static_cast<int>(pfn(pa_1gb) & ~(512 * 512 - 1)), 512 * 512), "whole 1GB page reported");
+    check(!dirty.test(static_cast<int>(pfn(pa_garbage))), "entries below PML index ignored");
+
+    check(!pte->dirty,   "4kb dirty flag cleared");
+    check(!pde->dirty,   "2MB dirty flag cleared");
+    check(!pdpte->dirty, "1GB dirty flag cleared");
+
+    check(ept.harvest_dirty(dirty) == 0, "harvested pages removed");
+
+    //
+    // Bitmap of 270 bits ends in the middle of its 5th word - page 261
+    // must be reported, page 300 must stay for the next harvest.
+    //
+    const pa_t partial[] = { pa_t::from_pfn(261), pa_t::from_pfn(300) };
+    ept.mark_dirty(partial, 2);
+
+    bitmap short_dirty(270);
+
+    check(ept.harvest_dirty(short_dirty) == 1, "partial word harvested");
+    check(short_dirty.test(261), "page in the partial word reported");
+
+    dirty.clear();
+
+    check(ept.harvest_dirty(dirty) == 1, "page above the short bitmap kept");
+    check(dirty.test(300), "page above the short bitmap reported later");
+
+    ept.destroy();
+  }
+
+  memory_manager::destroy();
+  free(pool);
+
+  printf("%s\n", bad_count ? "FAIL" : "PASS");
+
+  return bad_count != 0;
+}
@@ -0,0 +1,188 @@
+//
+// EPT table pool (ept_table_pool_t) compared to allocating each table
+// separately from the memory manager (how EPT tables used to be allocated).
+//
+// Measures allocation latency (TSC cycles) and teardown time of
+// table_count tables, and their locality - share of tables which follow
+// right after the previously allocated one. Checks that:
+//   - chunks grow 1, 2, 4, ... pages (the first table takes 1 page),
+//   - pool tables are zeroed, also after free() and reuse,
+//   - at least 90% of pool tables are adjacent to the previous one,
+//   - teardown of the pool is faster than freeing tables one by one,
+//   - overlay which remaps nothing reserves just 1 page for its tables.
+//
+// Usage: ept_pool_bench [table_count]
+//
+// Note that global operator new is served by the memory manager, therefore
+// the harness keeps its own data in malloc()-ed buffers.
+//
+#include "support/harness.h"
+
+#include "hvpp/ept.h"
+#include "lib/mm.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+#include <x86intrin.h>
+
+using namespace hvpp;
+
+static int bad_count = 0;
+
+static void check(bool condition, const char* what)
+{
+  if (!condition)
+  {
+    printf("FAIL: %s\n", what);
+    bad_count += 1;
+  }
+}
+
+struct result_t
+{
+  uint64_t p50;
+  uint64_t p99;
+  uint64_t teardown;
+  double   adjacent;
+};
+
+template <typename TAllocate, typename TTeardown>
+static result_t measure(void** table, uint64_t* cycles, int table_count, TAllocate allocate, TTeardown teardown)
+{
+  int adjacent_count = 0;
+
+  for (int i = 0; i < table_count; ++i)
+  {
+    const auto tsc = __rdtsc();
+    table[i] = allocate();
+    cycles[i] = __rdtsc() - tsc;
+
+    adjacent_count += i > 0 && static_cast<uint8_t*>(table[i]) == static_cast<uint8_t*>(table[i - 1]) + ia32::page_size;
+  }
+
+  std::sort(cycles, cycles + table_count);
+
+  const auto tsc = __rdtsc();
+  teardown();
+
+  return {
+    cycles[table_count / 2],
+    cycles[table_count * 99 / 100],
+    __rdtsc() - tsc,
+    100.0 * adjacent_count / (table_count - 1),
+  };
+}
+
+static bool is_zeroed(const void* table)
+{
+  const auto entry = static_cast<const uint64_t*>(table);
+  return std::all_of(entry, entry + 512, [](uint64_t value) { return value == 0; });
+}
+
+int main(int argc, char** argv)
+{
+  const int table_count = std::max(argc > 1 ? atoi(argv[1]) : 8192, 16);
+
+  harness::setup_msrs(true);
+  harness::setup_physical_memory(1, 4ull << 30, 0);
+
+  const size_t pool_size = 128 * 1024 * 1024;
+  const auto pool = aligned_alloc(ia32::page_size, pool_size);
+  memory_manager::initialize(pool, pool_size);
+
+  const auto table  = static_cast<void**>(malloc(table_count * sizeof(void*)));
+  const auto cycles = static_cast<uint64_t*>(malloc(table_count * sizeof(uint64_t)));
+
+  //
+  // Chunk growth.
+  //
+  {
+    static ept_table_pool_t table_pool;
+    table_pool.initialize();
+
+    uint32_t expected_page_count = 0;
+
+    for (int i = 0; i < 15; ++i)
+    {
+      const auto page = table_pool.allocate();
+      check(page && is_zeroed(page), "pool table zeroed");
+
+      if (i == 0 || i == 1 || i == 3 || i == 7)
+      {
+        expected_page_count = expected_page_count * 2 + 1;
+      }
+
+      check(table_pool.page_count() == expected_page_count, "chunks grow 1, 2, 4, 8 pages");
+
+      page[i].flags = 0x7;
+      table_pool.free(page);
+
+      check(table_pool.allocate() == page && is_zeroed(page), "freed table reused zeroed");
+    }
+
+    table_pool.destroy();
+  }
+
+  //
+  // Overlay.
+  //
+  {
+    static ept_t shared;
+    static ept_t overlay;
+
+    shared.initialize();
+    shared.map_identity();
+
+    const auto allocated_bytes = memory_manager::allocated_bytes();
+    overlay.initialize(shared);
+
+    check(memory_manager::allocated_bytes() - allocated_bytes == ia32::page_size, "overlay reserves 1 page");
+
+    overlay.destroy();
+    shared.destroy();
+  }
+
+  //
+  // Pool vs. memory manager.
+  //
+  static ept_table_pool_t table_pool;
+  table_pool.initialize();
+
+  const auto pool_result = measure(table, cycles, table_count,
+    [] { return static_cast<void*>(table_pool.allocate()); },
+    [] { table_pool.destroy(); });
+
+  const auto mm_result = measure(table, cycles, table_count,
+    [] { return memory_manager::allocate_zeroed(ia32::page_size); },
+    [&] {
+      for (int i = 0; i < table_count; ++i)
+      {
+        memory_manager::free(table[i]);
+      }
+    });
+
+  printf("%d tables:\n", table_count);
+  printf("  %-15s %10s %10s %14s %10s\n", "", "p50", "p99", "teardown", "adjacent");
+  printf("  %-15s %10llu %10llu %14llu %9.1f%%\n", "table pool",
+    (unsigned long long)pool_result.p50, (unsigned long long)pool_result.p99,
+    (unsigned long long)pool_result.teardown, pool_result.adjacent);
+  printf("  %-15s %10llu %10llu %14llu %9.1f%%\n", "memory manager",
+    (unsigned long long)mm_result.p50, (unsigned long long)mm_result.p99,
+    (unsigned long long)mm_result.teardown, mm_result.adjacent);
+
+  check(pool_result.adjacent >= 90.0, "pool tables adjacent");
+  check(pool_result.teardown < mm_result.teardown, "pool teardown faster");
+  check(memory_manager::allocated_bytes() == 0, "everything freed");
+
+  free(cycles);
+  free(table);
+
+  memory_manager::destroy();
+  free(pool);
+
+  printf("%s\n", bad_count ? "FAIL" : "PASS");
+
+  return bad_count != 0;
+}
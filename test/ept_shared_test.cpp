@@ -0,0 +1,168 @@
+//
+// Memory and build time of one shared identity EPT with per-VCPU overlays,
+// compared to one standalone identity EPT per VCPU (how VCPUs used to
+// build their EPTs).
+//
+// 64GB of physical memory in 8 ranges with 4kb-misaligned boundaries (1GB
+// pages disabled), 32 VCPUs. Each VCPU remaps one hook page (like
+// custom_vmexit_handler does) - in its own standalone EPT, or in its
+// overlay of the shared EPT. Checks that:
+//   - the shared EPT with overlays takes at most 1/8 of the memory,
+//   - each overlay copies only the tables on the path to the hook page,
+//   - all VCPUs see the same translations, except of their own hook page.
+//
+// Usage: ept_shared_test [vcpu_count]
+//
+#include "support/harness.h"
+
+#include "hvpp/ept.h"
+#include "lib/mm.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace hvpp;
+
+static int bad_count = 0;
+
+static void check(bool condition, const char* what)
+{
+  if (!condition)
+  {
+    printf("FAIL: %s\n", what);
+    bad_count += 1;
+  }
+}
+
+static constexpr int      max_vcpu_count = 64;
+static constexpr uint64_t hook_pa        = 0x40000000 + 0x123000;
+static constexpr uint64_t hook_host_pa   = 0x80000000;
+
+static const uint64_t samples[] = {
+  0x100000, 0x101000, 0x7fe000, 0x40000000, 0x40124000, 0x200000000, 0x200001000, 0xf00000000,
+};
+
+static double elapsed_ms(std::chrono::steady_clock::time_point begin)
+{
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+}
+
+static bool translations_match(ept_t& ept, ept_t& reference)
+{
+  for (const auto pa : samples)
+  {
+    pa_t host_pa, reference_host_pa;
+
+    if (ept.translate(pa_t(pa), host_pa) != reference.translate(pa_t(pa), reference_host_pa) ||
+        host_pa != reference_host_pa)
+    {
+      return false;
+    }
+  }
+
+  pa_t host_pa;
+  return ept.translate(pa_t(hook_pa), host_pa) && host_pa.value() == hook_host_pa;
+}
+
+int main(int argc, char** argv)
+{
+  const int vcpu_count = std::min(argc > 1 ? atoi(argv[1]) : 32, max_vcpu_count);
+
+  harness::setup_msrs(false);
+  harness::setup_physical_memory(8, (8ull << 30) + 0x3000, 0x5000);
+
+  const size_t pool_size = 64 * 1024 * 1024;
+  const auto pool = aligned_alloc(ia32::page_size, pool_size);
+  memory_manager::initialize(pool, pool_size);
+
+  static ept_t ept[max_vcpu_count];
+
+  //
+  // Standalone EPT per VCPU.
+  //
+  auto bytes_before = memory_manager::allocated_bytes();
+  auto begin = std::chrono::steady_clock::now();
+
+  for (int i = 0; i < vcpu_count; ++i)
+  {
+    ept[i].initialize();
+    ept[i].map_identity();
+    ept[i].map_4kb(pa_t(hook_pa), pa_t(hook_host_pa));
+  }
+
+  const double standalone_ms = elapsed_ms(begin);
+  const auto standalone_bytes = memory_manager::allocated_bytes() - bytes_before;
+
+  for (int i = 0; i < vcpu_count; ++i)
+  {
+    check(translations_match(ept[i], ept[0]), "standalone translations");
+  }
+
+  for (int i = 0; i < vcpu_count; ++i)
+  {
+    ept[i].destroy();
+  }
+
+  //
+  // Shared EPT with overlay per VCPU.
+  //
+  static ept_t shared;
+
+  bytes_before = memory_manager::allocated_bytes();
+  begin = std::chrono::steady_clock::now();
+
+  shared.initialize();
+  shared.map_identity();
+
+  for (int i = 0; i < vcpu_count; ++i)
+  {
+    ept[i].initialize(shared);
+    ept[i].map_4kb(pa_t(hook_pa), pa_t(hook_host_pa));
+  }
+
+  const double shared_ms = elapsed_ms(begin);
+  const auto shared_bytes = memory_manager::allocated_bytes() - bytes_before;
+
+  for (int i = 0; i < vcpu_count; ++i)
+  {
+    check(translations_match(ept[i], ept[0]), "overlay translations");
+
+    //
+    // Root, PDPT, PD and PT on the path to the hook page.
+    //
+    uint32_t table_count = 0;
+
+    for (auto level = page_table_level::pt; level <= ept[i].root_level(); level = level + 1)
+    {
+      table_count += ept[i].table_count(level);
+    }
+
+    check(table_count == 4, "overlay copies only the path to the hook page");
+  }
+
+  pa_t host_pa;
+  check(shared.translate(pa_t(hook_pa), host_pa) && host_pa.value() == hook_pa, "hook page not visible in the shared EPT");
+
+  printf("%d VCPUs:\n", vcpu_count);
+  printf("  standalone EPTs:       %8zu kB, %8.2f ms\n", standalone_bytes / 1024, standalone_ms);
+  printf("  shared EPT + overlays: %8zu kB, %8.2f ms\n", shared_bytes / 1024, shared_ms);
+
+  check(shared_bytes * 8 <= standalone_bytes, "shared EPT saves memory");
+
+  for (int i = 0; i < vcpu_count; ++i)
+  {
+    ept[i].destroy();
+  }
+
+  shared.destroy();
+
+  check(memory_manager::allocated_bytes() == 0, "everything freed");
+
+  memory_manager::destroy();
+  free(pool);
+
+  printf("%s\n", bad_count ? "FAIL" : "PASS");
+
+  return bad_count != 0;
+}
@@ -0,0 +1,295 @@
+//
+// Check of "suppress #VE" bit handling (HVPP_ENABLE_VE) against a simulated
+// VMCS and a mocked processor.
+//
+// mock_vmcs holds the VMCS fields which setup_guest() writes when the
+// processor grants "EPT-violation #VE" (the control itself, the #VE
+// information area address and the EPTP index). mock_access() walks the
+// EPT from the EPT pointer like the processor does and, on EPT violation,
+// decides between #VE and VM-exit by the rules of Vol3C[25.5.6.1]: #VE is
+// delivered only if the control is enabled, the entry which caused the
+// violation has "suppress #VE" bit clear and the information area isn't
+// busy (dword at offset 4 isn't 0xFFFFFFFF). Checks that:
+//   - every entry of the identity EPT (also not-present entries and large
+//     pages) has "suppress #VE" set, so that nothing converts by default,
+//   - suppress_ve() in the overlay splits the 1GB page, copies only the
+//     path to the page and leaves the shared EPT untouched,
+//   - the transaction records INVEPT only when the bit actually changes,
+//   - write to a convertible write-protected page is delivered as #VE
+//     with correct information, other violations cause VM-exit,
+//   - convertible page isn't merged into a large page, but is merged
+//     again after "suppress #VE" is set back.
+//
+// Usage: ept_ve_test
+//
+#include "support/harness.h"
+
+#include "hvpp/ept.h"
+#include "ia32/vmx/ve_info.h"
+#include "lib/mm.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace hvpp;
+
+static int bad_count = 0;
+
+static void check(bool condition, const char* what)
+{
+  if (!condition)
+  {
+    printf("FAIL: %s\n", what);
+    bad_count += 1;
+  }
+}
+
+//
+// Layout of the information area (ref: Vol3C[25.5.6.2]).
+//
+static_assert(offsetof(vmx::ve_info_t, exit_reason)            ==  0);
+static_assert(offsetof(vmx::ve_info_t, busy)                   ==  4);
+static_assert(offsetof(vmx::ve_info_t, exit_qualification)     ==  8);
+static_assert(offsetof(vmx::ve_info_t, guest_linear_address)   == 16);
+static_assert(offsetof(vmx::ve_info_t, guest_physical_address) == 24);
+static_assert(offsetof(vmx::ve_info_t, eptp_index)             == 32);
+static_assert(alignof(vmx::ve_info_t) == ia32::page_size);
+
+static constexpr uint64_t convertible_pa = 0x40000000 + 0x123000;
+static constexpr uint64_t neighbour_pa   = 0x40000000 + 0x124000;
+static constexpr uint64_t unmapped_pa    = 64ull << 30;
+
+static constexpr uint32_t ve_busy        = 0xFFFFFFFF;
+static constexpr uint32_t exit_reason_ept_violation = 48;
+
+struct mock_vmcs_t
+{
+  bool      ept_violation_ve;
+  pa_t      ve_info_address;
+  uint16_t  eptp_index;
+  ept_ptr_t ept_pointer;
+};
+
+static mock_vmcs_t mock_vmcs;
+static vmx::ve_info_t ve_info;
+
+enum class outcome
+{
+  success,
+  vmexit,
+  ve,
+};
+
+static constexpr uint64_t access_read  = 1;
+static constexpr uint64_t access_write = 2;
+
+static const epte_t* mock_walk(ept_ptr_t eptp, uint64_t guest_pa)
+{
+  auto table = static_cast<const epte_t*>(pa_t::from_pfn(eptp.page_frame_number).va());
+
+  for (int level = static_cast<int>(eptp.page_walk_length); level >= 0; --level)
+  {
+    const auto& entry = table[(guest_pa >> (12 + 9 * level)) & 511];
+
+    if (!entry.is_present() || level == 0 || entry.large_page)
+    {
+      return &entry;
+    }
+
+    table = static_cast<const epte_t*>(pa_t::from_pfn(entry.page_frame_number).va());
+  }
+
+  return nullptr;
+}
+
+static outcome mock_access(uint64_t guest_pa, uint64_t access)
+{
+  const auto entry = mock_walk(mock_vmcs.ept_pointer, guest_pa);
+
+  if (entry->is_present() &&
+      (!(access & access_read)  || entry->read_access) &&
+      (!(access & access_write) || entry->write_access))
+  {
+    return outcome::success;
+  }
+
+  auto& info = *static_cast<vmx::ve_info_t*>(mock_vmcs.ve_info_address.va());
+
+  if (!mock_vmcs.ept_violation_ve || entry->suppress_ve || info.busy == ve_busy)
+  {
+    return outcome::vmexit;
+  }
+
+  info.exit_reason            = exit_reason_ept_violation;
+  info.busy                   = ve_busy;
+  info.exit_qualification     = access | (entry->flags & 7) << 3;
+  info.guest_linear_address   = 0;
+  info.guest_physical_address = guest_pa;
+  info.eptp_index             = mock_vmcs.eptp_index;
+
+  return outcome::ve;
+}
+
+static bool all_entries_suppressed(const epte_t* table, int level)
+{
+  for (int i = 0; i < 512; ++i)
+  {
+    const auto& entry = table[i];
+
+    if (!entry.suppress_ve)
+    {
+      return false;
+    }
+
+    if (entry.is_present() && level > 0 && !entry.large_page &&
+        !all_entries_suppressed(static_cast<const epte_t*>(pa_t::from_pfn(entry.page_frame_number).va()), level - 1))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool all_entries_suppressed(ept_t& ept)
+{
+  const auto eptp = ept.ept_pointer();
+
+  return all_entries_suppressed(
+    static_cast<const epte_t*>(pa_t::from_pfn(eptp.page_frame_number).va()),
+    static_cast<int>(eptp.page_walk_length));
+}
+
+static uint32_t total_table_count(ept_t& ept)
+{
+  uint32_t result = 0;
+
+  for (auto level = page_table_level::pt; level <= ept.root_level(); level = level + 1)
+  {
+    result += ept.table_count(level);
+  }
+
+  return result;
+}
+
+int main()
+{
+  harness::setup_msrs(true);
+  harness::setup_physical_memory(1, 4ull << 30, 0);
+
+  const size_t pool_size = 64 * 1024 * 1024;
+  const auto pool = aligned_alloc(ia32::page_size, pool_size);
+  memory_manager::initialize(pool, pool_size);
+
+  {
+    static ept_t shared;
+    shared.initialize();
+    shared.map_identity();
+
+    //
+    // VMCS set up like setup_guest() does when the processor grants
+    // "EPT-violation #VE".
+    //
+    mock_vmcs.ept_violation_ve = true;
+    mock_vmcs.ve_info_address = pa_t::from_va(&ve_info);
+    mock_vmcs.eptp_index = 0;
+    mock_vmcs.ept_pointer = shared.ept_pointer();
+
+    check(all_entries_suppressed(shared), "identity EPT suppresses #VE everywhere");
+    check(mock_access(convertible_pa, access_write) == outcome::success, "mapped page accessible");
+    check(mock_access(unmapped_pa, access_read) == outcome::vmexit, "unmapped page causes VM-exit");
+    check(ve_info.busy == 0, "nothing delivered");
+
+    //
+    // Convertible page in the overlay.
+    //
+    static ept_t overlay;
+    overlay.initialize(shared);
+    mock_vmcs.ept_pointer = overlay.ept_pointer();
+
+    {
+      ept_transaction_t transaction(overlay);
+
+      const auto entry = transaction.suppress_ve(pa_t(convertible_pa), false);
+      check(entry && !entry->suppress_ve, "page convertible");
+
+      check(transaction.suppress_ve(pa_t(convertible_pa), false) == entry, "same page again");
+      check(!transaction.suppress_ve(pa_t(unmapped_pa), false), "unmapped page can't be convertible");
+
+      transaction.commit();
+
+      //
+      // 3 remaps, single INVEPT.
+      //
+      check(transaction.flushes_avoided() == 5, "INVEPT recorded once");
+
+      transaction.suppress_ve(pa_t(convertible_pa), false);
+      transaction.commit();
+
+      check(transaction.flushes_avoided() == 7, "no INVEPT without change");
+    }
+
+    page_table_level level;
+    const auto shared_entry = shared.lookup(pa_t(convertible_pa), level);
+
+    check(shared_entry && shared_entry->suppress_ve && level == page_table_level::pdpt, "shared 1GB page untouched");
+    check(all_entries_suppressed(shared), "shared EPT untouched");
+    check(total_table_count(overlay) == 4, "overlay copied only the path to the page");
+    check(mock_walk(overlay.ept_pointer(), neighbour_pa)->suppress_ve, "neighbour page not convertible");
+
+    //
+    // Write-protect the convertible page and its neighbour.
+    //
+    overlay.map_4kb(pa_t(convertible_pa), pa_t(convertible_pa), epte_t::access_type::read_execute);
+    overlay.map_4kb(pa_t(neighbour_pa), pa_t(neighbour_pa), epte_t::access_type::read_execute);
+
+    check(!mock_walk(overlay.ept_pointer(), convertible_pa)->suppress_ve, "remap keeps the page convertible");
+    check(mock_access(convertible_pa, access_read) == outcome::success, "read allowed");
+    check(mock_access(neighbour_pa, access_write) == outcome::vmexit, "neighbour write causes VM-exit");
+
+    mock_vmcs.eptp_index = 3;
+
+    check(mock_access(convertible_pa + 0x10, access_write) == outcome::ve, "write delivered as #VE");
+    check(ve_info.exit_reason == exit_reason_ept_violation &&
+          ve_info.busy == ve_busy &&
+          ve_info.guest_physical_address == convertible_pa + 0x10 &&
+          ve_info.exit_qualification == (access_write | 0b101 << 3) &&
+          ve_info.eptp_index == 3, "#VE information");
+
+    check(mock_access(convertible_pa, access_write) == outcome::vmexit, "busy information area causes VM-exit");
+
+    ve_info.busy = 0;
+    check(mock_access(convertible_pa, access_write) == outcome::ve, "#VE after the guest released the area");
+
+    ve_info.busy = 0;
+    mock_vmcs.ept_violation_ve = false;
+    check(mock_access(convertible_pa, access_write) == outcome::vmexit, "control disabled causes VM-exit");
+
+    //
+    // Merging.
+    //
+    overlay.map_4kb(pa_t(neighbour_pa), pa_t(neighbour_pa));
+    overlay.map_4kb(pa_t(convertible_pa), pa_t(convertible_pa));
+
+    check(overlay.lookup(pa_t(convertible_pa), level) && level == page_table_level::pt, "convertible page not merged");
+
+    overlay.suppress_ve(pa_t(convertible_pa), true);
+    overlay.map_4kb(pa_t(convertible_pa), pa_t(convertible_pa));
+
+    const auto merged_entry = overlay.lookup(pa_t(convertible_pa), level);
+    check(merged_entry && merged_entry->suppress_ve && level != page_table_level::pt, "merged after suppress #VE set back");
+    check(all_entries_suppressed(overlay), "overlay suppresses #VE everywhere again");
+
+    overlay.destroy();
+    shared.destroy();
+  }
+
+  check(memory_manager::allocated_bytes() == 0, "everything freed");
+
+  memory_manager::destroy();
+  free(pool);
+
+  printf("%s\n", bad_count ? "FAIL" : "PASS");
+
+  return bad_count != 0;
+}
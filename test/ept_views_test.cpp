@@ -0,0 +1,224 @@
+//
+// Check of EPT views (ept_views_t) against a mocked VMFUNC.
+//
+// mock_vmfunc_eptp_switch() does what the processor does for VMFUNC leaf 0
+// (EPTP switching): it reads the selected entry of the EPTP list (through
+// the physical address the VMCS would hold) and fails for an invalid
+// entry. mock_translate() then walks the EPT from that EPTP like the
+// processor does, so that only the hardware-visible structures are checked.
+//
+// A read/execute split hook is set up: view 0 maps the hooked page
+// read/write to the original page, view 1 execute-only to its copy.
+// Checks that:
+//   - switching views through the EPTP list changes the translation,
+//   - views share unmodified subtrees with the shared EPT (untouched view
+//     owns just its root table),
+//   - destroyed view can't be switched to and its index is reused,
+//   - all 512 views can be created, each taking 1 table page (plus the
+//     ept_t object).
+//
+// Usage: ept_views_test
+//
+#include "support/harness.h"
+
+#include "hvpp/ept.h"
+#include "lib/mm.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace hvpp;
+
+static int bad_count = 0;
+
+static void check(bool condition, const char* what)
+{
+  if (!condition)
+  {
+    printf("FAIL: %s\n", what);
+    bad_count += 1;
+  }
+}
+
+static constexpr uint64_t hook_pa      = 0x40000000 + 0x123000;
+static constexpr uint64_t hook_copy_pa = 0x80000000;
+static constexpr uint64_t other_pa     = 0x40000000 + 0x456000;
+
+static bool mock_vmfunc_eptp_switch(pa_t eptp_list_address, uint32_t index, ept_ptr_t& eptp)
+{
+  //
+  // Index out of the list or invalid EPTP causes VM-exit instead.
+  //
+  if (index >= ept_views_t::max_view_count)
+  {
+    return false;
+  }
+
+  eptp = static_cast<const ept_ptr_t*>(eptp_list_address.va())[index];
+
+  return eptp.page_walk_length == ept_ptr_t::page_walk_length_4 ||
+         eptp.page_walk_length == ept_ptr_t::page_walk_length_5;
+}
+
+static const epte_t* mock_translate(ept_ptr_t eptp, uint64_t guest_pa, uint64_t& host_pa)
+{
+  auto table = static_cast<const epte_t*>(pa_t::from_pfn(eptp.page_frame_number).va());
+
+  for (int level = static_cast<int>(eptp.page_walk_length); level >= 0; --level)
+  {
+    const auto& entry = table[(guest_pa >> (12 + 9 * level)) & 511];
+
+    if (!entry.is_present())
+    {
+      return nullptr;
+    }
+
+    if (level == 0 || entry.large_page)
+    {
+      const uint64_t page_mask = (1ull << (12 + 9 * level)) - 1;
+      host_pa = (pa_t::from_pfn(entry.page_frame_number).value() & ~page_mask) | (guest_pa & page_mask);
+      return &entry;
+    }
+
+    table = static_cast<const epte_t*>(pa_t::from_pfn(entry.page_frame_number).va());
+  }
+
+  return nullptr;
+}
+
+static bool check_view(ept_views_t& views, int index, uint64_t expected_host_pa, bool expected_write, bool expected_execute)
+{
+  ept_ptr_t eptp;
+  uint64_t host_pa = 0;
+
+  if (!mock_vmfunc_eptp_switch(views.eptp_list_address(), index, eptp) ||
+      eptp.flags != views[index].ept_pointer().flags)
+  {
+    return false;
+  }
+
+  const auto entry = mock_translate(eptp, hook_pa, host_pa);
+
+  return entry &&
+         host_pa == expected_host_pa &&
+         entry->read_access == !expected_execute &&
+         entry->write_access == expected_write &&
+         entry->execute_access == expected_execute &&
+         mock_translate(eptp, other_pa, host_pa) && host_pa == other_pa;
+}
+
+static uint32_t total_table_count(ept_t& ept)
+{
+  uint32_t result = 0;
+
+  for (auto level = page_table_level::pt; level <= ept.root_level(); level = level + 1)
+  {
+    result += ept.table_count(level);
+  }
+
+  return result;
+}
+
+int main()
+{
+  harness::setup_msrs(true);
+  harness::setup_physical_memory(1, 4ull << 30, 0);
+
+  const size_t pool_size = 64 * 1024 * 1024;
+  const auto pool = aligned_alloc(ia32::page_size, pool_size);
+  memory_manager::initialize(pool, pool_size);
+
+  {
+    static ept_t shared;
+    shared.initialize();
+    shared.map_identity();
+
+    static ept_views_t views;
+    views.initialize(shared);
+
+    check(views.count() == 1 && views.contains(0), "default view");
+
+    //
+    // Split hook.
+    //
+    const int exec_view = views.create();
+    check(exec_view == 1, "second view");
+
+    views[0].map_4kb(pa_t(hook_pa), pa_t(hook_pa), epte_t::access_type::read_write);
+    views[exec_view].map_4kb(pa_t(hook_pa), pa_t(hook_copy_pa), epte_t::access_type::execute);
+
+    check(check_view(views, 0, hook_pa, true, false), "view 0 reads the original page");
+    check(check_view(views, exec_view, hook_copy_pa, false, true), "view 1 executes the copy");
+    check(check_view(views, 0, hook_pa, true, false), "switched back to view 0");
+
+    //
+    // Subtree sharing - PML4, PDPT, PD and PT on the path to the hooked
+    // page are private, the rest is borrowed from the shared EPT.
+    //
+    const int untouched_view = views.create();
+
+    check(total_table_count(views[0]) == 4, "view 0 copied only the path to the hooked page");
+    check(total_table_count(views[untouched_view]) == 1, "untouched view owns only its root");
+
+    {
+      ept_ptr_t eptp;
+      uint64_t host_pa;
+
+      check(mock_vmfunc_eptp_switch(views.eptp_list_address(), untouched_view, eptp) &&
+            mock_translate(eptp, hook_pa, host_pa) == shared.lookup(pa_t(hook_pa)),
+            "untouched view walks into the shared tables");
+    }
+
+    //
+    // Destroyed view.
+    //
+    views.destroy(untouched_view);
+
+    {
+      ept_ptr_t eptp;
+      check(!mock_vmfunc_eptp_switch(views.eptp_list_address(), untouched_view, eptp), "destroyed view can't be switched to");
+      check(!mock_vmfunc_eptp_switch(views.eptp_list_address(), ept_views_t::max_view_count, eptp), "index out of the list");
+    }
+
+    check(views.create() == untouched_view, "index reused");
+
+    //
+    // All views.
+    //
+    const auto allocated_bytes = memory_manager::allocated_bytes();
+    const int created_count = ept_views_t::max_view_count - views.count();
+
+    for (int i = 0; i < created_count; ++i)
+    {
+      check(views.create() != -1, "view created");
+    }
+
+    check(views.count() == ept_views_t::max_view_count, "512 views");
+    check(views.create() == -1, "no free view");
+
+    const auto bytes_per_view = (memory_manager::allocated_bytes() - allocated_bytes) / created_count;
+    printf("%d views, %zu bytes per view\n", views.count(), bytes_per_view);
+
+    check(bytes_per_view <= 2 * ia32::page_size, "view takes its root table and the ept_t");
+
+    for (int i = 0; i < ept_views_t::max_view_count; ++i)
+    {
+      ept_ptr_t eptp;
+      check(mock_vmfunc_eptp_switch(views.eptp_list_address(), i, eptp) && eptp.flags == views[i].ept_pointer().flags, "EPTP list entry");
+    }
+
+    check(check_view(views, exec_view, hook_copy_pa, false, true), "hook survives other views");
+
+    views.destroy();
+    shared.destroy();
+  }
+
+  check(memory_manager::allocated_bytes() == 0, "everything freed");
+
+  memory_manager::destroy();
+  free(pool);
+
+  printf("%s\n", bad_count ? "FAIL" : "PASS");
+
+  return bad_count != 0;
+}
@@ -0,0 +1,97 @@
+#pragma once
+//
+// Minimal stand-in for the MSVC <intrin.h>, so that hvpp sources can be
+// compiled with GCC/Clang in the user-mode harness. Privileged intrinsics
+// are no-ops; MSRs are read from the table provided by the harness.
+//
+#include <x86intrin.h>
+
+#include <cstdint>
+
+#define _In_
+#define _Out_
+#define _Inout_
+#define _In_opt_
+#define _Out_opt_
+
+//
+// This is where hvpp_assert() ends up (see support/kernel.cpp).
+//
+#define __debugbreak() harness_debug_break(__FILE__, __LINE__)
+
+void harness_debug_break(const char* file, int line) noexcept;
+
+#define _ReturnAddress() __builtin_return_address(0)
+
+uint64_t harness_read_msr(unsigned long msr_id) noexcept;
+
+inline void __cpuid(int cpu_info[4], int)                    { cpu_info[0] = cpu_info[1] = cpu_info[2] = cpu_info[3] = 0; }
+inline void __cpuidex(int cpu_info[4], int, int)             { cpu_info[0] = cpu_info[1] = cpu_info[2] = cpu_info[3] = 0; }
+
+inline unsigned char  __inbyte(unsigned short)               { return 0; }
+inline unsigned short __inword(unsigned short)               { return 0; }
+inline unsigned long  __indword(unsigned short)              { return 0; }
+inline void __inbytestring(unsigned short, unsigned char*, unsigned long)    { }
+inline void __inwordstring(unsigned short, unsigned short*, unsigned long)   { }
+inline void __indwordstring(unsigned short, unsigned long*, unsigned long)   { }
+inline void __outbyte(unsigned short, unsigned char)         { }
+inline void __outword(unsigned short, unsigned short)        { }
+inline void __outdword(unsigned short, unsigned long)        { }
+inline void __outbytestring(unsigned short, unsigned char*, unsigned long)   { }
+inline void __outwordstring(unsigned short, unsigned short*, unsigned long)  { }
+inline void __outdwordstring(unsigned short, unsigned long*, unsigned long)  { }
+
+inline void __sidt(void*)                                    { }
+inline void __lidt(void*)                                    { }
+inline uint64_t __readcr0()                                  { return 0; }
+inline uint64_t __readcr2()                                  { return 0; }
+inline uint64_t __readcr3()                                  { return 0; }
+inline uint64_t __readcr4()                                  { return 0; }
+inline void __writecr0(uint64_t)                             { }
+inline void __writecr2(uint64_t)                             { }
+inline void __writecr3(uint64_t)                             { }
+inline void __writecr4(uint64_t)                             { }
+inline uint64_t __readdr(unsigned)                           { return 0; }
+inline void __writedr(unsigned, uint64_t)                    { }
+inline uint64_t __readmsr(unsigned long msr_id)              { return harness_read_msr(msr_id); }
+inline void __writemsr(unsigned long, uint64_t)              { }
+inline void __clts()                                         { }
+inline void __wbinvd()                                       { }
+
+inline unsigned char __vmx_on(uint64_t*)                     { return 0; }
+inline void          __vmx_off()                             { }
+inline unsigned char __vmx_vmlaunch()                        { return 0; }
+inline unsigned char __vmx_vmresume()                        { return 0; }
+inline unsigned char __vmx_vmclear(uint64_t*)                { return 0; }
+inline unsigned char __vmx_vmread(size_t, size_t*)           { return 0; }
+inline unsigned char __vmx_vmwrite(size_t, size_t)           { return 0; }
+inline void          __vmx_vmptrst(uint64_t*)                { }
+inline unsigned char __vmx_vmptrld(uint64_t*)                { return 0; }
+
+inline unsigned char _BitScanForward64(unsigned long* index, uint64_t mask)
+{
+  if (!mask) return 0;
+  *index = __builtin_ctzll(mask);
+  return 1;
+}
+
+inline unsigned char _BitScanReverse64(unsigned long* index, uint64_t mask)
+{
+  if (!mask) return 0;
+  *index = 63 - __builtin_clzll(mask);
+  return 1;
+}
+
+inline unsigned char _bittest(const long* base, long offset)
+{
+  return (reinterpret_cast<const uint32_t*>(base)[offset >> 5] >> (offset & 31)) & 1;
+}
+
+inline unsigned char _bittestandset(long* base, long offset)
+{
+  const unsigned char result = _bittest(base, offset);
+  reinterpret_cast<uint32_t*>(base)[offset >> 5] |= 1u << (offset & 31);
+  return result;
+}
+
+inline uint64_t __popcnt64(uint64_t value)                   { return __builtin_popcountll(value); }
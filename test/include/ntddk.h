@@ -0,0 +1,27 @@
+#pragma once
+//
+// Minimal stand-in for the WDK <ntddk.h> - only what the hvpp sources
+// compiled into the user-mode harness need. The functions are implemented
+// by the harness (see support/kernel.cpp).
+//
+#include <cstddef>
+#include <cstdint>
+
+typedef long          NTSTATUS;
+typedef void*         PVOID;
+typedef long long     LONGLONG;
+
+typedef union _LARGE_INTEGER
+{
+  LONGLONG QuadPart;
+} LARGE_INTEGER, PHYSICAL_ADDRESS;
+
+typedef struct _PHYSICAL_MEMORY_RANGE
+{
+  PHYSICAL_ADDRESS BaseAddress;
+  LARGE_INTEGER    NumberOfBytes;
+} PHYSICAL_MEMORY_RANGE, *PPHYSICAL_MEMORY_RANGE;
+
+PHYSICAL_ADDRESS       MmGetPhysicalAddress(PVOID BaseAddress);
+PVOID                  MmGetVirtualForPhysical(PHYSICAL_ADDRESS PhysicalAddress);
+PPHYSICAL_MEMORY_RANGE MmGetPhysicalMemoryRanges();
@@ -0,0 +1,359 @@
+//
+// Check of the growable memory manager - arenas backed by mmap()-ed memory
+// (in the driver they're allocated from the nonpaged pool by a thread at
+// passive level).
+//
+// The first arena is given to initialize(), the watermark is set to a
+// quarter of it. Checks that:
+//   - arena_needed() turns on only below the watermark, allocations in
+//     root mode below it are counted by low_memory_root_allocation_count
+//     (and the ones outside of root mode aren't),
+//   - exhausted arena makes allocations fail (failed_allocation_count),
+//     until a new arena is added,
+//   - allocations try the arenas in order - memory freed in the first
+//     arena is used again before the second one,
+//   - allocation too big for the free space of the first arena is served
+//     by the second one,
+//   - per-arena statistics match the allocations made in each arena,
+//   - no more than max_arena_count arenas can be added,
+//   - thread polling arena_needed() and adding arenas keeps a thread
+//     allocating in root mode from ever failing.
+//
+// Usage: mm_arena_test
+//
+// Note that global operator new is served by the memory manager, therefore
+// the harness keeps its own data in malloc()-ed buffers.
+//
+#include "support/harness.h"
+
+#include "lib/mm.h"
+
+#include <sys/mman.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+static int bad_count = 0;
+
+static void check(bool condition, const char* what)
+{
+  if (!condition)
+  {
+    printf("FAIL: %s\n", what);
+    bad_count += 1;
+  }
+}
+
+static constexpr size_t arena_size       = 1024 * 1024;
+static constexpr size_t allocation_size  = 2 * ia32::page_size;
+static constexpr int    max_allocation_count = 4096;
+
+static void*  arena_memory[memory_manager::max_arena_count];
+static int    arena_memory_count;
+
+static void** allocation;
+static int    allocation_count;
+
+static void* map_arena()
+{
+  const auto address = mmap(nullptr, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return address != MAP_FAILED ? address : nullptr;
+}
+
+static bool add_arena()
+{
+  const auto address = map_arena();
+
+  if (!address)
+  {
+    return false;
+  }
+
+  if (!memory_manager::add_arena(address, arena_size))
+  {
+    munmap(address, arena_size);
+    return false;
+  }
+
+  arena_memory[arena_memory_count++] = address;
+  return true;
+}
+
+static bool in_arena(const void* address, int index)
+{
+  const auto base = static_cast<const uint8_t*>(arena_memory[index]);
+  return address >= base && address < base + arena_size;
+}
+
+//
+// Allocates until the allocation fails (or "stop" returns true).
+//
+template <typename TStop>
+static void allocate_until(TStop stop)
+{
+  while (allocation_count < max_allocation_count && !stop())
+  {
+    const auto address = memory_manager::allocate(allocation_size);
+
+    if (!address)
+    {
+      break;
+    }
+
+    allocation[allocation_count++] = address;
+  }
+}
+
+static void free_all()
+{
+  while (allocation_count > 0)
+  {
+    memory_manager::free(allocation[--allocation_count]);
+  }
+}
+
+static void unmap_arenas()
+{
+  while (arena_memory_count > 0)
+  {
+    munmap(arena_memory[--arena_memory_count], arena_size);
+  }
+}
+
+int main()
+{
+  //
+  // Exhausting the arena is expected to fail allocations (and hit their
+  // assertion).
+  //
+  setenv("HVPP_TEST_NOBREAK", "1", 1);
+
+  allocation = static_cast<void**>(malloc(max_allocation_count * sizeof(void*)));
+
+  arena_memory[arena_memory_count++] = map_arena();
+  memory_manager::initialize(arena_memory[0], arena_size);
+
+  const size_t watermark = memory_manager::free_bytes() / 4;
+  memory_manager::set_arena_watermark(watermark);
+
+  check(memory_manager::statistics().arena_count == 1, "first arena");
+  check(!memory_manager::arena_needed(), "no arena needed at start");
+
+  //
+  // Down to the watermark outside of root mode.
+  //
+  allocate_until([&] { return memory_manager::free_bytes() < watermark + allocation_size; });
+
+  check(!memory_manager::arena_needed(), "no arena needed above the watermark");
+
+  allocate_until([&] { return memory_manager::free_bytes() < watermark; });
+
+  check(memory_manager::arena_needed(), "arena needed below the watermark");
+  check(memory_manager::statistics().low_memory_root_allocation_count == 0, "low memory allocation outside of root mode");
+
+  //
+  // The rest in root mode - until the arena is exhausted.
+  //
+  memory_manager::set_root_mode(true);
+
+  const int root_first = allocation_count;
+  allocate_until([] { return false; });
+  const int root_allocation_count = allocation_count - root_first;
+
+  memory_manager::set_root_mode(false);
+
+  {
+    const auto statistics = memory_manager::statistics();
+
+    check(root_allocation_count > 0, "root mode allocations");
+    check(statistics.low_memory_root_allocation_count == static_cast<uint64_t>(root_allocation_count), "low memory root allocations counted");
+    check(statistics.failed_allocation_count == 1, "exhausted arena fails");
+  }
+
+  const int first_arena_allocation_count = allocation_count;
+
+  //
+  // Second arena - allocations succeed again.
+  //
+  check(add_arena(), "second arena added");
+  check(memory_manager::statistics().arena_count == 2, "arena count");
+  check(!memory_manager::arena_needed(), "no arena needed after adding one");
+
+  {
+    const auto address = memory_manager::allocate(allocation_size);
+
+    check(address && in_arena(address, 1), "allocation from the second arena");
+
+    allocation[allocation_count++] = address;
+  }
+
+  //
+  // Memory freed in the first arena is used first.
+  //
+  {
+    memory_manager::free(allocation[0]);
+
+    const auto address = memory_manager::allocate(allocation_size);
+    check(address == allocation[0], "arenas tried in order");
+
+    allocation[0] = address;
+  }
+
+  //
+  // Too big for the free space of the first arena (which is only the freed
+  // allocation).
+  //
+  {
+    memory_manager::free(allocation[0]);
+
+    const auto address = memory_manager::allocate(4 * allocation_size);
+    check(address && in_arena(address, 1), "big allocation from the second arena");
+
+    allocation[0] = address;
+  }
+
+  //
+  // Per-arena statistics.
+  //
+  {
+    const auto first  = memory_manager::arena_statistics(0);
+    const auto second = memory_manager::arena_statistics(1);
+    const auto none   = memory_manager::arena_statistics(2);
+
+    check(first.base_address && in_arena(first.base_address, 0) && first.size <= arena_size, "first arena layout");
+    check(second.base_address && in_arena(second.base_address, 1) && second.size <= arena_size, "second arena layout");
+    check(first.allocated_bytes == (first_arena_allocation_count - 1) * allocation_size, "first arena allocated bytes");
+    check(second.allocated_bytes == 5 * allocation_size, "second arena allocated bytes");
+    check(first.allocation_count == static_cast<uint64_t>(first_arena_allocation_count + 1), "first arena allocation count");
+    check(second.allocation_count == 2, "second arena allocation count");
+    check(first.largest_free_page_count < 4 * allocation_size / ia32::page_size, "first arena free space");
+    check(second.largest_free_page_count >= 4 * allocation_size / ia32::page_size, "second arena free space");
+    check(!none.base_address && !none.size, "statistics of missing arena");
+
+    check(first.allocated_bytes + second.allocated_bytes == memory_manager::allocated_bytes(), "arena bytes add up");
+  }
+
+  //
+  // Arena limit.
+  //
+  while (arena_memory_count < memory_manager::max_arena_count)
+  {
+    if (!add_arena())
+    {
+      break;
+    }
+  }
+
+  check(arena_memory_count == memory_manager::max_arena_count, "arenas up to the limit");
+
+  {
+    const auto address = map_arena();
+    check(!memory_manager::add_arena(address, arena_size), "no arena over the limit");
+    munmap(address, arena_size);
+  }
+
+  check(!memory_manager::arena_needed() || memory_manager::free_bytes() >= watermark, "no arena needed at the limit");
+
+  free_all();
+
+  check(memory_manager::allocated_bytes() == 0, "everything freed");
+
+  memory_manager::destroy();
+  unmap_arenas();
+
+  //
+  // Arenas added by a polling thread while another one allocates in root
+  // mode. The watermark leaves room for the allocations made before the
+  // poller notices.
+  //
+  arena_memory[arena_memory_count++] = map_arena();
+  memory_manager::initialize(arena_memory[0], arena_size);
+  memory_manager::set_arena_watermark(memory_manager::free_bytes() / 2);
+
+  {
+    static constexpr int target_allocation_count = 1000;
+
+    std::atomic<int>  allocated = 0;
+    std::atomic<bool> done = false;
+
+    std::thread poller([&] {
+      harness::set_cpu_index(1);
+
+      while (!done)
+      {
+        if (memory_manager::arena_needed())
+        {
+          add_arena();
+        }
+
+        std::this_thread::yield();
+      }
+    });
+
+    std::thread worker([&] {
+      harness::set_cpu_index(0);
+      memory_manager::set_root_mode(true);
+
+      while (allocation_count < target_allocation_count)
+      {
+        //
+        // Give the poller a chance, like VM-exits spread over time would.
+        //
+        if (memory_manager::arena_needed())
+        {
+          std::this_thread::yield();
+        }
+
+        const auto address = memory_manager::allocate(allocation_size);
+
+        if (!address)
+        {
+          break;
+        }
+
+        allocation[allocation_count++] = address;
+        allocated += 1;
+      }
+
+      memory_manager::set_root_mode(false);
+      done = true;
+    });
+
+    worker.join();
+    poller.join();
+
+    const auto statistics = memory_manager::statistics();
+
+    printf("%d allocations of %zu kB: %llu arenas, %llu low memory root allocations\n",
+      allocated.load(), allocation_size / 1024,
+      (unsigned long long)statistics.arena_count,
+      (unsigned long long)statistics.low_memory_root_allocation_count);
+
+    check(allocated == target_allocation_count, "growing arenas keep root mode allocations going");
+    check(statistics.failed_allocation_count == 0, "no failed allocations while growing");
+    check(statistics.arena_count > 1 && statistics.arena_count == static_cast<uint64_t>(arena_memory_count), "arenas added by the poller");
+  }
+
+  free_all();
+
+  {
+    //
+    // std::thread allocates its state with operator new - the slabs keep
+    // their first empty page.
+    //
+    const auto statistics = memory_manager::statistics();
+
+    check(statistics.slab_object_count == 0 &&
+          memory_manager::allocated_bytes() == statistics.slab_page_count * ia32::page_size, "everything freed");
+  }
+
+  memory_manager::destroy();
+  unmap_arenas();
+  free(allocation);
+
+  printf("%s\n", bad_count ? "FAIL" : "PASS");
+
+  return bad_count != 0;
+}
@@ -0,0 +1,219 @@
+//
+// Multi-threaded stress of the memory manager with per-CPU magazines.
+//
+// Each thread pretends to be a different processor and replays random
+// allocations and frees of its own 256 slots:
+//   - single-page phase: only 1-page allocations (EPT tables, hook pages),
+//   - mixed phase: 90% 1-page and 10% 2-16 page allocations.
+// Every returned range is checked not to overlap any live one (of any
+// thread). Pages of the slabs (std::thread objects of the harness) are
+// single-page allocations too and they are counted in the statistics. Reports global lock acquisitions per operation (allocation or
+// free), contended acquisitions and TSC cycles spent waiting - before the
+// magazines, every operation took the global lock once. Checks that:
+//   - no range is handed out twice and nothing leaks,
+//   - all 1-page operations are served by the magazines,
+//   - 1-page operations take the global lock at most once per 16 of them
+//     (magazines refill and drain in batches of 32 pages), multi-page ones
+//     exactly once.
+//
+// Usage: mm_magazine_stress [thread_count] [operation_count_per_thread]
+//
+// Note that global operator new is served by the memory manager, therefore
+// the harness keeps its own data in malloc()-ed buffers.
+//
+#include "support/harness.h"
+
+#include "lib/mm.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+
+static int bad_count = 0;
+
+static void check(bool condition, const char* what)
+{
+  if (!condition)
+  {
+    printf("FAIL: %s\n", what);
+    bad_count += 1;
+  }
+}
+
+static constexpr int    slot_count = 256;
+static constexpr size_t pool_size  = 256 * 1024 * 1024;
+
+static uint8_t*              pool;
+static std::atomic<uint8_t>* page_owned;
+static std::atomic<int>      overlap_count;
+
+struct thread_result_t
+{
+  uint64_t single_page_count;               // 1-page allocations and frees
+  uint64_t multi_page_count;                // multi-page allocations and frees
+  int      failed_count;
+};
+
+static void mark(uint8_t* address, int page_count, uint8_t owned)
+{
+  const auto first_page = (address - pool) / ia32::page_size;
+
+  for (int page = 0; page < page_count; ++page)
+  {
+    overlap_count += page_owned[first_page + page].exchange(owned) == owned;
+  }
+}
+
+static void stress(int cpu_index, int operation_count, int multi_page_percent, thread_result_t& result)
+{
+  harness::set_cpu_index(cpu_index);
+
+  std::mt19937 rng(cpu_index + 1);
+  uint8_t* slot_address[slot_count] = {};
+  int      slot_page_count[slot_count] = {};
+
+  result = {};
+
+  for (int i = 0; i < operation_count; ++i)
+  {
+    const int slot = rng() % slot_count;
+
+    if (const auto address = slot_address[slot])
+    {
+      mark(address, slot_page_count[slot], 0);
+      memory_manager::free(address);
+
+      (slot_page_count[slot] == 1 ? result.single_page_count : result.multi_page_count) += 1;
+      slot_address[slot] = nullptr;
+      continue;
+    }
+
+    const int page_count = static_cast<int>(rng() % 100) < multi_page_percent
+      ? 2 + rng() % 15
+      : 1;
+
+    const auto address = static_cast<uint8_t*>(memory_manager::allocate(page_count * ia32::page_size));
+
+    if (!address)
+    {
+      result.failed_count += 1;
+      continue;
+    }
+
+    mark(address, page_count, 1);
+
+    (page_count == 1 ? result.single_page_count : result.multi_page_count) += 1;
+    slot_address[slot] = address;
+    slot_page_count[slot] = page_count;
+  }
+
+  for (int slot = 0; slot < slot_count; ++slot)
+  {
+    if (const auto address = slot_address[slot])
+    {
+      mark(address, slot_page_count[slot], 0);
+      memory_manager::free(address);
+
+      (slot_page_count[slot] == 1 ? result.single_page_count : result.multi_page_count) += 1;
+    }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  const int thread_count = std::min(std::max(argc > 1 ? atoi(argv[1]) : 4, 1), 64);
+  const int operation_count = std::max(argc > 2 ? atoi(argv[2]) : 200000, 1);
+
+  pool = static_cast<uint8_t*>(aligned_alloc(ia32::page_size, pool_size));
+  page_owned = static_cast<std::atomic<uint8_t>*>(calloc(pool_size / ia32::page_size, sizeof(std::atomic<uint8_t>)));
+
+  const auto result = static_cast<thread_result_t*>(calloc(thread_count, sizeof(thread_result_t)));
+
+  static const struct
+  {
+    const char* name;
+    int         multi_page_percent;
+  } phases[] = {
+    { "single-page", 0  },
+    { "mixed",       10 },
+  };
+
+  printf("%d threads, %d operations each:\n", thread_count, operation_count);
+  printf("  %-12s %10s %10s %12s %10s %12s %14s\n", "",
+    "ms", "locks", "locks/op", "contended", "wait/op", "magazine hits");
+
+  for (const auto& phase : phases)
+  {
+    memory_manager::initialize(pool, pool_size);
+
+    std::vector<std::thread> threads;
+    const auto begin = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < thread_count; ++i)
+    {
+      threads.emplace_back(stress, i, operation_count, phase.multi_page_percent, std::ref(result[i]));
+    }
+
+    for (auto& thread : threads)
+    {
+      thread.join();
+    }
+
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+
+    //
+    // Threads are gone, the vector can be freed (it's allocated by the
+    // memory manager).
+    //
+    threads = std::vector<std::thread>();
+
+    uint64_t single_page_count = 0;
+    uint64_t multi_page_count = 0;
+    int failed_count = 0;
+
+    for (int i = 0; i < thread_count; ++i)
+    {
+      single_page_count += result[i].single_page_count;
+      multi_page_count  += result[i].multi_page_count;
+      failed_count      += result[i].failed_count;
+    }
+
+    const auto statistics = memory_manager::statistics();
+    const auto fast_count = statistics.fast_allocation_count + statistics.fast_free_count;
+    const auto operation_total = single_page_count + multi_page_count;
+
+    printf("  %-12s %10.1f %10llu %12.4f %10llu %12.1f %13.1f%%\n", phase.name, ms,
+      (unsigned long long)statistics.lock_count,
+      double(statistics.lock_count) / operation_total,
+      (unsigned long long)statistics.lock_contention_count,
+      double(statistics.lock_wait_cycles) / operation_total,
+      100.0 * fast_count / std::max<uint64_t>(single_page_count, 1));
+
+    check(failed_count == 0, "no failed allocations");
+    check(overlap_count == 0, "no range handed out twice");
+    check(fast_count >= single_page_count, "1-page operations served by magazines");
+    check(statistics.lock_count <= multi_page_count + single_page_count / 16, "global lock acquisitions");
+
+    //
+    // std::thread allocates its state (freed by the thread itself) with
+    // operator new - the slabs keep their first empty page.
+    //
+    check(statistics.slab_object_count == 0 &&
+          memory_manager::allocated_bytes() == statistics.slab_page_count * ia32::page_size, "everything freed");
+
+    memory_manager::destroy();
+  }
+
+  free(result);
+  free(page_owned);
+  free(pool);
+
+  printf("%s\n", bad_count ? "FAIL" : "PASS");
+
+  return bad_count != 0;
+}
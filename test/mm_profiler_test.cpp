@@ -0,0 +1,335 @@
+//
+// Check of the allocation profiler (HVPP_ENABLE_MM_PROFILER).
+//
+// - Allocations made from 4 call sites in different contexts must be
+//   attributed to 4 sites with the right counts per context, and the one
+//   made in root mode must be counted as root allocation.
+// - After 300k random allocations and frees (of small objects and whole
+//   pages), the live allocation table of memory_manager::profile_dump() must match the
+//   actual live set, and live bytes of the sites must add up.
+// - After 4 threads allocate and free concurrently, nothing may be left
+//   in the live table.
+//
+// Note that global operator new is served by the memory manager (and
+// recorded by the profiler), therefore the test keeps its own data in
+// malloc()-ed buffers.
+//
+// Usage: mm_profiler_test
+//
+#include "support/harness.h"
+
+#include "lib/mm.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+using memory_manager::allocation_context;
+using memory_manager::profile_allocation_t;
+using memory_manager::profile_header_t;
+using memory_manager::profile_site_t;
+
+struct object_t
+{
+  char data[100];
+};
+
+//
+// Allocation sites. Each one must be a separate function which calls the
+// memory manager (not tail-calls it), so that the return address recorded
+// by the profiler points into it.
+//
+template <typename T>
+static T* no_tail_call(T* address)
+{
+  asm volatile("" : : "r"(address) : "memory");
+  return address;
+}
+
+__attribute__((noinline)) static void*     site_allocate(size_t size)         { return no_tail_call(memory_manager::allocate(size)); }
+__attribute__((noinline)) static void*     site_allocate_small(size_t size)   { return no_tail_call(memory_manager::allocate_small(size)); }
+__attribute__((noinline)) static void*     site_allocate_aligned(size_t size) { return no_tail_call(memory_manager::allocate_aligned(size, 64)); }
+__attribute__((noinline)) static object_t* site_new()                         { return no_tail_call(new object_t); }
+
+struct profile_t
+{
+  uint8_t*              buffer;
+  profile_header_t*     header;
+  profile_site_t*       site;
+  profile_allocation_t* allocation;
+
+  profile_t()
+  {
+    const auto size = memory_manager::profile_dump(nullptr, 0);
+
+    buffer = static_cast<uint8_t*>(malloc(size));
+    header = reinterpret_cast<profile_header_t*>(buffer);
+    site = reinterpret_cast<profile_site_t*>(header + 1);
+
+    if (memory_manager::profile_dump(buffer, size) != size)
+    {
+      printf("memory_manager::profile_dump() size mismatch\n");
+      abort();
+    }
+
+    allocation = reinterpret_cast<profile_allocation_t*>(site + header->site_count);
+  }
+
+  ~profile_t()
+  {
+    free(buffer);
+  }
+};
+
+struct live_t
+{
+  uint64_t address;
+  uint32_t size;
+
+  bool operator<(const live_t& other) const { return address < other.address; }
+};
+
+static int check_attribution()
+{
+  int bad_count = 0;
+
+  void* address[6];
+
+  address[0] = site_allocate(10000);
+  address[1] = site_allocate_small(40);
+  address[2] = site_allocate_aligned(100);
+
+  harness::set_context(mp::context_t::dispatch);
+  address[3] = site_allocate_small(50);
+  harness::set_context(mp::context_t::ipi);
+  address[4] = site_allocate_small(60);
+  harness::set_context(mp::context_t::passive);
+
+  memory_manager::set_root_mode(true);
+  address[5] = site_new();
+  memory_manager::set_root_mode(false);
+
+  {
+    profile_t profile;
+    const auto& header = *profile.header;
+
+    printf("sites %u, allocations %u, root allocations %llu\n",
+      header.site_count, header.allocation_count, (unsigned long long)header.root_allocation_count);
+
+    bad_count += header.magic != memory_manager::profile_magic;
+    bad_count += header.version != memory_manager::profile_version;
+    bad_count += header.site_count != 4;
+    bad_count += header.allocation_count != 6;
+    bad_count += header.root_allocation_count != 1;
+
+    int single_site_count = 0;
+
+    for (int i = 0; i < header.site_count; ++i)
+    {
+      const auto& site = profile.site[i];
+      const auto count = [&site](allocation_context context) { return site.context_count[static_cast<int>(context)]; };
+
+      if (site.allocation_count == 3)
+      {
+        //
+        // allocate_small() - one allocation in each context.
+        //
+        bad_count += count(allocation_context::passive) != 1;
+        bad_count += count(allocation_context::dispatch) != 1;
+        bad_count += count(allocation_context::ipi) != 1;
+        bad_count += site.live_bytes != 40 + 50 + 60;
+      }
+      else
+      {
+        single_site_count += site.allocation_count == 1;
+      }
+    }
+
+    bad_count += single_site_count != 3;
+  }
+
+  memory_manager::free(address[0]);
+  memory_manager::free(address[1]);
+  memory_manager::free(address[2]);
+  memory_manager::free(address[3]);
+  memory_manager::free(address[4]);
+  delete static_cast<object_t*>(address[5]);
+
+  profile_t profile;
+  bad_count += profile.header->allocation_count != 0;
+
+  for (int i = 0; i < profile.header->site_count; ++i)
+  {
+    bad_count += profile.site[i].live_count != 0 || profile.site[i].live_bytes != 0;
+  }
+
+  return bad_count;
+}
+
+static int check_live_table()
+{
+  int bad_count = 0;
+
+  const int max_live_count = 8000;
+  const auto live = static_cast<live_t*>(malloc(max_live_count * sizeof(live_t)));
+  int live_count = 0;
+
+  srand(1);
+
+  for (int i = 0; i < 300000; ++i)
+  {
+    if (live_count < max_live_count && (rand() % 3 || live_count == 0))
+    {
+      const size_t size = rand() % 2 ? 16 + rand() % 1900 : ia32::page_size * (1 + rand() % 3);
+      const auto address = size < 2000 ? site_allocate_small(size) : site_allocate(size);
+
+      if (!address)
+      {
+        bad_count += 1;
+        continue;
+      }
+
+      live[live_count++] = { reinterpret_cast<uint64_t>(address), static_cast<uint32_t>(size) };
+    }
+    else
+    {
+      const int index = rand() % live_count;
+
+      memory_manager::free(reinterpret_cast<void*>(live[index].address));
+      live[index] = live[--live_count];
+    }
+  }
+
+  {
+    profile_t profile;
+    const auto& header = *profile.header;
+
+    printf("live allocations %d, in profile %u, dropped %u\n", live_count, header.allocation_count, header.dropped_count);
+
+    if (header.allocation_count == static_cast<uint32_t>(live_count))
+    {
+      std::sort(live, live + live_count);
+
+      const auto recorded = static_cast<live_t*>(malloc(live_count * sizeof(live_t)));
+
+      for (int i = 0; i < live_count; ++i)
+      {
+        recorded[i] = { profile.allocation[i].address, profile.allocation[i].size };
+      }
+
+      std::sort(recorded, recorded + live_count);
+
+      for (int i = 0; i < live_count; ++i)
+      {
+        bad_count += recorded[i].address != live[i].address || recorded[i].size != live[i].size;
+      }
+
+      free(recorded);
+    }
+    else
+    {
+      bad_count += 1;
+    }
+
+    uint64_t live_bytes = 0;
+    uint64_t site_live_bytes = 0;
+
+    for (int i = 0; i < live_count; ++i)
+    {
+      live_bytes += live[i].size;
+    }
+
+    for (int i = 0; i < header.site_count; ++i)
+    {
+      site_live_bytes += profile.site[i].live_bytes;
+    }
+
+    bad_count += live_bytes != site_live_bytes;
+  }
+
+  for (int i = 0; i < live_count; ++i)
+  {
+    memory_manager::free(reinterpret_cast<void*>(live[i].address));
+  }
+
+  free(live);
+
+  profile_t profile;
+  bad_count += profile.header->allocation_count != 0;
+
+  return bad_count;
+}
+
+static int check_concurrent()
+{
+  std::thread threads[4];
+
+  for (int t = 0; t < 4; ++t)
+  {
+    threads[t] = std::thread([t] {
+      harness::set_cpu_index(t);
+
+      void* live[256] = {};
+      uint32_t seed = t + 1;
+
+      for (int i = 0; i < 50000; ++i)
+      {
+        seed = seed * 1103515245 + 12345;
+
+        auto& slot = live[(seed >> 8) % 256];
+
+        if (slot)
+        {
+          memory_manager::free(slot);
+          slot = nullptr;
+        }
+        else
+        {
+          slot = (seed >> 16) % 4 ? site_allocate_small(16 + (seed >> 18) % 1000) : site_allocate(ia32::page_size);
+        }
+      }
+
+      for (auto address : live)
+      {
+        if (address)
+        {
+          memory_manager::free(address);
+        }
+      }
+    });
+  }
+
+  for (auto& thread : threads)
+  {
+    thread.join();
+  }
+
+  //
+  // std::thread state objects are allocated by global operator new (and
+  // freed by the thread) - they're done by now too.
+  //
+  profile_t profile;
+  printf("after concurrent allocations: %u live\n", profile.header->allocation_count);
+
+  return profile.header->allocation_count != 0;
+}
+
+int main()
+{
+  const size_t pool_size = 64 * 1024 * 1024;
+  const auto pool = aligned_alloc(ia32::page_size, pool_size);
+
+  memory_manager::initialize(pool, pool_size);
+
+  int bad_count = 0;
+  bad_count += check_attribution();
+  bad_count += check_live_table();
+  bad_count += check_concurrent();
+
+  memory_manager::destroy();
+  free(pool);
+
+  printf("%s\n", bad_count ? "FAILED" : "ok");
+  return bad_count != 0;
+}
@@ -0,0 +1,203 @@
+//
+// Memory overhead of small objects with and without the size-class slabs
+// of the memory manager, as seen by allocated_bytes().
+//
+// For each object size, object_count objects are allocated with
+// allocate() (a page each - how small objects used to be allocated) and
+// with allocate_small(). Checks that:
+//   - slab objects take ceil(object_count / objects per slab) pages,
+//   - objects are 16-byte aligned (64-byte aligned from 64 bytes up), never
+//     page-aligned, and they don't overlap,
+//   - freeing them in random order returns all slabs but one of the class
+//     (no matter which slab empties last),
+//   - sizes above the largest class are forwarded to allocate(),
+//   - global operator new routes small sizes to the slabs.
+//
+// Usage: mm_slab_test [object_count]
+//
+// Note that global operator new is served by the memory manager, therefore
+// the harness keeps its own data in malloc()-ed buffers.
+//
+#include "support/harness.h"
+
+#include "lib/mm.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+static int bad_count = 0;
+
+static void check(bool condition, const char* what)
+{
+  if (!condition)
+  {
+    printf("FAIL: %s\n", what);
+    bad_count += 1;
+  }
+}
+
+//
+// Object sizes of the slab classes (see mm.cpp) and the size of the slab
+// header.
+//
+static constexpr size_t class_sizes[] = { 16, 32, 64, 128, 192, 256, 448, 576, 1344, 1984 };
+static constexpr size_t slab_header_size = 64;
+
+static constexpr int class_count = sizeof(class_sizes) / sizeof(class_sizes[0]);
+
+static int class_index(size_t size)
+{
+  for (int i = 0; i < class_count; ++i)
+  {
+    if (size <= class_sizes[i])
+    {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+int main(int argc, char** argv)
+{
+  const int object_count = std::max(argc > 1 ? atoi(argv[1]) : 1000, 2);
+
+  const size_t pool_size = 64 * 1024 * 1024;
+  const auto pool = aligned_alloc(ia32::page_size, pool_size);
+  memory_manager::initialize(pool, pool_size);
+
+  const auto object = static_cast<uint8_t**>(malloc(object_count * sizeof(uint8_t*)));
+  std::mt19937 rng(5);
+
+  //
+  // Empty slab kept by each class after the objects are freed - it's used
+  // first by the next round of the same class.
+  //
+  bool class_used[class_count] = {};
+
+  static const size_t sizes[] = { 1, 8, 16, 24, 40, 64, 100, 200, 256, 500, 1000, 1984, 2000 };
+
+  printf("%d objects:\n", object_count);
+  printf("  %6s %14s %14s %8s\n", "size", "without slabs", "with slabs", "saving");
+
+  for (const auto size : sizes)
+  {
+    //
+    // Without slabs.
+    //
+    auto bytes_before = memory_manager::allocated_bytes();
+
+    for (int i = 0; i < object_count; ++i)
+    {
+      object[i] = static_cast<uint8_t*>(memory_manager::allocate(size));
+    }
+
+    const auto page_bytes = memory_manager::allocated_bytes() - bytes_before;
+
+    for (int i = 0; i < object_count; ++i)
+    {
+      memory_manager::free(object[i]);
+    }
+
+    //
+    // With slabs.
+    //
+    bytes_before = memory_manager::allocated_bytes();
+
+    for (int i = 0; i < object_count; ++i)
+    {
+      object[i] = static_cast<uint8_t*>(memory_manager::allocate_small(size));
+      memset(object[i], i & 0xff, size);
+    }
+
+    const auto slab_bytes = memory_manager::allocated_bytes() - bytes_before;
+
+    printf("  %6zu %11zu kB %11zu kB %7.1fx\n", size, page_bytes / 1024, slab_bytes / 1024, double(page_bytes) / slab_bytes);
+
+    const int index = class_index(size);
+
+    if (index >= 0)
+    {
+      const size_t object_size = class_sizes[index];
+      const size_t per_slab = (ia32::page_size - slab_header_size) / object_size;
+      const size_t expected_bytes = ((object_count + per_slab - 1) / per_slab - class_used[index]) * ia32::page_size;
+      const size_t alignment = object_size >= 64 ? 64 : 16;
+
+      check(slab_bytes == expected_bytes, "slab pages");
+
+      for (int i = 0; i < object_count; ++i)
+      {
+        check(reinterpret_cast<uintptr_t>(object[i]) % alignment == 0, "object alignment");
+        check(reinterpret_cast<uintptr_t>(object[i]) % ia32::page_size != 0, "object not page-aligned");
+      }
+
+      std::sort(object, object + object_count);
+
+      for (int i = 1; i < object_count; ++i)
+      {
+        check(object[i] >= object[i - 1] + size, "objects don't overlap");
+      }
+
+      for (int i = 0; i < object_count; ++i)
+      {
+        check(std::all_of(object[i], object[i] + size, [&](uint8_t value) { return value == object[i][0]; }), "object content intact");
+      }
+    }
+    else
+    {
+      check(slab_bytes == page_bytes, "big objects forwarded to allocate()");
+    }
+
+    std::shuffle(object, object + object_count, rng);
+
+    for (int i = 0; i < object_count; ++i)
+    {
+      memory_manager::free(object[i]);
+    }
+
+    const size_t kept_bytes = index >= 0 && !class_used[index] ? ia32::page_size : 0;
+
+    check(memory_manager::allocated_bytes() - bytes_before == kept_bytes, "slabs released but one");
+
+    if (index >= 0)
+    {
+      class_used[index] = true;
+    }
+  }
+
+  //
+  // Global operator new.
+  //
+  {
+    const auto object_count_before = memory_manager::statistics().slab_object_count;
+
+    const auto small = new uint8_t[40];
+    const auto big   = new uint8_t[3000];
+
+    check(memory_manager::statistics().slab_object_count == object_count_before + 1, "operator new uses slabs");
+    check(reinterpret_cast<uintptr_t>(small) % ia32::page_size != 0, "small object from slab");
+    check(reinterpret_cast<uintptr_t>(big) % ia32::page_size == 0, "big object from pages");
+
+    delete[] big;
+    delete[] small;
+
+    check(memory_manager::statistics().slab_object_count == object_count_before, "operator delete frees slab object");
+  }
+
+  free(object);
+
+  const auto statistics = memory_manager::statistics();
+
+  check(statistics.slab_object_count == 0 &&
+        memory_manager::allocated_bytes() == statistics.slab_page_count * ia32::page_size, "everything freed");
+
+  memory_manager::destroy();
+  free(pool);
+
+  printf("%s\n", bad_count ? "FAIL" : "PASS");
+
+  return bad_count != 0;
+}
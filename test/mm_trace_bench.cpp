@@ -0,0 +1,302 @@
+//
+// Replay of a synthetic allocation trace against the memory manager -
+// built once with the page bitmap backend (mm_trace_bench_bitmap) and once
+// with HVPP_ENABLE_BUDDY_ALLOCATOR (mm_trace_bench_buddy).
+//
+// The trace is the same for both: 384 slots, each either free or holding
+// one allocation - 80% of allocations take 1 page, 18% take 2-64 pages and
+// 2% take 256-2048 pages, in a 64k-page (256MB) pool. Reports percentiles
+// of allocation and free latency (TSC cycles), failed allocations and the
+// largest free run at the end. Every returned range is also checked not
+// to overlap any live one.
+//
+// The trace is replayed round_count times (on a fresh memory manager) and
+// the lowest percentiles of all rounds are taken.
+//
+// Fails if any allocation fails. If a baseline file is given, the bitmap
+// build writes its p99 and p99.99 latencies into it and the buddy build
+// fails if any of its own is more than max_slowdown times the baseline
+// (plus latency_slack cycles, which absorbs timer noise on latencies of
+// a few hundred cycles). CTest runs the bitmap build first.
+//
+// Usage: mm_trace_bench_{bitmap,buddy} [operation_count] [baseline_file]
+//
+// Note that global operator new is served by the memory manager, therefore
+// the harness keeps its own data in malloc()-ed buffers.
+//
+#include "support/harness.h"
+
+#include "lib/mm.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+#include <x86intrin.h>
+
+struct trace_op_t
+{
+  int slot;
+  int page_count;                           // 0 for free
+};
+
+struct latency_t
+{
+  uint32_t* cycles;
+  int       count;
+
+  void add(uint64_t value) { cycles[count++] = static_cast<uint32_t>(value); }
+
+  void sort() { std::sort(cycles, cycles + count); }
+
+  uint64_t percentile(int per_10000)
+  {
+    return count ? cycles[static_cast<int64_t>(count) * per_10000 / 10000] : 0;
+  }
+
+  uint64_t max() { return count ? cycles[count - 1] : 0; }
+};
+
+template <typename T>
+static T* allocate_array(size_t count)
+{
+  return static_cast<T*>(calloc(count, sizeof(T)));
+}
+
+static constexpr int                round_count   = 3;
+static constexpr unsigned long long max_slowdown  = 4;
+static constexpr unsigned long long latency_slack = 2000;
+
+int main(int argc, char** argv)
+{
+  const int operation_count = argc > 1 ? atoi(argv[1]) : 2000000;
+  const char* baseline_path = argc > 2 ? argv[2] : nullptr;
+  const int slot_count = 384;
+
+  //
+  // Record the trace.
+  //
+  const auto trace = allocate_array<trace_op_t>(operation_count);
+
+  {
+    std::mt19937 rng(7);
+    bool live[slot_count] = {};
+
+    for (int i = 0; i < operation_count; ++i)
+    {
+      const int slot = rng() % slot_count;
+
+      if (live[slot])
+      {
+        trace[i] = { slot, 0 };
+      }
+      else
+      {
+        const int r = rng() % 100;
+        const int page_count = r < 80 ? 1
+                             : r < 98 ? 2 + rng() % 63
+                             :          256 + rng() % 1793;
+
+        trace[i] = { slot, page_count };
+      }
+
+      live[slot] = !live[slot];
+    }
+  }
+
+  const size_t pool_size = 256 * 1024 * 1024;
+  const auto pool = static_cast<uint8_t*>(aligned_alloc(ia32::page_size, pool_size));
+
+  printf("backend: %s\n",
+#ifdef HVPP_ENABLE_BUDDY_ALLOCATOR
+    "buddy"
+#else
+    "bitmap"
+#endif
+  );
+
+  latency_t allocate_latency = { allocate_array<uint32_t>(operation_count), 0 };
+  latency_t free_latency     = { allocate_array<uint32_t>(operation_count), 0 };
+
+  const auto page_owned = allocate_array<uint8_t>(pool_size / ia32::page_size);
+
+  int    failed_count = 0;
+  int    overlap_count = 0;
+  size_t allocated_bytes = 0;
+
+  //
+  // Allocate p99, allocate p99.99, free p99, free p99.99 - each the lowest
+  // of all rounds, so that a timer interrupt or preemption hitting one
+  // round doesn't show up as a regression.
+  //
+  unsigned long long latency[4] = { ~0ull, ~0ull, ~0ull, ~0ull };
+
+  const char* latency_name[4] = {
+    "allocate p99", "allocate p99.99", "free p99", "free p99.99",
+  };
+
+  for (int round = 0; round < round_count; ++round)
+  {
+    memory_manager::initialize(pool, pool_size);
+
+    if (round == 0)
+    {
+      printf("initial largest free run: %llu pages\n",
+        (unsigned long long)memory_manager::statistics().largest_free_page_count);
+    }
+
+    allocate_latency.count = 0;
+    free_latency.count = 0;
+
+    uint8_t* slot_address[slot_count] = {};
+    int      slot_page_count[slot_count] = {};
+    int      round_failed_count = 0;
+
+    const auto begin = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < operation_count; ++i)
+    {
+      const auto& op = trace[i];
+
+      if (op.page_count)
+      {
+        auto tsc = __rdtsc();
+        const auto address = static_cast<uint8_t*>(memory_manager::allocate(op.page_count * ia32::page_size));
+        allocate_latency.add(__rdtsc() - tsc);
+
+        slot_address[op.slot] = address;
+        slot_page_count[op.slot] = op.page_count;
+
+        if (!address)
+        {
+          round_failed_count += 1;
+          continue;
+        }
+
+        const auto first_page = (address - pool) / ia32::page_size;
+
+        for (int page = 0; page < op.page_count; ++page)
+        {
+          overlap_count += page_owned[first_page + page];
+          page_owned[first_page + page] = 1;
+        }
+      }
+      else if (const auto address = slot_address[op.slot])
+      {
+        const auto first_page = (address - pool) / ia32::page_size;
+        memset(&page_owned[first_page], 0, slot_page_count[op.slot]);
+
+        auto tsc = __rdtsc();
+        memory_manager::free(address);
+        free_latency.add(__rdtsc() - tsc);
+
+        slot_address[op.slot] = nullptr;
+      }
+    }
+
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+
+    allocate_latency.sort();
+    free_latency.sort();
+
+    printf("round %d: %d operations in %.1f ms\n", round + 1, operation_count, ms);
+    printf("  allocate cycles: p50 %llu, p99 %llu, p99.99 %llu, max %llu\n",
+      (unsigned long long)allocate_latency.percentile(5000),
+      (unsigned long long)allocate_latency.percentile(9900),
+      (unsigned long long)allocate_latency.percentile(9999),
+      (unsigned long long)allocate_latency.max());
+    printf("  free cycles:     p50 %llu, p99 %llu, p99.99 %llu, max %llu\n",
+      (unsigned long long)free_latency.percentile(5000),
+      (unsigned long long)free_latency.percentile(9900),
+      (unsigned long long)free_latency.percentile(9999),
+      (unsigned long long)free_latency.max());
+    printf("  failed allocations: %d (%.2f%%)\n", round_failed_count, 100.0 * round_failed_count / allocate_latency.count);
+    printf("  largest free run at the end: %llu pages\n",
+      (unsigned long long)memory_manager::statistics().largest_free_page_count);
+
+    const unsigned long long round_latency[4] = {
+      allocate_latency.percentile(9900), allocate_latency.percentile(9999),
+      free_latency.percentile(9900),     free_latency.percentile(9999),
+    };
+
+    for (int i = 0; i < 4; ++i)
+    {
+      latency[i] = std::min(latency[i], round_latency[i]);
+    }
+
+    failed_count += round_failed_count;
+
+    for (int slot = 0; slot < slot_count; ++slot)
+    {
+      if (const auto address = slot_address[slot])
+      {
+        const auto first_page = (address - pool) / ia32::page_size;
+        memset(&page_owned[first_page], 0, slot_page_count[slot]);
+        memory_manager::free(address);
+      }
+    }
+
+    allocated_bytes += memory_manager::allocated_bytes();
+
+    memory_manager::destroy();
+  }
+
+  free(pool);
+  free(page_owned);
+  free(free_latency.cycles);
+  free(allocate_latency.cycles);
+  free(trace);
+
+  int regression_count = 0;
+
+  if (baseline_path)
+  {
+#ifdef HVPP_ENABLE_BUDDY_ALLOCATOR
+    unsigned long long baseline[4] = {};
+    const auto file = fopen(baseline_path, "r");
+
+    if (!file || fscanf(file, "%llu %llu %llu %llu", &baseline[0], &baseline[1], &baseline[2], &baseline[3]) != 4)
+    {
+      printf("FAILED: cannot read baseline from %s\n", baseline_path);
+      return 1;
+    }
+
+    fclose(file);
+
+    for (int i = 0; i < 4; ++i)
+    {
+      const auto allowed = max_slowdown * baseline[i] + latency_slack;
+
+      printf("%-16s %6llu cycles, bitmap %6llu (allowed %llu)\n", latency_name[i], latency[i], baseline[i], allowed);
+
+      regression_count += latency[i] > allowed;
+    }
+#else
+    (void)(latency_name);
+
+    const auto file = fopen(baseline_path, "w");
+
+    if (!file)
+    {
+      printf("FAILED: cannot write baseline to %s\n", baseline_path);
+      return 1;
+    }
+
+    fprintf(file, "%llu %llu %llu %llu\n", latency[0], latency[1], latency[2], latency[3]);
+    fclose(file);
+#endif
+  }
+
+  if (overlap_count || allocated_bytes || failed_count || regression_count)
+  {
+    printf("FAILED: %d overlapping pages, %zu bytes still allocated, %d failed allocations, %d latency regressions\n",
+      overlap_count, allocated_bytes, failed_count, regression_count);
+    return 1;
+  }
+
+  printf("PASS\n");
+
+  return 0;
+}
@@ -0,0 +1,144 @@
+//
+// Check of the VA <-> PA translation tables of the memory manager.
+//
+// The emulated OS translates with a scrambled layout: physical addresses
+// are shifted by 1TB and pages of one 2MB chunk of each arena are mapped
+// in reverse order (i.e. that chunk is not physically contiguous). The
+// arenas start and end at addresses which aren't 2MB-aligned.
+//
+// Every sampled address of the arenas must round-trip through
+// memory_manager::pa_from_va()/va_from_pa() and ia32::pa_t without
+// calling the OS, addresses outside of the arenas must be rejected, and
+// after destroy() pa_t must ask the OS again.
+//
+// Usage: mm_translate_test
+//
+#include "support/harness.h"
+
+#include "ia32/memory.h"
+#include "lib/mm.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+static constexpr uint64_t pa_offset = 0x10000000000;  // 1TB
+
+static uint64_t reversed_chunk[2];
+
+static uint64_t reverse_in_chunk(uint64_t address)
+{
+  const uint64_t page = address & ~0xfffull;
+  const uint64_t offset = address & 0xfff;
+
+  for (auto chunk : reversed_chunk)
+  {
+    if (page >= chunk && page < chunk + 0x200000)
+    {
+      return chunk + ((511 - ((page - chunk) >> 12)) << 12) + offset;
+    }
+  }
+
+  return address;
+}
+
+static uint64_t va_to_pa(uint64_t va) { return reverse_in_chunk(va) + pa_offset; }
+static uint64_t pa_to_va(uint64_t pa) { return reverse_in_chunk(pa - pa_offset); }
+
+static int check_arena(uint8_t* base, size_t size)
+{
+  int bad_count = 0;
+
+  for (auto va = base; va < base + size; va += ia32::page_size + 123)
+  {
+    const auto expected_pa = va_to_pa(reinterpret_cast<uint64_t>(va));
+
+    uint64_t pa;
+    if (!memory_manager::pa_from_va(va, pa) || pa != expected_pa)
+    {
+      bad_count += 1;
+    }
+
+    if (memory_manager::va_from_pa(expected_pa) != va)
+    {
+      bad_count += 1;
+    }
+
+    if (ia32::pa_t::from_va(va).value() != expected_pa ||
+        ia32::pa_t(expected_pa).va() != va)
+    {
+      bad_count += 1;
+    }
+  }
+
+  //
+  // Just outside of the arena.
+  //
+  uint64_t pa;
+  bad_count += memory_manager::pa_from_va(base - 1, pa);
+  bad_count += memory_manager::pa_from_va(base + size, pa);
+  bad_count += memory_manager::va_from_pa(va_to_pa(reinterpret_cast<uint64_t>(base) - ia32::page_size)) != nullptr;
+  bad_count += memory_manager::va_from_pa(va_to_pa(reinterpret_cast<uint64_t>(base + size))) != nullptr;
+
+  return bad_count;
+}
+
+int main()
+{
+  harness::va_to_pa = &va_to_pa;
+  harness::pa_to_va = &pa_to_va;
+
+  //
+  // Arenas start 5 pages past a 2MB boundary and aren't multiple of 2MB.
+  //
+  const size_t memory_size = 16 * 1024 * 1024;
+  const size_t arena_size = 9 * 1024 * 1024 + 3 * ia32::page_size;
+
+  uint8_t* memory[2];
+  uint8_t* arena[2];
+
+  for (int i = 0; i < 2; ++i)
+  {
+    memory[i] = static_cast<uint8_t*>(aligned_alloc(0x200000, memory_size));
+    arena[i] = memory[i] + 5 * ia32::page_size;
+    reversed_chunk[i] = reinterpret_cast<uint64_t>(memory[i]) + 0x400000;
+  }
+
+  memory_manager::initialize(arena[0], arena_size);
+  memory_manager::add_arena(arena[1], arena_size);
+
+  const auto os_translation_count = harness::os_translation_count;
+
+  int bad_count = 0;
+  bad_count += check_arena(arena[0], arena_size);
+  bad_count += check_arena(arena[1], arena_size);
+
+  //
+  // Unknown physical address.
+  //
+  bad_count += memory_manager::va_from_pa(12345) != nullptr;
+
+  const auto translation_os_calls = harness::os_translation_count - os_translation_count;
+
+  //
+  // Allocated memory (the allocation map is at the start of the arena).
+  //
+  const auto address = memory_manager::allocate(2 * ia32::page_size);
+  bad_count += !address || ia32::pa_t::from_va(address).va() != address;
+  memory_manager::free(address);
+
+  memory_manager::destroy();
+
+  //
+  // The translator is removed by destroy() - the OS is asked again.
+  //
+  const auto os_translation_count_after_destroy = harness::os_translation_count;
+  bad_count += ia32::pa_t::from_va(arena[0]).value() != va_to_pa(reinterpret_cast<uint64_t>(arena[0]));
+  bad_count += harness::os_translation_count == os_translation_count_after_destroy;
+
+  printf("mismatches: %d, OS calls during table lookups: %ld\n", bad_count, translation_os_calls);
+
+  free(memory[0]);
+  free(memory[1]);
+
+  return bad_count || translation_os_calls;
+}
@@ -0,0 +1,214 @@
+//
+// Latency of allocate_zeroed() with and without pages zeroed in advance
+// by zero_free_pages(), and of initialize().
+//
+// "Before" is what the memory manager did before background zeroing: it
+// filled the whole pool with 0xCC in initialize() and zeroed every page in
+// allocate_zeroed(). The first is measured directly (memset of the pool),
+// the second by allocations made before zero_free_pages() ever ran
+// ("cold"). "After" are allocations made once zero_free_pages() had
+// zeroed the pages reserved by preceding allocations ("warm"), as the
+// memory thread of the driver does every 10ms.
+//
+// The last phase runs zero_free_pages() on a separate thread while other
+// threads allocate, and checks that allocate_zeroed() always returns
+// zeroed memory.
+//
+// Usage: mm_zero_bench
+//
+#include "support/harness.h"
+
+#include "lib/mm.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#include <x86intrin.h>
+
+static constexpr size_t pool_size        = 256 * 1024 * 1024;
+static constexpr int    allocation_count = 64;
+static constexpr size_t allocation_size  = 16 * ia32::page_size;
+
+static bool is_zeroed(const void* address, size_t size)
+{
+  const auto data = static_cast<const uint64_t*>(address);
+
+  for (size_t i = 0; i < size / sizeof(uint64_t); ++i)
+  {
+    if (data[i])
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static uint64_t allocate_zeroed_cycles(void** address, int& bad_count)
+{
+  //
+  // Average cycles of allocate_zeroed(); leaves the memory dirty.
+  //
+  const auto begin = __rdtsc();
+
+  for (int i = 0; i < allocation_count; ++i)
+  {
+    address[i] = memory_manager::allocate_zeroed(allocation_size);
+  }
+
+  const auto cycles = (__rdtsc() - begin) / allocation_count;
+
+  for (int i = 0; i < allocation_count; ++i)
+  {
+    bad_count += !is_zeroed(address[i], allocation_size);
+    memset(address[i], 0x5A, allocation_size);
+  }
+
+  return cycles;
+}
+
+int main()
+{
+  const auto pool = aligned_alloc(ia32::page_size, pool_size);
+  memset(pool, 0xAB, pool_size);
+
+  int bad_count = 0;
+  void* address[allocation_count];
+
+  //
+  // Before: the pool was filled with 0xCC in initialize().
+  //
+  auto begin = __rdtsc();
+  memset(pool, 0xCC, pool_size);
+  const auto pool_memset_cycles = __rdtsc() - begin;
+
+  memory_manager::initialize(pool, pool_size);
+  const auto initialize_cycles = memory_manager::statistics().initialize_cycles;
+
+  printf("initialize():                   %12llu cycles (pool memset alone: %llu cycles)\n",
+    (unsigned long long)initialize_cycles, (unsigned long long)pool_memset_cycles);
+
+  //
+  // Cold: nothing has been zeroed in advance yet.
+  //
+  const auto cold_cycles = allocate_zeroed_cycles(address, bad_count);
+
+  for (auto p : address)
+  {
+    memory_manager::free(p);
+  }
+
+  //
+  // Let zero_free_pages() zero the pages reserved by allocations - each
+  // allocation reserves a small batch and returns the batch zeroed by the
+  // previous call.
+  //
+  for (int i = 0; i < 1024; ++i)
+  {
+    memory_manager::free(memory_manager::allocate(allocation_size));
+    memory_manager::zero_free_pages(1024);
+  }
+
+  const auto warm_stats_before = memory_manager::statistics();
+  const auto warm_cycles = allocate_zeroed_cycles(address, bad_count);
+  const auto warm_stats_after = memory_manager::statistics();
+
+  for (auto p : address)
+  {
+    memory_manager::free(p);
+  }
+
+  printf("16-page allocate_zeroed() cold: %12llu cycles\n", (unsigned long long)cold_cycles);
+  printf("16-page allocate_zeroed() warm: %12llu cycles (%llu of %d pages zeroed in advance)\n",
+    (unsigned long long)warm_cycles,
+    (unsigned long long)(warm_stats_after.zeroed_hit_count - warm_stats_before.zeroed_hit_count),
+    allocation_count * static_cast<int>(allocation_size / ia32::page_size));
+
+  //
+  // Zeroer thread running concurrently with allocations.
+  //
+  std::atomic<bool> stop = false;
+  std::atomic<int> concurrent_bad_count = 0;
+
+  std::thread zeroer([&stop] {
+    harness::set_cpu_index(0);
+
+    while (!stop)
+    {
+      memory_manager::zero_free_pages(1024);
+    }
+  });
+
+  std::thread allocators[3];
+
+  for (int t = 0; t < 3; ++t)
+  {
+    allocators[t] = std::thread([t, &concurrent_bad_count] {
+      harness::set_cpu_index(1 + t);
+
+      void* live[64] = {};
+      uint32_t seed = t + 1;
+
+      for (int i = 0; i < 100000; ++i)
+      {
+        seed = seed * 1103515245 + 12345;
+
+        auto& slot = live[(seed >> 8) % 64];
+        const size_t size = ia32::page_size * (1 + ((seed >> 16) % 8 == 0 ? (seed >> 20) % 8 : 0));
+
+        if (slot)
+        {
+          memory_manager::free(slot);
+          slot = nullptr;
+        }
+        else if ((slot = memory_manager::allocate_zeroed(size)) != nullptr)
+        {
+          concurrent_bad_count += !is_zeroed(slot, size);
+          memset(slot, 0x5A, size);
+        }
+      }
+
+      for (auto p : live)
+      {
+        if (p)
+        {
+          memory_manager::free(p);
+        }
+      }
+    });
+  }
+
+  for (auto& thread : allocators)
+  {
+    thread.join();
+  }
+
+  stop = true;
+  zeroer.join();
+
+  const auto stats = memory_manager::statistics();
+
+  printf("concurrent: %llu pages zeroed in advance, %llu hits, %llu misses\n",
+    (unsigned long long)stats.zeroer_page_count,
+    (unsigned long long)stats.zeroed_hit_count,
+    (unsigned long long)stats.zeroed_miss_count);
+
+  bad_count += concurrent_bad_count;
+
+  //
+  // destroy() asserts that all pages (including those reserved for
+  // zeroing) are back in the page bitmap.
+  //
+  memory_manager::destroy();
+  free(pool);
+
+  if (bad_count)
+  {
+    printf("FAILED: %d allocations not zeroed\n", bad_count);
+    return 1;
+  }
+
+  return 0;
+}
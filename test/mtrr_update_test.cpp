@@ -0,0 +1,191 @@
+//
+// Check of memory_manager::update_mtrr() against concurrent readers of
+// memory_manager::mtrr(), and of the deferred EPT invalidation requests.
+//
+// One thread keeps switching the emulated MTRRs between two settings
+// (WT 2MB range at 8GB / UC 1GB range at 8GB) and calls update_mtrr(),
+// like handle_mtrr_write() does. Other threads keep querying memory types
+// without any lock - each answer must be valid for one of the settings
+// (the index must never be seen half-built). Switching back and forth must
+// reuse the snapshots instead of allocating new ones.
+//
+// Usage: mtrr_update_test [reader_count] [switch_count]
+//
+#include "support/harness.h"
+
+#include "hvpp/ept.h"
+#include "lib/mm.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <thread>
+
+using namespace hvpp;
+
+static int bad_count = 0;
+
+static void check(bool condition, const char* what)
+{
+  if (!condition)
+  {
+    printf("FAIL: %s\n", what);
+    bad_count += 1;
+  }
+}
+
+//
+// Address, type with the first setting, type with the second setting.
+//
+struct sample_t
+{
+  uint64_t    pa;
+  memory_type type[2];
+};
+
+static const sample_t samples[] = {
+  { 0x000a0000,               { memory_type::uncacheable,   memory_type::uncacheable   } },
+  { 0x80000000,               { memory_type::write_back,    memory_type::write_back    } },
+  { 0xe0000000,               { memory_type::uncacheable,   memory_type::uncacheable   } },
+  { 0x200001000,              { memory_type::write_through, memory_type::uncacheable   } },
+  { 0x220000000,              { memory_type::write_back,    memory_type::uncacheable   } },
+  { 0x240000000,              { memory_type::write_back,    memory_type::write_back    } },
+};
+
+static void set_mtrr(int setting)
+{
+  if (setting == 0)
+  {
+    harness::msr_table[0x202] = 0x200000000 | 4;
+    harness::msr_table[0x203] = (~(0x200000ull - 1) & 0xFFFFFFFFF000) | (1 << 11);
+  }
+  else
+  {
+    harness::msr_table[0x202] = 0x200000000 | 0;
+    harness::msr_table[0x203] = (~(0x40000000ull - 1) & 0xFFFFFFFFF000) | (1 << 11);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  const int reader_count = argc > 1 ? atoi(argv[1]) : 3;
+  const int switch_count = argc > 2 ? atoi(argv[2]) : 2000;
+
+  harness::setup_msrs(true);
+  harness::setup_physical_memory(1, 16ull << 30, 0);
+
+  const size_t pool_size = 16 * 1024 * 1024;
+  const auto pool = aligned_alloc(ia32::page_size, pool_size);
+  memory_manager::initialize(pool, pool_size);
+
+  for (const auto& sample : samples)
+  {
+    check(memory_manager::mtrr().type(pa_t(sample.pa)) == sample.type[0], "initial memory type");
+  }
+
+  //
+  // Readers.
+  //
+  std::atomic<bool> stop = false;
+  std::atomic<long> bad_answer_count = 0;
+  std::atomic<long> answer_count = 0;
+  static std::thread readers[64];
+
+  for (int i = 0; i < reader_count && i < 64; ++i)
+  {
+    readers[i] = std::thread([&] {
+      while (!stop)
+      {
+        for (const auto& sample : samples)
+        {
+          const auto type = memory_manager::mtrr().type(pa_t(sample.pa));
+
+          if (type != sample.type[0] && type != sample.type[1])
+          {
+            bad_answer_count.fetch_add(1, std::memory_order_relaxed);
+          }
+        }
+
+        answer_count.fetch_add(std::size(samples), std::memory_order_relaxed);
+        std::this_thread::yield();
+      }
+    });
+  }
+
+  //
+  // Writer.
+  //
+  int publish_count = 0;
+  uint64_t allocated_bytes_after_first_switch = 0;
+
+  for (int i = 1; i <= switch_count; ++i)
+  {
+    //
+    // Let the readers run between the switches (even on a single CPU).
+    //
+    const auto seen_answer_count = answer_count.load();
+
+    while (reader_count > 0 && answer_count.load() == seen_answer_count)
+    {
+      std::this_thread::yield();
+    }
+
+    set_mtrr(i % 2);
+    publish_count += memory_manager::update_mtrr();
+
+    if (i == 2)
+    {
+      allocated_bytes_after_first_switch = memory_manager::allocated_bytes();
+    }
+  }
+
+  stop = true;
+
+  for (int i = 0; i < reader_count && i < 64; ++i)
+  {
+    readers[i].join();
+  }
+
+  printf("%ld answers, %ld bad, %d publications\n", answer_count.load(), bad_answer_count.load(), publish_count);
+
+  check(bad_answer_count == 0, "readers see only valid memory types");
+  check(publish_count == switch_count, "each switch published");
+  check(!memory_manager::update_mtrr(), "no change, nothing published");
+  check(memory_manager::allocated_bytes() == allocated_bytes_after_first_switch, "snapshots reused");
+
+  for (const auto& sample : samples)
+  {
+    check(memory_manager::mtrr().type(pa_t(sample.pa)) == sample.type[switch_count % 2], "final memory type");
+  }
+
+  //
+  // Invalidation requested through an overlay is seen through the shared
+  // EPT and through other overlays.
+  //
+  {
+    ept_t shared;
+    shared.initialize();
+
+    ept_t overlay[2];
+    overlay[0].initialize(shared);
+    overlay[1].initialize(shared);
+
+    const auto generation = shared.invalidation_generation();
+    overlay[0].request_invalidation();
+
+    check(shared.invalidation_generation() != generation, "invalidation requested");
+    check(overlay[1].invalidation_generation() == shared.invalidation_generation(), "overlays share the request");
+
+    overlay[1].destroy();
+    overlay[0].destroy();
+    shared.destroy();
+  }
+
+  memory_manager::destroy();
+  free(pool);
+
+  printf("%s\n", bad_count ? "FAIL" : "PASS");
+
+  return bad_count != 0;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include "lib/mp.h"
+
+#include <ntddk.h>
+
+#include <cstdint>
+
+//
+// State of the emulated machine, which the harness programs set up before
+// calling into hvpp code.
+//
+namespace harness
+{
+  //
+  // MSRs read by __readmsr() (only the architectural 0x000-0xFFF range).
+  //
+  extern uint64_t msr_table[0x1000];
+
+  //
+  // Physical memory ranges returned by MmGetPhysicalMemoryRanges(),
+  // terminated by an empty range.
+  //
+  extern PHYSICAL_MEMORY_RANGE physical_memory_ranges[64];
+
+  //
+  // Translation of MmGetPhysicalAddress() / MmGetVirtualForPhysical().
+  // Identity, unless set. os_translation_count counts calls of both.
+  //
+  extern uint64_t (*va_to_pa)(uint64_t va);
+  extern uint64_t (*pa_to_va)(uint64_t pa);
+  extern long     os_translation_count;
+
+  //
+  // Index of the emulated CPU the calling thread runs on (mp::cpu_index()).
+  //
+  void set_cpu_index(uint32_t cpu_index) noexcept;
+
+  //
+  // Context (IRQL) the calling thread runs in (mp::context()).
+  //
+  void set_context(mp::context_t context) noexcept;
+
+  //
+  // MTRRs with the WB default type, UC legacy VGA range, UC 3GB-4GB hole
+  // and small WT range at 8GB; EPT capabilities with 2MB (and optionally
+  // 1GB) pages.
+  //
+  void setup_msrs(bool large_pages_1gb = true) noexcept;
+
+  //
+  // "count" ranges of "size" bytes, starting at 1MB and separated by
+  // "gap" bytes.
+  //
+  void setup_physical_memory(int count, uint64_t size, uint64_t gap) noexcept;
+}
@@ -0,0 +1,192 @@
+//
+// User-mode implementation of the OS services used by the hvpp sources
+// compiled into the harness (see test/include/ntddk.h).
+//
+#include "harness.h"
+
+#include "lib/log.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace harness
+{
+  uint64_t msr_table[0x1000];
+
+  PHYSICAL_MEMORY_RANGE physical_memory_ranges[64];
+
+  uint64_t (*va_to_pa)(uint64_t va) = nullptr;
+  uint64_t (*pa_to_va)(uint64_t pa) = nullptr;
+  long     os_translation_count = 0;
+
+  static thread_local uint32_t current_cpu_index = 0;
+  static thread_local mp::context_t current_context = mp::context_t::passive;
+
+  void set_cpu_index(uint32_t cpu_index) noexcept
+  {
+    current_cpu_index = cpu_index;
+  }
+
+  void set_context(mp::context_t context) noexcept
+  {
+    current_context = context;
+  }
+
+  void setup_msrs(bool large_pages_1gb) noexcept
+  {
+    memset(msr_table, 0, sizeof(msr_table));
+
+    //
+    // IA32_MTRRCAP: 2 variable ranges, fixed ranges supported.
+    // IA32_MTRR_DEF_TYPE: WB, fixed ranges and MTRRs enabled.
+    //
+    msr_table[0x0fe] = 2 | (1 << 8);
+    msr_table[0x2ff] = 6 | (1 << 10) | (1 << 11);
+
+    //
+    // Fixed ranges - WB, except for 0xA0000-0xBFFFF (UC) and
+    // 0xC0000-0xC7FFF (WP).
+    //
+    const uint64_t wb = 0x0606060606060606;
+
+    msr_table[0x250] = wb;
+    msr_table[0x258] = wb;
+    msr_table[0x259] = 0;
+
+    for (uint32_t msr_id = 0x268; msr_id <= 0x26f; ++msr_id)
+    {
+      msr_table[msr_id] = msr_id == 0x268 ? 0x0505050505050505 : wb;
+    }
+
+    //
+    // Variable ranges - [3GB, 4GB) UC, [8GB, 8GB + 2MB) WT.
+    //
+    msr_table[0x200] = 0xC0000000;
+    msr_table[0x201] = (~(0x40000000ull - 1) & 0xFFFFFFFFF000) | (1 << 11);
+    msr_table[0x202] = 0x200000000 | 4;
+    msr_table[0x203] = (~(0x200000ull - 1) & 0xFFFFFFFFF000) | (1 << 11);
+
+    //
+    // IA32_VMX_EPT_VPID_CAP: execute-only, 4-level walk, UC, WB, 2MB
+    // (and 1GB) pages, INVEPT (single-context, all-context).
+    //
+    msr_table[0x48c] = 1 | (1 << 6) | (1 << 8) | (1 << 14) | (1 << 16) |
+                       (uint64_t(large_pages_1gb) << 17) |
+                       (1 << 20) | (1 << 21) | (1ull << 25) | (1ull << 26);
+  }
+
+  void setup_physical_memory(int count, uint64_t size, uint64_t gap) noexcept
+  {
+    memset(physical_memory_ranges, 0, sizeof(physical_memory_ranges));
+
+    uint64_t address = 0x100000;
+
+    for (int i = 0; i < count && i < 63; ++i)
+    {
+      physical_memory_ranges[i].BaseAddress.QuadPart = address;
+      physical_memory_ranges[i].NumberOfBytes.QuadPart = size;
+      address += size + gap;
+    }
+  }
+}
+
+void harness_debug_break(const char* file, int line) noexcept
+{
+  //
+  // Aborts the program, unless HVPP_TEST_NOBREAK is set (by programs which
+  // expect failed assertions, e.g. failed allocations) - then only the
+  // first one is reported.
+  //
+  static std::atomic<int> count = 0;
+
+  if (!getenv("HVPP_TEST_NOBREAK"))
+  {
+    fprintf(stderr, "__debugbreak() at %s:%d\n", file, line);
+    abort();
+  }
+
+  if (count++ == 0)
+  {
+    fprintf(stderr, "__debugbreak() at %s:%d (further ones are not reported)\n", file, line);
+  }
+}
+
+uint64_t harness_read_msr(unsigned long msr_id) noexcept
+{
+  return msr_id < 0x1000 ? harness::msr_table[msr_id] : 0;
+}
+
+PHYSICAL_ADDRESS MmGetPhysicalAddress(PVOID BaseAddress)
+{
+  const auto va = reinterpret_cast<uint64_t>(BaseAddress);
+
+  PHYSICAL_ADDRESS result;
+  result.QuadPart = harness::va_to_pa ? harness::va_to_pa(va) : va;
+
+  harness::os_translation_count += 1;
+  return result;
+}
+
+PVOID MmGetVirtualForPhysical(PHYSICAL_ADDRESS PhysicalAddress)
+{
+  const auto pa = static_cast<uint64_t>(PhysicalAddress.QuadPart);
+
+  harness::os_translation_count += 1;
+  return reinterpret_cast<PVOID>(harness::pa_to_va ? harness::pa_to_va(pa) : pa);
+}
+
+PPHYSICAL_MEMORY_RANGE MmGetPhysicalMemoryRanges()
+{
+  return harness::physical_memory_ranges;
+}
+
+extern "C" void ia32_asm_inv_ept(unsigned long type, void* descriptor) noexcept
+{
+  (void)(type);
+  (void)(descriptor);
+}
+
+extern "C" void ia32_asm_inv_vpid(unsigned long type, void* descriptor) noexcept
+{
+  (void)(type);
+  (void)(descriptor);
+}
+
+namespace logger
+{
+  void print(level_t level, const char* function, const char* format, ...) noexcept
+  {
+    (void)(level);
+    (void)(function);
+    (void)(format);
+  }
+}
+
+namespace mp::detail
+{
+  uint32_t cpu_index() noexcept
+  {
+    return harness::current_cpu_index;
+  }
+
+  context_t context() noexcept
+  {
+    return harness::current_context;
+  }
+
+  void sleep(uint32_t milliseconds) noexcept
+  {
+    (void)(milliseconds);
+  }
+
+  void ipi_call(void(*callback)(void*), void* context) noexcept
+  {
+    //
+    // There is just one emulated CPU - multi-threaded programs run the
+    // work on their own threads.
+    //
+    callback(context);
+  }
+}